@@ -13,6 +13,7 @@
 #include "xfs_copy.h"
 #include "libxlog.h"
 #include "libfrog/platform.h"
+#include "libfrog/ioengine.h"
 
 #define	rounddown(x, y)	(((x)/(y))*(y))
 #define uuid_equal(s,d) (platform_uuid_compare((s),(d)) == 0)
@@ -41,10 +42,13 @@ static wbuf		btree_buf;
 
 static unsigned int	kids;
 
+/* Number of copy buffers that can be in flight to the targets. */
+#define NR_WBUFS	16
+
 static thread_control	glob_masks;
 static thread_args	*targ;
 
-static pthread_mutex_t	mainwait;
+static const struct ioengine *ioengine;
 
 #define ACTIVE		1
 #define INACTIVE	2
@@ -198,17 +202,9 @@ do_write(
 	if (!buf)
 		buf = &w_buf;
 
-	if (target[args->id].position != buf->position)  {
-		if (lseek(args->fd, buf->position, SEEK_SET) < 0)  {
-			error = target[args->id].err_type = 1;
-		} else  {
-			target[args->id].position = buf->position;
-		}
-	}
-
-	if ((res = write(target[args->id].fd, buf->data,
-				buf->length)) == buf->length)  {
-		target[args->id].position += res;
+	if ((res = pwrite(target[args->id].fd, buf->data, buf->length,
+				buf->position)) == buf->length)  {
+		target[args->id].position = buf->position + res;
 	} else  {
 		error = 2;
 	}
@@ -220,19 +216,83 @@ do_write(
 	return error;
 }
 
+/*
+ * Write out ring buffers [args->seq, args->seq + nr) in one batch.  Buffers
+ * that follow each other on disk are merged into a single request.
+ */
+static int
+write_ring(
+	thread_args	*args,
+	struct io_req	*reqs,
+	struct iovec	*iov,
+	uint64_t	nr)
+{
+	struct io_req	*req = NULL;
+	xfs_off_t	next = -1;
+	unsigned int	nr_reqs = 0;
+	uint64_t	i;
+
+	for (i = 0; i < nr; i++) {
+		wbuf	*buf;
+
+		buf = &glob_masks.buffer[(args->seq + i) % glob_masks.nr_bufs];
+		if (!req || buf->position != next) {
+			req = &reqs[nr_reqs++];
+			req->offset = buf->position;
+			req->iov = &iov[i];
+			req->iovcnt = 0;
+		}
+		iov[i].iov_base = buf->data;
+		iov[i].iov_len = buf->length;
+		req->iovcnt++;
+		next = buf->position + buf->length;
+	}
+
+	if (!ioengine->writev(args->fd, reqs, nr_reqs)) {
+		target[args->id].position = next;
+		return 0;
+	}
+
+	for (i = 0; i < nr_reqs; i++) {
+		if (reqs[i].error) {
+			target[args->id].error = -reqs[i].error;
+			target[args->id].position = reqs[i].offset;
+			break;
+		}
+	}
+	return 2;
+}
+
 static void *
 begin_reader(void *arg)
 {
 	thread_args	*args = arg;
+	struct io_req	*reqs;
+	struct iovec	*iov;
+	uint64_t	nr;
 
 	rcu_register_thread();
+	reqs = calloc(glob_masks.nr_bufs, sizeof(*reqs));
+	iov = calloc(glob_masks.nr_bufs, sizeof(*iov));
+	if (!reqs || !iov) {
+		target[args->id].error = ENOMEM;
+		goto handle_error;
+	}
+
 	for (;;) {
-		pthread_mutex_lock(&args->wait);
-		if (do_write(args, NULL))
+		pthread_mutex_lock(&glob_masks.mutex);
+		while (args->seq == glob_masks.head)
+			pthread_cond_wait(&glob_masks.filled, &glob_masks.mutex);
+		nr = glob_masks.head - args->seq;
+		pthread_mutex_unlock(&glob_masks.mutex);
+
+		/* the reader can't reuse these buffers until seq moves on */
+		if (write_ring(args, reqs, iov, nr))
 			goto handle_error;
-	        pthread_mutex_lock(&glob_masks.mutex);
-		if (--glob_masks.num_working == 0)
-			pthread_mutex_unlock(&mainwait);
+
+		pthread_mutex_lock(&glob_masks.mutex);
+		args->seq += nr;
+		pthread_cond_broadcast(&glob_masks.drained);
 		pthread_mutex_unlock(&glob_masks.mutex);
 	}
 	/* NOTREACHED */
@@ -242,9 +302,10 @@ handle_error:
 
 	pthread_mutex_lock(&glob_masks.mutex);
 	target[args->id].state = INACTIVE;
-	if (--glob_masks.num_working == 0)
-		pthread_mutex_unlock(&mainwait);
+	pthread_cond_broadcast(&glob_masks.drained);
 	pthread_mutex_unlock(&glob_masks.mutex);
+	free(reqs);
+	free(iov);
 	rcu_unregister_thread();
 	pthread_exit(NULL);
 	return NULL;
@@ -481,36 +542,77 @@ read_ag_header(int fd, xfs_agnumber_t agno, wbuf *buf, ag_header_t *ag,
 }
 
 
-static void
-write_wbuf(void)
+/*
+ * Wait until the slowest active target is less than @lag buffers behind the
+ * reader.  Must be called with the ring lock held.  Returns the number of
+ * targets still active.
+ */
+static int
+wait_for_targets(
+	uint64_t	lag)
 {
+	uint64_t	tail;
+	int		active;
 	int		i;
-	int		badness = 0;
 
-	/* verify target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			glob_masks.num_working++;
+	for (;;) {
+		tail = glob_masks.head;
+		active = 0;
+		for (i = 0; i < num_targets; i++) {
+			if (target[i].state == INACTIVE)
+				continue;
+			active++;
+			tail = min(tail, targ[i].seq);
+		}
+		if (!active || glob_masks.head - tail < lag)
+			return active;
 
-	/* release target threads */
-	for (i = 0; i < num_targets; i++)
-		if (target[i].state != INACTIVE)
-			pthread_mutex_unlock(&targ[i].wait);	/* wake up */
-		else
-			badness++;
+		signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
+		pthread_cond_wait(&glob_masks.drained, &glob_masks.mutex);
+		signal_maskfunc(SIGCHLD, SIG_BLOCK);
+	}
+}
+
+/* Grab the next free buffer in the ring for the reader to fill. */
+static wbuf *
+get_wbuf(void)
+{
+	wbuf		*buf;
+	int		active;
+
+	pthread_mutex_lock(&glob_masks.mutex);
+	active = wait_for_targets(glob_masks.nr_bufs);
+	buf = &glob_masks.buffer[glob_masks.head % glob_masks.nr_bufs];
+	pthread_mutex_unlock(&glob_masks.mutex);
 
 	/*
-	 * If all the targets are inactive then there won't be any io
-	 * threads left to release mainwait.  We're screwed, so bail out.
+	 * If all the targets are inactive then nobody is left to write the
+	 * buffer.  We're screwed, so bail out.
 	 */
-	if (badness == num_targets) {
+	if (!active) {
 		check_errors();
 		exit(1);
 	}
+	return buf;
+}
 
-	signal_maskfunc(SIGCHLD, SIG_UNBLOCK);
-	pthread_mutex_lock(&mainwait);
-	signal_maskfunc(SIGCHLD, SIG_BLOCK);
+/* Hand the buffer returned by get_wbuf to the target threads. */
+static void
+write_wbuf(void)
+{
+	pthread_mutex_lock(&glob_masks.mutex);
+	glob_masks.head++;
+	pthread_cond_broadcast(&glob_masks.filled);
+	pthread_mutex_unlock(&glob_masks.mutex);
+}
+
+/* Wait for every active target to finish writing the whole ring. */
+static void
+drain_wbufs(void)
+{
+	pthread_mutex_lock(&glob_masks.mutex);
+	wait_for_targets(1);
+	pthread_mutex_unlock(&glob_masks.mutex);
 }
 
 static void
@@ -551,9 +653,11 @@ main(int argc, char **argv)
 {
 	int		i, j;
 	int		logfd;
+	wbuf		*buf;
 	int		howfar = 0;
 	int		open_flags;
 	xfs_off_t	pos;
+	xfs_off_t	rpos;
 	size_t		length;
 	int		c;
 	uint64_t	size, sizeb;
@@ -915,7 +1019,12 @@ main(int argc, char **argv)
 		do_log(_("Couldn't initialize global thread mask\n"));
 		die_perror();
 	}
-	glob_masks.num_working = 0;
+	if (pthread_cond_init(&glob_masks.filled, NULL) != 0 ||
+	    pthread_cond_init(&glob_masks.drained, NULL) != 0)  {
+		do_log(_("Couldn't initialize ring buffer wakeups\n"));
+		die_perror();
+	}
+	glob_masks.head = 0;
 
 	if (wbuf_init(&w_buf, wbuf_size, wbuf_align,
 					wbuf_miniosize, 0) == NULL)  {
@@ -923,21 +1032,39 @@ main(int argc, char **argv)
 		die_perror();
 	}
 
-	wblocks = wbuf_size / BBSIZE;
+	wblocks = w_buf.size / BBSIZE;
 
-	if (wbuf_init(&btree_buf, max(source_blocksize, wbuf_miniosize),
-				wbuf_align, wbuf_miniosize, 1) == NULL)  {
-		do_log(_("Error initializing btree buf 1\n"));
+	/*
+	 * The ring buffers are all the same size as w_buf.  If memory is
+	 * tight, make do with a shorter ring rather than smaller buffers.
+	 */
+	glob_masks.buffer = calloc(NR_WBUFS, sizeof(wbuf));
+	if (!glob_masks.buffer)  {
+		do_log(_("Couldn't allocate ring buffers\n"));
 		die_perror();
 	}
+	for (i = 0; i < NR_WBUFS; i++)  {
+		wbuf	*rbuf = &glob_masks.buffer[i];
 
-	if (pthread_mutex_init(&mainwait,NULL) != 0)  {
-		do_log(_("Error creating first semaphore.\n"));
+		if (wbuf_init(rbuf, w_buf.size, wbuf_align,
+					wbuf_miniosize, i + 2) == NULL)
+			break;
+		if (rbuf->size != w_buf.size)  {
+			free(rbuf->data);
+			break;
+		}
+	}
+	glob_masks.nr_bufs = i;
+	if (glob_masks.nr_bufs == 0)  {
+		do_log(_("Error initializing ring buffers\n"));
+		die_perror();
+	}
+
+	if (wbuf_init(&btree_buf, max(source_blocksize, wbuf_miniosize),
+				wbuf_align, wbuf_miniosize, 1) == NULL)  {
+		do_log(_("Error initializing btree buf 1\n"));
 		die_perror();
-		exit(1);
 	}
-	/* need to start out blocking */
-	pthread_mutex_lock(&mainwait);
 
 	/* set up sigchild signal handler */
 
@@ -957,18 +1084,13 @@ main(int argc, char **argv)
 			platform_uuid_generate(&tcarg->uuid);
 		else
 			platform_uuid_copy(&tcarg->uuid, &mp->m_sb.sb_uuid);
-
-		if (pthread_mutex_init(&tcarg->wait, NULL) != 0)  {
-			do_log(_("Error creating thread mutex %d\n"), i);
-			die_perror();
-			exit(1);
-		}
-		/* need to start out blocking */
-		pthread_mutex_lock(&tcarg->wait);
 	}
 
+	ioengine = mp->m_ddev_targp->bt_ioengine;
+
 	for (i = 0, tcarg = targ; i < num_targets; i++, tcarg++)  {
 		tcarg->id = i;
+		tcarg->seq = 0;
 		tcarg->fd = target[i].fd;
 
 		target[i].state = ACTIVE;
@@ -996,7 +1118,8 @@ main(int argc, char **argv)
 	for (agno = 0; agno < num_ags && kids > 0; agno++)  {
 		/* read in first blocks of the ag */
 
-		read_ag_header(source_fd, agno, &w_buf, &ag_hdr, mp,
+		buf = get_wbuf();
+		read_ag_header(source_fd, agno, buf, &ag_hdr, mp,
 			source_blocksize, source_sectorsize);
 
 		/* set the in_progress bit for the first AG */
@@ -1012,6 +1135,11 @@ main(int argc, char **argv)
 
 		/* write the ag header out */
 
+		pos = buf->position >> BBSHIFT;
+		length = buf->length >> BBSHIFT;
+		next_begin = pos + length;
+		ASSERT(buf->position % source_sectorsize == 0);
+
 		write_wbuf();
 
 		/* traverse btree until we get to the leftmost leaf node */
@@ -1026,7 +1154,7 @@ main(int argc, char **argv)
 				+ source_blocksize / BBSIZE;
 
 		for (;;) {
-			/* none of this touches the w_buf buffer */
+			/* none of this touches the ring buffers */
 
 			if (current_level >= btree_levels) {
 				do_log(
@@ -1064,13 +1192,8 @@ main(int argc, char **argv)
 
 		/* align first data copy but don't overwrite ag header */
 
-		pos = w_buf.position >> BBSHIFT;
-		length = w_buf.length >> BBSHIFT;
-		next_begin = pos + length;
 		ag_begin = next_begin;
 
-		ASSERT(w_buf.position % source_sectorsize == 0);
-
 		/* handle the rest of the ag */
 
 		for (;;) {
@@ -1110,29 +1233,30 @@ main(int argc, char **argv)
 				if (size > 0)  {
 					/* copy extent */
 
-					w_buf.position = (xfs_off_t)
-						begin << BBSHIFT;
+					rpos = (xfs_off_t) begin << BBSHIFT;
 
 					while (size > 0)  {
+						buf = get_wbuf();
+						buf->position = rpos;
+
 						/*
 						 * let lower layer do alignment
 						 */
-						if (size > w_buf.size)  {
-							w_buf.length = w_buf.size;
-							size -= w_buf.size;
+						if (size > buf->size)  {
+							buf->length = buf->size;
+							size -= buf->size;
 							sizeb -= wblocks;
 							numblocks += wblocks;
 						} else  {
-							w_buf.length = size;
+							buf->length = size;
 							numblocks += sizeb;
 							size = 0;
 						}
 
-						read_wbuf(source_fd, &w_buf, mp);
+						read_wbuf(source_fd, buf, mp);
+						rpos = buf->position + buf->length;
 						write_wbuf();
 
-						w_buf.position += w_buf.length;
-
 						howfar = bump_bar(
 							howfar, numblocks);
 					}
@@ -1182,28 +1306,30 @@ main(int argc, char **argv)
 			if (size > 0)  {
 				/* copy extent */
 
-				w_buf.position = (xfs_off_t) begin << BBSHIFT;
+				rpos = (xfs_off_t) begin << BBSHIFT;
 
 				while (size > 0)  {
+					buf = get_wbuf();
+					buf->position = rpos;
+
 					/*
 					 * let lower layer do alignment
 					 */
-					if (size > w_buf.size)  {
-						w_buf.length = w_buf.size;
-						size -= w_buf.size;
+					if (size > buf->size)  {
+						buf->length = buf->size;
+						size -= buf->size;
 						sizeb -= wblocks;
 						numblocks += wblocks;
 					} else  {
-						w_buf.length = size;
+						buf->length = size;
 						numblocks += sizeb;
 						size = 0;
 					}
 
-					read_wbuf(source_fd, &w_buf, mp);
+					read_wbuf(source_fd, buf, mp);
+					rpos = buf->position + buf->length;
 					write_wbuf();
 
-					w_buf.position += w_buf.length;
-
 					howfar = bump_bar(howfar, numblocks);
 				}
 			}
@@ -1211,6 +1337,9 @@ main(int argc, char **argv)
 	}
 
 	if (kids > 0)  {
+		/* the targets must be idle before we write to them directly */
+		drain_wbufs();
+
 		if (!duplicate)
 			/* write a clean log using the specified UUID */
 			format_logs(mp);
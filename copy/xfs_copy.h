@@ -52,14 +52,23 @@ typedef struct {
 typedef struct t_args {
 	int		id;
 	uuid_t		uuid;
-	pthread_mutex_t	wait;
+	uint64_t	seq;		/* next ring buffer to write */
 	int		fd;
 } thread_args;
 
+/*
+ * The main thread reads the source into a ring of buffers and each target
+ * thread writes them out in order.  A buffer can only be refilled once every
+ * active target has written it, so slow targets can fall at most nr_bufs
+ * buffers behind before the reader waits for them.
+ */
 typedef struct {
 	pthread_mutex_t mutex;
-	int		num_working;
-	wbuf		*buffer;
+	pthread_cond_t	filled;		/* more buffers for the writers */
+	pthread_cond_t	drained;	/* writers are done with buffers */
+	uint64_t	head;		/* sequence of next buffer to fill */
+	unsigned int	nr_bufs;	/* number of buffers in the ring */
+	wbuf		*buffer;	/* the ring itself */
 } thread_control;
 
 typedef int thread_id;
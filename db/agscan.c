@@ -0,0 +1,167 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Scan allocation groups on a pool of worker threads.
+ *
+ * Commands that summarise per-AG metadata spend nearly all of their time
+ * waiting for synchronous metadata reads, one AG after another.  Instead,
+ * hand each AG to a worker thread and walk the AGs in order on the main
+ * thread, printing whatever each scan had to say and letting the caller
+ * fold that AG's results into its totals.  The output is the same as that
+ * of a serial scan.
+ */
+
+#include "libxfs.h"
+#include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
+#include "output.h"
+#include "io.h"
+#include "init.h"
+#include "malloc.h"
+#include "agscan.h"
+
+struct agscan_ag {
+	struct output_capture	*out;
+	bool			done;
+};
+
+struct agscan {
+	const struct agscan_ops	*ops;
+	void			*priv;
+	struct agscan_ag	*ags;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+};
+
+unsigned int
+agscan_nr_threads(void)
+{
+	return min_t(unsigned int, platform_nproc(), mp->m_sb.sb_agcount);
+}
+
+static inline bool
+agscan_want(
+	const struct agscan_ops	*ops,
+	xfs_agnumber_t		agno)
+{
+	return !ops->want || ops->want(agno);
+}
+
+static void
+agscan_one(
+	struct agscan		*as,
+	xfs_agnumber_t		agno)
+{
+	struct output_capture	*oc;
+
+	oc = output_capture_start();
+	as->ops->scan(agno, as->priv);
+	output_capture_stop();
+
+	pthread_mutex_lock(&as->lock);
+	as->ags[agno].out = oc;
+	as->ags[agno].done = true;
+	pthread_cond_broadcast(&as->wait);
+	pthread_mutex_unlock(&as->lock);
+}
+
+static void
+agscan_worker(
+	struct workqueue	*wq,
+	uint32_t		agno,
+	void			*arg)
+{
+	agscan_one(arg, agno);
+	iocur_stack_free();
+}
+
+/*
+ * Scan every AG with ops->scan, then call ops->merge for each of them in AG
+ * order.  Workers are allowed to run a few AGs ahead of the merge so that
+ * the amount of held back output and per-AG state stays bounded.
+ */
+void
+agscan_run(
+	const struct agscan_ops	*ops,
+	void			*priv)
+{
+	struct agscan		as = {
+		.ops		= ops,
+		.priv		= priv,
+	};
+	struct workqueue	wq;
+	xfs_agnumber_t		agcount = mp->m_sb.sb_agcount;
+	xfs_agnumber_t		agno;
+	xfs_agnumber_t		next = 0;
+	unsigned int		nr_threads = agscan_nr_threads();
+	unsigned int		window;
+
+	if (nr_threads < 2 || workqueue_create(&wq, NULL, nr_threads)) {
+		for (agno = 0; agno < agcount; agno++) {
+			if (!agscan_want(ops, agno))
+				continue;
+			ops->scan(agno, priv);
+			ops->merge(agno, priv);
+		}
+		return;
+	}
+
+	as.ags = xcalloc(agcount, sizeof(struct agscan_ag));
+	pthread_mutex_init(&as.lock, NULL);
+	pthread_cond_init(&as.wait, NULL);
+	window = nr_threads * AGSCAN_AHEAD;
+
+	for (agno = 0; agno < agcount; agno++) {
+		for (; next < agcount && next - agno < window; next++) {
+			if (!agscan_want(ops, next))
+				continue;
+			if (workqueue_add(&wq, agscan_worker, next, &as))
+				agscan_one(&as, next);
+		}
+		if (!agscan_want(ops, agno))
+			continue;
+
+		pthread_mutex_lock(&as.lock);
+		while (!as.ags[agno].done)
+			pthread_cond_wait(&as.wait, &as.lock);
+		pthread_mutex_unlock(&as.lock);
+
+		output_capture_flush(as.ags[agno].out);
+		ops->merge(agno, priv);
+	}
+
+	workqueue_terminate(&wq);
+	workqueue_destroy(&wq);
+	pthread_cond_destroy(&as.wait);
+	pthread_mutex_destroy(&as.lock);
+	xfree(as.ags);
+}
+
+/*
+ * Read a metadata buffer from a worker thread.  The io cursor stack belongs
+ * to the main thread, and xfs_db does not lock cached buffers, so bypass
+ * the buffer cache entirely.  Like set_cur, the buffer is returned even if
+ * it fails verification; the verifier will already have complained.
+ */
+int
+agscan_read_buf(
+	xfs_daddr_t		daddr,
+	int			bblen,
+	const struct xfs_buf_ops *ops,
+	struct xfs_buf		**bpp)
+{
+	int			error;
+
+	error = -libxfs_buf_read_uncached(mp->m_ddev_targp, daddr, bblen, 0,
+			bpp, NULL);
+	if (error)
+		return error;
+
+	/*
+	 * Uncached buffers have no perag, but the AG btree verifiers need
+	 * one to check sibling pointers.  libxfs_buf_relse drops it again.
+	 */
+	(*bpp)->b_pag = libxfs_perag_get(mp, xfs_daddr_to_agno(mp, daddr));
+	if (ops)
+		libxfs_readbuf_verify(*bpp, ops);
+	return 0;
+}
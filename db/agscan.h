@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Scan allocation groups on a pool of worker threads.
+ */
+#ifndef __DB_AGSCAN_H__
+#define __DB_AGSCAN_H__
+
+/* How many AGs per thread may be scanned ahead of the one being merged. */
+#define	AGSCAN_AHEAD		4
+
+struct agscan_ops {
+	/* Should this AG be scanned at all? NULL means yes. */
+	bool	(*want)(xfs_agnumber_t agno);
+
+	/*
+	 * Scan an AG.  This runs on a worker thread, so it must not touch any
+	 * unlocked global state.  Worker threads have their own io cursor
+	 * stack, but cached buffers are not locked, so two scans must never
+	 * modify the same buffer.  Anything it prints with dbprintf is held
+	 * back and printed in AG order.
+	 */
+	void	(*scan)(xfs_agnumber_t agno, void *priv);
+
+	/*
+	 * Called on the main thread, in AG order, after the AG's scan output
+	 * has been printed.
+	 */
+	void	(*merge)(xfs_agnumber_t agno, void *priv);
+};
+
+extern unsigned int	agscan_nr_threads(void);
+extern void		agscan_run(const struct agscan_ops *ops, void *priv);
+extern int		agscan_read_buf(xfs_daddr_t daddr, int bblen,
+					const struct xfs_buf_ops *ops,
+					struct xfs_buf **bpp);
+
+#endif /* __DB_AGSCAN_H__ */
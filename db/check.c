@@ -20,6 +20,8 @@
 #include "init.h"
 #include "malloc.h"
 #include "dir2.h"
+#include "dbmap.h"
+#include "agscan.h"
 
 typedef enum {
 	IS_USER_QUOTA, IS_PROJECT_QUOTA, IS_GROUP_QUOTA,
@@ -109,7 +111,7 @@ static xfs_agino_t	agicount;
 static xfs_agino_t	agifreecount;
 static xfs_fsblock_t	*blist;
 static int		blist_size;
-static char		**dbmap;	/* really dbm_t:8 */
+static struct dbmap	**dbmap;	/* block types and owning inodes */
 static dirhash_t	**dirhash;
 static int		error;
 static uint64_t	fdblocks;
@@ -118,10 +120,10 @@ static uint64_t	icount;
 static uint64_t	ifree;
 static inodata_t	***inodata;
 static int		inodata_hash_size;
-static inodata_t	***inomap;
 static int		nflag;
 static int		pflag;
 static int		tflag;
+static int		xflag;
 static qdata_t		**qpdata;
 static int		qpdo;
 static qdata_t		**qudata;
@@ -369,7 +371,7 @@ static const cmdinfo_t	blockfree_cmd =
 	  NULL, N_("free block usage information"), NULL };
 static const cmdinfo_t	blockget_cmd =
 	{ "blockget", NULL, blockget_f, 0, -1, 0,
-	  N_("[-s|-v] [-n] [-t] [-b bno]... [-i ino] ..."),
+	  N_("[-s|-v] [-n] [-t] [-x] [-b bno]... [-i ino] ..."),
 	  N_("get block usage and check consistency"), NULL };
 static const cmdinfo_t	blocktrash_cmd =
 	{ "blocktrash", NULL, blocktrash_f, 0, -1, 0,
@@ -759,26 +761,282 @@ blockfree_f(
 	}
 	rt = mp->m_sb.sb_rextents != 0;
 	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		dbmap_free(dbmap[c]);
 		free_inodata(c);
 	}
 	if (rt) {
-		xfree(dbmap[c]);
-		xfree(inomap[c]);
+		dbmap_free(dbmap[c]);
 		xfree(sumcompute);
 		xfree(sumfile);
 		sumcompute = sumfile = NULL;
 	}
 	xfree(dbmap);
-	xfree(inomap);
 	xfree(inodata);
 	dbmap = NULL;
-	inomap = NULL;
 	inodata = NULL;
 	return 0;
 }
 
+/*
+ * The checks below all run on the main thread, one synchronous metadata read
+ * after another.  To keep the storage busy, worker threads read the headers,
+ * btree blocks and inode clusters of the next few AGs ahead of time.  They
+ * read outside the buffer cache; the main thread inserts the buffers into
+ * the cache, still unverified, just before it scans that AG.  All checking
+ * and every verifier complaint therefore still happens in the usual order.
+ */
+struct prefetch_ag {
+	struct xfs_buf		**bufs;
+	unsigned int		nr;
+	unsigned int		max;
+};
+
+static struct prefetch_ag	*prefetch;
+static unsigned int		prefetch_limit;	/* max buffers held */
+static unsigned int		prefetch_held;
+static pthread_mutex_t		prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct xfs_buf *
+prefetch_read(
+	struct prefetch_ag	*pa,
+	xfs_daddr_t		daddr,
+	int			bblen)
+{
+	struct xfs_buf		*bp;
+
+	pthread_mutex_lock(&prefetch_lock);
+	if (prefetch_held >= prefetch_limit) {
+		pthread_mutex_unlock(&prefetch_lock);
+		return NULL;
+	}
+	prefetch_held++;
+	pthread_mutex_unlock(&prefetch_lock);
+
+	if (agscan_read_buf(daddr, bblen, NULL, &bp)) {
+		pthread_mutex_lock(&prefetch_lock);
+		prefetch_held--;
+		pthread_mutex_unlock(&prefetch_lock);
+		return NULL;
+	}
+	if (pa->nr == pa->max) {
+		pa->max = pa->max ? pa->max * 2 : 16;
+		pa->bufs = xrealloc(pa->bufs, pa->max * sizeof(*pa->bufs));
+	}
+	pa->bufs[pa->nr++] = bp;
+	return bp;
+}
+
+static void
+prefetch_inodes(
+	struct prefetch_ag	*pa,
+	xfs_agnumber_t		agno,
+	struct xfs_btree_block	*block)
+{
+	struct xfs_ino_geometry	*igeo = M_IGEO(mp);
+	xfs_inobt_rec_t		*rp;
+	xfs_agblock_t		agbno;
+	xfs_agblock_t		end_agbno;
+	int			blks_per_buf;
+	int			inodes_per_buf;
+	int			ioff;
+	int			i;
+
+	if (be16_to_cpu(block->bb_numrecs) > igeo->inobt_mxr[0])
+		return;
+	if (xfs_has_sparseinodes(mp))
+		blks_per_buf = igeo->blocks_per_cluster;
+	else
+		blks_per_buf = igeo->ialloc_blks;
+	inodes_per_buf = min(XFS_FSB_TO_INO(mp, blks_per_buf),
+			     XFS_INODES_PER_CHUNK);
+
+	rp = XFS_INOBT_REC_ADDR(mp, block, 1);
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++) {
+		agbno = XFS_AGINO_TO_AGBNO(mp, be32_to_cpu(rp[i].ir_startino));
+		end_agbno = agbno + igeo->ialloc_blks;
+		if (end_agbno > mp->m_sb.sb_agblocks)
+			continue;
+		for (ioff = 0;
+		     agbno < end_agbno && ioff < XFS_INODES_PER_CHUNK;
+		     agbno += blks_per_buf, ioff += inodes_per_buf) {
+			if (xfs_inobt_is_sparse_disk(&rp[i], ioff))
+				continue;
+			if (!prefetch_read(pa, XFS_AGB_TO_DADDR(mp, agno, agbno),
+					XFS_FSB_TO_BB(mp, blks_per_buf)))
+				return;
+		}
+	}
+}
+
+/*
+ * Walk a short format btree.  Nothing read here has been verified yet, so
+ * only follow pointers that look sane and give up on anything else.
+ */
+static void
+prefetch_sbtree(
+	struct prefetch_ag	*pa,
+	xfs_agnumber_t		agno,
+	xfs_agblock_t		bno,
+	int			level,
+	typnm_t			btype)
+{
+	struct xfs_btree_block	*block;
+	struct xfs_buf		*bp;
+	__be32			*pp;
+	unsigned int		maxrecs;
+	int			i;
+
+	if (level < 0 || bno == 0 || bno >= mp->m_sb.sb_agblocks)
+		return;
+	bp = prefetch_read(pa, XFS_AGB_TO_DADDR(mp, agno, bno), blkbb);
+	if (!bp)
+		return;
+	block = bp->b_addr;
+	if (be16_to_cpu(block->bb_level) != level)
+		return;
+	if (level == 0) {
+		if (btype == TYP_INOBT)
+			prefetch_inodes(pa, agno, block);
+		return;
+	}
+
+	switch (btype) {
+	case TYP_BNOBT:
+	case TYP_CNTBT:
+		maxrecs = mp->m_alloc_mxr[1];
+		pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, maxrecs);
+		break;
+	case TYP_INOBT:
+	case TYP_FINOBT:
+		maxrecs = M_IGEO(mp)->inobt_mxr[1];
+		pp = XFS_INOBT_PTR_ADDR(mp, block, 1, maxrecs);
+		break;
+	case TYP_RMAPBT:
+		maxrecs = mp->m_rmap_mxr[1];
+		pp = XFS_RMAP_PTR_ADDR(block, 1, maxrecs);
+		break;
+	case TYP_REFCBT:
+		maxrecs = mp->m_refc_mxr[1];
+		pp = XFS_REFCOUNT_PTR_ADDR(block, 1, maxrecs);
+		break;
+	default:
+		return;
+	}
+	if (be16_to_cpu(block->bb_numrecs) > maxrecs)
+		return;
+	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
+		prefetch_sbtree(pa, agno, be32_to_cpu(pp[i]), level - 1, btype);
+}
+
+static void
+prefetch_scan_ag(
+	xfs_agnumber_t		agno,
+	void			*priv)
+{
+	struct prefetch_ag	*pa = &prefetch[agno];
+	struct xfs_buf		*agfbp;
+	struct xfs_buf		*agibp;
+	xfs_agf_t		*agf;
+	xfs_agi_t		*agi;
+
+	if (!prefetch_limit)
+		return;
+
+	prefetch_read(pa, XFS_AG_DADDR(mp, agno, XFS_SB_DADDR),
+			XFS_FSS_TO_BB(mp, 1));
+	agfbp = prefetch_read(pa, XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1));
+	agibp = prefetch_read(pa, XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1));
+	prefetch_read(pa, XFS_AG_DADDR(mp, agno, XFS_AGFL_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1));
+
+	if (agfbp) {
+		agf = agfbp->b_addr;
+		if (be32_to_cpu(agf->agf_magicnum) == XFS_AGF_MAGIC) {
+			prefetch_sbtree(pa, agno, be32_to_cpu(agf->agf_bno_root),
+					be32_to_cpu(agf->agf_bno_level) - 1,
+					TYP_BNOBT);
+			prefetch_sbtree(pa, agno, be32_to_cpu(agf->agf_cnt_root),
+					be32_to_cpu(agf->agf_cnt_level) - 1,
+					TYP_CNTBT);
+			if (agf->agf_rmap_root)
+				prefetch_sbtree(pa, agno,
+					be32_to_cpu(agf->agf_rmap_root),
+					be32_to_cpu(agf->agf_rmap_level) - 1,
+					TYP_RMAPBT);
+			if (agf->agf_refcount_root)
+				prefetch_sbtree(pa, agno,
+					be32_to_cpu(agf->agf_refcount_root),
+					be32_to_cpu(agf->agf_refcount_level) - 1,
+					TYP_REFCBT);
+		}
+	}
+	if (agibp) {
+		agi = agibp->b_addr;
+		if (be32_to_cpu(agi->agi_magicnum) == XFS_AGI_MAGIC) {
+			prefetch_sbtree(pa, agno, be32_to_cpu(agi->agi_root),
+					be32_to_cpu(agi->agi_level) - 1,
+					TYP_INOBT);
+			if (agi->agi_free_root)
+				prefetch_sbtree(pa, agno,
+					be32_to_cpu(agi->agi_free_root),
+					be32_to_cpu(agi->agi_free_level) - 1,
+					TYP_FINOBT);
+		}
+	}
+}
+
+/* Hand an AG's prefetched buffers to the buffer cache, unverified. */
+static void
+prefetch_install(
+	xfs_agnumber_t		agno)
+{
+	struct prefetch_ag	*pa = &prefetch[agno];
+	struct xfs_buf		*pbp;
+	struct xfs_buf		*bp;
+	unsigned int		i;
+
+	for (i = 0; i < pa->nr; i++) {
+		pbp = pa->bufs[i];
+		if (!libxfs_buf_get(mp->m_ddev_targp, xfs_buf_daddr(pbp),
+				pbp->b_length, &bp)) {
+			if (!(bp->b_flags &
+			      (LIBXFS_B_UPTODATE | LIBXFS_B_DIRTY))) {
+				memcpy(bp->b_addr, pbp->b_addr,
+						BBTOB(pbp->b_length));
+				bp->b_flags |= LIBXFS_B_UPTODATE |
+					       LIBXFS_B_UNCHECKED;
+			}
+			libxfs_buf_relse(bp);
+		}
+		libxfs_buf_relse(pbp);
+	}
+
+	pthread_mutex_lock(&prefetch_lock);
+	prefetch_held -= pa->nr;
+	pthread_mutex_unlock(&prefetch_lock);
+	xfree(pa->bufs);
+	pa->bufs = NULL;
+	pa->nr = pa->max = 0;
+}
+
+static void
+check_ag(
+	xfs_agnumber_t		agno,
+	void			*priv)
+{
+	int			*sbyell = priv;
+
+	prefetch_install(agno);
+	scan_ag(agno);
+	if (sbver_err > 4 && !*sbyell && sbver_err >= agno) {
+		*sbyell = 1;
+		dbprintf(_("WARNING: this may be a newer XFS "
+			 "filesystem.\n"));
+	}
+}
+
 /*
  * Check consistency of xfs filesystem contents.
  */
@@ -787,9 +1045,12 @@ blockget_f(
 	int		argc,
 	char		**argv)
 {
-	xfs_agnumber_t	agno;
+	const struct agscan_ops	ops = {
+		.scan		= prefetch_scan_ag,
+		.merge		= check_ag,
+	};
 	int		oldprefix;
-	int		sbyell;
+	int		sbyell = 0;
 
 	if (dbmap) {
 		dbprintf(_("already have block usage information\n"));
@@ -805,14 +1066,14 @@ blockget_f(
 	}
 	oldprefix = dbprefix;
 	dbprefix |= pflag;
-	for (agno = 0, sbyell = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		scan_ag(agno);
-		if (sbver_err > 4 && !sbyell && sbver_err >= agno) {
-			sbyell = 1;
-			dbprintf(_("WARNING: this may be a newer XFS "
-				 "filesystem.\n"));
-		}
-	}
+	if (agscan_nr_threads() > 1)
+		prefetch_limit = mp->m_ddev_targp->bcache->c_maxcount / 2;
+	else
+		prefetch_limit = 0;
+	prefetch = xcalloc(mp->m_sb.sb_agcount, sizeof(struct prefetch_ag));
+	agscan_run(&ops, &sbyell);
+	xfree(prefetch);
+	prefetch = NULL;
 	if (blist_size) {
 		xfree(blist);
 		blist = NULL;
@@ -929,6 +1190,7 @@ blocktrash_f(
 	struct timeval	now;
 	char		*p;
 	xfs_rfsblock_t	randb;
+	struct dbmap_run	run;
 	uint		seed;
 	int		sopt;
 	int		tmask;
@@ -1074,11 +1336,12 @@ blocktrash_f(
 		goto out;
 	}
 	for (blocks = 0, agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		for (agbno = 0, p = dbmap[agno];
+		for (agbno = 0;
 		     agbno < mp->m_sb.sb_agblocks;
-		     agbno++, p++) {
-			if ((1 << *p) & tmask)
-				blocks++;
+		     agbno = run.end) {
+			dbmap_lookup(dbmap[agno], agbno, &run);
+			if ((1 << run.type) & tmask)
+				blocks += run.end - agbno;
 		}
 	}
 	if (blocks == 0) {
@@ -1091,18 +1354,22 @@ blocktrash_f(
 		for (bi = 0, agno = 0, done = 0;
 		     !done && agno < mp->m_sb.sb_agcount;
 		     agno++) {
-			for (agbno = 0, p = dbmap[agno];
+			for (agbno = 0;
 			     agbno < mp->m_sb.sb_agblocks;
-			     agbno++, p++) {
-				if (!((1 << *p) & tmask))
+			     agbno = run.end) {
+				dbmap_lookup(dbmap[agno], agbno, &run);
+				if (!((1 << run.type) & tmask))
 					continue;
-				if (bi++ < randb)
+				if (bi + (run.end - agbno) <= randb) {
+					bi += run.end - agbno;
 					continue;
+				}
+				agbno += randb - bi;
 				push_cur();
 				set_cur(NULL,
 					XFS_AGB_TO_DADDR(mp, agno, agbno),
 					blkbb, DB_RING_IGN, NULL);
-				blocktrash_b(bit_offset, (dbm_t)*p,
+				blocktrash_b(bit_offset, (dbm_t)run.type,
 					&lentab[random() % lentablen], mode);
 				pop_cur();
 				done = 1;
@@ -1128,6 +1395,7 @@ blockuse_f(
 	xfs_fsblock_t	fsb;
 	inodata_t	*i;
 	char		*p;
+	struct dbmap_run	run;
 	int		shownames;
 
 	if (!dbmap) {
@@ -1163,11 +1431,11 @@ blockuse_f(
 		}
 	}
 	while (agbno <= end) {
-		p = &dbmap[agno][agbno];
-		i = inomap[agno][agbno];
+		dbmap_lookup(dbmap[agno], agbno, &run);
+		i = run.owner;
 		dbprintf(_("block %llu (%u/%u) type %s"),
 			(xfs_fsblock_t)XFS_AGB_TO_FSB(mp, agno, agbno),
-			agno, agbno, typename[(dbm_t)*p]);
+			agno, agbno, typename[(dbm_t)run.type]);
 		if (i) {
 			dbprintf(_(" inode %lld"), i->ino);
 			if (shownames && (p = inode_name(i->ino, NULL))) {
@@ -1215,29 +1483,34 @@ check_dbmap(
 	int		ignore_reflink)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_agblock_t	b;
+	struct dbmap_run	run;
 	dbm_t		d;
 
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
+	for (i = 0; i < len; i = run.end - agbno) {
 		if (!dbmap_boundscheck(agno, agbno + i)) {
 			dbprintf(_("block %u/%u beyond end of expected area\n"),
 				agno, agbno + i);
 			error++;
 			break;
 		}
-		d = (dbm_t)*p;
+		dbmap_lookup(dbmap[agno], agbno + i, &run);
+		run.end = min_t(uint64_t, run.end, (uint64_t)agbno + len);
+		d = (dbm_t)run.type;
 		if (ignore_reflink && (d == DBM_UNKNOWN || d == DBM_DATA ||
 				       d == DBM_RLDATA))
 			continue;
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLISTA(agno, agbno + i)) {
+		if (d == type)
+			continue;
+		for (b = agbno + i; (!sflag || blist_size) && b < run.end; b++) {
+			if (!sflag || CHECK_BLISTA(agno, b)) {
 				dbprintf(_("block %u/%u expected type %s got "
 					 "%s\n"),
-					agno, agbno + i, typename[type],
-					typename[(dbm_t)*p]);
+					agno, b, typename[type],
+					typename[d]);
 			}
-			error++;
 		}
+		error += run.end - (agbno + i);
 	}
 }
 
@@ -1260,7 +1533,9 @@ check_inomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_agblock_t	b;
+	inodata_t	*id;
+	struct dbmap_run	run;
 	int		rval;
 
 	if (!check_range(agno, agbno, len))  {
@@ -1268,16 +1543,22 @@ check_inomap(
 			agno, agbno, agbno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		if (*idp && !(*idp)->isreflink) {
-			if (!sflag || (*idp)->ilist ||
-			    CHECK_BLISTA(agno, agbno + i))
+	for (i = 0, rval = 1; i < len; i = run.end - agbno) {
+		dbmap_lookup(dbmap[agno], agbno + i, &run);
+		run.end = min_t(uint64_t, run.end, (uint64_t)agbno + len);
+		id = run.owner;
+		if (!id || id->isreflink)
+			continue;
+		for (b = agbno + i;
+		     (!sflag || id->ilist || blist_size) && b < run.end;
+		     b++) {
+			if (!sflag || id->ilist || CHECK_BLISTA(agno, b))
 				dbprintf(_("block %u/%u claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					agno, agbno + i, c_ino, (*idp)->ino);
-			error++;
-			rval = 0;
+					agno, b, c_ino, id->ino);
 		}
+		error += run.end - (agbno + i);
+		rval = 0;
 	}
 	return rval;
 }
@@ -1348,23 +1629,28 @@ check_rdbmap(
 	dbm_t		type)
 {
 	xfs_extlen_t	i;
-	char		*p;
+	xfs_rfsblock_t	b;
+	struct dbmap_run	run;
 
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
+	for (i = 0; i < len; i = run.end - bno) {
 		if (!rdbmap_boundscheck(bno + i)) {
 			dbprintf(_("rtblock %llu beyond end of expected area\n"),
 				bno + i);
 			error++;
 			break;
 		}
-		if ((dbm_t)*p != type) {
-			if (!sflag || CHECK_BLIST(bno + i))
+		dbmap_lookup(dbmap[mp->m_sb.sb_agcount], bno + i, &run);
+		run.end = min(run.end, bno + len);
+		if ((dbm_t)run.type == type)
+			continue;
+		for (b = bno + i; (!sflag || blist_size) && b < run.end; b++) {
+			if (!sflag || CHECK_BLIST(b))
 				dbprintf(_("rtblock %llu expected type %s got "
 					 "%s\n"),
-					bno + i, typename[type],
-					typename[(dbm_t)*p]);
-			error++;
+					b, typename[type],
+					typename[(dbm_t)run.type]);
 		}
+		error += run.end - (bno + i);
 	}
 }
 
@@ -1375,7 +1661,9 @@ check_rinomap(
 	xfs_ino_t	c_ino)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
+	xfs_rfsblock_t	b;
+	inodata_t	*id;
+	struct dbmap_run	run;
 	int		rval;
 
 	if (!check_rrange(bno, len)) {
@@ -1383,17 +1671,22 @@ check_rinomap(
 			bno, bno + len - 1, c_ino);
 		return 0;
 	}
-	for (i = 0, rval = 1, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		if (*idp) {
-			if (!sflag || (*idp)->ilist || CHECK_BLIST(bno + i))
+	for (i = 0, rval = 1; i < len; i = run.end - bno) {
+		dbmap_lookup(dbmap[mp->m_sb.sb_agcount], bno + i, &run);
+		run.end = min(run.end, bno + len);
+		id = run.owner;
+		if (!id)
+			continue;
+		for (b = bno + i;
+		     (!sflag || id->ilist || blist_size) && b < run.end;
+		     b++) {
+			if (!sflag || id->ilist || CHECK_BLIST(b))
 				dbprintf(_("rtblock %llu claimed by inode %lld, "
 					 "previous inum %lld\n"),
-					bno + i, c_ino, (*idp)->ino);
-			error++;
-			rval = 0;
+					b, c_ino, id->ino);
 		}
+		error += run.end - (bno + i);
+		rval = 0;
 	}
 	return rval;
 }
@@ -1475,8 +1768,9 @@ check_set_dbmap(
 	xfs_agblock_t	c_agbno)
 {
 	xfs_extlen_t	i;
+	xfs_agblock_t	b;
 	int		mayprint;
-	char		*p;
+	struct dbmap_run	run;
 
 	if (!check_range(agno, agbno, len))  {
 		dbprintf(_("blocks %u/%u..%u claimed by block %u/%u\n"), agno,
@@ -1485,22 +1779,28 @@ check_set_dbmap(
 	}
 	check_dbmap(agno, agbno, len, type1, is_reflink(type2));
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[agno][agbno]; i < len; i++, p++) {
+	for (i = 0; i < len; i = run.end - agbno) {
 		if (!dbmap_boundscheck(agno, agbno + i)) {
 			dbprintf(_("block %u/%u beyond end of expected area\n"),
 				agno, agbno + i);
 			error++;
 			break;
 		}
-		if (*p == DBM_RLDATA && type2 == DBM_DATA)
+		dbmap_lookup(dbmap[agno], agbno + i, &run);
+		run.end = min_t(uint64_t, run.end, (uint64_t)agbno + len);
+		if (run.type == DBM_RLDATA && type2 == DBM_DATA)
 			;	/* do nothing */
-		else if (*p == DBM_DATA && type2 == DBM_DATA)
-			*p = (char)DBM_RLDATA;
+		else if (run.type == DBM_DATA && type2 == DBM_DATA)
+			dbmap_set_type(dbmap[agno], agbno + i,
+					run.end - (agbno + i), DBM_RLDATA);
 		else
-			*p = (char)type2;
-		if (mayprint && (verbose || CHECK_BLISTA(agno, agbno + i)))
-			dbprintf(_("setting block %u/%u to %s\n"), agno, agbno + i,
-				typename[type2]);
+			dbmap_set_type(dbmap[agno], agbno + i,
+					run.end - (agbno + i), type2);
+		for (b = agbno + i; mayprint && b < run.end; b++) {
+			if (verbose || CHECK_BLISTA(agno, b))
+				dbprintf(_("setting block %u/%u to %s\n"),
+					agno, b, typename[type2]);
+		}
 	}
 }
 
@@ -1513,24 +1813,23 @@ check_set_rdbmap(
 {
 	xfs_extlen_t	i;
 	int		mayprint;
-	char		*p;
 
 	if (!check_rrange(bno, len))
 		return;
 	check_rdbmap(bno, len, type1);
 	mayprint = verbose | blist_size;
-	for (i = 0, p = &dbmap[mp->m_sb.sb_agcount][bno]; i < len; i++, p++) {
+	for (i = 0; i < len; i++) {
 		if (!rdbmap_boundscheck(bno + i)) {
 			dbprintf(_("rtblock %llu beyond end of expected area\n"),
 				bno + i);
 			error++;
 			break;
 		}
-		*p = (char)type2;
 		if (mayprint && (verbose || CHECK_BLIST(bno + i)))
 			dbprintf(_("setting rtblock %llu to %s\n"),
 				bno + i, typename[type2]);
 	}
+	dbmap_set_type(dbmap[mp->m_sb.sb_agcount], bno, i, type2);
 }
 
 static inline xfs_suminfo_t
@@ -1698,30 +1997,24 @@ init(
 	if (!sb_logcheck())
 		return 0;
 	rt = mp->m_sb.sb_rextents != 0;
-	dbmap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*dbmap));
-	inomap = xmalloc((mp->m_sb.sb_agcount + rt) * sizeof(*inomap));
+	dbmap = xcalloc(mp->m_sb.sb_agcount + rt, sizeof(*dbmap));
 	inodata = xmalloc(mp->m_sb.sb_agcount * sizeof(*inodata));
 	inodata_hash_size =
 		(int)max(min(mp->m_sb.sb_icount /
 				(INODATA_AVG_HASH_LENGTH * mp->m_sb.sb_agcount),
 			     MAX_INODATA_HASH_SIZE),
 			 MIN_INODATA_HASH_SIZE);
-	for (c = 0; c < mp->m_sb.sb_agcount; c++) {
-		dbmap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_agblocks, sizeof(**inomap));
+	for (c = 0; c < mp->m_sb.sb_agcount; c++)
 		inodata[c] = xcalloc(inodata_hash_size, sizeof(**inodata));
-	}
 	if (rt) {
 		unsigned long long	words;
 
-		dbmap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**dbmap));
-		inomap[c] = xcalloc(mp->m_sb.sb_rblocks, sizeof(**inomap));
 		words = XFS_FSB_TO_B(mp, mp->m_rsumblocks) >> XFS_WORDLOG;
 		sumfile = xcalloc(words, sizeof(union xfs_suminfo_raw));
 		sumcompute = xcalloc(words, sizeof(union xfs_suminfo_raw));
 	}
-	nflag = sflag = tflag = verbose = optind = 0;
-	while ((c = getopt(argc, argv, "b:i:npstv")) != EOF) {
+	nflag = sflag = tflag = verbose = xflag = optind = 0;
+	while ((c = getopt(argc, argv, "b:i:npstvx")) != EOF) {
 		switch (c) {
 		case 'b':
 			bno = strtoll(optarg, NULL, 10);
@@ -1746,11 +2039,18 @@ init(
 		case 'v':
 			verbose = 1;
 			break;
+		case 'x':
+			xflag = 1;
+			break;
 		default:
 			dbprintf(_("bad option for blockget command\n"));
 			return 0;
 		}
 	}
+	for (c = 0; c < mp->m_sb.sb_agcount; c++)
+		dbmap[c] = dbmap_alloc(mp->m_sb.sb_agblocks, xflag);
+	if (rt)
+		dbmap[c] = dbmap_alloc(mp->m_sb.sb_rblocks, xflag);
 	error = sbver_err = serious_error = 0;
 	fdblocks = frextents = icount = ifree = 0;
 	sbversion = XFS_SB_VERSION_4;
@@ -4684,16 +4984,14 @@ set_inomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_inomap(agno, agbno, len, id->ino))
 		return;
+	dbmap_set_owner(dbmap[agno], agbno, len, id);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[agno][agbno]; i < len; i++, idp++) {
-		*idp = id;
-		if (mayprint &&
-		    (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLISTA(agno, agbno + i))
 			dbprintf(_("setting inode to %lld for block %u/%u\n"),
 				id->ino, agno, agbno + i);
 	}
@@ -4715,17 +5013,14 @@ set_rinomap(
 	inodata_t	*id)
 {
 	xfs_extlen_t	i;
-	inodata_t	**idp;
 	int		mayprint;
 
 	if (!check_rinomap(bno, len, id->ino))
 		return;
+	dbmap_set_owner(dbmap[mp->m_sb.sb_agcount], bno, len, id);
 	mayprint = verbose | id->ilist | blist_size;
-	for (i = 0, idp = &inomap[mp->m_sb.sb_agcount][bno];
-	     i < len;
-	     i++, idp++) {
-		*idp = id;
-		if (mayprint && (verbose || id->ilist || CHECK_BLIST(bno + i)))
+	for (i = 0; mayprint && i < len; i++) {
+		if (verbose || id->ilist || CHECK_BLIST(bno + i))
 			dbprintf(_("setting inode to %lld for rtblock %llu\n"),
 				id->ino, bno + i);
 	}
@@ -0,0 +1,357 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Range-encoded block usage map for the check command.
+ *
+ * blockget used to record a type byte and an inode pointer for every block
+ * in the filesystem, which is nine bytes per block and does not fit in
+ * memory for large filesystems.  Most of a filesystem is covered by long
+ * runs of blocks with the same type and owner, so each map is split into
+ * fixed size chunks and every chunk keeps a sorted array of runs instead.
+ * A chunk that has never been written costs nothing but its header.
+ *
+ * When spilling is requested, the run arrays are kept in an xfile and only
+ * a handful of chunks are held in memory at a time.
+ */
+
+#include "libxfs.h"
+#include "libxfs/xfile.h"
+#include "output.h"
+#include "init.h"
+#include "malloc.h"
+#include "dbmap.h"
+
+#define	DBM_CHUNK_SHIFT		13
+#define	DBM_CHUNK_BLOCKS	(1U << DBM_CHUNK_SHIFT)
+#define	DBM_CHUNK_MASK		(DBM_CHUNK_BLOCKS - 1)
+
+/* Number of chunks kept in memory when the maps are spilled to an xfile. */
+#define	DBM_RESIDENT		256
+
+struct dbm_run {
+	uint32_t		start;		/* block offset within chunk */
+	uint32_t		type;
+	void			*owner;
+};
+
+/* Each chunk gets a fixed slot in the xfile, big enough for its worst case. */
+#define	DBM_SLOT_BYTES		((loff_t)DBM_CHUNK_BLOCKS * sizeof(struct dbm_run))
+
+struct dbm_chunk {
+	struct dbm_run		*runs;		/* NULL if unwritten or spilled */
+	uint32_t		nr;		/* 0 if never written */
+	uint32_t		max;
+};
+
+struct dbmap {
+	uint64_t		nblocks;
+	uint64_t		nr_chunks;
+	struct dbm_chunk	*chunks;
+	loff_t			slot_base;	/* -1 if not spilled */
+};
+
+struct dbm_resident {
+	struct dbmap		*dm;
+	uint64_t		cidx;
+};
+
+static struct xfile		*dbm_xfile;
+static unsigned int		dbm_xfile_users;
+static loff_t			dbm_xfile_next;
+static struct dbm_resident	dbm_resident[DBM_RESIDENT];
+static unsigned int		dbm_clock;
+
+static void
+dbm_spill_failed(void)
+{
+	dbprintf(_("%s: out of memory\n"), progname);
+	exit(4);
+}
+
+static inline loff_t
+dbm_slot_pos(
+	struct dbmap	*dm,
+	uint64_t	cidx)
+{
+	return dm->slot_base + cidx * DBM_SLOT_BYTES;
+}
+
+static inline uint32_t
+dbm_chunk_len(
+	struct dbmap	*dm,
+	uint64_t	cidx)
+{
+	return min_t(uint64_t, DBM_CHUNK_BLOCKS,
+			dm->nblocks - (cidx << DBM_CHUNK_SHIFT));
+}
+
+/* Write a resident chunk back to the xfile and drop its run array. */
+static void
+dbm_evict(
+	unsigned int		slot)
+{
+	struct dbm_resident	*r = &dbm_resident[slot];
+	struct dbm_chunk	*c;
+
+	if (!r->dm)
+		return;
+	c = &r->dm->chunks[r->cidx];
+	if (xfile_store(dbm_xfile, c->runs, c->nr * sizeof(struct dbm_run),
+			dbm_slot_pos(r->dm, r->cidx)))
+		dbm_spill_failed();
+	xfree(c->runs);
+	c->runs = NULL;
+	c->max = 0;
+	r->dm = NULL;
+}
+
+/* Make a chunk's run array available in memory. */
+static struct dbm_chunk *
+dbm_chunk_get(
+	struct dbmap		*dm,
+	uint64_t		cidx)
+{
+	struct dbm_chunk	*c = &dm->chunks[cidx];
+
+	if (c->runs)
+		return c;
+
+	if (c->nr == 0) {
+		c->max = 4;
+		c->runs = xrealloc(NULL, c->max * sizeof(struct dbm_run));
+		memset(&c->runs[0], 0, sizeof(struct dbm_run));
+		c->nr = 1;
+	} else {
+		c->max = c->nr;
+		c->runs = xrealloc(NULL, c->max * sizeof(struct dbm_run));
+		if (xfile_load(dbm_xfile, c->runs,
+				c->nr * sizeof(struct dbm_run),
+				dbm_slot_pos(dm, cidx)))
+			dbm_spill_failed();
+	}
+
+	if (dm->slot_base >= 0) {
+		dbm_evict(dbm_clock);
+		dbm_resident[dbm_clock].dm = dm;
+		dbm_resident[dbm_clock].cidx = cidx;
+		dbm_clock = (dbm_clock + 1) % DBM_RESIDENT;
+	}
+	return c;
+}
+
+/* Find the run containing @off.  The first run always starts at zero. */
+static uint32_t
+dbm_chunk_find(
+	const struct dbm_chunk	*c,
+	uint32_t		off)
+{
+	uint32_t		lo = 0;
+	uint32_t		hi = c->nr;
+
+	while (hi - lo > 1) {
+		uint32_t	mid = (lo + hi) / 2;
+
+		if (c->runs[mid].start <= off)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Make sure a run starts at @off and return its index. */
+static uint32_t
+dbm_chunk_split(
+	struct dbm_chunk	*c,
+	uint32_t		off)
+{
+	uint32_t		i = dbm_chunk_find(c, off);
+
+	if (c->runs[i].start == off)
+		return i;
+	if (c->nr == c->max) {
+		c->max *= 2;
+		c->runs = xrealloc(c->runs, c->max * sizeof(struct dbm_run));
+	}
+	memmove(&c->runs[i + 2], &c->runs[i + 1],
+			(c->nr - i - 1) * sizeof(struct dbm_run));
+	c->runs[i + 1] = c->runs[i];
+	c->runs[i + 1].start = off;
+	c->nr++;
+	return i + 1;
+}
+
+/* Coalesce identical neighbours among runs [from, to). */
+static void
+dbm_chunk_merge(
+	struct dbm_chunk	*c,
+	uint32_t		from,
+	uint32_t		to)
+{
+	uint32_t		w = from;
+	uint32_t		r;
+
+	for (r = from + 1; r < to; r++) {
+		if (c->runs[r].type == c->runs[w].type &&
+		    c->runs[r].owner == c->runs[w].owner)
+			continue;
+		c->runs[++w] = c->runs[r];
+	}
+	if (w + 1 == to)
+		return;
+	memmove(&c->runs[w + 1], &c->runs[to],
+			(c->nr - to) * sizeof(struct dbm_run));
+	c->nr -= to - (w + 1);
+}
+
+static void
+dbm_update(
+	struct dbmap		*dm,
+	uint64_t		bno,
+	uint64_t		len,
+	bool			set_type,
+	unsigned int		type,
+	void			*owner)
+{
+	uint64_t		end = bno + len;
+
+	ASSERT(end <= dm->nblocks);
+
+	while (bno < end) {
+		uint64_t		cidx = bno >> DBM_CHUNK_SHIFT;
+		uint64_t		base = cidx << DBM_CHUNK_SHIFT;
+		uint32_t		clen = dbm_chunk_len(dm, cidx);
+		uint32_t		lo = bno - base;
+		uint32_t		hi = min_t(uint64_t, end - base, clen);
+		struct dbm_chunk	*c = dbm_chunk_get(dm, cidx);
+		uint32_t		i, j, k;
+
+		i = dbm_chunk_split(c, lo);
+		j = hi < clen ? dbm_chunk_split(c, hi) : c->nr;
+		for (k = i; k < j; k++) {
+			if (set_type)
+				c->runs[k].type = type;
+			else
+				c->runs[k].owner = owner;
+		}
+		dbm_chunk_merge(c, i ? i - 1 : 0, min(j + 1, c->nr));
+
+		bno = base + hi;
+	}
+}
+
+struct dbmap *
+dbmap_alloc(
+	uint64_t	nblocks,
+	bool		spill)
+{
+	struct dbmap	*dm;
+	int		error;
+
+	dm = xcalloc(1, sizeof(struct dbmap));
+	dm->nblocks = nblocks;
+	dm->nr_chunks = (nblocks + DBM_CHUNK_BLOCKS - 1) >> DBM_CHUNK_SHIFT;
+	dm->chunks = xcalloc(dm->nr_chunks, sizeof(struct dbm_chunk));
+	dm->slot_base = -1;
+	if (!spill)
+		return dm;
+
+	if (!dbm_xfile) {
+		error = xfile_create(_("xfs_db block map"), 0, &dbm_xfile);
+		if (error) {
+			dbprintf(_("could not create block map file: %s\n"),
+					strerror(-error));
+			return dm;
+		}
+	}
+	dbm_xfile_users++;
+	dm->slot_base = dbm_xfile_next;
+	dbm_xfile_next += dm->nr_chunks * DBM_SLOT_BYTES;
+	return dm;
+}
+
+void
+dbmap_free(
+	struct dbmap	*dm)
+{
+	uint64_t	cidx;
+	unsigned int	i;
+
+	if (!dm)
+		return;
+
+	for (cidx = 0; cidx < dm->nr_chunks; cidx++)
+		xfree(dm->chunks[cidx].runs);
+	xfree(dm->chunks);
+
+	if (dm->slot_base >= 0) {
+		for (i = 0; i < DBM_RESIDENT; i++) {
+			if (dbm_resident[i].dm == dm)
+				dbm_resident[i].dm = NULL;
+		}
+		xfile_discard(dbm_xfile, dm->slot_base,
+				dm->nr_chunks * DBM_SLOT_BYTES);
+		if (--dbm_xfile_users == 0) {
+			xfile_destroy(dbm_xfile);
+			dbm_xfile = NULL;
+			dbm_xfile_next = 0;
+			dbm_clock = 0;
+		}
+	}
+	xfree(dm);
+}
+
+/*
+ * Return the run containing @bno.  Runs never cross a chunk boundary, so
+ * callers walking a range should step from one run's end to the next.
+ */
+void
+dbmap_lookup(
+	struct dbmap		*dm,
+	uint64_t		bno,
+	struct dbmap_run	*run)
+{
+	uint64_t		cidx = bno >> DBM_CHUNK_SHIFT;
+	uint64_t		base = cidx << DBM_CHUNK_SHIFT;
+	struct dbm_chunk	*c = &dm->chunks[cidx];
+	uint32_t		i;
+
+	ASSERT(bno < dm->nblocks);
+
+	if (c->nr == 0) {
+		run->start = base;
+		run->end = base + dbm_chunk_len(dm, cidx);
+		run->type = 0;
+		run->owner = NULL;
+		return;
+	}
+
+	c = dbm_chunk_get(dm, cidx);
+	i = dbm_chunk_find(c, bno & DBM_CHUNK_MASK);
+	run->start = base + c->runs[i].start;
+	if (i + 1 < c->nr)
+		run->end = base + c->runs[i + 1].start;
+	else
+		run->end = base + dbm_chunk_len(dm, cidx);
+	run->type = c->runs[i].type;
+	run->owner = c->runs[i].owner;
+}
+
+void
+dbmap_set_type(
+	struct dbmap	*dm,
+	uint64_t	bno,
+	uint64_t	len,
+	unsigned int	type)
+{
+	dbm_update(dm, bno, len, true, type, NULL);
+}
+
+void
+dbmap_set_owner(
+	struct dbmap	*dm,
+	uint64_t	bno,
+	uint64_t	len,
+	void		*owner)
+{
+	dbm_update(dm, bno, len, false, 0, owner);
+}
@@ -0,0 +1,27 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Range-encoded block usage map for the check command.
+ */
+#ifndef __DB_DBMAP_H__
+#define __DB_DBMAP_H__
+
+struct dbmap;
+
+/* A run of blocks sharing the same type and owner. */
+struct dbmap_run {
+	uint64_t	start;		/* first block of the run */
+	uint64_t	end;		/* first block past the run */
+	unsigned int	type;
+	void		*owner;
+};
+
+extern struct dbmap	*dbmap_alloc(uint64_t nblocks, bool spill);
+extern void		dbmap_free(struct dbmap *dm);
+extern void		dbmap_lookup(struct dbmap *dm, uint64_t bno,
+				     struct dbmap_run *run);
+extern void		dbmap_set_type(struct dbmap *dm, uint64_t bno,
+				       uint64_t len, unsigned int type);
+extern void		dbmap_set_owner(struct dbmap *dm, uint64_t bno,
+					uint64_t len, void *owner);
+
+#endif /* __DB_DBMAP_H__ */
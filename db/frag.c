@@ -14,6 +14,7 @@
 #include "type.h"
 #include "init.h"
 #include "malloc.h"
+#include "agscan.h"
 
 typedef struct extent {
 	xfs_fileoff_t	startoff;
@@ -39,14 +40,23 @@ static int		Rflag;
 static int		rflag;
 static int		vflag;
 
+/* Per-AG state of a fragmentation scan, which runs on a worker thread. */
+struct frag_scan {
+	xfs_agnumber_t		agno;
+	uint64_t		extcount_actual;
+	uint64_t		extcount_ideal;
+};
+
+static struct frag_scan	*frag_ags;
+
 typedef void	(*scan_lbtree_f_t)(struct xfs_btree_block *block,
 				   int			level,
 				   extmap_t		**extmapp,
 				   typnm_t		btype);
 
-typedef void	(*scan_sbtree_f_t)(struct xfs_btree_block *block,
-				   int			level,
-				   xfs_agf_t		*agf);
+typedef void	(*scan_sbtree_f_t)(struct frag_scan	*fs,
+				   struct xfs_btree_block *block,
+				   int			level);
 
 static extmap_t		*extmap_alloc(xfs_extnum_t nex);
 static xfs_extnum_t	extmap_ideal(extmap_t *extmap);
@@ -60,20 +70,22 @@ static void		process_btinode(struct xfs_dinode *dip,
 					extmap_t **extmapp, int whichfork);
 static void		process_exinode(struct xfs_dinode *dip,
 					extmap_t **extmapp, int whichfork);
-static void		process_fork(struct xfs_dinode *dip, int whichfork);
-static void		process_inode(xfs_agf_t *agf, xfs_agino_t agino,
+static void		process_fork(struct frag_scan *fs,
+				     struct xfs_dinode *dip, int whichfork);
+static void		process_inode(struct frag_scan *fs, xfs_agino_t agino,
 				      struct xfs_dinode *dip);
-static void		scan_ag(xfs_agnumber_t agno);
+static void		scan_ag(xfs_agnumber_t agno, void *priv);
+static void		merge_ag(xfs_agnumber_t agno, void *priv);
 static void		scan_lbtree(xfs_fsblock_t root, int nlevels,
 				    scan_lbtree_f_t func, extmap_t **extmapp,
 				    typnm_t btype);
-static void		scan_sbtree(xfs_agf_t *agf, xfs_agblock_t root,
+static void		scan_sbtree(struct frag_scan *fs, xfs_agblock_t root,
 				    int nlevels, scan_sbtree_f_t func,
 				    typnm_t btype);
 static void		scanfunc_bmap(struct xfs_btree_block *block, int level,
 				      extmap_t **extmapp, typnm_t btype);
-static void		scanfunc_ino(struct xfs_btree_block *block, int level,
-				     xfs_agf_t *agf);
+static void		scanfunc_ino(struct frag_scan *fs,
+				     struct xfs_btree_block *block, int level);
 
 static const cmdinfo_t	frag_cmd =
 	{ "frag", NULL, frag_f, 0, -1, 0,
@@ -146,13 +158,18 @@ frag_f(
 	int		argc,
 	char		**argv)
 {
-	xfs_agnumber_t	agno;
+	const struct agscan_ops	ops = {
+		.scan		= scan_ag,
+		.merge		= merge_ag,
+	};
 	double		answer;
 
 	if (!init(argc, argv))
 		return 0;
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		scan_ag(agno);
+	frag_ags = xcalloc(mp->m_sb.sb_agcount, sizeof(struct frag_scan));
+	agscan_run(&ops, NULL);
+	xfree(frag_ags);
+	frag_ags = NULL;
 	if (extcount_actual)
 		answer = (double)(extcount_actual - extcount_ideal) * 100.0 /
 			 (double)extcount_actual;
@@ -269,6 +286,7 @@ process_exinode(
 
 static void
 process_fork(
+	struct frag_scan	*fs,
 	struct xfs_dinode	*dip,
 	int			whichfork)
 {
@@ -287,14 +305,14 @@ process_fork(
 		process_btinode(dip, &extmap, whichfork);
 		break;
 	}
-	extcount_actual += extmap->nents;
-	extcount_ideal += extmap_ideal(extmap);
+	fs->extcount_actual += extmap->nents;
+	fs->extcount_ideal += extmap_ideal(extmap);
 	xfree(extmap);
 }
 
 static void
 process_inode(
-	xfs_agf_t		*agf,
+	struct frag_scan	*fs,
 	xfs_agino_t		agino,
 	struct xfs_dinode	*dip)
 {
@@ -304,7 +322,7 @@ process_inode(
 	int			skipa;
 	int			skipd;
 
-	ino = XFS_AGINO_TO_INO(mp, be32_to_cpu(agf->agf_seqno), agino);
+	ino = XFS_AGINO_TO_INO(mp, fs->agno, agino);
 	switch (be16_to_cpu(dip->di_mode) & S_IFMT) {
 	case S_IFDIR:
 		skipd = !dflag;
@@ -331,48 +349,56 @@ process_inode(
 		skipd = 1;
 		break;
 	}
-	actual = extcount_actual;
-	ideal = extcount_ideal;
+	actual = fs->extcount_actual;
+	ideal = fs->extcount_ideal;
 	if (!skipd)
-		process_fork(dip, XFS_DATA_FORK);
+		process_fork(fs, dip, XFS_DATA_FORK);
 	skipa = !aflag || !dip->di_forkoff;
 	if (!skipa)
-		process_fork(dip, XFS_ATTR_FORK);
+		process_fork(fs, dip, XFS_ATTR_FORK);
 	if (vflag && (!skipd || !skipa))
 		dbprintf(_("inode %lld actual %lld ideal %lld\n"),
-			ino, extcount_actual - actual, extcount_ideal - ideal);
+			ino, fs->extcount_actual - actual,
+			fs->extcount_ideal - ideal);
 }
 
 static void
 scan_ag(
-	xfs_agnumber_t	agno)
+	xfs_agnumber_t		agno,
+	void			*priv)
 {
-	xfs_agf_t	*agf;
-	xfs_agi_t	*agi;
-
-	push_cur();
-	set_cur(&typtab[TYP_AGF],
-		XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
-		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
-	if ((agf = iocur_top->data) == NULL) {
+	struct frag_scan	*fs = &frag_ags[agno];
+	struct xfs_buf		*agfbp;
+	struct xfs_buf		*agibp;
+	xfs_agi_t		*agi;
+
+	fs->agno = agno;
+	if (agscan_read_buf(XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), typtab[TYP_AGF].bops, &agfbp)) {
 		dbprintf(_("can't read agf block for ag %u\n"), agno);
-		pop_cur();
 		return;
 	}
-	push_cur();
-	set_cur(&typtab[TYP_AGI],
-		XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
-		XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
-	if ((agi = iocur_top->data) == NULL) {
+	if (agscan_read_buf(XFS_AG_DADDR(mp, agno, XFS_AGI_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), typtab[TYP_AGI].bops, &agibp)) {
 		dbprintf(_("can't read agi block for ag %u\n"), agno);
-		pop_cur();
-		pop_cur();
+		libxfs_buf_relse(agfbp);
 		return;
 	}
-	scan_sbtree(agf, be32_to_cpu(agi->agi_root),
+	agi = agibp->b_addr;
+	scan_sbtree(fs, be32_to_cpu(agi->agi_root),
 			be32_to_cpu(agi->agi_level), scanfunc_ino, TYP_INOBT);
-	pop_cur();
-	pop_cur();
+	libxfs_buf_relse(agibp);
+	libxfs_buf_relse(agfbp);
+}
+
+/* Add an AG's extent counts to the totals; runs on the main thread. */
+static void
+merge_ag(
+	xfs_agnumber_t		agno,
+	void			*priv)
+{
+	extcount_actual += frag_ags[agno].extcount_actual;
+	extcount_ideal += frag_ags[agno].extcount_ideal;
 }
 
 static void
@@ -383,38 +409,36 @@ scan_lbtree(
 	extmap_t	**extmapp,
 	typnm_t		btype)
 {
-	push_cur();
-	set_cur(&typtab[btype], XFS_FSB_TO_DADDR(mp, root), blkbb, DB_RING_IGN,
-		NULL);
-	if (iocur_top->data == NULL) {
+	struct xfs_buf	*bp;
+
+	if (agscan_read_buf(XFS_FSB_TO_DADDR(mp, root), blkbb,
+			typtab[btype].bops, &bp)) {
 		dbprintf(_("can't read btree block %u/%u\n"),
 			XFS_FSB_TO_AGNO(mp, root),
 			XFS_FSB_TO_AGBNO(mp, root));
 		return;
 	}
-	(*func)(iocur_top->data, nlevels - 1, extmapp, btype);
-	pop_cur();
+	(*func)(bp->b_addr, nlevels - 1, extmapp, btype);
+	libxfs_buf_relse(bp);
 }
 
 static void
 scan_sbtree(
-	xfs_agf_t	*agf,
-	xfs_agblock_t	root,
-	int		nlevels,
-	scan_sbtree_f_t	func,
-	typnm_t		btype)
+	struct frag_scan	*fs,
+	xfs_agblock_t		root,
+	int			nlevels,
+	scan_sbtree_f_t		func,
+	typnm_t			btype)
 {
-	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
+	struct xfs_buf		*bp;
 
-	push_cur();
-	set_cur(&typtab[btype], XFS_AGB_TO_DADDR(mp, seqno, root),
-		blkbb, DB_RING_IGN, NULL);
-	if (iocur_top->data == NULL) {
-		dbprintf(_("can't read btree block %u/%u\n"), seqno, root);
+	if (agscan_read_buf(XFS_AGB_TO_DADDR(mp, fs->agno, root), blkbb,
+			typtab[btype].bops, &bp)) {
+		dbprintf(_("can't read btree block %u/%u\n"), fs->agno, root);
 		return;
 	}
-	(*func)(iocur_top->data, nlevels - 1, agf);
-	pop_cur();
+	(*func)(fs, bp->b_addr, nlevels - 1);
+	libxfs_buf_relse(bp);
 }
 
 static void
@@ -455,12 +479,13 @@ scanfunc_bmap(
 
 static void
 scanfunc_ino(
+	struct frag_scan	*fs,
 	struct xfs_btree_block	*block,
-	int			level,
-	xfs_agf_t		*agf)
+	int			level)
 {
 	xfs_agino_t		agino;
-	xfs_agnumber_t		seqno = be32_to_cpu(agf->agf_seqno);
+	xfs_agnumber_t		seqno = fs->agno;
+	struct xfs_buf		*bp;
 	int			i;
 	int			j;
 	int			off;
@@ -489,18 +514,16 @@ scanfunc_ino(
 			off = XFS_AGINO_TO_OFFSET(mp, agino);
 			end_agbno = agbno + igeo->ialloc_blks;
 
-			push_cur();
 			ioff = 0;
 			while (agbno < end_agbno &&
 			       ioff < XFS_INODES_PER_CHUNK) {
 				if (xfs_inobt_is_sparse_disk(&rp[i], ioff))
 					goto next_buf;
 
-				set_cur(&typtab[TYP_INODE],
-					XFS_AGB_TO_DADDR(mp, seqno, agbno),
-					XFS_FSB_TO_BB(mp, blks_per_buf),
-					DB_RING_IGN, NULL);
-				if (iocur_top->data == NULL) {
+				if (agscan_read_buf(
+						XFS_AGB_TO_DADDR(mp, seqno, agbno),
+						XFS_FSB_TO_BB(mp, blks_per_buf),
+						typtab[TYP_INODE].bops, &bp)) {
 					dbprintf(_("can't read inode block %u/%u\n"),
 						 seqno, agbno);
 					goto next_buf;
@@ -509,21 +532,21 @@ scanfunc_ino(
 				for (j = 0; j < inodes_per_buf; j++) {
 					if (XFS_INOBT_IS_FREE_DISK(&rp[i], ioff + j))
 						continue;
-					dip = (struct xfs_dinode *)((char *)iocur_top->data +
+					dip = (struct xfs_dinode *)((char *)bp->b_addr +
 						((off + j) << mp->m_sb.sb_inodelog));
-					process_inode(agf, agino + ioff + j, dip);
+					process_inode(fs, agino + ioff + j, dip);
 				}
+				libxfs_buf_relse(bp);
 
 next_buf:
 				agbno += blks_per_buf;
 				ioff += inodes_per_buf;
 			}
-			pop_cur();
 		}
 		return;
 	}
 	pp = XFS_INOBT_PTR_ADDR(mp, block, 1, igeo->inobt_mxr[1]);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-		scan_sbtree(agf, be32_to_cpu(pp[i]), level, scanfunc_ino,
+		scan_sbtree(fs, be32_to_cpu(pp[i]), level, scanfunc_ino,
 								TYP_INOBT);
 }
@@ -12,25 +12,36 @@
 #include "output.h"
 #include "init.h"
 #include "malloc.h"
+#include "agscan.h"
 #include "libfrog/histogram.h"
 
+/* Per-AG state of a free space scan, which runs on a worker thread. */
+struct freesp_scan {
+	xfs_agnumber_t		agno;
+	struct histogram	*hist;
+};
+
 static void	addhistent(int h);
-static void	addtohist(xfs_agnumber_t agno, xfs_agblock_t agbno,
+static void	addtohist(struct freesp_scan *fs, xfs_agblock_t agbno,
 			  xfs_extlen_t len);
 static int	freesp_f(int argc, char **argv);
 static void	histinit(int maxlen);
 static int	init(int argc, char **argv);
 static void	printhist(void);
-static void	scan_ag(xfs_agnumber_t agno);
-static void	scanfunc_bno(struct xfs_btree_block *block, typnm_t typ, int level,
-			     xfs_agf_t *agf);
-static void	scanfunc_cnt(struct xfs_btree_block *block, typnm_t typ, int level,
-			     xfs_agf_t *agf);
-static void	scan_freelist(xfs_agf_t *agf);
-static void	scan_sbtree(xfs_agf_t *agf, xfs_agblock_t root, typnm_t typ,
-			    int nlevels,
-			    void (*func)(struct xfs_btree_block *block, typnm_t typ,
-					 int level, xfs_agf_t *agf));
+static void	scan_ag(xfs_agnumber_t agno, void *priv);
+static void	merge_ag(xfs_agnumber_t agno, void *priv);
+static void	scanfunc_bno(struct freesp_scan *fs,
+			     struct xfs_btree_block *block, typnm_t typ,
+			     int level);
+static void	scanfunc_cnt(struct freesp_scan *fs,
+			     struct xfs_btree_block *block, typnm_t typ,
+			     int level);
+static void	scan_freelist(struct freesp_scan *fs, xfs_agf_t *agf);
+static void	scan_sbtree(struct freesp_scan *fs, xfs_agblock_t root,
+			    typnm_t typ, int nlevels,
+			    void (*func)(struct freesp_scan *fs,
+					 struct xfs_btree_block *block,
+					 typnm_t typ, int level));
 static int	usage(void);
 
 static int		agcount;
@@ -40,6 +51,7 @@ static int		countflag;
 static int		dumpflag;
 static int		equalsize;
 static struct histogram	freesp_hist;
+static struct histogram	*freesp_aghist;
 static int		multsize;
 static int		seen1;
 static int		summaryflag;
@@ -49,18 +61,18 @@ static const cmdinfo_t	freesp_cmd =
 	  "[-bcdfs] [-A alignment] [-a agno]... [-e binsize] [-h h1]... [-m binmult]",
 	  "summarize free space for filesystem", NULL };
 
-static int
+static bool
 inaglist(
 	xfs_agnumber_t	agno)
 {
 	int		i;
 
 	if (agcount == 0)
-		return 1;
+		return true;
 	for (i = 0; i < agcount; i++)
 		if (aglist[i] == agno)
-			return 1;
-	return 0;
+			return true;
+	return false;
 }
 
 /*
@@ -71,7 +83,11 @@ freesp_f(
 	int		argc,
 	char		**argv)
 {
-	xfs_agnumber_t	agno;
+	const struct agscan_ops	ops = {
+		.want		= inaglist,
+		.scan		= scan_ag,
+		.merge		= merge_ag,
+	};
 
 	if (!init(argc, argv))
 		return 0;
@@ -79,10 +95,11 @@ freesp_f(
 	if (dumpflag)
 		dbprintf("%8s %8s %8s\n", "agno", "agbno", "len");
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)  {
-		if (inaglist(agno))
-			scan_ag(agno);
-	}
+	freesp_aghist = xcalloc(mp->m_sb.sb_agcount, sizeof(struct histogram));
+	agscan_run(&ops, NULL);
+	xfree(freesp_aghist);
+	freesp_aghist = NULL;
+
 	if (hist_buckets(&freesp_hist))
 		printhist();
 	if (summaryflag) {
@@ -188,26 +205,63 @@ usage(void)
 	return 0;
 }
 
+/* Give an AG's histogram the same buckets as the global one. */
+static void
+init_aghist(
+	struct histogram	*hist)
+{
+	unsigned int		i;
+
+	hist_init(hist);
+	for (i = 0; i < hist_buckets(&freesp_hist); i++) {
+		if (hist_add_bucket(hist, freesp_hist.buckets[i].low)) {
+			dbprintf(_("%s: out of memory\n"), progname);
+			exit(4);
+		}
+	}
+	if (hist_buckets(hist))
+		hist_prepare(hist, freesp_hist.buckets[i - 1].high);
+}
+
 static void
 scan_ag(
-	xfs_agnumber_t	agno)
+	xfs_agnumber_t		agno,
+	void			*priv)
 {
-	xfs_agf_t	*agf;
+	struct freesp_scan	fs = {
+		.agno		= agno,
+		.hist		= &freesp_aghist[agno],
+	};
+	struct xfs_buf		*bp;
+	xfs_agf_t		*agf;
 
-	push_cur();
-	set_cur(&typtab[TYP_AGF], XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
-				XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
-	agf = iocur_top->data;
-	scan_freelist(agf);
+	init_aghist(fs.hist);
+	if (agscan_read_buf(XFS_AG_DADDR(mp, agno, XFS_AGF_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), typtab[TYP_AGF].bops, &bp)) {
+		dbprintf(_("can't read agf block for ag %u\n"), agno);
+		return;
+	}
+	agf = bp->b_addr;
+	scan_freelist(&fs, agf);
 	if (countflag)
-		scan_sbtree(agf, be32_to_cpu(agf->agf_cnt_root),
+		scan_sbtree(&fs, be32_to_cpu(agf->agf_cnt_root),
 			TYP_CNTBT, be32_to_cpu(agf->agf_cnt_level),
 			scanfunc_cnt);
 	else
-		scan_sbtree(agf, be32_to_cpu(agf->agf_bno_root),
+		scan_sbtree(&fs, be32_to_cpu(agf->agf_bno_root),
 			TYP_BNOBT, be32_to_cpu(agf->agf_bno_level),
 			scanfunc_bno);
-	pop_cur();
+	libxfs_buf_relse(bp);
+}
+
+/* Fold an AG's free space into the totals; runs on the main thread. */
+static void
+merge_ag(
+	xfs_agnumber_t		agno,
+	void			*priv)
+{
+	hist_import(&freesp_hist, &freesp_aghist[agno]);
+	hist_free(&freesp_aghist[agno]);
 }
 
 static int
@@ -216,66 +270,67 @@ scan_agfl(
 	xfs_agblock_t		bno,
 	void			*priv)
 {
-	addtohist(*(xfs_agnumber_t *)priv, bno, 1);
+	addtohist(priv, bno, 1);
 	return 0;
 }
 
 static void
 scan_freelist(
-	xfs_agf_t	*agf)
+	struct freesp_scan	*fs,
+	xfs_agf_t		*agf)
 {
-	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
+	struct xfs_buf		*bp;
 
 	if (be32_to_cpu(agf->agf_flcount) == 0)
 		return;
-	push_cur();
-	set_cur(&typtab[TYP_AGFL], XFS_AG_DADDR(mp, seqno, XFS_AGFL_DADDR(mp)),
-				XFS_FSS_TO_BB(mp, 1), DB_RING_IGN, NULL);
+	if (agscan_read_buf(XFS_AG_DADDR(mp, fs->agno, XFS_AGFL_DADDR(mp)),
+			XFS_FSS_TO_BB(mp, 1), typtab[TYP_AGFL].bops, &bp)) {
+		dbprintf(_("can't read agfl block for ag %u\n"), fs->agno);
+		return;
+	}
 
 	/* verify agf values before proceeding */
 	if (be32_to_cpu(agf->agf_flfirst) >= libxfs_agfl_size(mp) ||
 	    be32_to_cpu(agf->agf_fllast) >= libxfs_agfl_size(mp)) {
 		dbprintf(_("agf %d freelist blocks bad, skipping "
-			  "freelist scan\n"), seqno);
-		pop_cur();
+			  "freelist scan\n"), fs->agno);
+		libxfs_buf_relse(bp);
 		return;
 	}
 
-	libxfs_agfl_walk(mp, agf, iocur_top->bp, scan_agfl, &seqno);
-	pop_cur();
+	libxfs_agfl_walk(mp, agf, bp, scan_agfl, fs);
+	libxfs_buf_relse(bp);
 }
 
 static void
 scan_sbtree(
-	xfs_agf_t	*agf,
-	xfs_agblock_t	root,
-	typnm_t		typ,
-	int		nlevels,
-	void		(*func)(struct xfs_btree_block	*block,
-				typnm_t			typ,
-				int			level,
-				xfs_agf_t		*agf))
+	struct freesp_scan	*fs,
+	xfs_agblock_t		root,
+	typnm_t			typ,
+	int			nlevels,
+	void			(*func)(struct freesp_scan	*fs,
+					struct xfs_btree_block	*block,
+					typnm_t			typ,
+					int			level))
 {
-	xfs_agnumber_t	seqno = be32_to_cpu(agf->agf_seqno);
+	struct xfs_buf		*bp;
 
-	push_cur();
-	set_cur(&typtab[typ], XFS_AGB_TO_DADDR(mp, seqno, root),
-		blkbb, DB_RING_IGN, NULL);
-	if (iocur_top->data == NULL) {
-		dbprintf(_("can't read btree block %u/%u\n"), seqno, root);
+	if (agscan_read_buf(XFS_AGB_TO_DADDR(mp, fs->agno, root), blkbb,
+			typtab[typ].bops, &bp)) {
+		dbprintf(_("can't read btree block %u/%u\n"), fs->agno, root);
 		return;
 	}
-	(*func)(iocur_top->data, typ, nlevels - 1, agf);
-	pop_cur();
+	(*func)(fs, bp->b_addr, typ, nlevels - 1);
+	libxfs_buf_relse(bp);
 }
 
 /*ARGSUSED*/
 static void
 scanfunc_bno(
+	struct freesp_scan	*fs,
 	struct xfs_btree_block	*block,
 	typnm_t			typ,
-	int			level,
-	xfs_agf_t		*agf)
+	int			level)
 {
 	int			i;
 	xfs_alloc_ptr_t		*pp;
@@ -288,22 +343,21 @@ scanfunc_bno(
 	if (level == 0) {
 		rp = XFS_ALLOC_REC_ADDR(mp, block, 1);
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-			addtohist(be32_to_cpu(agf->agf_seqno),
-					be32_to_cpu(rp[i].ar_startblock),
+			addtohist(fs, be32_to_cpu(rp[i].ar_startblock),
 					be32_to_cpu(rp[i].ar_blockcount));
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_bno);
+		scan_sbtree(fs, be32_to_cpu(pp[i]), typ, level, scanfunc_bno);
 }
 
 static void
 scanfunc_cnt(
+	struct freesp_scan	*fs,
 	struct xfs_btree_block	*block,
 	typnm_t			typ,
-	int			level,
-	xfs_agf_t		*agf)
+	int			level)
 {
 	int			i;
 	xfs_alloc_ptr_t		*pp;
@@ -316,14 +370,13 @@ scanfunc_cnt(
 	if (level == 0) {
 		rp = XFS_ALLOC_REC_ADDR(mp, block, 1);
 		for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-			addtohist(be32_to_cpu(agf->agf_seqno),
-					be32_to_cpu(rp[i].ar_startblock),
+			addtohist(fs, be32_to_cpu(rp[i].ar_startblock),
 					be32_to_cpu(rp[i].ar_blockcount));
 		return;
 	}
 	pp = XFS_ALLOC_PTR_ADDR(mp, block, 1, mp->m_alloc_mxr[1]);
 	for (i = 0; i < be16_to_cpu(block->bb_numrecs); i++)
-		scan_sbtree(agf, be32_to_cpu(pp[i]), typ, level, scanfunc_cnt);
+		scan_sbtree(fs, be32_to_cpu(pp[i]), typ, level, scanfunc_cnt);
 }
 
 static void
@@ -335,16 +388,16 @@ addhistent(
 
 static void
 addtohist(
-	xfs_agnumber_t	agno,
-	xfs_agblock_t	agbno,
-	xfs_extlen_t	len)
+	struct freesp_scan	*fs,
+	xfs_agblock_t		agbno,
+	xfs_extlen_t		len)
 {
-	if (alignment && (XFS_AGB_TO_FSB(mp,agno,agbno) % alignment))
+	if (alignment && (XFS_AGB_TO_FSB(mp, fs->agno, agbno) % alignment))
 		return;
 
 	if (dumpflag)
-		dbprintf("%8d %8d %8d\n", agno, agbno, len);
-	hist_add(&freesp_hist, len);
+		dbprintf("%8d %8d %8d\n", fs->agno, agbno, len);
+	hist_add(fs->hist, len);
 }
 
 static void
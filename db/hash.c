@@ -430,7 +430,7 @@ hashcoll_f(
 	}
 
 	if (seed)
-		srandom(seed);
+		obfuscate_seed(seed);
 
 	if (read_stdin) {
 		char	buf[MAXNAMELEN];
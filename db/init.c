@@ -33,7 +33,7 @@ static void
 usage(void)
 {
 	fprintf(stderr, _(
-		"Usage: %s [-ifFrxV] [-p prog] [-l logdev] [-R rtdev] [-c cmd]... device\n"
+		"Usage: %s [-ifFmrxV] [-p prog] [-l logdev] [-R rtdev] [-M extmap] [-c cmd]... device\n"
 		), progname);
 	exit(1);
 }
@@ -54,7 +54,7 @@ init(
 	textdomain(PACKAGE);
 
 	progname = basename(argv[0]);
-	while ((c = getopt(argc, argv, "c:fFip:rR:xVl:")) != EOF) {
+	while ((c = getopt(argc, argv, "c:fFimM:p:rR:xVl:")) != EOF) {
 		switch (c) {
 		case 'c':
 			cmdline = xrealloc(cmdline, (ncmdline+1)*sizeof(char*));
@@ -69,6 +69,13 @@ init(
 		case 'i':
 			x.flags = LIBXFS_ISREADONLY | LIBXFS_ISINACTIVE;
 			break;
+		case 'm':
+			x.data.isfile = 1;
+			x.data.metadump = true;
+			break;
+		case 'M':
+			x.data.metadump_map = optarg;
+			break;
 		case 'p':
 			progname = optarg;
 			break;
@@ -93,9 +100,13 @@ init(
 	}
 	if (optind + 1 != argc)
 		usage();
+	if (x.data.metadump_map && !x.data.metadump)
+		usage();
 
 	x.data.name = argv[optind];
 	x.flags |= LIBXFS_DIRECT;
+	if (x.data.metadump)
+		x.flags |= LIBXFS_ISREADONLY;
 
 	x.bcache_flags = CACHE_MISCOMPARE_PURGE;
 	if (!libxfs_init(&x)) {
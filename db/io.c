@@ -51,10 +51,10 @@ static const cmdinfo_t  ring_cmd =
 	{ "ring", NULL, ring_f, 0, 1, 0, NULL,
 	  N_("show position ring or move to a specific entry"), ring_help };
 
-iocur_t	*iocur_base;
-iocur_t	*iocur_top;
-int	iocur_sp = -1;
-int	iocur_len;
+__thread iocur_t	*iocur_base;
+__thread iocur_t	*iocur_top;
+__thread int		iocur_sp = -1;
+__thread int		iocur_len;
 
 #define RING_ENTRIES 20
 static iocur_t iocur_ring[RING_ENTRIES];
@@ -117,6 +117,24 @@ pop_cur(void)
 	}
 }
 
+/* Release the calling thread's whole io cursor stack. */
+void
+iocur_stack_free(void)
+{
+	int	i;
+
+	for (i = 0; i <= iocur_sp; i++) {
+		if (iocur_base[i].bp)
+			libxfs_buf_relse(iocur_base[i].bp);
+		free(iocur_base[i].bbmap);
+	}
+	free(iocur_base);
+	iocur_base = NULL;
+	iocur_top = NULL;
+	iocur_sp = -1;
+	iocur_len = 0;
+}
+
 /*ARGSUSED*/
 static int
 pop_f(
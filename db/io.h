@@ -35,12 +35,14 @@ typedef struct iocur {
 #define DB_RING_ADD 1                   /* add to ring on set_cur */
 #define DB_RING_IGN 0                   /* do not add to ring on set_cur */
 
-extern iocur_t	*iocur_base;		/* base of stack */
-extern iocur_t	*iocur_top;		/* top element of stack */
-extern int	iocur_sp;		/* current top of stack */
-extern int	iocur_len;		/* length of stack array */
+/* Each thread has its own stack. */
+extern __thread iocur_t	*iocur_base;	/* base of stack */
+extern __thread iocur_t	*iocur_top;	/* top element of stack */
+extern __thread int	iocur_sp;	/* current top of stack */
+extern __thread int	iocur_len;	/* length of stack array */
 
 extern void	io_init(void);
+extern void	iocur_stack_free(void);
 extern void	off_cur(int off, int len);
 extern void	pop_cur(void);
 extern void	print_iocur(char *tag, iocur_t *ioc);
@@ -12,6 +12,8 @@
 static void
 badmalloc(void)
 {
+	/* don't let the message vanish into an agscan worker's capture */
+	output_capture_stop();
 	dbprintf(_("%s: out of memory\n"), progname);
 	exit(4);
 }
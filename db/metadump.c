@@ -13,6 +13,7 @@
 #include "output.h"
 #include "type.h"
 #include "init.h"
+#include "malloc.h"
 #include "sig.h"
 #include "xfs_metadump.h"
 #include "fprint.h"
@@ -20,6 +21,12 @@
 #include "field.h"
 #include "dir2.h"
 #include "obfuscate.h"
+#include "libfrog/platform.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/lzcodec.h"
+#include "libfrog/bitmap.h"
+#include "libxfs/xfile.h"
+#include "agscan.h"
 
 #undef REMAP_DEBUG
 
@@ -46,9 +53,17 @@ static void	metadump_help(void);
 
 static const cmdinfo_t	metadump_cmd =
 	{ "metadump", NULL, metadump_f, 0, -1, 0,
-		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] [-v 1|2] filename"),
+		N_("[-a] [-e] [-g] [-m max_extent] [-w] [-o] [-v 1|2|3] [-i index] [-d base_index] [-x extmap] filename"),
 		N_("dump metadata to a file"), metadump_help };
 
+static int	namebench_f(int argc, char **argv);
+static void	namebench_help(void);
+
+static const cmdinfo_t	namebench_cmd =
+	{ "namebench", NULL, namebench_f, 0, -1, 0,
+		N_("[-d dirs] [-l namelen] [-n names] [-u]"),
+		N_("time name obfuscation in big directories"), namebench_help };
+
 struct metadump_ops {
 	/*
 	 * Initialize Metadump. This may perform actions such as
@@ -63,6 +78,11 @@ struct metadump_ops {
 	 */
 	int (*write)(enum typnm type, const char *data, xfs_daddr_t off,
 			int len);
+	/*
+	 * Record that @len 512 byte blocks at the v2 extent address @addr held
+	 * metadata in the base of a delta dump, but no longer do.
+	 */
+	int (*write_tombstone)(uint64_t addr, int len);
 	/*
 	 * Flush any in-memory remanents of metadata to the metadump file.
 	 */
@@ -73,6 +93,51 @@ struct metadump_ops {
 	void (*release)(void);
 };
 
+/*
+ * A v3 chunk.  The dump thread fills @data with v2 style records, a worker
+ * compresses it into @out, and the dump thread writes @out to the file once
+ * all earlier chunks have been written.
+ */
+struct md3_chunk {
+	char			*data;
+	size_t			len;
+	char			*out;
+	size_t			out_len;
+	uint64_t		low;
+	uint64_t		high;
+	bool			done;
+};
+
+/* One extent in a block index. */
+struct md_bindex_ent {
+	uint64_t		addr;		/* v2 extent address */
+	uint32_t		len;		/* 512 byte blocks */
+	uint32_t		crc;
+	bool			overlaps;	/* base only */
+};
+
+struct md_bindex {
+	struct md_bindex_ent	*ents;
+	uint64_t		nr;
+	uint64_t		size;
+	uint32_t		chain_id;
+	uint32_t		chain_seq;
+};
+
+/* Where the data of one extent is in the dump. */
+struct md_emap_ent {
+	uint64_t		addr;		/* v2 extent address */
+	uint32_t		len;		/* 512 byte blocks */
+	uint32_t		chunk_off;	/* v3 only */
+	uint64_t		pos;		/* v2 file offset, v3 chunk */
+};
+
+struct md_emap {
+	struct md_emap_ent	*ents;
+	uint64_t		nr;
+	uint64_t		size;
+};
+
 static struct metadump {
 	int			version;
 	bool			show_progress;
@@ -86,7 +151,8 @@ static struct metadump {
 	bool			external_log;
 	bool			stdout_metadump;
 	bool			realtime_data;
-	xfs_ino_t		cur_ino;
+	xfs_ino_t		orphanage_ino;
+	bool			scan_failed;
 	/* Metadump file */
 	FILE			*outf;
 	struct metadump_ops	*mdops;
@@ -96,12 +162,73 @@ static struct metadump {
 	char			*block_buffer;
 	int			num_indices;
 	int			cur_index;
+	/* v3 chunks being filled, compressed or waiting to be written */
+	struct md3_chunk	*chunks;
+	unsigned int		nr_chunks;
+	uint64_t		chunk_head;
+	uint64_t		chunk_tail;
+	struct workqueue	chunk_wq;
+	pthread_mutex_t		chunk_lock;
+	pthread_cond_t		chunk_done;
+	/* v3 chunk index, and bytes written so far (v2 and v3) */
+	struct xfs_meta_index_rec *chunk_index;
+	uint64_t		nr_chunk_index;
+	uint64_t		out_offset;
+	/* block index of this dump, and of the base of a delta dump */
+	char			*bindex_file;
+	char			*base_file;
+	struct md_bindex	bindex;
+	struct md_bindex	base;
+	struct bitmap		*delta_written;
+	uint64_t		delta_skipped;
+	/* extent map of this dump */
+	char			*emap_file;
+	struct md_emap		emap;
 } metadump;
 
+/* The inode being copied by this thread. */
+static __thread xfs_ino_t	cur_ino;
+
+/*
+ * When AGs are scanned in parallel, each worker appends everything it would
+ * have written to the dump, and any warnings, to a private staging area.  The
+ * main thread replays the staging areas into the dump in AG order, so the
+ * dump is the same no matter how many threads made it.  Staged records
+ * beyond MD_STAGE_MEM bytes are moved out to an xfile.
+ */
+#define MD_STAGE_MEM		(1U << 20)
+
+enum md_rec_kind {
+	MD_REC_BLOCK,
+	MD_REC_WARNING,
+};
+
+struct md_stage_rec {
+	uint32_t		kind;
+	uint32_t		type;		/* enum typnm for blocks */
+	int64_t			off;		/* daddr for blocks */
+	uint32_t		len;		/* payload bytes */
+	uint32_t		pad;
+};
+
+struct md_stage {
+	char			*buf;
+	size_t			len;
+	size_t			size;
+	struct xfile		*xf;
+	loff_t			spilled;
+	int			error;
+	int			rval;		/* what scan_ag returned */
+};
+
+/* The staging area for the AG this thread is scanning, if any. */
+static __thread struct md_stage	*md_stage;
+
 void
 metadump_init(void)
 {
 	add_command(&metadump_cmd);
+	add_command(&namebench_cmd);
 }
 
 static void
@@ -114,15 +241,35 @@ metadump_help(void)
 " or xfs_repair failures.\n\n"
 " Options:\n"
 "   -a -- Copy full metadata blocks without zeroing unused space\n"
+"   -d -- Only dump what changed since the dump with this block index\n"
 "   -e -- Ignore read errors and keep going\n"
 "   -g -- Display dump progress\n"
+"   -i -- Write a block index of the dump to this file\n"
 "   -m -- Specify max extent size in blocks to copy (default = %d blocks)\n"
 "   -o -- Don't obfuscate names and extended attributes\n"
-"   -v -- Metadump version to be used\n"
+"   -v -- Metadump version to be used (3 compresses the dump)\n"
 "   -w -- Show warnings of bad metadata information\n"
+"   -x -- Write a map of where each extent is in the dump to this file, so\n"
+"         that xfs_db -m and xfs_repair -o metadump can read the dump\n"
+"         without scanning it first\n"
 "\n"), DEFAULT_MAX_EXT_SIZE);
 }
 
+static int md_stage_add(struct md_stage *ms, enum md_rec_kind kind,
+		enum typnm type, int64_t off, const void *data, uint32_t len);
+static int md_dump_extent(enum typnm type, const char *data, xfs_daddr_t off,
+		int len);
+
+static void
+emit_warning(
+	const char	*msg)
+{
+	fprintf(stderr, "%s%s: %s\n",
+			metadump.progress_since_warning ? "\n" : "",
+			progname, msg);
+	metadump.progress_since_warning = false;
+}
+
 static void
 print_warning(const char *fmt, ...)
 {
@@ -137,10 +284,12 @@ print_warning(const char *fmt, ...)
 	va_end(ap);
 	buf[sizeof(buf)-1] = '\0';
 
-	fprintf(stderr, "%s%s: %s\n",
-			metadump.progress_since_warning ? "\n" : "",
-			progname, buf);
-	metadump.progress_since_warning = false;
+	if (md_stage) {
+		md_stage_add(md_stage, MD_REC_WARNING, 0, 0, buf,
+				strlen(buf) + 1);
+		return;
+	}
+	emit_warning(buf);
 }
 
 static void
@@ -150,7 +299,8 @@ print_progress(const char *fmt, ...)
 	va_list		ap;
 	FILE		*f;
 
-	if (seenint())
+	/* The main thread reports progress for parallel scans. */
+	if (seenint() || md_stage)
 		return;
 
 	va_start(ap, fmt);
@@ -164,6 +314,20 @@ print_progress(const char *fmt, ...)
 	metadump.progress_since_warning = true;
 }
 
+/* Write to the dump, or to this thread's staging area. */
+static int
+md_write(
+	enum typnm	type,
+	const char	*data,
+	xfs_daddr_t	off,
+	int		len)
+{
+	if (md_stage)
+		return md_stage_add(md_stage, MD_REC_BLOCK, type, off, data,
+				BBTOB(len));
+	return md_dump_extent(type, data, off, len);
+}
+
 /*
  * we want to preserve the state of the metadata in the dump - whether it is
  * intact or corrupt, so even if the buffer has a verifier attached to it we
@@ -200,14 +364,13 @@ write_buf(
 
 	/* handle discontiguous buffers */
 	if (!buf->bbmap) {
-		ret = metadump.mdops->write(buf->typ->typnm, buf->data, buf->bb,
-				buf->blen);
+		ret = md_write(buf->typ->typnm, buf->data, buf->bb, buf->blen);
 		if (ret)
 			return ret;
 	} else {
 		int	len = 0;
 		for (i = 0; i < buf->bbmap->nmaps; i++) {
-			ret = metadump.mdops->write(buf->typ->typnm,
+			ret = md_write(buf->typ->typnm,
 					buf->data + BBTOB(len),
 					buf->bbmap->b[i].bm_bn,
 					buf->bbmap->b[i].bm_len);
@@ -627,7 +790,7 @@ scanfunc_rtrmapbt(
 				print_warning("invalid block number (%u/%u) "
 						"in inode %llu %s block %u/%u",
 						pagno, pbno,
-						(unsigned long long)metadump.cur_ino,
+						(unsigned long long)cur_ino,
 						typtab[btype].name, agno, agbno);
 			continue;
 		}
@@ -748,7 +911,7 @@ scanfunc_rtrefcbt(
 				print_warning("invalid block number (%u/%u) "
 						"in inode %llu %s block %u/%u",
 						pagno, pbno,
-						(unsigned long long)metadump.cur_ino,
+						(unsigned long long)cur_ino,
 						typtab[btype].name, agno, agbno);
 			continue;
 		}
@@ -761,69 +924,180 @@ scanfunc_rtrefcbt(
 
 /* filename and extended attribute obfuscation routines */
 
-struct name_ent {
-	struct name_ent		*next;
+/*
+ * Names are only compared within a directory or an attr fork, so each thread
+ * has its own name table, which is emptied after every inode.  The table is
+ * open addressed and sized for the directory up front when we can tell how
+ * big the directory is, and the names are packed into a single buffer, so
+ * neither adding a name nor emptying the table costs an allocation per name.
+ */
+struct name_slot {
 	xfs_dahash_t		hash;
-	int			namelen;
-	unsigned char		name[1];
+	uint16_t		namelen;	/* zero if the slot is free */
+	uint32_t		off;		/* of the name in names */
 };
 
-#define NAME_TABLE_SIZE		4096
+struct name_table {
+	struct name_slot	*slots;
+	unsigned int		size;		/* power of two, or zero */
+	unsigned int		shift;		/* 32 - log2(size) */
+	unsigned int		nr;
+	unsigned char		*names;
+	size_t			names_len;
+	size_t			names_size;
+};
+
+#define NAME_TABLE_MIN		64
+
+/* Tables bigger than this are freed when they're emptied. */
+#define NAME_TABLE_KEEP		4096
+
+/* Don't size a table for more names than this before we've seen them. */
+#define NAME_TABLE_MAX_RESERVE	(1U << 22)
+
+/* Guess at the number of names in a directory from its size. */
+#define NAME_TABLE_DIRENT_BYTES	32
+
+static __thread struct name_table	nametable;
+
+static inline unsigned int
+nametable_slot(
+	xfs_dahash_t		hash)
+{
+	return (hash * 0x9e3779b1U) >> nametable.shift;
+}
+
+/* Resize the table to @size slots, which must be a power of two. */
+static int
+nametable_resize(
+	unsigned int		size)
+{
+	struct name_slot	*old = nametable.slots;
+	unsigned int		old_size = nametable.size;
+	unsigned int		i;
+
+	nametable.slots = calloc(size, sizeof(struct name_slot));
+	if (!nametable.slots) {
+		nametable.slots = old;
+		return -ENOMEM;
+	}
+	nametable.size = size;
+	nametable.shift = 32 - highbit32(size);
+
+	for (i = 0; i < old_size; i++) {
+		unsigned int	s;
 
-static struct name_ent		*nametable[NAME_TABLE_SIZE];
+		if (!old[i].namelen)
+			continue;
+		s = nametable_slot(old[i].hash);
+		while (nametable.slots[s].namelen)
+			s = (s + 1) & (size - 1);
+		nametable.slots[s] = old[i];
+	}
+	free(old);
+	return 0;
+}
 
+/* Make room for @nr names in a directory that we're about to process. */
 static void
-nametable_clear(void)
+nametable_reserve(
+	unsigned int		nr)
 {
-	int		i;
-	struct name_ent	*ent;
+	unsigned int		size = NAME_TABLE_MIN;
 
-	for (i = 0; i < NAME_TABLE_SIZE; i++) {
-		while ((ent = nametable[i])) {
-			nametable[i] = ent->next;
-			free(ent);
-		}
+	nr = min(nr, NAME_TABLE_MAX_RESERVE);
+	while (size < nr * 2)
+		size <<= 1;
+	if (size > nametable.size)
+		nametable_resize(size);
+}
+
+static void
+nametable_clear(void)
+{
+	if (nametable.size > NAME_TABLE_KEEP) {
+		free(nametable.slots);
+		nametable.slots = NULL;
+		nametable.size = 0;
+	} else if (nametable.nr) {
+		memset(nametable.slots, 0,
+				nametable.size * sizeof(struct name_slot));
 	}
+	nametable.nr = 0;
+	nametable.names_len = 0;
 }
 
-/*
- * See if the given name is already in the name table.  If so,
- * return a pointer to its entry, otherwise return a null pointer.
- */
-static struct name_ent *
+static void
+nametable_free(void)
+{
+	nametable_clear();
+	free(nametable.slots);
+	free(nametable.names);
+	memset(&nametable, 0, sizeof(nametable));
+}
+
+/* See if the given name is already in the name table. */
+static bool
 nametable_find(xfs_dahash_t hash, int namelen, unsigned char *name)
 {
-	struct name_ent	*ent;
+	unsigned int		s;
 
-	for (ent = nametable[hash % NAME_TABLE_SIZE]; ent; ent = ent->next) {
-		if (ent->hash == hash && ent->namelen == namelen &&
-				!memcmp(ent->name, name, namelen))
-			return ent;
+	if (!nametable.nr)
+		return false;
+
+	for (s = nametable_slot(hash);
+	     nametable.slots[s].namelen;
+	     s = (s + 1) & (nametable.size - 1)) {
+		struct name_slot *slot = &nametable.slots[s];
+
+		if (slot->hash == hash && slot->namelen == namelen &&
+		    !memcmp(nametable.names + slot->off, name, namelen))
+			return true;
 	}
-	return NULL;
+	return false;
 }
 
 /*
- * Add the given name to the name table.  Returns a pointer to the
- * name's new entry, or a null pointer if an error occurs.
+ * Add the given name to the name table.  Returns false if we run out of
+ * memory.
  */
-static struct name_ent *
+static bool
 nametable_add(xfs_dahash_t hash, int namelen, unsigned char *name)
 {
-	struct name_ent	*ent;
-
-	ent = malloc(sizeof *ent + namelen);
-	if (!ent)
-		return NULL;
+	struct name_slot	*slot;
+	unsigned int		s;
 
-	ent->namelen = namelen;
-	memcpy(ent->name, name, namelen);
-	ent->hash = hash;
-	ent->next = nametable[hash % NAME_TABLE_SIZE];
+	/* Keep the table at most half full. */
+	if ((nametable.nr + 1) * 2 > nametable.size &&
+	    nametable_resize(max(nametable.size * 2, NAME_TABLE_MIN)))
+		return false;
 
-	nametable[hash % NAME_TABLE_SIZE] = ent;
+	if (nametable.names_len + namelen > UINT32_MAX)
+		return false;
+	if (nametable.names_len + namelen > nametable.names_size) {
+		size_t		size = max_t(size_t, 4096,
+					     nametable.names_size * 2);
+		unsigned char	*names;
+
+		size = max(size, nametable.names_len + namelen);
+		names = realloc(nametable.names, size);
+		if (!names)
+			return false;
+		nametable.names = names;
+		nametable.names_size = size;
+	}
 
-	return ent;
+	s = nametable_slot(hash);
+	while (nametable.slots[s].namelen)
+		s = (s + 1) & (nametable.size - 1);
+	slot = &nametable.slots[s];
+	slot->hash = hash;
+	slot->namelen = namelen;
+	slot->off = nametable.names_len;
+	memcpy(nametable.names + nametable.names_len, name, namelen);
+	nametable.names_len += namelen;
+	nametable.nr++;
+	return true;
 }
 
 /*
@@ -851,17 +1125,39 @@ static inline uint8_t *remap_ent_after(struct remap_ent *ent)
 	return &ent->names[ent->namelen];
 }
 
-#define REMAP_TABLE_SIZE		4096
+/* The remap table starts out this big and doubles when it gets full. */
+#define REMAP_TABLE_MIN		4096
+
+/*
+ * The dirent and the parent pointer for a name can be in different AGs, so
+ * the remap table is shared.  Hold the lock from looking up a name until the
+ * new name has been added so that both ends always agree.  Every obfuscated
+ * name on the filesystem ends up in here, so the table has to grow.
+ */
+static struct remap_ent		**remaptable;
+static unsigned int		remaptable_size;
+static unsigned int		remaptable_shift;
+static unsigned long		remaptable_nr;
+static pthread_mutex_t		remap_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned int
+remaptable_slot(
+	xfs_ino_t		dir_ino,
+	xfs_dahash_t		namehash)
+{
+	uint64_t		key;
 
-static struct remap_ent		*remaptable[REMAP_TABLE_SIZE];
+	key = (dir_ino * 0x9e3779b97f4a7c15ULL) ^ namehash;
+	return (key * 0x9e3779b97f4a7c15ULL) >> remaptable_shift;
+}
 
 static void
 remaptable_clear(void)
 {
-	int			i;
+	unsigned int		i;
 	struct remap_ent	*ent, *next;
 
-	for (i = 0; i < REMAP_TABLE_SIZE; i++) {
+	for (i = 0; i < remaptable_size; i++) {
 		ent = remaptable[i];
 
 		while (ent) {
@@ -870,6 +1166,41 @@ remaptable_clear(void)
 			ent = next;
 		}
 	}
+	free(remaptable);
+	remaptable = NULL;
+	remaptable_size = 0;
+	remaptable_nr = 0;
+}
+
+/* Double the size of the remap table.  It's fine to fail. */
+static void
+remaptable_grow(void)
+{
+	struct remap_ent	**old = remaptable;
+	unsigned int		old_size = remaptable_size;
+	unsigned int		size = max(old_size * 2, REMAP_TABLE_MIN);
+	unsigned int		i;
+	struct remap_ent	*ent, *next;
+
+	remaptable = calloc(size, sizeof(struct remap_ent *));
+	if (!remaptable) {
+		remaptable = old;
+		return;
+	}
+	remaptable_size = size;
+	remaptable_shift = 64 - highbit32(size);
+
+	for (i = 0; i < old_size; i++) {
+		for (ent = old[i]; ent; ent = next) {
+			unsigned int	slot;
+
+			next = ent->next;
+			slot = remaptable_slot(ent->dir_ino, ent->namehash);
+			ent->next = remaptable[slot];
+			remaptable[slot] = ent;
+		}
+	}
+	free(old);
 }
 
 /* Try to find a remapping table entry. */
@@ -880,7 +1211,11 @@ remaptable_find(
 	const unsigned char	*name,
 	unsigned int		namelen)
 {
-	struct remap_ent	*ent = remaptable[namehash % REMAP_TABLE_SIZE];
+	struct remap_ent	*ent;
+
+	if (!remaptable_size)
+		return NULL;
+	ent = remaptable[remaptable_slot(dir_ino, namehash)];
 
 	remap_debug("REMAP FIND: 0x%lx hash 0x%x '%.*s'\n",
 			dir_ino, namehash, namelen, name);
@@ -911,6 +1246,12 @@ remaptable_add(
 	const unsigned char	*new_name)
 {
 	struct remap_ent	*ent;
+	unsigned int		slot;
+
+	if (remaptable_nr >= remaptable_size)
+		remaptable_grow();
+	if (!remaptable_size)
+		return NULL;
 
 	ent = malloc(sizeof(struct remap_ent) + (namelen * 2));
 	if (!ent)
@@ -921,9 +1262,10 @@ remaptable_add(
 	ent->namelen = namelen;
 	memcpy(remap_ent_before(ent), old_name, namelen);
 	memcpy(remap_ent_after(ent), new_name, namelen);
-	ent->next = remaptable[namehash % REMAP_TABLE_SIZE];
-
-	remaptable[namehash % REMAP_TABLE_SIZE] = ent;
+	slot = remaptable_slot(dir_ino, namehash);
+	ent->next = remaptable[slot];
+	remaptable[slot] = ent;
+	remaptable_nr++;
 
 	remap_debug("REMAP ADD: 0x%lx hash 0x%x '%.*s' -> '%.*s'\n",
 			dir_ino, namehash, namelen, old_name, namelen,
@@ -960,25 +1302,27 @@ in_lost_found(
 	int			namelen,
 	unsigned char		*name)
 {
-	static xfs_ino_t	orphanage_ino = 0;
 	char			s[24];	/* 21 is enough (64 bits in decimal) */
 	int			slen;
 
-	/* Record the "lost+found" inode if we haven't done so already */
+	/*
+	 * Record the "lost+found" inode if we haven't done so already.
+	 * Parallel scans look it up before they start.
+	 */
 
 	ASSERT(ino != 0);
-	if (!orphanage_ino && is_orphanage_dir(mp, metadump.cur_ino, namelen,
+	if (!metadump.orphanage_ino && is_orphanage_dir(mp, cur_ino, namelen,
 						name))
-		orphanage_ino = ino;
+		metadump.orphanage_ino = ino;
 
 	/* We don't obfuscate the "lost+found" directory itself */
 
-	if (ino == orphanage_ino)
+	if (ino == metadump.orphanage_ino)
 		return 1;
 
 	/* Most files aren't in "lost+found" at all */
 
-	if (metadump.cur_ino != orphanage_ino)
+	if (cur_ino != metadump.orphanage_ino)
 		return 0;
 
 	/*
@@ -1050,6 +1394,118 @@ dirattr_hashname(
 	return libxfs_attr_hashname(name, namelen);
 }
 
+/*
+ * Seed the random part of an obfuscated name from the hash and the length
+ * of the original name, which the dump gives away anyway.  A name then comes
+ * out the same every time we dump it, whichever directory it is in and
+ * whichever thread gets to it first.  If names were drawn from one sequence,
+ * adding a file would change the obfuscated name of every file after it, and
+ * a delta dump would have to carry all of those directory blocks again.
+ */
+static void
+seed_obfuscated_name(
+	xfs_dahash_t		hash,
+	int			namelen,
+	bool			is_dirent)
+{
+	__be32			key[3] = {
+		cpu_to_be32(hash),
+		cpu_to_be32(namelen),
+		cpu_to_be32(is_dirent),
+	};
+
+	obfuscate_seed(crc32c(XFS_CRC_SEED, key, sizeof(key)));
+}
+
+/*
+ * Since an obfuscated name depends only on the hash and the length of the
+ * original, remember the names we've come up with.  The same names turn up
+ * in directory after directory, and ascii-ci filesystems can take hundreds
+ * of tries to find a name that hashes the same.  Each thread has its own
+ * direct mapped cache, which is thrown away after each AG.
+ */
+struct name_cache_ent {
+	xfs_dahash_t		hash;
+	uint16_t		namelen;
+	bool			is_dirent;
+	unsigned char		name[];
+};
+
+#define NAME_CACHE_BITS		14
+#define NAME_CACHE_SIZE		(1U << NAME_CACHE_BITS)
+
+static __thread struct name_cache_ent	**namecache;
+
+static inline unsigned int
+namecache_slot(
+	xfs_dahash_t		hash,
+	int			namelen,
+	bool			is_dirent)
+{
+	return ((hash ^ (namelen << 1 | is_dirent)) * 0x9e3779b1U) >>
+		(32 - NAME_CACHE_BITS);
+}
+
+static void
+namecache_free(void)
+{
+	unsigned int		i;
+
+	if (!namecache)
+		return;
+	for (i = 0; i < NAME_CACHE_SIZE; i++)
+		free(namecache[i]);
+	free(namecache);
+	namecache = NULL;
+}
+
+static void
+obfuscate_name_cached(
+	xfs_dahash_t		hash,
+	int			namelen,
+	unsigned char		*name,
+	bool			is_dirent)
+{
+	struct name_cache_ent	*ent;
+	unsigned char		orig[namelen];
+	unsigned int		slot;
+
+	/* obfuscate_name leaves short names alone. */
+	if (namelen < 5)
+		return;
+
+	if (!namecache)
+		namecache = calloc(NAME_CACHE_SIZE, sizeof(*namecache));
+
+	slot = namecache_slot(hash, namelen, is_dirent);
+	ent = namecache ? namecache[slot] : NULL;
+	if (ent && ent->hash == hash && ent->namelen == namelen &&
+	    ent->is_dirent == is_dirent) {
+		memcpy(name, ent->name, namelen);
+		return;
+	}
+
+	memcpy(orig, name, namelen);
+	seed_obfuscated_name(hash, namelen, is_dirent);
+	obfuscate_name(hash, namelen, name, is_dirent);
+
+	/*
+	 * If no ci-compatible name turned up, we got the original name back,
+	 * which is no use to anyone else with the same hash.
+	 */
+	if (!namecache || !memcmp(orig, name, namelen))
+		return;
+
+	ent = realloc(namecache[slot], sizeof(*ent) + namelen);
+	if (!ent)
+		return;
+	ent->hash = hash;
+	ent->namelen = namelen;
+	ent->is_dirent = is_dirent;
+	memcpy(ent->name, name, namelen);
+	namecache[slot] = ent;
+}
+
 static void
 generate_obfuscated_name(
 	xfs_ino_t		ino,
@@ -1087,13 +1543,15 @@ generate_obfuscated_name(
 	if (xfs_has_parent(mp) && ino) {
 		struct remap_ent	*remap;
 
-		remap = remaptable_find(metadump.cur_ino, hash, name, namelen);
+		pthread_mutex_lock(&remap_lock);
+		remap = remaptable_find(cur_ino, hash, name, namelen);
 		if (remap) {
 			remap_debug("found obfuscated dir 0x%lx '%.*s' -> 0x%lx -> '%.*s' \n",
 					cur_ino, namelen,
 					remap_ent_before(remap), ino, namelen,
 					remap_ent_after(remap));
 			memcpy(name, remap_ent_after(remap), namelen);
+			pthread_mutex_unlock(&remap_lock);
 			return;
 		}
 
@@ -1109,7 +1567,7 @@ generate_obfuscated_name(
 		memcpy(orig_name, name, namelen);
 	}
 
-	obfuscate_name(hash, namelen, name, ino != 0);
+	obfuscate_name_cached(hash, namelen, name, ino != 0);
 	ASSERT(hash == dirattr_hashname(ino != 0, name, namelen));
 
 	/*
@@ -1122,8 +1580,8 @@ generate_obfuscated_name(
 		print_warning("duplicate name for inode %llu "
 				"in dir inode %llu\n",
 			(unsigned long long) ino,
-			(unsigned long long) metadump.cur_ino);
-		return;
+			(unsigned long long) cur_ino);
+		goto out_unlock;
 	}
 
 	/* Create an entry for the new name in the name table. */
@@ -1132,7 +1590,7 @@ generate_obfuscated_name(
 		print_warning("unable to record name for inode %llu "
 				"in dir inode %llu\n",
 			(unsigned long long) ino,
-			(unsigned long long) metadump.cur_ino);
+			(unsigned long long) cur_ino);
 
 	/*
 	 * We've obfuscated a name in the directory entry.  Remember this
@@ -1143,16 +1601,19 @@ generate_obfuscated_name(
 
 add_remap:
 	remap_debug("obfuscating dir 0x%lx '%.*s' -> 0x%lx -> '%.*s' \n",
-			metadump.cur_ino, namelen, orig_name, ino, namelen,
+			cur_ino, namelen, orig_name, ino, namelen,
 			name);
 
-	if (!remaptable_add(metadump.cur_ino, hash, orig_name, namelen, name))
+	if (!remaptable_add(cur_ino, hash, orig_name, namelen, name))
 		print_warning("unable to record remapped dirent name for inode %llu "
 				"in dir inode %llu\n",
 			(unsigned long long) ino,
-			(unsigned long long) metadump.cur_ino);
+			(unsigned long long) cur_ino);
+out_unlock:
 	if (orig_name && orig_name != name)
 		free(orig_name);
+	if (xfs_has_parent(mp) && ino)
+		pthread_mutex_unlock(&remap_lock);
 }
 
 static inline bool
@@ -1186,7 +1647,7 @@ process_sf_dir(
 		ino_dir_size = XFS_DFORK_DSIZE(dip, mp);
 		if (metadump.show_warnings)
 			print_warning("invalid size in dir inode %llu",
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 	}
 
 	sfep = xfs_dir2_sf_firstentry(sfp);
@@ -1202,7 +1663,7 @@ process_sf_dir(
 		if (namelen == 0) {
 			if (metadump.show_warnings)
 				print_warning("zero length entry in dir inode "
-					"%llu", (long long)metadump.cur_ino);
+					"%llu", (long long)cur_ino);
 			if (i != sfp->count - 1)
 				break;
 			namelen = ino_dir_size - ((char *)&sfep->name[0] -
@@ -1213,7 +1674,7 @@ process_sf_dir(
 			if (metadump.show_warnings)
 				print_warning("entry length in dir inode %llu "
 					"overflows space",
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 			if (i != sfp->count - 1)
 				break;
 			namelen = ino_dir_size - ((char *)&sfep->name[0] -
@@ -1261,7 +1722,7 @@ obfuscate_path_components(
 			/* last (or single) component */
 			namelen = strnlen((char *)comp, len);
 			hash = dirattr_hashname(true, comp, namelen);
-			obfuscate_name(hash, namelen, comp, false);
+			obfuscate_name_cached(hash, namelen, comp, false);
 			ASSERT(hash == dirattr_hashname(true, comp, namelen));
 			break;
 		}
@@ -1273,7 +1734,7 @@ obfuscate_path_components(
 			continue;
 		}
 		hash = dirattr_hashname(true, comp, namelen);
-		obfuscate_name(hash, namelen, comp, false);
+		obfuscate_name_cached(hash, namelen, comp, false);
 		ASSERT(hash == dirattr_hashname(true, comp, namelen));
 		comp += namelen + 1;
 		len -= namelen + 1;
@@ -1291,7 +1752,7 @@ process_sf_symlink(
 	if (len > XFS_DFORK_DSIZE(dip, mp)) {
 		if (metadump.show_warnings)
 			print_warning("invalid size (%d) in symlink inode %llu",
-					len, (long long)metadump.cur_ino);
+					len, (long long)cur_ino);
 		len = XFS_DFORK_DSIZE(dip, mp);
 	}
 
@@ -1322,7 +1783,7 @@ maybe_obfuscate_pptr(
 	unsigned char			old_name[MAXNAMELEN];
 	struct remap_ent		*remap;
 	xfs_dahash_t			hash;
-	xfs_ino_t			child_ino = metadump.cur_ino;
+	xfs_ino_t			child_ino = cur_ino;
 	xfs_ino_t			parent_ino;
 	int				error;
 
@@ -1344,12 +1805,12 @@ maybe_obfuscate_pptr(
 	 * the name table is used for extended attributes, the inode number
 	 * provided is 0, in which case we don't need to make this check.
 	 */
-	metadump.cur_ino = parent_ino;
+	cur_ino = parent_ino;
 	if (in_lost_found(child_ino, namelen, name)) {
-		metadump.cur_ino = child_ino;
+		cur_ino = child_ino;
 		return;
 	}
-	metadump.cur_ino = child_ino;
+	cur_ino = child_ino;
 
 	hash = dirattr_hashname(true, name, namelen);
 
@@ -1357,14 +1818,16 @@ maybe_obfuscate_pptr(
 	 * If we already processed the dirent, use the same name for the parent
 	 * pointer.
 	 */
+	pthread_mutex_lock(&remap_lock);
 	remap = remaptable_find(parent_ino, hash, name, namelen);
 	if (remap) {
 		remap_debug(
  "found obfuscated pptr 0x%lx '%.*s' -> 0x%lx -> '%.*s' \n",
 				parent_ino, namelen, remap_ent_before(remap),
-				metadump.cur_ino, namelen,
+				cur_ino, namelen,
 				remap_ent_after(remap));
 		memcpy(name, remap_ent_after(remap), namelen);
+		pthread_mutex_unlock(&remap_lock);
 		return;
 	}
 
@@ -1372,16 +1835,17 @@ maybe_obfuscate_pptr(
 	 * Obfuscate the parent pointer name and remember this for later
 	 * in case we encounter the dirent and need to reuse the name there.
 	 */
-	obfuscate_name(hash, namelen, name, true);
+	obfuscate_name_cached(hash, namelen, name, true);
 
 	remap_debug("obfuscated pptr 0x%lx '%.*s' -> 0x%lx -> '%.*s'\n",
-			parent_ino, namelen, old_name, metadump.cur_ino,
+			parent_ino, namelen, old_name, cur_ino,
 			namelen, name);
 	if (!remaptable_add(parent_ino, hash, old_name, namelen, name))
 		print_warning(
  "unable to record remapped pptr name for inode %llu in dir inode %llu\n",
-			(unsigned long long) metadump.cur_ino,
+			(unsigned long long) cur_ino,
 			(unsigned long long) parent_ino);
+	pthread_mutex_unlock(&remap_lock);
 }
 
 static inline bool
@@ -1428,7 +1892,7 @@ process_sf_attr(
 		ino_attr_size = XFS_DFORK_ASIZE(dip, mp);
 		if (metadump.show_warnings)
 			print_warning("invalid attr size in inode %llu",
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 	}
 
 	for (i = 0; (i < hdr->count) &&
@@ -1439,14 +1903,14 @@ process_sf_attr(
 		if (namelen == 0) {
 			if (metadump.show_warnings)
 				print_warning("zero length attr entry in inode "
-					"%llu", (long long)metadump.cur_ino);
+					"%llu", (long long)cur_ino);
 			break;
 		} else if ((char *)asfep - (char *)hdr +
 				xfs_attr_sf_entsize(asfep) > ino_attr_size) {
 			if (metadump.show_warnings)
 				print_warning("attr entry length in inode %llu "
 					"overflows space",
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 			break;
 		}
 
@@ -1504,7 +1968,7 @@ process_dir_free_block(
 		if (metadump.show_warnings)
 			print_warning("invalid magic in dir inode %llu "
 				      "free block",
-				      (unsigned long long)metadump.cur_ino);
+				      (unsigned long long)cur_ino);
 		break;
 	}
 }
@@ -1603,7 +2067,7 @@ process_dir_data_block(
 		if (metadump.show_warnings)
 			print_warning(
 		"invalid magic in dir inode %llu block %ld",
-		(unsigned long long)metadump.cur_ino, (long)offset);
+		(unsigned long long)cur_ino, (long)offset);
 		return;
 	}
 
@@ -1626,7 +2090,7 @@ process_dir_data_block(
 				if (metadump.show_warnings)
 					print_warning(
 			"invalid length for dir free space in inode %llu",
-						(long long)metadump.cur_ino);
+						(long long)cur_ino);
 				return;
 			}
 			if (be16_to_cpu(*xfs_dir2_data_unused_tag_p(dup)) !=
@@ -1660,7 +2124,7 @@ process_dir_data_block(
 			if (metadump.show_warnings)
 				print_warning(
 			"invalid length for dir entry name in inode %llu",
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 			return;
 		}
 		if (be16_to_cpu(*libxfs_dir2_data_entry_tag_p(mp, dep)) !=
@@ -1742,7 +2206,7 @@ out_pop:
 
 #define MAX_REMOTE_VALS		4095
 
-static struct attr_data_s {
+static __thread struct attr_data_s {
 	int			remote_val_count;
 	xfs_dablk_t		remote_vals[MAX_REMOTE_VALS];
 } attr_data;
@@ -1809,7 +2273,7 @@ process_attr_block(
 				xfs_attr3_rmt_buf_space(mp)) {
 		if (metadump.show_warnings)
 			print_warning("invalid attr count in inode %llu",
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 		return;
 	}
 
@@ -1827,7 +2291,7 @@ process_attr_block(
 			if (metadump.show_warnings)
 				print_warning(
 				"invalid attr nameidx in inode %llu",
-						(long long)metadump.cur_ino);
+						(long long)cur_ino);
 			break;
 		}
 		if (entry->flags & XFS_ATTR_LOCAL) {
@@ -1839,7 +2303,7 @@ process_attr_block(
 				if (metadump.show_warnings)
 					print_warning(
 				"zero length for attr name in inode %llu",
-						(long long)metadump.cur_ino);
+						(long long)cur_ino);
 				break;
 			}
 
@@ -1872,7 +2336,7 @@ process_attr_block(
 				if (metadump.show_warnings)
 					print_warning(
 				"invalid attr entry in inode %llu",
-						(long long)metadump.cur_ino);
+						(long long)cur_ino);
 				break;
 			}
 			if (entry->flags & XFS_ATTR_PARENT) {
@@ -2013,8 +2477,8 @@ out_pop:
 /*
  * Static map to aggregate multiple extents into a single directory block.
  */
-static struct bbmap mfsb_map;
-static int mfsb_length;
+static __thread struct bbmap mfsb_map;
+static __thread int mfsb_length;
 
 static int
 process_multi_fsb_dir(
@@ -2194,7 +2658,7 @@ process_bmbt_reclist(
 					"starts at %llu, previous extent "
 					"ended at %llu", i,
 					typtab[btype].name,
-					(long long)metadump.cur_ino,
+					(long long)cur_ino,
 					o, op + cp - 1);
 			break;
 		}
@@ -2209,7 +2673,7 @@ process_bmbt_reclist(
 				print_warning("suspicious count %u in bmap "
 					"extent %d in %s ino %llu", c, i,
 					typtab[btype].name,
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 			break;
 		}
 
@@ -2225,7 +2689,7 @@ process_bmbt_reclist(
 					"(%llu) in bmap extent %d in %s ino "
 					"%llu", agno, agbno, s, i,
 					typtab[btype].name,
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 			break;
 		}
 
@@ -2234,7 +2698,7 @@ process_bmbt_reclist(
 				print_warning("bmap extent %i in %s inode %llu "
 					"overflows AG (end is %u/%u)", i,
 					typtab[btype].name,
-					(long long)metadump.cur_ino,
+					(long long)cur_ino,
 					agno, agbno + c - 1);
 			break;
 		}
@@ -2333,7 +2797,7 @@ process_btinode(
 	if (level > XFS_BM_MAXLEVELS(mp, whichfork)) {
 		if (metadump.show_warnings)
 			print_warning("invalid level (%u) in inode %lld %s "
-				"root", level, (long long)metadump.cur_ino,
+				"root", level, (long long)cur_ino,
 				typtab[btype].name);
 		return 1;
 	}
@@ -2347,7 +2811,7 @@ process_btinode(
 	if (nrecs > maxrecs) {
 		if (metadump.show_warnings)
 			print_warning("invalid numrecs (%u) in inode %lld %s "
-				"root", nrecs, (long long)metadump.cur_ino,
+				"root", nrecs, (long long)cur_ino,
 				typtab[btype].name);
 		return 1;
 	}
@@ -2382,7 +2846,7 @@ process_btinode(
 			if (metadump.show_warnings)
 				print_warning("invalid block number (%u/%u) "
 					"in inode %llu %s root", ag, bno,
-					(long long)metadump.cur_ino,
+					(long long)cur_ino,
 					typtab[btype].name);
 			continue;
 		}
@@ -2428,7 +2892,7 @@ process_exinode(
 out_warn:
 	if (metadump.show_warnings)
 		print_warning("bad number of extents %llu in inode %lld",
-			(unsigned long long)nex, (long long)metadump.cur_ino);
+			(unsigned long long)nex, (long long)cur_ino);
 	return 1;
 }
 
@@ -2450,7 +2914,7 @@ process_rtrmap(
 		if (metadump.show_warnings)
 			print_warning("invalid level (%u) in inode %lld %s "
 					"root", level,
-					(unsigned long long)metadump.cur_ino,
+					(unsigned long long)cur_ino,
 					typtab[btype].name);
 		return 1;
 	}
@@ -2465,7 +2929,7 @@ process_rtrmap(
 		if (metadump.show_warnings)
 			print_warning("invalid numrecs (%u) in inode %lld %s "
 					"root", nrecs,
-					(unsigned long long)metadump.cur_ino,
+					(unsigned long long)cur_ino,
 					typtab[btype].name);
 		return 1;
 	}
@@ -2484,7 +2948,7 @@ process_rtrmap(
 				print_warning("invalid block number (%u/%u) "
 						"in inode %llu %s root", ag,
 						bno,
-						(unsigned long long)metadump.cur_ino,
+						(unsigned long long)cur_ino,
 						typtab[btype].name);
 			continue;
 		}
@@ -2513,7 +2977,7 @@ process_rtrefc(
 		if (metadump.show_warnings)
 			print_warning("invalid level (%u) in inode %lld %s "
 					"root", level,
-					(unsigned long long)metadump.cur_ino,
+					(unsigned long long)cur_ino,
 					typtab[btype].name);
 		return 1;
 	}
@@ -2528,7 +2992,7 @@ process_rtrefc(
 		if (metadump.show_warnings)
 			print_warning("invalid numrecs (%u) in inode %lld %s "
 					"root", nrecs,
-					(unsigned long long)metadump.cur_ino,
+					(unsigned long long)cur_ino,
 					typtab[btype].name);
 		return 1;
 	}
@@ -2547,7 +3011,7 @@ process_rtrefc(
 				print_warning("invalid block number (%u/%u) "
 						"in inode %llu %s root", ag,
 						bno,
-						(unsigned long long)metadump.cur_ino,
+						(unsigned long long)cur_ino,
 						typtab[btype].name);
 			continue;
 		}
@@ -2576,7 +3040,7 @@ process_inode_data(
 			print_warning(
 "Invalid data fork size (%d) in inode %llu, preserving contents!",
 					XFS_DFORK_DSIZE(dip, mp),
-					(long long)metadump.cur_ino);
+					(long long)cur_ino);
 			break;
 		}
 
@@ -2620,7 +3084,7 @@ process_dev_inode(
 	if (xfs_dfork_data_extents(dip)) {
 		if (metadump.show_warnings)
 			print_warning("inode %llu has unexpected extents",
-				      (unsigned long long)metadump.cur_ino);
+				      (unsigned long long)cur_ino);
 		return;
 	}
 
@@ -2632,7 +3096,7 @@ process_dev_inode(
 	if (XFS_DFORK_DSIZE(dip, mp) > XFS_LITINO(mp)) {
 		print_warning(
 "Invalid data fork size (%d) in inode %llu, preserving contents!",
-			XFS_DFORK_DSIZE(dip, mp), (long long)metadump.cur_ino);
+			XFS_DFORK_DSIZE(dip, mp), (long long)cur_ino);
 		return;
 	}
 
@@ -2662,7 +3126,7 @@ process_inode(
 	bool			crc_was_ok = false; /* no recalc by default */
 	bool			need_new_crc = false;
 
-	metadump.cur_ino = XFS_AGINO_TO_INO(mp, agno, agino);
+	cur_ino = XFS_AGINO_TO_INO(mp, agno, agino);
 
 	/* we only care about crc recalculation if we will modify the inode. */
 	if (metadump.obfuscate || metadump.zero_stale_data) {
@@ -2679,6 +3143,14 @@ process_inode(
 		goto done;
 	}
 
+	/*
+	 * Size the name table for a big directory up front, guessing at an
+	 * average directory entry size, rather than growing it as we go.
+	 */
+	if (metadump.obfuscate && S_ISDIR(be16_to_cpu(dip->di_mode)))
+		nametable_reserve(be64_to_cpu(dip->di_size) /
+				NAME_TABLE_DIRENT_BYTES);
+
 	/* copy appropriate data fork metadata */
 	switch (be16_to_cpu(dip->di_mode) & S_IFMT) {
 	case S_IFDIR:
@@ -2831,7 +3303,7 @@ copy_inode_chunk(
 					XFS_INOBT_IS_FREE_DISK(rp, ioff + i)))
 				goto pop_out;
 
-			inodes_copied++;
+			uatomic_inc(&inodes_copied);
 		}
 
 		if (write_buf(iocur_top))
@@ -3267,14 +3739,15 @@ static struct metadump_ops metadump1_ops = {
 };
 
 static int
-init_metadump_v2(void)
+write_metadump_header(
+	uint32_t			magic)
 {
 	struct xfs_metadump_header	xmh = {0};
 	uint32_t			compat_flags = 0;
 	uint32_t			incompat_flags = 0;
 
-	xmh.xmh_magic = cpu_to_be32(XFS_MD_MAGIC_V2);
-	xmh.xmh_version = cpu_to_be32(2);
+	xmh.xmh_magic = cpu_to_be32(magic);
+	xmh.xmh_version = cpu_to_be32(metadump.version);
 
 	if (metadump.obfuscate)
 		compat_flags |= XFS_MD2_COMPAT_OBFUSCATED;
@@ -3286,6 +3759,11 @@ init_metadump_v2(void)
 		compat_flags |= XFS_MD2_COMPAT_EXTERNALLOG;
 	if (metadump.realtime_data)
 		incompat_flags |= XFS_MD2_INCOMPAT_RTDEVICE;
+	if (metadump.base_file) {
+		incompat_flags |= XFS_MD2_INCOMPAT_DELTA;
+		xmh.xmh_chain_id = cpu_to_be32(metadump.bindex.chain_id);
+		xmh.xmh_chain_seq = cpu_to_be32(metadump.bindex.chain_seq);
+	}
 
 	xmh.xmh_compat_flags = cpu_to_be32(compat_flags);
 	xmh.xmh_incompat_flags = cpu_to_be32(incompat_flags);
@@ -3298,6 +3776,13 @@ init_metadump_v2(void)
 	return 0;
 }
 
+static int
+init_metadump_v2(void)
+{
+	metadump.out_offset = sizeof(struct xfs_metadump_header);
+	return write_metadump_header(XFS_MD_MAGIC_V2);
+}
+
 static int
 copy_rtsb(void)
 {
@@ -3333,17 +3818,95 @@ copy_rtsb(void)
 	return error ? 0 : 1;
 }
 
+/*
+ * With -x, we record where the data of every extent went in the dump file, so
+ * that the dump can be read like a disk image without restoring it or even
+ * scanning it; see libxfs/mdimage.c.  The map is only valid for the dump it
+ * was written with, so it records the size of the dump as a sanity check.
+ */
+
+static void
+md_emap_add(
+	uint64_t		addr,
+	uint32_t		len,
+	uint32_t		chunk_off,
+	uint64_t		pos)
+{
+	struct md_emap		*em = &metadump.emap;
+	struct md_emap_ent	*ent;
+
+	if (em->nr == em->size) {
+		em->size = max_t(uint64_t, 1024, em->size * 2);
+		em->ents = xrealloc(em->ents,
+				em->size * sizeof(struct md_emap_ent));
+	}
+	ent = &em->ents[em->nr++];
+	ent->addr = addr;
+	ent->len = len;
+	ent->chunk_off = chunk_off;
+	ent->pos = pos;
+}
+
+static void
+md_emap_free(void)
+{
+	xfree(metadump.emap.ents);
+	memset(&metadump.emap, 0, sizeof(metadump.emap));
+}
+
 static int
-write_metadump_v2(
+md_emap_save(
+	const char		*path)
+{
+	struct md_emap		*em = &metadump.emap;
+	struct xfs_meta_emap	xmem = {0};
+	struct xfs_meta_emap_rec xmer;
+	struct md_emap_ent	*ent;
+	FILE			*f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		print_warning("cannot create extent map %s: %s", path,
+				strerror(errno));
+		return -1;
+	}
+
+	xmem.xmem_magic = cpu_to_be32(XFS_MD_EMAP_MAGIC);
+	xmem.xmem_version = cpu_to_be32(XFS_MD_EMAP_VERSION);
+	xmem.xmem_dump_size = cpu_to_be64(metadump.out_offset);
+	xmem.xmem_count = cpu_to_be64(em->nr);
+	if (fwrite(&xmem, sizeof(xmem), 1, f) != 1)
+		goto out_error;
+
+	for (ent = em->ents; ent < em->ents + em->nr; ent++) {
+		xmer.xmer_addr = cpu_to_be64(ent->addr);
+		xmer.xmer_len = cpu_to_be32(ent->len);
+		xmer.xmer_chunk_off = cpu_to_be32(ent->chunk_off);
+		xmer.xmer_pos = cpu_to_be64(ent->pos);
+		if (fwrite(&xmer, sizeof(xmer), 1, f) != 1)
+			goto out_error;
+	}
+
+	if (fclose(f)) {
+		f = NULL;
+		goto out_error;
+	}
+	return 0;
+out_error:
+	print_warning("error writing extent map %s", path);
+	if (f)
+		fclose(f);
+	return -1;
+}
+
+/* Encode the device that a block came from into a v2 extent address. */
+static uint64_t
+metadump_xme_addr(
 	enum typnm		type,
-	const char		*data,
-	xfs_daddr_t		off,
-	int			len)
+	xfs_daddr_t		off)
 {
-	struct xfs_meta_extent	xme;
-	uint64_t		addr;
+	uint64_t		addr = off;
 
-	addr = off;
 	if (type == TYP_LOG &&
 	    mp->m_logdev_targp->bt_bdev != mp->m_ddev_targp->bt_bdev)
 		addr |= XME_ADDR_LOG_DEVICE;
@@ -3351,6 +3914,17 @@ write_metadump_v2(
 		addr |= XME_ADDR_RT_DEVICE;
 	else
 		addr |= XME_ADDR_DATA_DEVICE;
+	return addr;
+}
+
+/* Write a v2 record.  Tombstones have no @data. */
+static int
+write_extent_v2(
+	uint64_t		addr,
+	const char		*data,
+	int			len)
+{
+	struct xfs_meta_extent	xme;
 
 	xme.xme_addr = cpu_to_be64(addr);
 	xme.xme_len = cpu_to_be32(len);
@@ -3359,45 +3933,1021 @@ write_metadump_v2(
 		print_warning("error writing to target file");
 		return -EIO;
 	}
+	metadump.out_offset += sizeof(xme);
+	if (!data)
+		return 0;
 
 	if (fwrite(data, len << BBSHIFT, 1, metadump.outf) != 1) {
 		print_warning("error writing to target file");
 		return -EIO;
 	}
+	if (metadump.emap_file)
+		md_emap_add(addr, len, 0, metadump.out_offset);
+	metadump.out_offset += BBTOB(len);
 
 	return 0;
 }
 
-static struct metadump_ops metadump2_ops = {
-	.init	= init_metadump_v2,
-	.write	= write_metadump_v2,
-};
+static int
+write_metadump_v2(
+	enum typnm		type,
+	const char		*data,
+	xfs_daddr_t		off,
+	int			len)
+{
+	return write_extent_v2(metadump_xme_addr(type, off), data, len);
+}
 
 static int
-metadump_f(
-	int 		argc,
-	char 		**argv)
+write_tombstone_v2(
+	uint64_t		addr,
+	int			len)
 {
-	xfs_agnumber_t	agno;
-	int		c;
-	int		start_iocur_sp;
-	int		outfd = -1;
-	int		ret;
-	char		*p;
-	bool		version_opt_set = false;
+	return write_extent_v2(addr | XME_ADDR_TOMBSTONE, NULL, len);
+}
 
-	exitcode = 1;
+static struct metadump_ops metadump2_ops = {
+	.init		= init_metadump_v2,
+	.write		= write_metadump_v2,
+	.write_tombstone = write_tombstone_v2,
+};
 
-	metadump.version = 1;
-	metadump.show_progress = false;
-	metadump.stop_on_read_error = false;
-	metadump.max_extent_size = DEFAULT_MAX_EXT_SIZE;
+/* Uncompressed size of a v3 chunk. */
+#define MD3_CHUNK_SIZE		(1U << 20)
+
+static void
+compress_chunk_v3(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct md3_chunk	*chunk = arg;
+	struct xfs_meta_chunk	*xmc = (struct xfs_meta_chunk *)chunk->out;
+	char			*payload = chunk->out + sizeof(*xmc);
+	ssize_t			len;
+	uint32_t		flags = 0;
+
+	len = lz_compress(chunk->data, chunk->len, payload,
+			lz_compress_bound(MD3_CHUNK_SIZE));
+	if (len < 0 || len >= chunk->len) {
+		memcpy(payload, chunk->data, chunk->len);
+		len = chunk->len;
+		flags |= XFS_MD3_CHUNK_RAW;
+	}
+
+	xmc->xmc_magic = cpu_to_be32(XFS_MD3_CHUNK_MAGIC);
+	xmc->xmc_flags = cpu_to_be32(flags);
+	xmc->xmc_len = cpu_to_be32(len);
+	xmc->xmc_ulen = cpu_to_be32(chunk->len);
+	xmc->xmc_crc = cpu_to_be32(crc32c(XFS_CRC_SEED, chunk->data,
+				chunk->len));
+	xmc->xmc_pad = 0;
+	chunk->out_len = sizeof(*xmc) + len;
+
+	pthread_mutex_lock(&metadump.chunk_lock);
+	chunk->done = true;
+	pthread_cond_broadcast(&metadump.chunk_done);
+	pthread_mutex_unlock(&metadump.chunk_lock);
+}
+
+static inline struct md3_chunk *
+chunk_v3(
+	uint64_t		seq)
+{
+	return &metadump.chunks[seq % metadump.nr_chunks];
+}
+
+/*
+ * Write the oldest chunk to the dump file once it has been compressed.  If
+ * @wait is false, only do that if it is already compressed.  Returns 1 if a
+ * chunk was written, 0 if not and -EIO on error.
+ */
+static int
+write_chunk_v3(
+	bool			wait)
+{
+	struct md3_chunk	*chunk = chunk_v3(metadump.chunk_tail);
+	struct xfs_meta_index_rec *rec;
+	bool			done;
+
+	pthread_mutex_lock(&metadump.chunk_lock);
+	while (wait && !chunk->done)
+		pthread_cond_wait(&metadump.chunk_done, &metadump.chunk_lock);
+	done = chunk->done;
+	pthread_mutex_unlock(&metadump.chunk_lock);
+	if (!done)
+		return 0;
+
+	if (fwrite(chunk->out, chunk->out_len, 1, metadump.outf) != 1) {
+		print_warning("error writing to target file");
+		return -EIO;
+	}
+
+	rec = realloc(metadump.chunk_index, (metadump.nr_chunk_index + 1) *
+			sizeof(*rec));
+	if (!rec) {
+		print_warning("memory allocation failure");
+		return -ENOMEM;
+	}
+	metadump.chunk_index = rec;
+	rec += metadump.nr_chunk_index++;
+	rec->xmir_offset = cpu_to_be64(metadump.out_offset);
+	rec->xmir_low = cpu_to_be64(chunk->low);
+	rec->xmir_high = cpu_to_be64(chunk->high);
+
+	metadump.out_offset += chunk->out_len;
+	metadump.chunk_tail++;
+	return 1;
+}
+
+/*
+ * Hand the chunk being filled to the compression workers and move on to the
+ * next one, writing out older chunks to make room if necessary.
+ */
+static int
+submit_chunk_v3(void)
+{
+	struct md3_chunk	*chunk = chunk_v3(metadump.chunk_head);
+	int			ret;
+
+	chunk->done = false;
+	ret = -workqueue_add(&metadump.chunk_wq, compress_chunk_v3, 0, chunk);
+	if (ret) {
+		print_warning("could not queue chunk compression: %s",
+				strerror(ret));
+		return -ret;
+	}
+	metadump.chunk_head++;
+
+	/* Write whatever is ready, and the oldest chunk if the ring is full. */
+	do {
+		ret = write_chunk_v3(metadump.chunk_head - metadump.chunk_tail ==
+				metadump.nr_chunks);
+		if (ret < 0)
+			return ret;
+	} while (ret > 0 && metadump.chunk_tail < metadump.chunk_head);
+
+	chunk = chunk_v3(metadump.chunk_head);
+	chunk->len = 0;
+	chunk->low = -1ULL;
+	chunk->high = 0;
+	return 0;
+}
+
+static void
+release_metadump_v3(void)
+{
+	unsigned int		i;
+
+	workqueue_terminate(&metadump.chunk_wq);
+	workqueue_destroy(&metadump.chunk_wq);
+	pthread_cond_destroy(&metadump.chunk_done);
+	pthread_mutex_destroy(&metadump.chunk_lock);
+
+	for (i = 0; i < metadump.nr_chunks; i++) {
+		free(metadump.chunks[i].data);
+		free(metadump.chunks[i].out);
+	}
+	free(metadump.chunks);
+	metadump.chunks = NULL;
+	free(metadump.chunk_index);
+	metadump.chunk_index = NULL;
+}
+
+static int
+init_metadump_v3(void)
+{
+	unsigned int		nr_threads = platform_nproc();
+	unsigned int		i;
+	int			ret;
+
+	/*
+	 * Copying metadata only fills the chunk at the head of the ring, and
+	 * we only wait for a compression when the ring is full.  With two
+	 * chunks per thread, each thread has another chunk queued behind the
+	 * one it is compressing while we copy and write.
+	 */
+	metadump.nr_chunks = nr_threads * 2;
+	metadump.chunks = calloc(metadump.nr_chunks, sizeof(struct md3_chunk));
+	if (!metadump.chunks) {
+		print_warning("memory allocation failure");
+		return -1;
+	}
+	for (i = 0; i < metadump.nr_chunks; i++) {
+		struct md3_chunk	*chunk = &metadump.chunks[i];
+
+		chunk->data = malloc(MD3_CHUNK_SIZE);
+		chunk->out = malloc(sizeof(struct xfs_meta_chunk) +
+				lz_compress_bound(MD3_CHUNK_SIZE));
+		if (!chunk->data || !chunk->out)
+			goto out_free;
+	}
+	metadump.chunk_head = 0;
+	metadump.chunk_tail = 0;
+	metadump.chunk_index = NULL;
+	metadump.nr_chunk_index = 0;
+	metadump.chunks[0].low = -1ULL;
+
+	pthread_mutex_init(&metadump.chunk_lock, NULL);
+	pthread_cond_init(&metadump.chunk_done, NULL);
+	ret = -workqueue_create(&metadump.chunk_wq, NULL, nr_threads);
+	if (ret) {
+		print_warning("could not start compression threads: %s",
+				strerror(ret));
+		pthread_cond_destroy(&metadump.chunk_done);
+		pthread_mutex_destroy(&metadump.chunk_lock);
+		goto out_free;
+	}
+
+	metadump.out_offset = sizeof(struct xfs_metadump_header);
+	ret = write_metadump_header(XFS_MD_MAGIC_V3);
+	if (ret)
+		release_metadump_v3();
+	return ret;
+
+out_free:
+	for (i = 0; i < metadump.nr_chunks; i++) {
+		free(metadump.chunks[i].data);
+		free(metadump.chunks[i].out);
+	}
+	free(metadump.chunks);
+	metadump.chunks = NULL;
+	return -1;
+}
+
+/*
+ * Append a record to the chunk being filled, splitting the extent over as
+ * many chunks as it takes.  Tombstones have no @data and are never split.
+ */
+static int
+write_extent_v3(
+	uint64_t		addr,
+	const char		*data,
+	int			len)
+{
+	struct xfs_meta_extent	xme;
+	struct md3_chunk	*chunk;
+	int			ret;
+
+	while (len > 0) {
+		size_t		room;
+		int		count;
+
+		chunk = chunk_v3(metadump.chunk_head);
+		room = MD3_CHUNK_SIZE - chunk->len;
+		if (room < sizeof(xme) + (data ? BBSIZE : 0)) {
+			ret = submit_chunk_v3();
+			if (ret)
+				return ret;
+			continue;
+		}
+		if (data)
+			count = min_t(size_t, len,
+					(room - sizeof(xme)) >> BBSHIFT);
+		else
+			count = len;
+
+		xme.xme_addr = cpu_to_be64(addr);
+		xme.xme_len = cpu_to_be32(count);
+		memcpy(chunk->data + chunk->len, &xme, sizeof(xme));
+		chunk->len += sizeof(xme);
+		if (!data)
+			break;
+		if (metadump.emap_file)
+			md_emap_add(addr, count, chunk->len,
+					metadump.chunk_head);
+		memcpy(chunk->data + chunk->len, data, BBTOB(count));
+		chunk->len += BBTOB(count);
+
+		chunk->low = min(chunk->low, addr);
+		chunk->high = max(chunk->high, addr + count);
+
+		addr += count;
+		data += BBTOB(count);
+		len -= count;
+	}
+
+	return 0;
+}
+
+static int
+write_metadump_v3(
+	enum typnm		type,
+	const char		*data,
+	xfs_daddr_t		off,
+	int			len)
+{
+	return write_extent_v3(metadump_xme_addr(type, off), data, len);
+}
+
+static int
+write_tombstone_v3(
+	uint64_t		addr,
+	int			len)
+{
+	return write_extent_v3(addr | XME_ADDR_TOMBSTONE, NULL, len);
+}
+
+static int
+finish_dump_metadump_v3(void)
+{
+	struct xfs_meta_index	xmi = {0};
+	struct xfs_meta_trailer	xmt = {0};
+	uint64_t		index_offset;
+	int			ret;
+
+	if (chunk_v3(metadump.chunk_head)->len) {
+		ret = submit_chunk_v3();
+		if (ret)
+			return ret;
+	}
+	while (metadump.chunk_tail < metadump.chunk_head) {
+		ret = write_chunk_v3(true);
+		if (ret < 0)
+			return ret;
+	}
+
+	index_offset = metadump.out_offset;
+	xmi.xmi_magic = cpu_to_be32(XFS_MD3_INDEX_MAGIC);
+	xmi.xmi_count = cpu_to_be32(metadump.nr_chunk_index);
+	xmt.xmt_index = cpu_to_be64(index_offset);
+	xmt.xmt_magic = cpu_to_be32(XFS_MD3_TRAILER_MAGIC);
+
+	if (fwrite(&xmi, sizeof(xmi), 1, metadump.outf) != 1 ||
+	    (metadump.nr_chunk_index &&
+	     fwrite(metadump.chunk_index, sizeof(struct xfs_meta_index_rec),
+			metadump.nr_chunk_index, metadump.outf) !=
+			metadump.nr_chunk_index) ||
+	    fwrite(&xmt, sizeof(xmt), 1, metadump.outf) != 1) {
+		print_warning("error writing to target file");
+		return -EIO;
+	}
+	metadump.out_offset += sizeof(xmi) + sizeof(xmt) +
+			metadump.nr_chunk_index *
+			sizeof(struct xfs_meta_index_rec);
+
+	return 0;
+}
+
+static struct metadump_ops metadump3_ops = {
+	.init		= init_metadump_v3,
+	.write		= write_metadump_v3,
+	.write_tombstone = write_tombstone_v3,
+	.finish_dump	= finish_dump_metadump_v3,
+	.release	= release_metadump_v3,
+};
+
+/*
+ * Delta Dumps
+ * ===========
+ *
+ * With -i, we record the address, length and crc32c of every extent that goes
+ * into the dump in a block index.  With -d, we read the index of an earlier
+ * dump of the same filesystem and leave out every extent that is already in
+ * the image that dump restores to.  Whatever the base held that isn't
+ * metadata any more is zeroed by tombstones at the end of the delta.
+ *
+ * An extent is only left out if the base has exactly the same extent with the
+ * same contents, nothing else in the base overlaps it, and nothing that we
+ * have already written to the delta overlaps it either; otherwise restoring
+ * the delta might not leave the last copy of a block on top.  The primary
+ * superblock is always written, because it sizes the target on restore.
+ */
+
+static void
+md_bindex_add(
+	struct md_bindex	*bi,
+	uint64_t		addr,
+	uint32_t		len,
+	uint32_t		crc)
+{
+	struct md_bindex_ent	*ent;
+
+	if (bi->nr == bi->size) {
+		bi->size = max_t(uint64_t, 1024, bi->size * 2);
+		bi->ents = xrealloc(bi->ents,
+				bi->size * sizeof(struct md_bindex_ent));
+	}
+	ent = &bi->ents[bi->nr++];
+	ent->addr = addr;
+	ent->len = len;
+	ent->crc = crc;
+	ent->overlaps = false;
+}
+
+static void
+md_bindex_free(
+	struct md_bindex	*bi)
+{
+	xfree(bi->ents);
+	memset(bi, 0, sizeof(*bi));
+}
+
+static int
+md_bindex_load(
+	const char		*path,
+	struct md_bindex	*bi)
+{
+	struct xfs_meta_bindex	xmb;
+	struct xfs_meta_bindex_rec xmbr;
+	uint64_t		count;
+	FILE			*f;
+
+	f = fopen(path, "rb");
+	if (!f) {
+		print_warning("cannot open block index %s: %s", path,
+				strerror(errno));
+		return -1;
+	}
+
+	if (fread(&xmb, sizeof(xmb), 1, f) != 1 ||
+	    xmb.xmb_magic != cpu_to_be32(XFS_MD_BINDEX_MAGIC)) {
+		print_warning("%s is not a metadump block index", path);
+		goto out_close;
+	}
+	if (be32_to_cpu(xmb.xmb_version) != XFS_MD_BINDEX_VERSION) {
+		print_warning("block index %s has unknown version %u", path,
+				be32_to_cpu(xmb.xmb_version));
+		goto out_close;
+	}
+	if (platform_uuid_compare(&xmb.xmb_uuid, &mp->m_sb.sb_uuid)) {
+		print_warning("block index %s is for a different filesystem",
+				path);
+		goto out_close;
+	}
+
+	bi->chain_id = be32_to_cpu(xmb.xmb_chain_id);
+	bi->chain_seq = be32_to_cpu(xmb.xmb_chain_seq);
+	for (count = be64_to_cpu(xmb.xmb_count); count > 0; count--) {
+		if (fread(&xmbr, sizeof(xmbr), 1, f) != 1) {
+			print_warning("block index %s is truncated", path);
+			goto out_free;
+		}
+		md_bindex_add(bi, be64_to_cpu(xmbr.xmbr_addr),
+				be32_to_cpu(xmbr.xmbr_len),
+				be32_to_cpu(xmbr.xmbr_crc));
+	}
+
+	fclose(f);
+	return 0;
+out_free:
+	md_bindex_free(bi);
+out_close:
+	fclose(f);
+	return -1;
+}
+
+static int
+md_bindex_save(
+	const char		*path,
+	struct md_bindex	*bi)
+{
+	struct xfs_meta_bindex	xmb = {0};
+	struct xfs_meta_bindex_rec xmbr;
+	struct md_bindex_ent	*ent;
+	FILE			*f;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		print_warning("cannot create block index %s: %s", path,
+				strerror(errno));
+		return -1;
+	}
+
+	xmb.xmb_magic = cpu_to_be32(XFS_MD_BINDEX_MAGIC);
+	xmb.xmb_version = cpu_to_be32(XFS_MD_BINDEX_VERSION);
+	xmb.xmb_chain_id = cpu_to_be32(bi->chain_id);
+	xmb.xmb_chain_seq = cpu_to_be32(bi->chain_seq);
+	platform_uuid_copy(&xmb.xmb_uuid, &mp->m_sb.sb_uuid);
+	xmb.xmb_count = cpu_to_be64(bi->nr);
+	if (fwrite(&xmb, sizeof(xmb), 1, f) != 1)
+		goto out_error;
+
+	for (ent = bi->ents; ent < bi->ents + bi->nr; ent++) {
+		xmbr.xmbr_addr = cpu_to_be64(ent->addr);
+		xmbr.xmbr_len = cpu_to_be32(ent->len);
+		xmbr.xmbr_crc = cpu_to_be32(ent->crc);
+		if (fwrite(&xmbr, sizeof(xmbr), 1, f) != 1)
+			goto out_error;
+	}
+
+	if (fclose(f)) {
+		f = NULL;
+		goto out_error;
+	}
+	return 0;
+out_error:
+	print_warning("error writing block index %s", path);
+	if (f)
+		fclose(f);
+	return -1;
+}
+
+static int
+md_bindex_ent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct md_bindex_ent *ea = a;
+	const struct md_bindex_ent *eb = b;
+
+	if (ea->addr < eb->addr)
+		return -1;
+	return ea->addr > eb->addr;
+}
+
+/*
+ * Load the base of a delta dump, sort it by address and mark every extent
+ * that overlaps another one.
+ */
+static int
+md_delta_init(void)
+{
+	struct md_bindex	*base = &metadump.base;
+	uint64_t		maxend = 0;
+	uint64_t		i;
+	int			error;
+
+	if (md_bindex_load(metadump.base_file, base))
+		return -1;
+	if (base->chain_seq == UINT32_MAX) {
+		print_warning("delta chain of %s is too long",
+				metadump.base_file);
+		return -1;
+	}
+
+	qsort(base->ents, base->nr, sizeof(struct md_bindex_ent),
+			md_bindex_ent_cmp);
+	for (i = 0; i < base->nr; i++) {
+		struct md_bindex_ent *ent = &base->ents[i];
+		uint64_t	end = ent->addr + ent->len;
+
+		if (ent->addr < maxend)
+			ent->overlaps = true;
+		if (i + 1 < base->nr && base->ents[i + 1].addr < end)
+			ent->overlaps = true;
+		maxend = max(maxend, end);
+	}
+
+	error = bitmap_alloc(&metadump.delta_written);
+	if (error) {
+		print_warning("cannot allocate delta map: %s",
+				strerror(-error));
+		return -1;
+	}
+
+	metadump.bindex.chain_id = base->chain_id;
+	metadump.bindex.chain_seq = base->chain_seq + 1;
+	metadump.delta_skipped = 0;
+	return 0;
+}
+
+/* Is this extent already in the image that the base restores to? */
+static bool
+md_delta_unchanged(
+	uint64_t		addr,
+	uint32_t		len,
+	uint32_t		crc)
+{
+	struct md_bindex	*base = &metadump.base;
+	uint64_t		lo = 0;
+	uint64_t		hi = base->nr;
+
+	while (lo < hi) {
+		uint64_t	mid = (lo + hi) / 2;
+
+		if (base->ents[mid].addr < addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == base->nr || base->ents[lo].addr != addr)
+		return false;
+
+	/* Extents that share an address overlap, so this one is unique. */
+	return !base->ents[lo].overlaps && base->ents[lo].len == len &&
+	       base->ents[lo].crc == crc &&
+	       !bitmap_test(metadump.delta_written, addr, len);
+}
+
+static int
+md_delta_write_tombstone(
+	uint64_t		start,
+	uint64_t		length,
+	void			*arg)
+{
+	int			error;
+
+	while (length > 0) {
+		int		len = min_t(uint64_t, length, INT_MAX >> BBSHIFT);
+
+		error = metadump.mdops->write_tombstone(start, len);
+		if (error)
+			return error;
+		start += len;
+		length -= len;
+	}
+	return 0;
+}
+
+struct md_gap {
+	struct bitmap		*gone;
+	uint64_t		next;		/* first address not yet covered */
+	uint64_t		end;
+	int			error;
+};
+
+/* Mark the part of a base extent in front of this new extent as gone. */
+static int
+md_delta_find_gap(
+	uint64_t		start,
+	uint64_t		length,
+	void			*arg)
+{
+	struct md_gap		*gap = arg;
+
+	if (start > gap->next)
+		gap->error = bitmap_set(gap->gone, gap->next,
+				min(start, gap->end) - gap->next);
+	gap->next = max(gap->next, start + length);
+	return gap->error;
+}
+
+/*
+ * Write tombstones for everything in the base that this dump doesn't have.
+ * By now, the block index has everything in this dump.
+ */
+static int
+md_delta_finish(void)
+{
+	struct bitmap		*have = NULL;
+	struct md_gap		gap = { NULL };
+	struct md_bindex_ent	*ent;
+	int			error;
+
+	error = bitmap_alloc(&have);
+	if (!error)
+		error = bitmap_alloc(&gap.gone);
+	for (ent = metadump.bindex.ents;
+	     !error && ent < metadump.bindex.ents + metadump.bindex.nr; ent++)
+		error = bitmap_set(have, ent->addr, ent->len);
+
+	for (ent = metadump.base.ents;
+	     !error && ent < metadump.base.ents + metadump.base.nr; ent++) {
+		gap.next = ent->addr;
+		gap.end = ent->addr + ent->len;
+		error = bitmap_iterate_range(have, ent->addr, ent->len,
+				md_delta_find_gap, &gap);
+		if (!error && gap.next < gap.end)
+			error = bitmap_set(gap.gone, gap.next,
+					gap.end - gap.next);
+	}
+	if (error) {
+		print_warning("cannot build delta map: %s", strerror(-error));
+		goto out;
+	}
+
+	error = bitmap_iterate(gap.gone, md_delta_write_tombstone, NULL);
+out:
+	if (gap.gone)
+		bitmap_free(&gap.gone);
+	if (have)
+		bitmap_free(&have);
+	return error ? -1 : 0;
+}
+
+/* Start a new delta chain. */
+static uint32_t
+md_new_chain_id(void)
+{
+	struct timespec		ts;
+	uint32_t		id;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	id = crc32c(getpid(), &ts, sizeof(ts));
+	return id ? id : 1;
+}
+
+static void
+md_delta_free(void)
+{
+	md_bindex_free(&metadump.base);
+	md_bindex_free(&metadump.bindex);
+	if (metadump.delta_written)
+		bitmap_free(&metadump.delta_written);
+}
+
+/*
+ * Hand an extent to the dump format, recording it in the block index and
+ * leaving it out if it hasn't changed since the base of a delta dump.
+ */
+static int
+md_dump_extent(
+	enum typnm		type,
+	const char		*data,
+	xfs_daddr_t		off,
+	int			len)
+{
+	uint64_t		addr;
+	uint32_t		crc;
+	bool			first;
+
+	if (!metadump.bindex_file && !metadump.base_file)
+		return metadump.mdops->write(type, data, off, len);
+
+	addr = metadump_xme_addr(type, off);
+	crc = crc32c(XFS_CRC_SEED, data, BBTOB(len));
+	first = metadump.bindex.nr == 0;
+	md_bindex_add(&metadump.bindex, addr, len, crc);
+
+	if (metadump.base_file) {
+		int		error;
+
+		if (!first && md_delta_unchanged(addr, len, crc)) {
+			metadump.delta_skipped++;
+			return 0;
+		}
+		error = bitmap_set(metadump.delta_written, addr, len);
+		if (error) {
+			print_warning("cannot update delta map: %s",
+					strerror(-error));
+			return error;
+		}
+	}
+
+	return metadump.mdops->write(type, data, off, len);
+}
+
+static int
+md_stage_add(
+	struct md_stage		*ms,
+	enum md_rec_kind	kind,
+	enum typnm		type,
+	int64_t			off,
+	const void		*data,
+	uint32_t		len)
+{
+	struct md_stage_rec	rec = {
+		.kind		= kind,
+		.type		= type,
+		.off		= off,
+		.len		= len,
+	};
+	size_t			need = sizeof(rec) + len;
+	int			error;
+
+	if (ms->error)
+		return ms->error;
+
+	/* Move what we have out to the xfile rather than grow past the limit. */
+	if (ms->len && ms->len + need > MD_STAGE_MEM) {
+		if (!ms->xf) {
+			error = -xfile_create(_("xfs_db metadump staging"), 0,
+					&ms->xf);
+			if (error)
+				goto fail;
+		}
+		error = -xfile_store(ms->xf, ms->buf, ms->len, ms->spilled);
+		if (error)
+			goto fail;
+		ms->spilled += ms->len;
+		ms->len = 0;
+	}
+
+	if (ms->len + need > ms->size) {
+		size_t		size;
+		char		*buf;
+
+		size = min_t(size_t, max_t(size_t, ms->size * 2, 65536),
+				MD_STAGE_MEM);
+		size = max_t(size_t, size, ms->len + need);
+		buf = realloc(ms->buf, size);
+		if (!buf) {
+			error = ENOMEM;
+			goto fail;
+		}
+		ms->buf = buf;
+		ms->size = size;
+	}
+
+	memcpy(ms->buf + ms->len, &rec, sizeof(rec));
+	memcpy(ms->buf + ms->len + sizeof(rec), data, len);
+	ms->len += need;
+	return 0;
+fail:
+	ms->error = error;
+	return -error;
+}
+
+static int
+md_stage_emit(
+	const struct md_stage_rec *rec,
+	const char		*payload)
+{
+	if (rec->kind == MD_REC_WARNING) {
+		emit_warning(payload);
+		return 0;
+	}
+	return md_dump_extent(rec->type, payload, rec->off,
+			rec->len >> BBSHIFT);
+}
+
+/* Write out a staging area, oldest records first. */
+static int
+md_stage_replay(
+	struct md_stage		*ms)
+{
+	struct md_stage_rec	rec;
+	char			*payload = NULL;
+	size_t			size = 0;
+	size_t			off;
+	loff_t			pos;
+	int			error = 0;
+
+	for (pos = 0; pos < ms->spilled; pos += sizeof(rec) + rec.len) {
+		error = -xfile_load(ms->xf, &rec, sizeof(rec), pos);
+		if (error)
+			break;
+		if (rec.len > size) {
+			char	*p = realloc(payload, rec.len);
+
+			if (!p) {
+				error = ENOMEM;
+				break;
+			}
+			payload = p;
+			size = rec.len;
+		}
+		error = -xfile_load(ms->xf, payload, rec.len, pos + sizeof(rec));
+		if (error)
+			break;
+		error = -md_stage_emit(&rec, payload);
+		if (error)
+			goto out;
+	}
+	if (error) {
+		print_warning("could not read staged metadata: %s",
+				strerror(error));
+		goto out;
+	}
+
+	for (off = 0; off < ms->len; off += sizeof(rec) + rec.len) {
+		memcpy(&rec, ms->buf + off, sizeof(rec));
+		error = -md_stage_emit(&rec, ms->buf + off + sizeof(rec));
+		if (error)
+			break;
+	}
+out:
+	free(payload);
+	return error;
+}
+
+static void
+md_stage_free(
+	struct md_stage		*ms)
+{
+	free(ms->buf);
+	if (ms->xf)
+		xfile_destroy(ms->xf);
+	memset(ms, 0, sizeof(*ms));
+}
+
+/*
+ * Parallel scans can get to "lost+found" before the root directory has been
+ * copied, so look it up before we start.
+ */
+static void
+find_orphanage(void)
+{
+	struct xfs_name		xname = {
+		.name		= (const unsigned char *)ORPHANAGE,
+		.len		= ORPHANAGE_LEN,
+	};
+	struct xfs_trans	*tp;
+	struct xfs_inode	*dp;
+	xfs_ino_t		ino;
+
+	tp = libxfs_trans_alloc_empty(mp);
+	if (!libxfs_iget(mp, tp, mp->m_sb.sb_rootino, 0, &dp)) {
+		if (S_ISDIR(VFS_I(dp)->i_mode) &&
+		    !libxfs_dir_lookup(tp, dp, &xname, &ino, NULL) &&
+		    xfs_verify_ino(mp, ino))
+			metadump.orphanage_ino = ino;
+		libxfs_irele(dp);
+	}
+	libxfs_trans_cancel(tp);
+}
+
+static bool
+metadump_want_ag(
+	xfs_agnumber_t		agno)
+{
+	return !metadump.scan_failed;
+}
+
+static void
+metadump_scan_ag(
+	xfs_agnumber_t		agno,
+	void			*priv)
+{
+	struct md_stage		*stages = priv;
+
+	md_stage = &stages[agno];
+	md_stage->rval = scan_ag(agno);
+	md_stage = NULL;
+	nametable_free();
+	namecache_free();
+}
+
+static void
+metadump_merge_ag(
+	xfs_agnumber_t		agno,
+	void			*priv)
+{
+	struct md_stage		*ms = &((struct md_stage *)priv)[agno];
+
+	if (ms->error)
+		print_warning("could not stage metadata for ag %u: %s", agno,
+				strerror(ms->error));
+	if (md_stage_replay(ms) || !ms->rval)
+		metadump.scan_failed = true;
+	md_stage_free(ms);
+
+	if (metadump.show_progress)
+		print_progress("Copied %u of %u inodes (%u of %u AGs)",
+				uatomic_read(&inodes_copied),
+				mp->m_sb.sb_icount, agno + 1,
+				mp->m_sb.sb_agcount);
+}
+
+/*
+ * Copy the metadata in every AG.  If there's more than one CPU, the AGs are
+ * scanned on worker threads and written out in AG order.  Obfuscated names
+ * don't depend on which thread made them, so neither does the dump.
+ */
+static int
+copy_ags(void)
+{
+	const struct agscan_ops	ops = {
+		.want		= metadump_want_ag,
+		.scan		= metadump_scan_ag,
+		.merge		= metadump_merge_ag,
+	};
+	struct md_stage		*stages = NULL;
+	xfs_agnumber_t		agno;
+
+	if (agscan_nr_threads() > 1)
+		stages = calloc(mp->m_sb.sb_agcount, sizeof(struct md_stage));
+	if (!stages) {
+		int	rval = 1;
+
+		for (agno = 0; agno < mp->m_sb.sb_agcount && rval; agno++)
+			rval = scan_ag(agno);
+		nametable_free();
+		namecache_free();
+		return rval;
+	}
+
+	if (metadump.obfuscate)
+		find_orphanage();
+	metadump.scan_failed = false;
+	agscan_run(&ops, stages);
+
+	/* Throw away whatever was scanned ahead of a failure. */
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		md_stage_free(&stages[agno]);
+	free(stages);
+	return !metadump.scan_failed;
+}
+
+static int
+metadump_f(
+	int 		argc,
+	char 		**argv)
+{
+	int		c;
+	int		start_iocur_sp;
+	int		outfd = -1;
+	int		ret;
+	char		*p;
+	bool		version_opt_set = false;
+
+	exitcode = 1;
+
+	metadump.version = 1;
+	metadump.show_progress = false;
+	metadump.stop_on_read_error = false;
+	metadump.max_extent_size = DEFAULT_MAX_EXT_SIZE;
 	metadump.show_warnings = false;
 	metadump.obfuscate = true;
 	metadump.zero_stale_data = true;
 	metadump.dirty_log = false;
 	metadump.external_log = false;
 	metadump.realtime_data = false;
+	metadump.orphanage_ino = 0;
+	metadump.bindex_file = NULL;
+	metadump.base_file = NULL;
+	metadump.emap_file = NULL;
 
 	if (mp->m_sb.sb_magicnum != XFS_SB_MAGIC) {
 		print_warning("bad superblock magic number %x, giving up",
@@ -3415,17 +4965,23 @@ metadump_f(
 		return 0;
 	}
 
-	while ((c = getopt(argc, argv, "aegm:ov:w")) != EOF) {
+	while ((c = getopt(argc, argv, "ad:egi:m:ov:wx:")) != EOF) {
 		switch (c) {
 			case 'a':
 				metadump.zero_stale_data = false;
 				break;
+			case 'd':
+				metadump.base_file = optarg;
+				break;
 			case 'e':
 				metadump.stop_on_read_error = true;
 				break;
 			case 'g':
 				metadump.show_progress = true;
 				break;
+			case 'i':
+				metadump.bindex_file = optarg;
+				break;
 			case 'm':
 				metadump.max_extent_size =
 					(int)strtol(optarg, &p, 0);
@@ -3442,8 +4998,8 @@ metadump_f(
 			case 'v':
 				metadump.version = (int)strtol(optarg, &p, 0);
 				if (*p != '\0' ||
-				    (metadump.version != 1 &&
-						metadump.version != 2)) {
+				    metadump.version < 1 ||
+				    metadump.version > 3) {
 					print_warning("bad metadump version: %s",
 						optarg);
 					return 0;
@@ -3453,6 +5009,9 @@ metadump_f(
 			case 'w':
 				metadump.show_warnings = true;
 				break;
+			case 'x':
+				metadump.emap_file = optarg;
+				break;
 			default:
 				print_warning("bad option for metadump command");
 				return 0;
@@ -3470,7 +5029,30 @@ metadump_f(
 	if (metadump.external_log && !version_opt_set)
 		metadump.version = 2;
 
-	if (metadump.version == 2 && mp->m_sb.sb_logstart == 0 &&
+	if ((metadump.bindex_file || metadump.base_file) &&
+	    metadump.version == 1) {
+		if (version_opt_set) {
+			print_warning("delta dumps and block indexes need a v2 or v3 metadump");
+			return 0;
+		}
+		metadump.version = 2;
+	}
+
+	if (metadump.emap_file) {
+		if (metadump.base_file) {
+			print_warning("delta dumps cannot have an extent map");
+			return 0;
+		}
+		if (metadump.version == 1) {
+			if (version_opt_set) {
+				print_warning("extent maps need a v2 or v3 metadump");
+				return 0;
+			}
+			metadump.version = 2;
+		}
+	}
+
+	if (metadump.version >= 2 && mp->m_sb.sb_logstart == 0 &&
 	    !metadump.external_log) {
 		print_warning("external log device not loaded, use -l");
 		return 1;
@@ -3485,7 +5067,7 @@ metadump_f(
 			metadump.realtime_data = true;
 			if (!version_opt_set)
 				metadump.version = 2;
-		} else if (metadump.version == 2 && !metadump.realtime_data) {
+		} else if (metadump.version >= 2 && !metadump.realtime_data) {
 			print_warning("realtime device not loaded, use -R");
 			return 1;
 		}
@@ -3524,6 +5106,14 @@ metadump_f(
 		pop_cur();
 	}
 
+	if (metadump.base_file) {
+		if (md_delta_init())
+			goto out;
+	} else if (metadump.bindex_file) {
+		metadump.bindex.chain_id = md_new_chain_id();
+		metadump.bindex.chain_seq = 0;
+	}
+
 	start_iocur_sp = iocur_sp;
 
 	if (strcmp(argv[optind], "-") == 0) {
@@ -3570,8 +5160,10 @@ metadump_f(
 
 	if (metadump.version == 1)
 		metadump.mdops = &metadump1_ops;
-	else
+	else if (metadump.version == 2)
 		metadump.mdops = &metadump2_ops;
+	else
+		metadump.mdops = &metadump3_ops;
 
 	ret = metadump.mdops->init();
 	if (ret)
@@ -3579,12 +5171,7 @@ metadump_f(
 
 	exitcode = 0;
 
-	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++) {
-		if (!scan_ag(agno)) {
-			exitcode = 1;
-			break;
-		}
-	}
+	exitcode = !copy_ags();
 
 	/* copy log */
 	if (!exitcode && !(metadump.version == 1 && metadump.external_log))
@@ -3596,10 +5183,26 @@ metadump_f(
 			exitcode = 1;
 	}
 
+	/* zero whatever the base of a delta has that we don't */
+	if (!exitcode && metadump.base_file)
+		exitcode = md_delta_finish() < 0;
+
 	/* write the remaining index */
 	if (!exitcode && metadump.mdops->finish_dump)
 		exitcode = metadump.mdops->finish_dump() < 0;
 
+	if (!exitcode && metadump.bindex_file)
+		exitcode = md_bindex_save(metadump.bindex_file,
+				&metadump.bindex) < 0;
+
+	if (!exitcode && metadump.emap_file)
+		exitcode = md_emap_save(metadump.emap_file) < 0;
+
+	if (!exitcode && metadump.base_file && metadump.show_progress)
+		print_progress("Left out %llu of %llu extents",
+				(unsigned long long)metadump.delta_skipped,
+				(unsigned long long)metadump.bindex.nr);
+
 	if (metadump.progress_since_warning)
 		fputc('\n', metadump.stdout_metadump ? stderr : stdout);
 
@@ -3621,6 +5224,112 @@ metadump_f(
 		metadump.mdops->release();
 
 out:
+	md_delta_free();
+	md_emap_free();
+	remaptable_clear();
+	return 0;
+}
+
+static void
+namebench_help(void)
+{
+	dbprintf(_(
+"\n"
+" Measure how quickly metadump obfuscates the names in big directories.\n"
+" Synthetic directories are filled with names of the given length and run\n"
+" through the same code that metadump -o uses for directory entries.  By\n"
+" default every directory has the same names, as happens with many copies\n"
+" of a source tree.\n"
+"\n"
+" Options:\n"
+"   -d -- Number of directories (default 1)\n"
+"   -l -- Length of each name (default 12)\n"
+"   -n -- Number of names in each directory (default 1000000)\n"
+"   -u -- Give every directory different names\n"
+"\n"));
+}
+
+static int
+namebench_f(
+	int			argc,
+	char			**argv)
+{
+	unsigned long		nr_names = 1000000;
+	unsigned long		nr_dirs = 1;
+	unsigned long		namelen = 12;
+	unsigned long		d, i;
+	unsigned long long	total;
+	bool			unique = false;
+	struct timeval		t1, t2;
+	unsigned char		name[MAXNAMELEN];
+	char			num[48];
+	xfs_ino_t		saved_ino = cur_ino;
+	double			secs;
+	int			c;
+
+	while ((c = getopt(argc, argv, "d:l:n:u")) != EOF) {
+		switch (c) {
+		case 'd':
+			nr_dirs = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			namelen = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			nr_names = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			unique = true;
+			break;
+		default:
+			namebench_help();
+			return 0;
+		}
+	}
+
+	if (namelen < 5 || namelen >= MAXNAMELEN || !nr_names || !nr_dirs) {
+		dbprintf(_("names must be 5 to %d bytes long\n"),
+				MAXNAMELEN - 1);
+		return 0;
+	}
+
+	gettimeofday(&t1, NULL);
+	for (d = 0; d < nr_dirs; d++) {
+		/* Pretend to be a directory that isn't the root. */
+		cur_ino = mp->m_sb.sb_rootino + 1 + d;
+		nametable_reserve(nr_names);
+
+		for (i = 0; i < nr_names; i++) {
+			int	len;
+
+			if (unique)
+				len = snprintf(num, sizeof(num), "%lu.%lu",
+						d, i);
+			else
+				len = snprintf(num, sizeof(num), "%lu", i);
+
+			/* Zero pad (or truncate) to the name length. */
+			memset(name, '0', namelen);
+			if (len > namelen) {
+				memcpy(name, num + len - namelen, namelen);
+			} else {
+				memcpy(name + namelen - len, num, len);
+				name[0] = 'f';
+			}
+			generate_obfuscated_name(cur_ino + 1, namelen, name);
+		}
+		nametable_clear();
+	}
+	gettimeofday(&t2, NULL);
+
+	nametable_free();
+	namecache_free();
 	remaptable_clear();
+	cur_ino = saved_ino;
+
+	total = (unsigned long long)nr_names * nr_dirs;
+	secs = (t2.tv_sec - t1.tv_sec) + (t2.tv_usec - t1.tv_usec) / 1e6;
+	dbprintf(_("%llu names in %lu directories: %.3f seconds, %.0f names/sec\n"),
+			total, nr_dirs, secs, secs > 0 ? total / secs : 0);
 	return 0;
 }
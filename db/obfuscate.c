@@ -7,6 +7,20 @@
 #include "init.h"
 #include "obfuscate.h"
 
+/*
+ * Each thread draws from its own random sequence, so that the names it
+ * generates don't depend on what other threads are doing at the same time.
+ * Metadump reseeds the sequence for every name.
+ */
+static __thread unsigned int	obfuscate_rand_state = 1;
+
+void
+obfuscate_seed(
+	unsigned int	seed)
+{
+	obfuscate_rand_state = seed;
+}
+
 static inline unsigned char
 random_filename_char(void)
 {
@@ -14,7 +28,8 @@ random_filename_char(void)
 						"abcdefghijklmnopqrstuvwxyz"
 						"0123456789-_";
 
-	return filename_alphabet[random() % (sizeof filename_alphabet - 1)];
+	return filename_alphabet[rand_r(&obfuscate_rand_state) %
+				 (sizeof filename_alphabet - 1)];
 }
 
 #define rol32(x,y)		(((x) << (y)) | ((x) >> (32 - (y))))
@@ -10,6 +10,7 @@
 
 #define is_invalid_char(c)	((c) == '/' || (c) == '\0')
 
+void obfuscate_seed(unsigned int seed);
 void obfuscate_name(xfs_dahash_t hash, size_t name_len, unsigned char *name,
 		bool is_dirent);
 int find_alternate(size_t name_len, unsigned char *name, uint32_t seq);
@@ -22,6 +22,40 @@ int		dbprefix;
 static FILE	*log_file;
 static char	*log_file_name;
 
+/*
+ * Output captured from a worker thread, to be printed later by the main
+ * thread so that the overall output keeps its usual order.
+ */
+struct output_capture {
+	FILE		*out;
+	char		*out_buf;
+	size_t		out_len;
+	FILE		*log;
+	char		*log_buf;
+	size_t		log_len;
+};
+
+static __thread struct output_capture	*capture;
+
+static int
+capture_vprintf(
+	const char	*fmt,
+	va_list		ap)
+{
+	va_list		aq;
+	int		i = 0;
+
+	if (capture->log) {
+		va_copy(aq, ap);
+		vfprintf(capture->log, fmt, aq);
+		va_end(aq);
+	}
+	if (dbprefix)
+		i += fprintf(capture->out, "%s: ", x.data.name);
+	i += vfprintf(capture->out, fmt, ap);
+	return i;
+}
+
 int
 dbprintf(const char *fmt, ...)
 {
@@ -30,6 +64,12 @@ dbprintf(const char *fmt, ...)
 
 	if (seenint())
 		return 0;
+	if (capture) {
+		va_start(ap, fmt);
+		i = capture_vprintf(fmt, ap);
+		va_end(ap);
+		return i;
+	}
 	va_start(ap, fmt);
 	blockint();
 	i = 0;
@@ -91,6 +131,67 @@ logprintf(const char *fmt, ...)
 	}
 }
 
+/*
+ * Start capturing everything this thread passes to dbprintf.  Returns NULL
+ * if the capture could not be set up, in which case output is not diverted.
+ */
+struct output_capture *
+output_capture_start(void)
+{
+	struct output_capture	*oc;
+
+	oc = calloc(1, sizeof(struct output_capture));
+	if (!oc)
+		return NULL;
+	oc->out = open_memstream(&oc->out_buf, &oc->out_len);
+	if (!oc->out)
+		goto out_free;
+	if (log_file) {
+		oc->log = open_memstream(&oc->log_buf, &oc->log_len);
+		if (!oc->log)
+			goto out_close;
+	}
+	capture = oc;
+	return oc;
+out_close:
+	fclose(oc->out);
+	free(oc->out_buf);
+out_free:
+	free(oc);
+	return NULL;
+}
+
+/* Stop capturing this thread's output. */
+void
+output_capture_stop(void)
+{
+	if (!capture)
+		return;
+	fclose(capture->out);
+	if (capture->log)
+		fclose(capture->log);
+	capture = NULL;
+}
+
+/* Print captured output as if it had been emitted now, then free it. */
+void
+output_capture_flush(
+	struct output_capture	*oc)
+{
+	if (!oc)
+		return;
+	if (!seenint()) {
+		blockint();
+		fwrite(oc->out_buf, 1, oc->out_len, stdout);
+		unblockint();
+		if (log_file && oc->log_buf)
+			fwrite(oc->log_buf, 1, oc->log_len, log_file);
+	}
+	free(oc->out_buf);
+	free(oc->log_buf);
+	free(oc);
+}
+
 void
 output_init(void)
 {
@@ -4,8 +4,13 @@
  * All Rights Reserved.
  */
 
+struct output_capture;
+
 extern int	dbprefix;
 
 extern int	dbprintf(const char *, ...);
 extern void	logprintf(const char *, ...);
 extern void	output_init(void);
+extern struct output_capture *output_capture_start(void);
+extern void	output_capture_stop(void);
+extern void	output_capture_flush(struct output_capture *oc);
@@ -33,7 +33,7 @@
 static const typ_t	*findtyp(char *name);
 static int		type_f(int argc, char **argv);
 
-const typ_t	*cur_typ;
+__thread const typ_t	*cur_typ;
 
 static const cmdinfo_t	type_cmd =
 	{ "type", NULL, type_f, 0, 1, 1, N_("[newtype]"),
@@ -6,17 +6,20 @@
 
 OPTS=" "
 DBOPTS=" "
-USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-l logdev] [-r rtdev] [-v version] source target"
+USAGE="Usage: xfs_metadump [-aefFogwV] [-m max_extents] [-l logdev] [-r rtdev] [-v version] [-i index] [-d base_index] [-x extmap] source target"
 
-while getopts "aefFgl:m:or:wv:V" c
+while getopts "ad:efFgi:l:m:or:wv:x:V" c
 do
 	case $c in
 	a)	OPTS=$OPTS"-a ";;
+	d)	OPTS=$OPTS"-d "$OPTARG" ";;
 	e)	OPTS=$OPTS"-e ";;
 	g)	OPTS=$OPTS"-g ";;
+	i)	OPTS=$OPTS"-i "$OPTARG" ";;
 	m)	OPTS=$OPTS"-m "$OPTARG" ";;
 	o)	OPTS=$OPTS"-o ";;
 	w)	OPTS=$OPTS"-w ";;
+	x)	OPTS=$OPTS"-x "$OPTARG" ";;
 	f)	DBOPTS=$DBOPTS" -f";;
 	l)	DBOPTS=$DBOPTS" -l "$OPTARG" ";;
 	F)	DBOPTS=$DBOPTS" -F";;
@@ -1198,6 +1198,8 @@ packfile(
 	char			ffname[SMBUFSZ];
 	int			ffd = -1;
 	int			error;
+	struct timespec		copy_start, copy_end;
+	long long		copied = 0;
 
 	/*
 	 * Work out the extent map - nextents will be set to the
@@ -1351,6 +1353,7 @@ packfile(
 	}
 
 	/* Loop through block map copying the file. */
+	clock_gettime(CLOCK_MONOTONIC, &copy_start);
 	for (extent = 0; extent < nextents; extent++) {
 		pos = outmap[extent].bmv_offset;
 		if (outmap[extent].bmv_block == -1) {
@@ -1385,6 +1388,8 @@ packfile(
 				extent = nextents;
 				break;
 			}
+			if (ct > 0)
+				copied += ct;
 			/* Ensure we do direct I/O to correct block
 			 * boundaries.
 			 */
@@ -1449,6 +1454,7 @@ packfile(
 				fname, strerror(errno));
 		goto out;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &copy_end);
 
 	/* switch to the owner's id, to keep quota in line */
         if (fchown(tfd, statp->bs_uid, statp->bs_gid) < 0) {
@@ -1484,11 +1490,19 @@ packfile(
 	}
 
 	/* Report progress */
-	if (vflag)
+	if (vflag) {
+		double	secs = copy_end.tv_sec - copy_start.tv_sec +
+			       (copy_end.tv_nsec - copy_start.tv_nsec) / 1e9;
+
 		fsrprintf(_("extents before:%d after:%d %s %s\n"),
 			  cur_nextents, new_nextents,
 			  (new_nextents <= nextents ? "DONE" : "    " ),
 		          fname);
+		fsrprintf(_("copied %lld bytes in %.2f seconds, %.1f MiB/s %s\n"),
+			  copied, secs,
+			  secs > 0 ? copied / secs / (1024 * 1024) : 0.0,
+			  fname);
+	}
 	retval = 0;
 
 out:
@@ -64,6 +64,8 @@ typedef unsigned int (*cache_node_hash_t)(cache_key_t, unsigned int,
 					  unsigned int);
 typedef int (*cache_node_compare_t)(struct cache_node *, cache_key_t);
 typedef unsigned int (*cache_bulk_relse_t)(struct cache *, struct list_head *);
+typedef void (*cache_bulk_flush_t)(struct cache *, struct cache_node **,
+				   unsigned int);
 typedef int (*cache_node_get_t)(struct cache_node *);
 typedef void (*cache_node_put_t)(struct cache_node *);
 
@@ -74,6 +76,7 @@ struct cache_operations {
 	cache_node_relse_t	relse;
 	cache_node_compare_t	compare;
 	cache_bulk_relse_t	bulkrelse;	/* optional */
+	cache_bulk_flush_t	bulkflush;	/* optional */
 	cache_node_get_t	get;		/* optional */
 	cache_node_put_t	put;		/* optional */
 };
@@ -90,36 +93,71 @@ struct cache_mru {
 	pthread_mutex_t		cm_mutex;	/* MRU lock */
 };
 
+/*
+ * Each priority of each shard keeps its nodes on a clock.  The hand sits at
+ * the head of the list; nodes the hand passes over go to the tail.
+ */
+struct cache_clock {
+	struct list_head	cc_list;	/* clock ring */
+	unsigned int		cc_count;	/* nodes on the clock */
+	unsigned int		cc_hot;		/* hot nodes on the clock */
+};
+
+/*
+ * The cache is split into shards by hash bucket.  Each shard has its own
+ * lock, node count and clocks, so threads working on different parts of the
+ * cache don't contend on anything but the hash chains they share.
+ */
+struct cache_shard {
+	pthread_mutex_t		cs_mutex;	/* protects the shard */
+	unsigned int		cs_maxcount;	/* max nodes in this shard */
+	unsigned int		cs_count;	/* count of nodes */
+	unsigned int		cs_max;		/* max nodes ever used */
+	unsigned long		cs_misses;	/* cache misses */
+	unsigned long		cs_hits;	/* cache hits (atomic) */
+	unsigned long		cs_evictions;	/* nodes reclaimed by shaking */
+	struct cache_clock	cs_clocks[CACHE_DIRTY_PRIORITY + 1];
+};
+
+/* cn_flags */
+#define CACHE_NODE_REFERENCED	(1U << 0)	/* used since the hand passed */
+#define CACHE_NODE_HOT		(1U << 1)	/* reused while resident */
+
 struct cache_node {
 	struct list_head	cn_hash;	/* hash chain */
-	struct list_head	cn_mru;		/* MRU chain */
+	struct list_head	cn_mru;		/* clock ring */
 	unsigned int		cn_count;	/* reference count */
 	unsigned int		cn_hashidx;	/* hash chain index */
 	int			cn_priority;	/* priority, -1 = free list */
 	int			cn_old_priority;/* saved pre-dirty prio */
+	unsigned int		cn_flags;	/* clock state */
 	pthread_mutex_t		cn_mutex;	/* node mutex */
 };
 
 struct cache {
 	int			c_flags;	/* behavioural flags */
 	unsigned int		c_maxcount;	/* max cache nodes */
-	unsigned int		c_count;	/* count of nodes */
-	pthread_mutex_t		c_mutex;	/* node count mutex */
 	cache_node_hash_t	hash;		/* node hash function */
 	cache_node_alloc_t	alloc;		/* allocation function */
 	cache_node_flush_t	flush;		/* flush dirty data function */
 	cache_node_relse_t	relse;		/* memory free function */
 	cache_node_compare_t	compare;	/* comparison routine */
 	cache_bulk_relse_t	bulkrelse;	/* bulk release routine */
+	cache_bulk_flush_t	bulkflush;	/* bulk flush routine */
 	cache_node_get_t	get;		/* prepare cache node after get */
 	cache_node_put_t	put;		/* prepare to put cache node */
 	unsigned int		c_hashsize;	/* hash bucket count */
 	unsigned int		c_hashshift;	/* hash key shift */
 	struct cache_hash	*c_hash;	/* hash table buckets */
-	struct cache_mru	c_mrus[CACHE_DIRTY_PRIORITY + 1];
-	unsigned long long	c_misses;	/* cache misses */
-	unsigned long long	c_hits;		/* cache hits */
-	unsigned int 		c_max;		/* max nodes ever used */
+	unsigned int		c_nr_shards;	/* shard count, power of 2 */
+	struct cache_shard	*c_shards;	/* shards */
+};
+
+/* Counters summed over all shards. */
+struct cache_stats {
+	unsigned long long	hits;
+	unsigned long long	misses;
+	unsigned long long	evictions;
 };
 
 struct cache *cache_init(int, unsigned int, struct cache_operations *);
@@ -129,11 +167,13 @@ void cache_purge(struct cache *);
 void cache_flush(struct cache *);
 
 int cache_node_get(struct cache *, cache_key_t, struct cache_node **);
+int cache_node_lookup(struct cache *, cache_key_t, struct cache_node **);
 void cache_node_put(struct cache *, struct cache_node *);
 void cache_node_set_priority(struct cache *, struct cache_node *, int);
 int cache_node_get_priority(struct cache_node *);
 int cache_node_purge(struct cache *, cache_key_t, struct cache_node *);
 void cache_report(FILE *fp, const char *, struct cache *);
+void cache_get_stats(struct cache *, struct cache_stats *);
 int cache_overflowed(struct cache *);
 
 #endif	/* __CACHE_H__ */
@@ -11,13 +11,7 @@
 #define KM_LARGE	0x0010u
 #define KM_NOLOCKDEP	0x0020u
 
-struct kmem_cache {
-	int		cache_unitsize;	/* Size in bytes of cache unit */
-	int		allocated;	/* debug: How many allocated? */
-	unsigned int	align;
-	const char	*cache_name;	/* tag name */
-	void		(*ctor)(void *);
-};
+struct kmem_cache;
 
 typedef unsigned int __bitwise gfp_t;
 
@@ -41,15 +35,9 @@ kmem_cache_init(unsigned int size, const char *name)
 
 extern void	*kmem_cache_alloc(struct kmem_cache *, gfp_t);
 extern void	*kmem_cache_zalloc(struct kmem_cache *, gfp_t);
+extern void	kmem_cache_free(struct kmem_cache *, void *);
 extern int	kmem_cache_destroy(struct kmem_cache *);
 
-static inline void
-kmem_cache_free(struct kmem_cache *cache, void *ptr)
-{
-	cache->allocated--;
-	free(ptr);
-}
-
 extern void	*kvmalloc(size_t, gfp_t);
 extern void	*krealloc(void *, size_t, int);
 
@@ -114,17 +114,22 @@ struct iomap;
 
 #define xfs_isset(a,i)	((a)[(i)/(sizeof(*(a))*NBBY)] & (1ULL<<((i)%(sizeof(*(a))*NBBY))))
 
+struct mdimage;
+
 struct libxfs_dev {
 	/* input parameters */
 	char		*name;	/* pathname of the device */
 	bool		isfile;	/* is the device a file? */
 	bool		create;	/* create file if it doesn't exist */
+	bool		metadump; /* device is a metadump image */
+	char		*metadump_map; /* extent map of the metadump */
 
 	/* output parameters */
 	dev_t		dev;	/* device name for the device */
 	long long       size;	/* size of subvolume (BBs) */
 	int		bsize;	/* device blksize */
 	int		fd;	/* file descriptor */
+	struct mdimage	*mdimage; /* metadump being read, if any */
 };
 
 /*
@@ -166,6 +171,8 @@ int		libxfs_init(struct libxfs_init *);
 void		libxfs_destroy(struct libxfs_init *li);
 
 extern int	libxfs_device_alignment (void);
+int		libxfs_device_pread(struct libxfs_dev *dev, void *buf,
+				size_t count, off_t offset);
 
 /* check or write log footer: specify device, log size in blocks & uuid */
 typedef char	*(libxfs_get_block_t)(char *, int, void *);
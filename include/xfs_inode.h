@@ -253,6 +253,11 @@ typedef struct xfs_inode {
 	xfs_agino_t		i_prev_unlinked;
 
 	xfs_fsize_t		i_size;		/* in-memory size */
+
+	/* incore inode cache state, see libxfs/inode.c */
+	pthread_mutex_t		i_load_lock;	/* held while reading in */
+	unsigned int		i_cache_flags;	/* XFS_ICACHE_* */
+
 	struct inode		i_vnode;
 } xfs_inode_t;
 
@@ -434,6 +439,10 @@ int libxfs_icreate(struct xfs_trans *tp, xfs_ino_t ino,
 extern int	libxfs_iget(struct xfs_mount *, struct xfs_trans *, xfs_ino_t,
 				uint, struct xfs_inode **);
 extern void	libxfs_irele(struct xfs_inode *ip);
+extern void	libxfs_icache_inval_buf(struct xfs_buf *bp);
+extern void	libxfs_icache_inval_inode(struct xfs_inode *ip);
+extern struct cache_operations	libxfs_icache_operations;
+extern int	libxfs_ihash_size;
 
 #define XFS_DEFAULT_COWEXTSZ_HINT	32
 
@@ -9,6 +9,7 @@
 
 #define	XFS_MD_MAGIC_V1		0x5846534d	/* 'XFSM' */
 #define	XFS_MD_MAGIC_V2		0x584D4432	/* 'XMD2' */
+#define	XFS_MD_MAGIC_V3		0x584D4433	/* 'XMD3' */
 
 /* Metadump v1 */
 typedef struct xfs_metablock {
@@ -50,7 +51,13 @@ struct xfs_metadump_header {
 	__be32		xmh_version;
 	__be32		xmh_compat_flags;
 	__be32		xmh_incompat_flags;
-	__be64		xmh_reserved;
+	/*
+	 * Delta dumps only: a random id shared by every dump in a delta chain,
+	 * and this dump's position in the chain, starting at one.  Both are
+	 * zero in full dumps.
+	 */
+	__be32		xmh_chain_id;
+	__be32		xmh_chain_seq;
 } __packed;
 
 /*
@@ -71,7 +78,15 @@ struct xfs_metadump_header {
 /* Dump contains realtime device contents. */
 #define XFS_MD2_INCOMPAT_RTDEVICE	(1U << 0)
 
-#define XFS_MD2_INCOMPAT_ALL		(XFS_MD2_INCOMPAT_RTDEVICE)
+/*
+ * Dump only contains the extents that changed since an earlier dump, and
+ * tombstones for extents that are no longer metadata.  It must be restored
+ * on top of the image that the earlier dump (and its deltas) produced.
+ */
+#define XFS_MD2_INCOMPAT_DELTA		(1U << 1)
+
+#define XFS_MD2_INCOMPAT_ALL		(XFS_MD2_INCOMPAT_RTDEVICE | \
+					 XFS_MD2_INCOMPAT_DELTA)
 
 struct xfs_meta_extent {
 	/*
@@ -80,6 +95,7 @@ struct xfs_meta_extent {
 	 * 00 - Data device
 	 * 01 - External log
 	 * 10 - Realtime device
+	 * The top bit marks a tombstone in a delta dump.
 	 */
 	__be64 xme_addr;
 	/* In units of 512 byte blocks */
@@ -99,4 +115,174 @@ struct xfs_meta_extent {
 
 #define XME_ADDR_DEVICE_MASK	(3ULL << XME_ADDR_DEVICE_SHIFT)
 
+/*
+ * The extent held metadata in the base of a delta dump but doesn't any more,
+ * and is zeroed when the delta is restored.  No data follows a tombstone.
+ */
+#define XME_ADDR_TOMBSTONE	(1ULL << 63)
+
+/*
+ * Metadump v3
+ *
+ * A v3 metadump carries the same records as v2, but the record stream is cut
+ * into chunks that are compressed independently of each other, so that they
+ * can be compressed and decompressed in parallel.  A record never straddles
+ * two chunks.  The header is the v2 header with the v3 magic, and all of the
+ * v2 header flags keep their meaning.
+ *
+ * |--------------------------------------|
+ * | struct xfs_metadump_header           |
+ * |--------------------------------------|
+ * | struct xfs_meta_chunk 0              |
+ * | Chunk 0's records, compressed        |
+ * | ...                                  |
+ * | struct xfs_meta_chunk (n-1)          |
+ * | Chunk (n-1)'s records, compressed    |
+ * |--------------------------------------|
+ * | struct xfs_meta_index                |
+ * | struct xfs_meta_index_rec 0          |
+ * | ...                                  |
+ * | struct xfs_meta_index_rec (n-1)      |
+ * |--------------------------------------|
+ * | struct xfs_meta_trailer              |
+ * |--------------------------------------|
+ *
+ * The index lets a reader that can seek find a chunk without decompressing
+ * everything in front of it.  A reader that can't seek just reads chunks until
+ * it finds the index.
+ */
+struct xfs_meta_chunk {
+	__be32		xmc_magic;
+	__be32		xmc_flags;
+	/* Length of the (compressed) records following this header */
+	__be32		xmc_len;
+	/* Length of the records once decompressed */
+	__be32		xmc_ulen;
+	/* crc32c of the decompressed records */
+	__be32		xmc_crc;
+	__be32		xmc_pad;
+} __packed;
+
+#define XFS_MD3_CHUNK_MAGIC	0x584D4443	/* 'XMDC' */
+
+/* Records are stored uncompressed. */
+#define XFS_MD3_CHUNK_RAW	(1U << 0)
+
+#define XFS_MD3_CHUNK_FLAGS_ALL	(XFS_MD3_CHUNK_RAW)
+
+/* Largest decompressed chunk that readers need to handle. */
+#define XFS_MD3_MAX_CHUNK_SIZE	(16U << 20)
+
+struct xfs_meta_index {
+	__be32		xmi_magic;
+	/* Number of xfs_meta_index_rec following this header */
+	__be32		xmi_count;
+	__be64		xmi_reserved;
+} __packed;
+
+#define XFS_MD3_INDEX_MAGIC	0x584D4449	/* 'XMDI' */
+
+struct xfs_meta_index_rec {
+	/* File offset of the chunk header */
+	__be64		xmir_offset;
+	/*
+	 * Lowest xme_addr and highest xme_addr + xme_len of the records in
+	 * the chunk, device bits included.
+	 */
+	__be64		xmir_low;
+	__be64		xmir_high;
+} __packed;
+
+struct xfs_meta_trailer {
+	/* File offset of the xfs_meta_index header */
+	__be64		xmt_index;
+	__be32		xmt_magic;
+	__be32		xmt_pad;
+} __packed;
+
+#define XFS_MD3_TRAILER_MAGIC	0x584D4454	/* 'XMDT' */
+
+/*
+ * Metadump block index
+ *
+ * A block index lists the address, length and crc32c of every extent in a
+ * v2 or v3 metadump, in dump order.  It is written to a file of its own, and
+ * lets a later dump of the same filesystem leave out the extents that haven't
+ * changed, producing a delta.  The index of a delta describes the whole image
+ * after the delta has been restored, so that it can be the base of the next
+ * delta in the chain.
+ *
+ * |----------------------------------|
+ * | struct xfs_meta_bindex           |
+ * |----------------------------------|
+ * | struct xfs_meta_bindex_rec 0     |
+ * | ...                              |
+ * | struct xfs_meta_bindex_rec (n-1) |
+ * |----------------------------------|
+ */
+struct xfs_meta_bindex {
+	__be32		xmb_magic;
+	__be32		xmb_version;
+	/*
+	 * Delta chain id and sequence number, as in xfs_metadump_header.  A
+	 * full dump starts a new chain at sequence zero, but only its index
+	 * records the chain id.
+	 */
+	__be32		xmb_chain_id;
+	__be32		xmb_chain_seq;
+	/* Filesystem that was dumped */
+	uuid_t		xmb_uuid;
+	/* Number of xfs_meta_bindex_rec following this header */
+	__be64		xmb_count;
+} __packed;
+
+#define XFS_MD_BINDEX_MAGIC	0x584D4249	/* 'XMBI' */
+#define XFS_MD_BINDEX_VERSION	1
+
+struct xfs_meta_bindex_rec {
+	/* Same as xme_addr and xme_len */
+	__be64		xmbr_addr;
+	__be32		xmbr_len;
+	/* crc32c of the extent's contents */
+	__be32		xmbr_crc;
+} __packed;
+
+/*
+ * Metadump extent map
+ *
+ * An extent map records where the data of every extent in a v2 or v3
+ * metadump can be found in the dump file, so that the blocks of a dump can
+ * be read in any order without restoring it first.  It is written to a file
+ * of its own.  Tombstones and delta dumps are not mapped.
+ *
+ * |-----------------------------------|
+ * | struct xfs_meta_emap              |
+ * |-----------------------------------|
+ * | struct xfs_meta_emap_rec 0        |
+ * | ...                               |
+ * | struct xfs_meta_emap_rec (n-1)    |
+ * |-----------------------------------|
+ */
+struct xfs_meta_emap {
+	__be32		xmem_magic;
+	__be32		xmem_version;
+	/* Size of the dump file, to catch a map that belongs to another dump */
+	__be64		xmem_dump_size;
+	/* Number of xfs_meta_emap_rec following this header */
+	__be64		xmem_count;
+} __packed;
+
+#define XFS_MD_EMAP_MAGIC	0x584D454D	/* 'XMEM' */
+#define XFS_MD_EMAP_VERSION	1
+
+struct xfs_meta_emap_rec {
+	/* Same as xme_addr and xme_len */
+	__be64		xmer_addr;
+	__be32		xmer_len;
+	/* v3: offset of the extent's data in the decompressed chunk */
+	__be32		xmer_chunk_off;
+	/* v2: file offset of the extent's data; v3: chunk number */
+	__be64		xmer_pos;
+} __packed;
+
 #endif /* _XFS_METADUMP_H_ */
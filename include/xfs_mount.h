@@ -102,6 +102,7 @@ typedef struct xfs_mount {
 	struct xfs_buftarg	*m_ddev_targp;
 	struct xfs_buftarg	*m_logdev_targp;
 	struct xfs_buftarg	*m_rtdev_targp;
+	struct cache		*m_icache;	/* incore inode cache */
 #define m_dev		m_ddev_targp
 #define m_logdev	m_logdev_targp
 #define m_rtdev		m_rtdev_targp
@@ -394,6 +395,7 @@ static inline int xfs_compare_freecounter(struct xfs_mount *mp,
 #define LIBXFS_MOUNT_REPORT_CORRUPTION	(1U << 1)
 
 #define LIBXFS_BHASHSIZE(sbp) 		(1<<10)
+#define LIBXFS_IHASHSIZE(sbp) 		(1<<9)
 
 void libxfs_compute_all_maxlevels(struct xfs_mount *mp);
 struct xfs_mount *libxfs_mount(struct xfs_mount *mp, struct xfs_sb *sb,
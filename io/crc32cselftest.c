@@ -6,11 +6,14 @@
 
 #include "platform_defs.h"
 #include "command.h"
+#include "input.h"
 #include "init.h"
 #include "io.h"
 #include "libfrog/crc32c.h"
 #include "libfrog/crc32cselftest.h"
 
+static cmdinfo_t crc32cbench_cmd;
+
 static int
 crc32cselftest_f(
 	int		argc,
@@ -30,8 +33,125 @@ static const cmdinfo_t	crc32cselftest_cmd = {
 	.oneline	= N_("self test of crc32c implementation"),
 };
 
+/* Checksum @len byte pieces of @buf until about @total bytes are done. */
+static void
+crc32cbench_run(
+	const struct crc32c_impl	*impl,
+	unsigned char			*buf,
+	size_t				len,
+	unsigned long long		total)
+{
+	unsigned long long		nr = max(1ULL, total / len);
+	unsigned long long		i;
+	struct timeval			t1, t2;
+	volatile uint32_t		crc = 0;
+	double				secs;
+
+	gettimeofday(&t1, NULL);
+	for (i = 0; i < nr; i++)
+		crc = impl->crc(crc, buf, len);
+	gettimeofday(&t2, NULL);
+
+	t2 = tsub(t2, t1);
+	secs = t2.tv_sec + t2.tv_usec / 1000000.0;
+	printf(_("%-9s %8zu bytes: %10.1f MiB/s\n"), impl->name, len,
+			secs > 0 ? nr * len / secs / 1048576.0 : 0.0);
+}
+
+static int
+crc32cbench_f(
+	int				argc,
+	char				**argv)
+{
+	static const size_t		sizes[] = { 512, 4096, 65536, 0 };
+	const struct crc32c_impl	*impl;
+	unsigned long long		total = 1ULL << 30;
+	unsigned char			*buf;
+	size_t				len = 0;
+	size_t				i;
+	int				c;
+
+	while ((c = getopt(argc, argv, "l:t:")) != EOF) {
+		switch (c) {
+		case 'l':
+			len = cvtnum(4096, 512, optarg);
+			if ((long long)len <= 0) {
+				exitcode = 1;
+				return command_usage(&crc32cbench_cmd);
+			}
+			break;
+		case 't':
+			total = cvtnum(4096, 512, optarg);
+			if ((long long)total <= 0) {
+				exitcode = 1;
+				return command_usage(&crc32cbench_cmd);
+			}
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&crc32cbench_cmd);
+		}
+	}
+	if (optind != argc) {
+		exitcode = 1;
+		return command_usage(&crc32cbench_cmd);
+	}
+
+	buf = malloc(len ? len : 65536);
+	if (!buf) {
+		perror("malloc");
+		exitcode = 1;
+		return 0;
+	}
+	for (i = 0; i < (len ? len : 65536); i++)
+		buf[i] = randbytes_test_buf[i % 4096];
+
+	printf(_("crc32c: using %s\n"), crc32c_impl_current()->name);
+	for (impl = crc32c_impls; impl->name; impl++) {
+		if (!crc32c_impl_usable(impl))
+			continue;
+		if (len) {
+			crc32cbench_run(impl, buf, len, total);
+			continue;
+		}
+		for (i = 0; sizes[i]; i++)
+			crc32cbench_run(impl, buf, sizes[i], total);
+	}
+
+	free(buf);
+	return 0;
+}
+
+static void
+crc32cbench_help(void)
+{
+	printf(_(
+"\n"
+" Measure the throughput of each crc32c implementation that this CPU can run.\n"
+"\n"
+" By default, 512 byte, 4k and 64k buffers are checksummed.\n"
+"\n"
+" -l len   -- Only checksum buffers of this length.\n"
+" -t total -- Checksum about this many bytes for each test (default 1g).\n"
+"\n"));
+}
+
+static cmdinfo_t crc32cbench_cmd = {
+	.name		= "crc32cbench",
+	.cfunc		= crc32cbench_f,
+	.argmin		= 0,
+	.argmax		= -1,
+	.canpush	= 0,
+	.args		= "[-l len] [-t total]",
+	.flags		= CMD_FLAG_ONESHOT | CMD_FLAG_FOREIGN_OK |
+			  CMD_NOFILE_OK | CMD_NOMAP_OK,
+	.oneline	= N_("benchmark the crc32c implementations"),
+	.help		= crc32cbench_help,
+};
+
 void
 crc32cselftest_init(void)
 {
 	add_command(&crc32cselftest_cmd);
+	add_command(&crc32cbench_cmd);
 }
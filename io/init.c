@@ -90,6 +90,7 @@ init_commands(void)
 	truncate_init();
 	utimes_init();
 	crc32cselftest_init();
+	wqbench_init();
 	exchangerange_init();
 	fsprops_init();
 }
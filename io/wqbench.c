@@ -0,0 +1,198 @@
+// SPDX-License-Identifier: GPL-2.0
+#include "platform_defs.h"
+#include "command.h"
+#include "input.h"
+#include "init.h"
+#include "io.h"
+#include "atomic.h"
+#include "libfrog/workqueue.h"
+
+static cmdinfo_t wqbench_cmd;
+
+struct wqbench {
+	unsigned long long	executed;
+	unsigned int		fanout;
+	unsigned int		spin;
+};
+
+/* Burn a few cycles so that the items aren't completely empty. */
+static void
+wqbench_spin(
+	uint32_t		index,
+	unsigned int		spin)
+{
+	volatile uint32_t	x = index;
+	unsigned int		i;
+
+	for (i = 0; i < spin; i++)
+		x = x * 2654435761U + i;
+}
+
+static void
+wqbench_leaf(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct wqbench		*wb = arg;
+
+	wqbench_spin(index, wb->spin);
+	uatomic_inc(&wb->executed);
+}
+
+/* Top level items queue more items from inside the workqueue. */
+static void
+wqbench_parent(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct wqbench		*wb = arg;
+	unsigned int		i;
+
+	for (i = 0; i < wb->fanout; i++) {
+		if (workqueue_add(wq, wqbench_leaf, index + i, wb))
+			break;
+	}
+	wqbench_leaf(wq, index, arg);
+}
+
+static int
+wqbench_run(
+	unsigned int		nr_threads,
+	unsigned long long	nr_items,
+	struct wqbench		*wb)
+{
+	struct workqueue	wq;
+	struct timeval		t1, t2;
+	unsigned long long	expected;
+	unsigned long long	i;
+	double			secs;
+	int			ret;
+
+	wb->executed = 0;
+	expected = nr_items * (wb->fanout + 1);
+
+	gettimeofday(&t1, NULL);
+	ret = -workqueue_create(&wq, NULL, nr_threads);
+	if (ret) {
+		errno = ret;
+		perror("workqueue_create");
+		return 1;
+	}
+	for (i = 0; i < nr_items; i++) {
+		ret = -workqueue_add(&wq, wb->fanout ? wqbench_parent :
+						       wqbench_leaf, i, wb);
+		if (ret) {
+			errno = ret;
+			perror("workqueue_add");
+			break;
+		}
+	}
+	ret = -workqueue_terminate(&wq);
+	if (ret) {
+		errno = ret;
+		perror("workqueue_terminate");
+	}
+	workqueue_destroy(&wq);
+	gettimeofday(&t2, NULL);
+
+	if (wb->executed != expected) {
+		fprintf(stderr, _("%u threads: ran %llu items, expected %llu\n"),
+				nr_threads, wb->executed, expected);
+		return 1;
+	}
+
+	t2 = tsub(t2, t1);
+	secs = t2.tv_sec + t2.tv_usec / 1000000.0;
+	printf(_("%3u threads: %llu items in %.3fs, %.0f items/sec\n"),
+			nr_threads, expected, secs,
+			secs > 0 ? tdiv(expected, t2) : 0.0);
+	return 0;
+}
+
+static int
+wqbench_f(
+	int			argc,
+	char			**argv)
+{
+	struct wqbench		wb = {
+		.fanout		= 0,
+		.spin		= 100,
+	};
+	unsigned long long	nr_items = 1000000;
+	unsigned int		max_threads = 64;
+	unsigned int		nr_threads;
+	int			c;
+
+	while ((c = getopt(argc, argv, "f:i:s:t:")) != EOF) {
+		switch (c) {
+		case 'f':
+			wb.fanout = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			nr_items = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			wb.spin = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			max_threads = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			exitcode = 1;
+			return command_usage(&wqbench_cmd);
+		}
+	}
+	if (optind != argc || !max_threads || !nr_items) {
+		exitcode = 1;
+		return command_usage(&wqbench_cmd);
+	}
+	if (wb.fanout)
+		nr_items = max(1ULL, nr_items / (wb.fanout + 1));
+
+	for (nr_threads = 1; nr_threads <= max_threads; nr_threads *= 2) {
+		if (wqbench_run(nr_threads, nr_items, &wb)) {
+			exitcode = 1;
+			return 0;
+		}
+	}
+	return 0;
+}
+
+static void
+wqbench_help(void)
+{
+	printf(_(
+"\n"
+" Measure how many work items per second the workqueue can run.\n"
+"\n"
+" The benchmark is repeated with 1, 2, 4, ... worker threads, up to the\n"
+" maximum given.\n"
+"\n"
+" -f fanout  -- Each item queued by this thread queues this many more items\n"
+"               from inside the workqueue.\n"
+" -i items   -- Run about this many items in total (default 1000000).\n"
+" -s spins   -- Make each item spin this many times (default 100).\n"
+" -t threads -- Maximum number of worker threads (default 64).\n"
+"\n"));
+}
+
+static cmdinfo_t wqbench_cmd = {
+	.name		= "wqbench",
+	.cfunc		= wqbench_f,
+	.argmin		= 0,
+	.argmax		= -1,
+	.canpush	= 0,
+	.args		= "[-f fanout] [-i items] [-s spins] [-t threads]",
+	.flags		= CMD_FLAG_ONESHOT | CMD_FLAG_FOREIGN_OK |
+			  CMD_NOFILE_OK | CMD_NOMAP_OK,
+	.oneline	= N_("benchmark the workqueue"),
+	.help		= wqbench_help,
+};
+
+void
+wqbench_init(void)
+{
+	add_command(&wqbench_cmd);
+}
@@ -26,7 +26,8 @@
  * lifted from the 3.8-rc2 kernel source for xfsprogs. Killed CONFIG_X86
  * specific bits for just the generic algorithm. Also removed the big endian
  * version of the algorithm as XFS only uses the little endian CRC version to
- * match the hardware acceleration available on Intel CPUs.
+ * match the hardware acceleration available on Intel CPUs.  The hardware
+ * accelerated versions live in crc32c.c, which falls back to this one.
  */
 
 /*
@@ -175,12 +176,12 @@ static inline u32 __pure crc32_le_generic(u32 crc, unsigned char const *p,
 }
 
 #if CRC_LE_BITS == 1
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+u32 __pure crc32c_le_generic(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len, NULL, CRC32C_POLY_LE);
 }
 #else
-u32 __pure crc32c_le(u32 crc, unsigned char const *p, size_t len)
+u32 __pure crc32c_le_generic(u32 crc, unsigned char const *p, size_t len)
 {
 	return crc32_le_generic(crc, p, len,
 			(const u32 (*)[256])crc32ctable_le, CRC32C_POLY_LE);
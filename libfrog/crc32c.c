@@ -0,0 +1,285 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Do not include platform_defs.h here, for the same reason as crc32.c.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include "crc32defs.h"
+#include "crc32c.h"
+
+/*
+ * CRC32c Dispatch
+ * ===============
+ *
+ * Every metadata block that the tools read or write is checksummed, so crc32c
+ * shows up near the top of the profile for repair, metadump and mkfs.  Modern
+ * x86 CPUs can compute crc32c directly with the SSE4.2 crc32 instruction, so
+ * we pick the fastest implementation that the CPU supports when the program
+ * starts, and fall back to the slicing-by-8 tables in crc32.c elsewhere.
+ *
+ * The crc32 instruction has a latency of three cycles but can start a new
+ * one every cycle, so a single dependent chain of them runs at a third of the
+ * speed the CPU is capable of.  For larger buffers we therefore split the
+ * input into three blocks, checksum them in parallel, and then fold the three
+ * results into one.  Folding multiplies each partial crc by x^(8 * n) modulo
+ * the crc polynomial, where n is the number of bytes that follow it, which
+ * takes a single carryless multiply (PCLMULQDQ) and one more crc32.
+ *
+ * The LIBXFS_CRC32C environment variable can name a specific implementation
+ * for debugging.
+ */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+# define CRC32C_X86
+# include <immintrin.h>
+#endif
+
+#ifdef CRC32C_X86
+
+/*
+ * Sizes of the three interleaved blocks.  The long blocks cover a 4k buffer
+ * with only 16 bytes left over, and the short ones a 512 byte sector with 8.
+ */
+#define CRC32C_LONG_BLOCK	1360
+#define CRC32C_SHORT_BLOCK	168
+
+/*
+ * Multiplying constants for folding a crc over one and two blocks of each
+ * size.  See crc32c_x86_init for how they are derived.
+ */
+static uint32_t		crc32c_long_k1, crc32c_long_k2;
+static uint32_t		crc32c_short_k1, crc32c_short_k2;
+
+static inline uint64_t
+crc32c_load64(
+	const unsigned char	*p)
+{
+	uint64_t		v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint32_t __attribute__((target("sse4.2")))
+crc32c_sse42_tail(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	uint64_t		c = crc;
+
+	while (len >= 8) {
+		c = _mm_crc32_u64(c, crc32c_load64(p));
+		p += 8;
+		len -= 8;
+	}
+	crc = c;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+/* One crc32 instruction after another. */
+static uint32_t __attribute__((target("sse4.2")))
+crc32c_le_sse42(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	return crc32c_sse42_tail(crc, p, len);
+}
+
+static bool
+crc32c_sse42_usable(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+
+/*
+ * Compute the crc of @crc followed by n zero bytes, where @k is the
+ * precomputed constant for n.
+ */
+static inline uint32_t __attribute__((target("sse4.2,pclmul")))
+crc32c_shift(
+	uint32_t		crc,
+	uint32_t		k)
+{
+	__m128i			prod;
+
+	prod = _mm_clmulepi64_si128(_mm_cvtsi32_si128(crc),
+			_mm_cvtsi32_si128(k), 0);
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(prod));
+}
+
+/*
+ * Checksum three consecutive blocks of @blk bytes in parallel, and fold the
+ * results together.
+ */
+static inline uint32_t __attribute__((target("sse4.2,pclmul")))
+crc32c_x3_blocks(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			blk,
+	uint32_t		k1,
+	uint32_t		k2)
+{
+	uint64_t		c0 = crc, c1 = 0, c2 = 0;
+	size_t			i;
+
+	for (i = 0; i < blk; i += 8) {
+		c0 = _mm_crc32_u64(c0, crc32c_load64(p + i));
+		c1 = _mm_crc32_u64(c1, crc32c_load64(p + blk + i));
+		c2 = _mm_crc32_u64(c2, crc32c_load64(p + 2 * blk + i));
+	}
+
+	return crc32c_shift(c0, k2) ^ crc32c_shift(c1, k1) ^ c2;
+}
+
+/* Three interleaved streams of crc32 instructions, folded with PCLMUL. */
+static uint32_t __attribute__((target("sse4.2,pclmul")))
+crc32c_le_sse42x3(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	while (len >= 3 * CRC32C_LONG_BLOCK) {
+		crc = crc32c_x3_blocks(crc, p, CRC32C_LONG_BLOCK,
+				crc32c_long_k1, crc32c_long_k2);
+		p += 3 * CRC32C_LONG_BLOCK;
+		len -= 3 * CRC32C_LONG_BLOCK;
+	}
+	while (len >= 3 * CRC32C_SHORT_BLOCK) {
+		crc = crc32c_x3_blocks(crc, p, CRC32C_SHORT_BLOCK,
+				crc32c_short_k1, crc32c_short_k2);
+		p += 3 * CRC32C_SHORT_BLOCK;
+		len -= 3 * CRC32C_SHORT_BLOCK;
+	}
+	return crc32c_sse42_tail(crc, p, len);
+}
+
+static bool
+crc32c_sse42x3_usable(void)
+{
+	return __builtin_cpu_supports("sse4.2") &&
+	       __builtin_cpu_supports("pclmul");
+}
+
+/*
+ * x^n mod P, bit reflected like the crcs themselves, so that the most
+ * significant bit holds the coefficient of x^0.
+ */
+static uint32_t
+crc32c_xpow(
+	unsigned int		n)
+{
+	uint32_t		v = 1U << 31;
+
+	while (n--)
+		v = (v >> 1) ^ ((v & 1) ? CRC32C_POLY_LE : 0);
+	return v;
+}
+
+/*
+ * crc32(0, d) computes d * x^32 mod P, and the 64-bit product of two
+ * reflected 32-bit values comes out multiplied by an extra x.  Shifting a
+ * crc over n bytes therefore needs k = x^(8n - 33) mod P.
+ */
+static void
+crc32c_x86_init(void)
+{
+	crc32c_long_k1 = crc32c_xpow(8 * CRC32C_LONG_BLOCK - 33);
+	crc32c_long_k2 = crc32c_xpow(16 * CRC32C_LONG_BLOCK - 33);
+	crc32c_short_k1 = crc32c_xpow(8 * CRC32C_SHORT_BLOCK - 33);
+	crc32c_short_k2 = crc32c_xpow(16 * CRC32C_SHORT_BLOCK - 33);
+}
+#endif /* CRC32C_X86 */
+
+const struct crc32c_impl crc32c_impls[] = {
+#ifdef CRC32C_X86
+	{
+		.name		= "sse4.2x3",
+		.crc		= crc32c_le_sse42x3,
+		.usable		= crc32c_sse42x3_usable,
+	},
+	{
+		.name		= "sse4.2",
+		.crc		= crc32c_le_sse42,
+		.usable		= crc32c_sse42_usable,
+	},
+#endif
+	{
+		.name		= "table",
+		.crc		= crc32c_le_generic,
+	},
+	{ NULL },
+};
+
+/* Until the constructor runs, use the implementation that always works. */
+static const struct crc32c_impl	*crc32c_current;
+static crc32c_fn		crc32c_fast = crc32c_le_generic;
+
+/* Look up an implementation by name. */
+const struct crc32c_impl *
+crc32c_impl_find(
+	const char			*name)
+{
+	const struct crc32c_impl	*impl;
+
+	for (impl = crc32c_impls; impl->name; impl++) {
+		if (!strcmp(impl->name, name))
+			return impl;
+	}
+	return NULL;
+}
+
+const struct crc32c_impl *
+crc32c_impl_current(void)
+{
+	if (!crc32c_current)
+		return crc32c_impl_find("table");
+	return crc32c_current;
+}
+
+static void __attribute__((constructor))
+crc32c_init(void)
+{
+	const struct crc32c_impl	*impl;
+	char				*p;
+
+#ifdef CRC32C_X86
+	__builtin_cpu_init();
+	crc32c_x86_init();
+#endif
+
+	for (impl = crc32c_impls; impl->name; impl++) {
+		if (crc32c_impl_usable(impl))
+			break;
+	}
+
+	p = getenv("LIBXFS_CRC32C");
+	if (p && *p) {
+		const struct crc32c_impl	*want = crc32c_impl_find(p);
+
+		if (want && crc32c_impl_usable(want))
+			impl = want;
+		else
+			fprintf(stderr,
+	"crc32c: cannot use implementation \"%s\", using \"%s\"\n",
+				p, impl->name);
+	}
+
+	crc32c_current = impl;
+	crc32c_fast = impl->crc;
+}
+
+uint32_t
+crc32c_le(
+	uint32_t		crc,
+	unsigned char const	*p,
+	size_t			len)
+{
+	return crc32c_fast(crc, p, len);
+}
@@ -6,6 +6,39 @@
 #ifndef __LIBFROG_CRC32C_H__
 #define __LIBFROG_CRC32C_H__
 
+#include <stdbool.h>
+
+typedef uint32_t (*crc32c_fn)(uint32_t crc, unsigned char const *p,
+		size_t len);
+
+/*
+ * One way of computing crc32c.  @usable returns false if this CPU lacks the
+ * instructions that @crc needs; it is NULL for the portable implementation.
+ */
+struct crc32c_impl {
+	const char		*name;
+	crc32c_fn		crc;
+	bool			(*usable)(void);
+};
+
+/* All implementations, best first, ending with an entry with a NULL name. */
+extern const struct crc32c_impl crc32c_impls[];
+
+const struct crc32c_impl *crc32c_impl_find(const char *name);
+const struct crc32c_impl *crc32c_impl_current(void);
+
+static inline bool
+crc32c_impl_usable(
+	const struct crc32c_impl	*impl)
+{
+	return !impl->usable || impl->usable();
+}
+
+/* table driven implementation, which works everywhere */
+extern uint32_t crc32c_le_generic(uint32_t crc, unsigned char const *p,
+		size_t len);
+
+/* dispatches to the best implementation for this CPU */
 extern uint32_t crc32c_le(uint32_t crc, unsigned char const *p, size_t len);
 
 #endif /* __LIBFROG_CRC32C_H__ */
@@ -31,6 +31,7 @@
 
 /* This is just the crc32 self test bits from crc32.c. */
 #include "libfrog/randbytes.h"
+#include "libfrog/crc32c.h"
 
 #ifndef __LIBFROG_CRC32CSELFTEST_H__
 #define __LIBFROG_CRC32CSELFTEST_H__
@@ -148,32 +149,55 @@ static struct crc_test {
 /* Don't print anything to stdout. */
 #define CRC32CTEST_QUIET	(1U << 0)
 
+/*
+ * Check that @impl produces the same results as the table driven code over
+ * buffers long enough for every code path in the accelerated versions.
+ */
 static int
-crc32c_test(
-	unsigned int	flags)
+crc32c_test_long(
+	const struct crc32c_impl	*impl)
+{
+	unsigned int			start, len;
+	int				errors = 0;
+
+	for (start = 0; start < 8; start++) {
+		for (len = 0; len + start <= 4096; len += 255) {
+			if (impl->crc(~0U, randbytes_test_buf + start, len) !=
+			    crc32c_le_generic(~0U, randbytes_test_buf + start,
+					len))
+				errors++;
+		}
+	}
+	return errors;
+}
+
+static int
+crc32c_test_impl(
+	const struct crc32c_impl	*impl,
+	unsigned int			flags)
 {
-	int		i;
-	int		errors = 0;
-	int		bytes = 0;
-	struct timeval	start, stop;
-	uint64_t	usec;
+	int				i;
+	int				errors = 0;
+	int				bytes = 0;
+	struct timeval			start, stop;
+	uint64_t			usec;
 
 	/* keep static to prevent cache warming code from
 	 * getting eliminated by the compiler */
-	static uint32_t	crc;
+	static uint32_t			crc;
 
 	/* pre-warm the cache */
 	for (i = 0; i < 100; i++) {
 		bytes += 2 * crc_tests[i].length;
 
-		crc ^= crc32c_le(crc_tests[i].crc,
+		crc ^= impl->crc(crc_tests[i].crc,
 				randbytes_test_buf + crc_tests[i].start,
 				crc_tests[i].length);
 	}
 
 	gettimeofday(&start, NULL);
 	for (i = 0; i < 100; i++) {
-		crc = crc32c_le(crc_tests[i].crc,
+		crc = impl->crc(crc_tests[i].crc,
 				randbytes_test_buf + crc_tests[i].start,
 				crc_tests[i].length);
 		if (crc != crc_tests[i].crc32c_le)
@@ -181,6 +205,8 @@ crc32c_test(
 	}
 	gettimeofday(&stop, NULL);
 
+	errors += crc32c_test_long(impl);
+
 	usec = stop.tv_usec - start.tv_usec +
 		1000000 * (stop.tv_sec - start.tv_sec);
 
@@ -188,13 +214,28 @@ crc32c_test(
 		return errors;
 
 	if (errors)
-		printf("crc32c: %d self tests failed\n", errors);
+		printf("crc32c: %s: %d self tests failed\n", impl->name, errors);
 	else {
-		printf("crc32c: tests passed, %d bytes in %" PRIu64 " usec\n",
-			bytes, usec);
+		printf("crc32c: %s: tests passed, %d bytes in %" PRIu64 " usec\n",
+			impl->name, bytes, usec);
 	}
 
 	return errors;
 }
 
+/* Test every implementation that this CPU can run. */
+static int
+crc32c_test(
+	unsigned int			flags)
+{
+	const struct crc32c_impl	*impl;
+	int				errors = 0;
+
+	for (impl = crc32c_impls; impl->name; impl++) {
+		if (crc32c_impl_usable(impl))
+			errors += crc32c_test_impl(impl, flags);
+	}
+	return errors;
+}
+
 #endif /* __LIBFROG_CRC32CSELFTEST_H__ */
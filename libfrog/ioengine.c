@@ -0,0 +1,499 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "platform_defs.h"
+#include "ioengine.h"
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+ * I/O Engines
+ * ===========
+ *
+ * An I/O engine services batches of vectored read or write requests.  The
+ * synchronous engine issues one preadv/pwritev per request, exactly as the
+ * tools always have.  The io_uring engine pushes the whole batch into a
+ * submission ring at once and then reaps the completions, so the device sees
+ * the entire batch at once instead of one request at a time.
+ *
+ * Rings are per-thread so that the many I/O threads in xfs_repair and
+ * xfs_scrub never contend on a shared submission queue.  A thread that cannot
+ * set up a ring (old kernel, io_uring disabled by sysctl or seccomp) silently
+ * falls back to synchronous I/O.
+ */
+
+/* Synchronous engine */
+
+static int
+sync_io(
+	int			fd,
+	struct io_req		*req,
+	bool			write)
+{
+	ssize_t			sts;
+
+	if (write)
+		sts = pwritev(fd, req->iov, req->iovcnt, req->offset);
+	else
+		sts = preadv(fd, req->iov, req->iovcnt, req->offset);
+	if (sts < 0)
+		req->error = -errno;
+	else if ((size_t)sts != io_req_len(req))
+		req->error = -EIO;
+	else
+		req->error = 0;
+	return req->error;
+}
+
+static int
+sync_batch(
+	int			fd,
+	struct io_req		*reqs,
+	unsigned int		nr,
+	bool			write)
+{
+	unsigned int		i;
+	int			error = 0;
+
+	for (i = 0; i < nr; i++) {
+		sync_io(fd, &reqs[i], write);
+		if (!error)
+			error = reqs[i].error;
+	}
+	return error;
+}
+
+static int
+sync_readv(
+	int			fd,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	return sync_batch(fd, reqs, nr, false);
+}
+
+static int
+sync_writev(
+	int			fd,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	return sync_batch(fd, reqs, nr, true);
+}
+
+static const struct ioengine sync_ioengine = {
+	.name		= "pread",
+	.readv		= sync_readv,
+	.writev		= sync_writev,
+};
+
+#ifdef HAVE_IO_URING
+
+/* Number of submission queue entries in each per-thread ring. */
+#define URING_DEPTH		64
+
+struct uring {
+	int			fd;
+	unsigned int		depth;
+
+	/* submission queue */
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	unsigned int		*sq_tail;
+	unsigned int		*sq_mask;
+	unsigned int		*sq_array;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_sz;
+
+	/* completion queue */
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		*cq_mask;
+	struct io_uring_cqe	*cqes;
+};
+
+/* Marks a thread that could not set up a ring. */
+#define URING_UNAVAILABLE	((struct uring *)-1UL)
+
+/* Request status while the request is still owned by the ring. */
+#define URING_PENDING		1
+
+/* user_data of the cancellations issued when a ring breaks. */
+#define URING_CANCEL		(~0ULL)
+
+static pthread_key_t		uring_key;
+static pthread_once_t		uring_once = PTHREAD_ONCE_INIT;
+
+static void
+uring_free(
+	struct uring		*ur)
+{
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqes_sz);
+	if (ur->cq_ring && ur->cq_ring != ur->sq_ring)
+		munmap(ur->cq_ring, ur->cq_ring_sz);
+	if (ur->sq_ring)
+		munmap(ur->sq_ring, ur->sq_ring_sz);
+	if (ur->fd >= 0)
+		close(ur->fd);
+	free(ur);
+}
+
+static void
+uring_destructor(
+	void			*p)
+{
+	if (p && p != URING_UNAVAILABLE)
+		uring_free(p);
+}
+
+static void
+uring_key_init(void)
+{
+	pthread_key_create(&uring_key, uring_destructor);
+}
+
+static struct uring *
+uring_setup(void)
+{
+	struct io_uring_params	p = { 0 };
+	struct uring		*ur;
+	void			*ring;
+
+	ur = calloc(1, sizeof(*ur));
+	if (!ur)
+		return NULL;
+
+	ur->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+	if (ur->fd < 0)
+		goto out_free;
+	ur->depth = p.sq_entries;
+
+	ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->cq_ring_sz = p.cq_off.cqes +
+			 p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ur->sq_ring_sz = ur->cq_ring_sz = max(ur->sq_ring_sz,
+						      ur->cq_ring_sz);
+
+	ring = mmap(NULL, ur->sq_ring_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ring == MAP_FAILED)
+		goto out_free;
+	ur->sq_ring = ring;
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ur->cq_ring = ur->sq_ring;
+	} else {
+		ring = mmap(NULL, ur->cq_ring_sz, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, ur->fd,
+				IORING_OFF_CQ_RING);
+		if (ring == MAP_FAILED)
+			goto out_free;
+		ur->cq_ring = ring;
+	}
+
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ring == MAP_FAILED)
+		goto out_free;
+	ur->sqes = ring;
+
+	ur->sq_tail = ur->sq_ring + p.sq_off.tail;
+	ur->sq_mask = ur->sq_ring + p.sq_off.ring_mask;
+	ur->sq_array = ur->sq_ring + p.sq_off.array;
+	ur->cq_head = ur->cq_ring + p.cq_off.head;
+	ur->cq_tail = ur->cq_ring + p.cq_off.tail;
+	ur->cq_mask = ur->cq_ring + p.cq_off.ring_mask;
+	ur->cqes = ur->cq_ring + p.cq_off.cqes;
+	return ur;
+
+out_free:
+	uring_free(ur);
+	return NULL;
+}
+
+/* Find this thread's ring, creating it if necessary. */
+static struct uring *
+uring_get(void)
+{
+	struct uring		*ur;
+
+	pthread_once(&uring_once, uring_key_init);
+
+	ur = pthread_getspecific(uring_key);
+	if (ur == URING_UNAVAILABLE)
+		return NULL;
+	if (ur)
+		return ur;
+
+	ur = uring_setup();
+	pthread_setspecific(uring_key, ur ? ur : URING_UNAVAILABLE);
+	return ur;
+}
+
+static inline void
+uring_prep(
+	struct uring		*ur,
+	int			fd,
+	struct io_req		*req,
+	unsigned int		idx,
+	bool			write)
+{
+	unsigned int		tail = *ur->sq_tail;
+	unsigned int		slot = tail & *ur->sq_mask;
+	struct io_uring_sqe	*sqe = &ur->sqes[slot];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe->fd = fd;
+	sqe->off = req->offset;
+	sqe->addr = (unsigned long)req->iov;
+	sqe->len = req->iovcnt;
+	sqe->user_data = idx;
+	ur->sq_array[slot] = slot;
+
+	/* Publish the sqe contents before the new tail. */
+	cmm_smp_mb();
+	uatomic_set(ur->sq_tail, tail + 1);
+}
+
+/* Reap all available completions; returns the number reaped. */
+static unsigned int
+uring_reap(
+	struct uring		*ur,
+	struct io_req		*reqs)
+{
+	unsigned int		head = *ur->cq_head;
+	unsigned int		nr = 0;
+
+	while (head != uatomic_read(ur->cq_tail)) {
+		struct io_uring_cqe	*cqe;
+		struct io_req		*req;
+
+		cmm_smp_mb();
+		cqe = &ur->cqes[head & *ur->cq_mask];
+		head++;
+		if (cqe->user_data == URING_CANCEL)
+			continue;
+
+		req = &reqs[cqe->user_data];
+		if (cqe->res < 0)
+			req->error = cqe->res;
+		else if ((size_t)cqe->res != io_req_len(req))
+			req->error = -EIO;
+		else
+			req->error = 0;
+		nr++;
+	}
+
+	cmm_smp_mb();
+	uatomic_set(ur->cq_head, head);
+	return nr;
+}
+
+/*
+ * The ring stopped taking requests in the middle of a batch.  Take back the
+ * requests that the kernel has not seen yet, ask it to cancel the ones it
+ * has, and wait for every one of those to complete, so that none of them
+ * can touch the caller's buffers after we return.
+ */
+static void
+uring_drain(
+	struct uring		*ur,
+	struct io_req		*reqs,
+	unsigned int		queued,
+	unsigned int		pending,
+	unsigned int		done)
+{
+	unsigned int		inflight = queued - pending - done;
+	unsigned int		nr_cancel = 0;
+	unsigned int		i;
+	int			ret;
+
+	uatomic_set(ur->sq_tail, *ur->sq_tail - pending);
+	queued -= pending;
+
+	for (i = 0; i < queued; i++) {
+		unsigned int		tail = *ur->sq_tail;
+		unsigned int		slot = tail & *ur->sq_mask;
+		struct io_uring_sqe	*sqe = &ur->sqes[slot];
+
+		if (reqs[i].error != URING_PENDING)
+			continue;
+
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->addr = i;
+		sqe->user_data = URING_CANCEL;
+		ur->sq_array[slot] = slot;
+		cmm_smp_mb();
+		uatomic_set(ur->sq_tail, tail + 1);
+		nr_cancel++;
+	}
+
+	/*
+	 * Completions land in the ring whether or not we can enter it, so if
+	 * even waiting fails, watch the completion queue until they're in.
+	 */
+	while (inflight > 0) {
+		ret = syscall(__NR_io_uring_enter, ur->fd, nr_cancel, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret > 0)
+			nr_cancel -= min_t(unsigned int, ret, nr_cancel);
+		else if (ret < 0 && errno != EINTR && errno != EAGAIN &&
+			 errno != EBUSY)
+			usleep(1000);
+		inflight -= uring_reap(ur, reqs);
+	}
+}
+
+static int
+uring_batch(
+	int			fd,
+	struct io_req		*reqs,
+	unsigned int		nr,
+	bool			write)
+{
+	struct uring		*ur;
+	unsigned int		queued = 0;
+	unsigned int		pending = 0;
+	unsigned int		done = 0;
+	unsigned int		i;
+	int			error = 0;
+
+	/* A lone request gains nothing from the ring. */
+	if (nr == 1)
+		return sync_io(fd, reqs, write);
+
+	ur = uring_get();
+	if (!ur)
+		return sync_batch(fd, reqs, nr, write);
+
+	for (i = 0; i < nr; i++)
+		reqs[i].error = URING_PENDING;
+
+	while (done < nr) {
+		int		ret;
+
+		while (queued < nr && queued - done < ur->depth) {
+			uring_prep(ur, fd, &reqs[queued], queued, write);
+			queued++;
+			pending++;
+		}
+
+		ret = syscall(__NR_io_uring_enter, ur->fd, pending, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if (errno != EINTR && errno != EAGAIN &&
+			    errno != EBUSY)
+				goto out_broken;
+			ret = 0;
+		}
+		pending -= ret;
+		done += uring_reap(ur, reqs);
+	}
+
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].error && !error)
+			error = reqs[i].error;
+	}
+	return error;
+
+out_broken:
+	/*
+	 * The ring stopped working.  Once nothing is left in flight, tear it
+	 * down, switch this thread over to synchronous I/O, and redo every
+	 * request that did not succeed in the ring.
+	 */
+	uring_drain(ur, reqs, queued, pending, done);
+	uring_free(ur);
+	pthread_setspecific(uring_key, URING_UNAVAILABLE);
+
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].error)
+			sync_io(fd, &reqs[i], write);
+		if (reqs[i].error && !error)
+			error = reqs[i].error;
+	}
+	return error;
+}
+
+static int
+uring_readv(
+	int			fd,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	return uring_batch(fd, reqs, nr, false);
+}
+
+static int
+uring_writev(
+	int			fd,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	return uring_batch(fd, reqs, nr, true);
+}
+
+static const struct ioengine uring_ioengine = {
+	.name		= "io_uring",
+	.readv		= uring_readv,
+	.writev		= uring_writev,
+};
+#endif /* HAVE_IO_URING */
+
+/* Available engines, best first. */
+static const struct ioengine *ioengines[] = {
+#ifdef HAVE_IO_URING
+	&uring_ioengine,
+#endif
+	&sync_ioengine,
+	NULL,
+};
+
+/* Look up an engine by name. */
+const struct ioengine *
+ioengine_find(
+	const char		*name)
+{
+	const struct ioengine	**e;
+
+	for (e = ioengines; *e; e++) {
+		if (!strcmp((*e)->name, name))
+			return *e;
+	}
+	return NULL;
+}
+
+const struct ioengine *
+ioengine_default(void)
+{
+	return ioengines[0];
+}
+
+/*
+ * Release the calling thread's engine state.  Worker threads get this for
+ * free when they exit; the main thread should call this before it exits.
+ */
+void
+ioengine_thread_exit(void)
+{
+#ifdef HAVE_IO_URING
+	pthread_once(&uring_once, uring_key_init);
+	uring_destructor(pthread_getspecific(uring_key));
+	pthread_setspecific(uring_key, NULL);
+#endif
+}
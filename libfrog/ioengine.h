@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __LIBFROG_IOENGINE_H__
+#define __LIBFROG_IOENGINE_H__
+
+#include <sys/uio.h>
+
+/*
+ * A single I/O request.  The request covers one contiguous range of a file
+ * starting at @offset, but the memory side may be scattered over @iovcnt
+ * segments.  The engine sets @error to zero or a negative errno once the
+ * request has completed; a short transfer is reported as -EIO.
+ */
+struct io_req {
+	off_t			offset;
+	struct iovec		*iov;
+	int			iovcnt;
+	int			error;
+};
+
+/*
+ * I/O engines move data between memory and a file.  Each method takes a batch
+ * of requests, submits as many of them at once as it can, and waits for all
+ * of them to complete before returning.  The return value is zero if every
+ * request succeeded, or the error of the first request that failed.
+ */
+struct ioengine {
+	const char		*name;
+	int			(*readv)(int fd, struct io_req *reqs,
+					 unsigned int nr);
+	int			(*writev)(int fd, struct io_req *reqs,
+					  unsigned int nr);
+};
+
+const struct ioengine *ioengine_find(const char *name);
+const struct ioengine *ioengine_default(void);
+void ioengine_thread_exit(void);
+
+static inline size_t
+io_req_len(
+	const struct io_req	*req)
+{
+	size_t			len = 0;
+	int			i;
+
+	for (i = 0; i < req->iovcnt; i++)
+		len += req->iov[i].iov_len;
+	return len;
+}
+
+#endif /* __LIBFROG_IOENGINE_H__ */
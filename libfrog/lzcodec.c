@@ -0,0 +1,292 @@
+// SPDX-License-Identifier: GPL-2.0
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "platform_defs.h"
+#include "lzcodec.h"
+
+/*
+ * LZ Codec
+ * ========
+ *
+ * A small LZ77 compressor for metadata images, so that they can be compressed
+ * without pulling in an external library.  Metadata blocks are mostly zeroes,
+ * repeated headers and runs of similar records, which a greedy matcher with a
+ * single hash probe handles well at memory bandwidth speeds.
+ *
+ * The compressed stream is a series of sequences.  Each sequence starts with a
+ * token byte: the high nibble is the literal run length and the low nibble is
+ * the match length minus LZ_MIN_MATCH.  A nibble of 15 means that the length
+ * continues in the following bytes, each of which is added to it until one is
+ * less than 255.  The literal bytes come next, then a two byte little endian
+ * match offset and the match length continuation.  The final sequence has
+ * only literals, and ends the stream.
+ *
+ * Matches may overlap the bytes that they produce, which is how long runs of
+ * a single byte are encoded.
+ */
+
+#define LZ_MIN_MATCH	4
+#define LZ_MAX_OFFSET	65535
+#define LZ_HASH_BITS	14
+#define LZ_RUN_MASK	15
+
+/* Give up on a match search sooner the longer we go without one. */
+#define LZ_SKIP_SHIFT	6
+
+static inline uint32_t
+lz_read32(
+	const uint8_t	*p)
+{
+	uint32_t	v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline unsigned int
+lz_hash(
+	uint32_t	v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Length of the common prefix of @a and @b, looking no further than @end. */
+static inline size_t
+lz_match_len(
+	const uint8_t	*a,
+	const uint8_t	*b,
+	const uint8_t	*end)
+{
+	const uint8_t	*start = b;
+
+	while (b + sizeof(uint64_t) <= end) {
+		uint64_t	x, y;
+
+		memcpy(&x, a, sizeof(x));
+		memcpy(&y, b, sizeof(y));
+		if (x != y) {
+			while (*a == *b) {
+				a++;
+				b++;
+			}
+			return b - start;
+		}
+		a += sizeof(x);
+		b += sizeof(y);
+	}
+	while (b < end && *a == *b) {
+		a++;
+		b++;
+	}
+	return b - start;
+}
+
+/* Write the continuation bytes of a length that didn't fit in its nibble. */
+static inline uint8_t *
+lz_put_len(
+	uint8_t		*op,
+	const uint8_t	*oend,
+	size_t		len)
+{
+	if (op + len / 255 + 1 > oend)
+		return NULL;
+	while (len >= 255) {
+		*op++ = 255;
+		len -= 255;
+	}
+	*op++ = len;
+	return op;
+}
+
+static uint8_t *
+lz_put_sequence(
+	uint8_t		*op,
+	const uint8_t	*oend,
+	const uint8_t	*lit,
+	size_t		lit_len,
+	unsigned int	offset,
+	size_t		match_len)
+{
+	uint8_t		*token = op;
+
+	if (op >= oend)
+		return NULL;
+	op++;
+
+	if (lit_len >= LZ_RUN_MASK) {
+		*token = LZ_RUN_MASK << 4;
+		op = lz_put_len(op, oend, lit_len - LZ_RUN_MASK);
+		if (!op)
+			return NULL;
+	} else {
+		*token = lit_len << 4;
+	}
+	if (op + lit_len > oend)
+		return NULL;
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+
+	/* the last sequence has no match */
+	if (!match_len)
+		return op;
+
+	if (op + 2 > oend)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+
+	match_len -= LZ_MIN_MATCH;
+	if (match_len >= LZ_RUN_MASK) {
+		*token |= LZ_RUN_MASK;
+		op = lz_put_len(op, oend, match_len - LZ_RUN_MASK);
+	} else {
+		*token |= match_len;
+	}
+	return op;
+}
+
+/*
+ * Compress @src_len bytes from @src into @dst.  Returns the compressed length,
+ * or -1 if the result does not fit in @dst_len bytes.
+ */
+ssize_t
+lz_compress(
+	const void	*src,
+	size_t		src_len,
+	void		*dst,
+	size_t		dst_len)
+{
+	uint32_t	table[1U << LZ_HASH_BITS];
+	const uint8_t	*base = src;
+	const uint8_t	*ip = base;
+	const uint8_t	*anchor = base;
+	const uint8_t	*iend = base + src_len;
+	uint8_t		*op = dst;
+	const uint8_t	*oend = op + dst_len;
+	unsigned int	misses = 0;
+
+	/* Table entries are offsets plus one so that zero means empty. */
+	memset(table, 0, sizeof(table));
+
+	while (ip + LZ_MIN_MATCH <= iend) {
+		uint32_t	seq = lz_read32(ip);
+		unsigned int	h = lz_hash(seq);
+		uint32_t	cand = table[h];
+		const uint8_t	*ref = base + cand - 1;
+		size_t		len;
+
+		table[h] = ip - base + 1;
+		if (!cand || ip - ref > LZ_MAX_OFFSET ||
+		    lz_read32(ref) != seq) {
+			ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		len = LZ_MIN_MATCH + lz_match_len(ref + LZ_MIN_MATCH,
+				ip + LZ_MIN_MATCH, iend);
+		op = lz_put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+				len);
+		if (!op)
+			return -1;
+
+		ip += len;
+		anchor = ip;
+		misses = 0;
+
+		/* Seed the table with the end of the match. */
+		if (ip - 2 >= base && ip + 2 <= iend)
+			table[lz_hash(lz_read32(ip - 2))] = ip - 2 - base + 1;
+	}
+
+	op = lz_put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return -1;
+	return op - (uint8_t *)dst;
+}
+
+/* Read the continuation bytes of a length. */
+static inline const uint8_t *
+lz_get_len(
+	const uint8_t	*ip,
+	const uint8_t	*iend,
+	size_t		*len)
+{
+	unsigned int	b;
+
+	do {
+		if (ip >= iend)
+			return NULL;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+	return ip;
+}
+
+/*
+ * Decompress @src_len bytes from @src into @dst.  Returns the decompressed
+ * length, or -1 if the input is corrupt or would overflow @dst_len bytes.
+ * Corrupt input never causes accesses outside either buffer.
+ */
+ssize_t
+lz_decompress(
+	const void	*src,
+	size_t		src_len,
+	void		*dst,
+	size_t		dst_len)
+{
+	const uint8_t	*ip = src;
+	const uint8_t	*iend = ip + src_len;
+	uint8_t		*op = dst;
+	uint8_t		*oend = op + dst_len;
+
+	while (ip < iend) {
+		unsigned int	token = *ip++;
+		size_t		len = token >> 4;
+		size_t		offset;
+		const uint8_t	*ref;
+
+		if (len == LZ_RUN_MASK) {
+			ip = lz_get_len(ip, iend, &len);
+			if (!ip)
+				return -1;
+		}
+		if (len > (size_t)(iend - ip) || len > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst))
+			return -1;
+
+		len = token & LZ_RUN_MASK;
+		if (len == LZ_RUN_MASK) {
+			ip = lz_get_len(ip, iend, &len);
+			if (!ip)
+				return -1;
+		}
+		len += LZ_MIN_MATCH;
+		if (len > (size_t)(oend - op))
+			return -1;
+
+		ref = op - offset;
+		if (offset >= len) {
+			memcpy(op, ref, len);
+			op += len;
+		} else {
+			while (len--)
+				*op++ = *ref++;
+		}
+	}
+
+	return op - (uint8_t *)dst;
+}
@@ -0,0 +1,21 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __LIBFROG_LZCODEC_H__
+#define __LIBFROG_LZCODEC_H__
+
+/*
+ * Worst case size of the compressed form of @len bytes.  Callers that do not
+ * want to handle a failed compression should size the output buffer with this.
+ */
+static inline size_t
+lz_compress_bound(
+	size_t		len)
+{
+	return len + len / 255 + 16;
+}
+
+ssize_t lz_compress(const void *src, size_t src_len, void *dst,
+		size_t dst_len);
+ssize_t lz_decompress(const void *src, size_t src_len, void *dst,
+		size_t dst_len);
+
+#endif /* __LIBFROG_LZCODEC_H__ */
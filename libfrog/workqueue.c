@@ -4,6 +4,7 @@
  * Author: Darrick J. Wong <darrick.wong@oracle.com>
  */
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,55 +13,400 @@
 #include <errno.h>
 #include <assert.h>
 #include <urcu.h>
+#include "platform_defs.h"
+#include "atomic.h"
 #include "workqueue.h"
 
+/*
+ * Work Stealing
+ * =============
+ *
+ * Every worker thread owns a fixed size deque of work items.  Items added by
+ * a worker go on the bottom of its own deque, and the worker takes work back
+ * off the bottom, so that work spawned by an item tends to run soon after it
+ * on the same CPU.  A worker that runs out of work of its own steals from the
+ * top of the other workers' deques.  This is the Chase-Lev algorithm; the
+ * owner only needs a compare and swap when it races a thief for the last item
+ * in the deque.
+ *
+ * Items added by threads that aren't workers of the queue go into a bounded
+ * multi-producer multi-consumer ring that every worker polls.  Each ring slot
+ * carries a sequence number saying whether it holds an item for the current
+ * lap of the ring, so producers and consumers claim slots with a single
+ * compare and swap and never wait for each other.
+ *
+ * The deques and the ring are allocated when the workqueue is created, so
+ * queueing an item normally doesn't allocate memory or take a lock.  When both
+ * are full, items spill onto a locked overflow list.
+ *
+ * A worker that runs out of work spins looking for more for a little while
+ * before it goes to sleep on a condition variable, but only a couple of
+ * workers may spin at once.  A producer only takes the lock to wake a worker
+ * if nobody is spinning and somebody is asleep, and a spinner that finds work
+ * wakes up another worker to take its place.  Producers and workers both
+ * update their own state and then issue a full barrier before looking at the
+ * other's, and a worker always looks for queued items one last time before
+ * it sleeps, so a wakeup is never lost.
+ */
+
+/* Number of items in each worker's deque; must be a power of two. */
+#define WORKQUEUE_DEQUE_SIZE	512
+
+/* Minimum number of slots in the shared ring; must be a power of two. */
+#define WORKQUEUE_RING_SIZE	4096
+
+/* Number of times an idle worker looks for work before going to sleep. */
+#define WORKQUEUE_IDLE_SPINS	64
+
+/* Maximum number of idle workers spinning at once. */
+#define WORKQUEUE_MAX_SPINNING	2
+
+static pthread_key_t		workqueue_key;
+static pthread_once_t		workqueue_once = PTHREAD_ONCE_INIT;
+
+static void
+workqueue_key_init(void)
+{
+	pthread_key_create(&workqueue_key, NULL);
+}
+
+/* Return the calling thread's deque if it's a worker of this queue. */
+static inline struct workqueue_worker *
+workqueue_self(
+	struct workqueue	*wq)
+{
+	struct workqueue_worker	*w = pthread_getspecific(workqueue_key);
+
+	return (w && w->wq == wq) ? w : NULL;
+}
+
+/* Push an item on the bottom of our own deque. */
+static bool
+deque_push(
+	struct workqueue_worker	*w,
+	const struct workqueue_item *item)
+{
+	long			b = w->bottom;
+	long			t = uatomic_read(&w->top);
+
+	if (b - t >= WORKQUEUE_DEQUE_SIZE)
+		return false;
+
+	w->items[b & (WORKQUEUE_DEQUE_SIZE - 1)] = *item;
+	cmm_smp_wmb();
+	uatomic_set(&w->bottom, b + 1);
+	return true;
+}
+
+/* Take the item most recently pushed on our own deque. */
+static bool
+deque_pop(
+	struct workqueue_worker	*w,
+	struct workqueue_item	*item)
+{
+	long			b = w->bottom - 1;
+	long			t;
+	bool			ret = true;
+
+	/* Don't bother with the barrier if the deque is obviously empty. */
+	if (b < uatomic_read(&w->top))
+		return false;
+
+	uatomic_set(&w->bottom, b);
+	cmm_smp_mb();
+	t = uatomic_read(&w->top);
+
+	if (b < t) {
+		/* empty */
+		uatomic_set(&w->bottom, b + 1);
+		return false;
+	}
+
+	*item = w->items[b & (WORKQUEUE_DEQUE_SIZE - 1)];
+	if (b == t) {
+		/* last item, so race the thieves for it */
+		if (uatomic_cmpxchg(&w->top, t, t + 1) != t)
+			ret = false;
+		uatomic_set(&w->bottom, t + 1);
+	}
+	return ret;
+}
+
+/* Take the oldest item from somebody else's deque. */
+static bool
+deque_steal(
+	struct workqueue_worker	*w,
+	struct workqueue_item	*item)
+{
+	long			t = uatomic_read(&w->top);
+	long			b;
+
+	cmm_smp_mb();
+	b = uatomic_read(&w->bottom);
+	if (b <= t)
+		return false;
+
+	/*
+	 * The owner can't reuse this slot until top moves past it, so if we
+	 * win the cmpxchg the copy we took is intact.
+	 */
+	*item = w->items[t & (WORKQUEUE_DEQUE_SIZE - 1)];
+	cmm_smp_mb();
+	return uatomic_cmpxchg(&w->top, t, t + 1) == t;
+}
+
+/* Add an item to the shared ring. */
+static bool
+ring_push(
+	struct workqueue	*wq,
+	const struct workqueue_item *item)
+{
+	struct workqueue_cell	*cell;
+	unsigned long		pos = uatomic_read(&wq->enqueue_pos);
+	long			dif;
+
+	for (;;) {
+		cell = &wq->cells[pos & wq->cell_mask];
+		dif = (long)(uatomic_read(&cell->seq) - pos);
+		cmm_smp_rmb();
+		if (dif == 0) {
+			unsigned long	old;
+
+			old = uatomic_cmpxchg(&wq->enqueue_pos, pos, pos + 1);
+			if (old == pos)
+				break;
+			pos = old;
+		} else if (dif < 0) {
+			/* full */
+			return false;
+		} else {
+			pos = uatomic_read(&wq->enqueue_pos);
+		}
+	}
+
+	cell->item = *item;
+	cmm_smp_wmb();
+	uatomic_set(&cell->seq, pos + 1);
+	return true;
+}
+
+/* Take an item off the shared ring. */
+static bool
+ring_pop(
+	struct workqueue	*wq,
+	struct workqueue_item	*item)
+{
+	struct workqueue_cell	*cell;
+	unsigned long		pos = uatomic_read(&wq->dequeue_pos);
+	long			dif;
+
+	for (;;) {
+		cell = &wq->cells[pos & wq->cell_mask];
+		dif = (long)(uatomic_read(&cell->seq) - (pos + 1));
+		cmm_smp_rmb();
+		if (dif == 0) {
+			unsigned long	old;
+
+			old = uatomic_cmpxchg(&wq->dequeue_pos, pos, pos + 1);
+			if (old == pos)
+				break;
+			pos = old;
+		} else if (dif < 0) {
+			/* empty */
+			return false;
+		} else {
+			pos = uatomic_read(&wq->dequeue_pos);
+		}
+	}
+
+	*item = cell->item;
+	cmm_smp_mb();
+	uatomic_set(&cell->seq, pos + wq->cell_mask + 1);
+	return true;
+}
+
+static int
+overflow_push(
+	struct workqueue	*wq,
+	const struct workqueue_item *item)
+{
+	struct workqueue_item	*wi;
+
+	wi = malloc(sizeof(struct workqueue_item));
+	if (!wi)
+		return -errno;
+	*wi = *item;
+	wi->next = NULL;
+
+	pthread_mutex_lock(&wq->overflow_lock);
+	if (wq->overflow_tail)
+		wq->overflow_tail->next = wi;
+	else
+		wq->overflow_head = wi;
+	wq->overflow_tail = wi;
+	uatomic_inc(&wq->overflow_count);
+	pthread_mutex_unlock(&wq->overflow_lock);
+	return 0;
+}
+
+static bool
+overflow_pop(
+	struct workqueue	*wq,
+	struct workqueue_item	*item)
+{
+	struct workqueue_item	*wi;
+
+	if (!uatomic_read(&wq->overflow_count))
+		return false;
+
+	pthread_mutex_lock(&wq->overflow_lock);
+	wi = wq->overflow_head;
+	if (wi) {
+		wq->overflow_head = wi->next;
+		if (!wq->overflow_head)
+			wq->overflow_tail = NULL;
+		uatomic_dec(&wq->overflow_count);
+	}
+	pthread_mutex_unlock(&wq->overflow_lock);
+
+	if (!wi)
+		return false;
+	*item = *wi;
+	free(wi);
+	return true;
+}
+
+/* Wake an idle worker if there's work and nobody is looking for it. */
+static int
+workqueue_wake(
+	struct workqueue	*wq)
+{
+	int			ret = 0;
+
+	cmm_smp_mb();
+	if (uatomic_read(&wq->spinning_threads) == 0 &&
+	    uatomic_read(&wq->idle_threads) > 0 &&
+	    uatomic_read(&wq->item_count) > 0) {
+		pthread_mutex_lock(&wq->lock);
+		ret = -pthread_cond_signal(&wq->wakeup);
+		pthread_mutex_unlock(&wq->lock);
+	}
+	return ret;
+}
+
+/* Find something to do: our own work first, then shared work, then steal. */
+static bool
+workqueue_get_item(
+	struct workqueue	*wq,
+	struct workqueue_worker	*w,
+	struct workqueue_item	*item)
+{
+	unsigned int		i;
+
+	if (deque_pop(w, item) || ring_pop(wq, item))
+		goto found;
+
+	for (i = 0; i < wq->thread_count; i++) {
+		struct workqueue_worker	*victim;
+
+		victim = &wq->workers[w->victim];
+		if (++w->victim == wq->thread_count)
+			w->victim = 0;
+		if (victim != w && deque_steal(victim, item))
+			goto found;
+	}
+
+	if (overflow_pop(wq, item))
+		goto found;
+	return false;
+found:
+	/* If the queue was full then send a wakeup if we're configured to. */
+	uatomic_dec(&wq->item_count);
+	if (wq->max_queued) {
+		cmm_smp_mb();
+		if (uatomic_read(&wq->full_waiters)) {
+			pthread_mutex_lock(&wq->lock);
+			pthread_cond_signal(&wq->queue_full);
+			pthread_mutex_unlock(&wq->lock);
+		}
+	}
+	return true;
+}
+
+/*
+ * Go to sleep until there's more work.  Returns false if the queue is being
+ * torn down and there's nothing left to do.
+ */
+static bool
+workqueue_wait(
+	struct workqueue	*wq)
+{
+	bool			ret = true;
+
+	pthread_mutex_lock(&wq->lock);
+	uatomic_inc(&wq->idle_threads);
+	cmm_smp_mb();
+	if (uatomic_read(&wq->item_count) == 0) {
+		if (wq->terminate)
+			ret = false;
+		else
+			pthread_cond_wait(&wq->wakeup, &wq->lock);
+	}
+	uatomic_dec(&wq->idle_threads);
+	pthread_mutex_unlock(&wq->lock);
+	return ret;
+}
+
 /* Main processing thread */
 static void *
 workqueue_thread(void *arg)
 {
-	struct workqueue	*wq = arg;
-	struct workqueue_item	*wi;
+	struct workqueue_worker	*w = arg;
+	struct workqueue	*wq = w->wq;
+	struct workqueue_item	wi;
+	unsigned int		spins = 0;
+	bool			spinning = false;
 
 	/*
 	 * Loop pulling work from the passed in work queue.
-	 * Check for notification to exit after every chunk of work.
+	 * Check for notification to exit whenever we run out of work.
 	 */
 	rcu_register_thread();
-	pthread_mutex_lock(&wq->lock);
+	pthread_setspecific(workqueue_key, w);
 	while (1) {
+		if (workqueue_get_item(wq, w, &wi)) {
+			if (spinning) {
+				spinning = false;
+				uatomic_dec(&wq->spinning_threads);
+				workqueue_wake(wq);
+			}
+			(wi.function)(wq, wi.index, wi.arg);
+			continue;
+		}
 
 		/*
-		 * Wait for work.
+		 * An item might be on its way into a queue that we already
+		 * looked at, so look again a few times before sleeping.
 		 */
-		while (wq->next_item == NULL && !wq->terminate) {
-			assert(wq->item_count == 0);
-			pthread_cond_wait(&wq->wakeup, &wq->lock);
+		if (!spinning &&
+		    uatomic_read(&wq->spinning_threads) < WORKQUEUE_MAX_SPINNING) {
+			spinning = true;
+			spins = 0;
+			uatomic_inc(&wq->spinning_threads);
+			continue;
+		}
+		if (spinning && ++spins < WORKQUEUE_IDLE_SPINS) {
+			sched_yield();
+			continue;
 		}
-		if (wq->next_item == NULL && wq->terminate)
+		if (spinning) {
+			spinning = false;
+			uatomic_dec(&wq->spinning_threads);
+		}
+		if (!workqueue_wait(wq))
 			break;
-
-		/*
-		 *  Dequeue work from the head of the list. If the queue was
-		 *  full then send a wakeup if we're configured to do so.
-		 */
-		assert(wq->item_count > 0);
-		if (wq->max_queued)
-			pthread_cond_broadcast(&wq->queue_full);
-
-		wi = wq->next_item;
-		wq->next_item = wi->next;
-		wq->item_count--;
-
-		wq->active_threads++;
-		pthread_mutex_unlock(&wq->lock);
-
-		(wi->function)(wi->queue, wi->index, wi->arg);
-		free(wi);
-
-		pthread_mutex_lock(&wq->lock);
-		wq->active_threads--;
 	}
-	pthread_mutex_unlock(&wq->lock);
+	pthread_setspecific(workqueue_key, NULL);
 	rcu_unregister_thread();
 
 	return NULL;
@@ -74,9 +420,12 @@ workqueue_create_bound(
 	unsigned int		nr_workers,
 	unsigned int		max_queue)
 {
-	unsigned int		i;
+	unsigned long		nr_cells = WORKQUEUE_RING_SIZE;
+	unsigned long		i;
 	int			err = 0;
 
+	pthread_once(&workqueue_once, workqueue_key_init);
+
 	memset(wq, 0, sizeof(*wq));
 	err = -pthread_cond_init(&wq->wakeup, NULL);
 	if (err)
@@ -87,21 +436,46 @@ workqueue_create_bound(
 	err = -pthread_mutex_init(&wq->lock, NULL);
 	if (err)
 		goto out_cond;
+	err = -pthread_mutex_init(&wq->overflow_lock, NULL);
+	if (err)
+		goto out_mutex;
 
 	wq->wq_ctx = wq_ctx;
 	wq->thread_count = nr_workers;
 	wq->max_queued = max_queue;
-	wq->threads = malloc(nr_workers * sizeof(pthread_t));
-	if (!wq->threads) {
-		err = -errno;
-		goto out_mutex;
-	}
 	wq->terminate = false;
 	wq->terminated = false;
 
+	while (nr_cells < max_queue)
+		nr_cells <<= 1;
+	wq->cells = calloc(nr_cells, sizeof(struct workqueue_cell));
+	if (!wq->cells) {
+		err = -errno;
+		goto out_overflow;
+	}
+	for (i = 0; i < nr_cells; i++)
+		wq->cells[i].seq = i;
+	wq->cell_mask = nr_cells - 1;
+
+	wq->workers = calloc(nr_workers, sizeof(struct workqueue_worker));
+	if (!wq->workers && nr_workers) {
+		err = -errno;
+		goto out_cells;
+	}
+	for (i = 0; i < nr_workers; i++) {
+		wq->workers[i].wq = wq;
+		wq->workers[i].victim = (i + 1) % nr_workers;
+		wq->workers[i].items = calloc(WORKQUEUE_DEQUE_SIZE,
+				sizeof(struct workqueue_item));
+		if (!wq->workers[i].items) {
+			err = -errno;
+			goto out_workers;
+		}
+	}
+
 	for (i = 0; i < nr_workers; i++) {
-		err = -pthread_create(&wq->threads[i], NULL, workqueue_thread,
-				wq);
+		err = -pthread_create(&wq->workers[i].thread, NULL,
+				workqueue_thread, &wq->workers[i]);
 		if (err)
 			break;
 	}
@@ -111,9 +485,21 @@ workqueue_create_bound(
 	 * the threads that may have been started running before we can destroy
 	 * the workqueue.
 	 */
-	if (err)
+	if (err) {
+		while (wq->thread_count > i)
+			free(wq->workers[--wq->thread_count].items);
+		workqueue_terminate(wq);
 		workqueue_destroy(wq);
+	}
 	return err;
+out_workers:
+	for (i = 0; i < nr_workers; i++)
+		free(wq->workers[i].items);
+	free(wq->workers);
+out_cells:
+	free(wq->cells);
+out_overflow:
+	pthread_mutex_destroy(&wq->overflow_lock);
 out_mutex:
 	pthread_mutex_destroy(&wq->lock);
 out_cond:
@@ -132,6 +518,22 @@ workqueue_create(
 	return workqueue_create_bound(wq, wq_ctx, nr_workers, 0);
 }
 
+/* Wait for the queue to drain below max_queued items. */
+static void
+workqueue_throttle(
+	struct workqueue	*wq)
+{
+	while (uatomic_read(&wq->item_count) >= wq->max_queued) {
+		pthread_mutex_lock(&wq->lock);
+		uatomic_inc(&wq->full_waiters);
+		cmm_smp_mb();
+		if (uatomic_read(&wq->item_count) >= wq->max_queued)
+			pthread_cond_wait(&wq->queue_full, &wq->lock);
+		uatomic_dec(&wq->full_waiters);
+		pthread_mutex_unlock(&wq->lock);
+	}
+}
+
 /*
  * Create a work item consisting of a function and some arguments and schedule
  * the work item to be run via the thread pool.  Returns zero or a negative
@@ -144,7 +546,12 @@ workqueue_add(
 	uint32_t		index,
 	void			*arg)
 {
-	struct workqueue_item	*wi;
+	struct workqueue_worker	*w;
+	struct workqueue_item	wi = {
+		.function	= func,
+		.index		= index,
+		.arg		= arg,
+	};
 	int			ret;
 
 	assert(!wq->terminated);
@@ -154,57 +561,25 @@ workqueue_add(
 		return 0;
 	}
 
-	wi = malloc(sizeof(struct workqueue_item));
-	if (!wi)
-		return -errno;
-
-	wi->function = func;
-	wi->index = index;
-	wi->arg = arg;
-	wi->queue = wq;
-	wi->next = NULL;
+	/* throttle on a full queue if configured */
+	if (wq->max_queued)
+		workqueue_throttle(wq);
 
-	/* Now queue the new work structure to the work queue. */
-	pthread_mutex_lock(&wq->lock);
-restart:
-	if (wq->next_item == NULL) {
-		assert(wq->item_count == 0);
-		wq->next_item = wi;
-	} else {
-		/* throttle on a full queue if configured */
-		if (wq->max_queued && wq->item_count == wq->max_queued) {
-			pthread_cond_wait(&wq->queue_full, &wq->lock);
-			/*
-			 * Queue might be empty or even still full by the time
-			 * we get the lock back, so restart the lookup so we do
-			 * the right thing with the current state of the queue.
-			 */
-			goto restart;
-		}
-		wq->last_item->next = wi;
-	}
-	wq->last_item = wi;
-	wq->item_count++;
-
-	if (wq->active_threads == wq->thread_count - 1) {
-		/* One thread is idle, wake it */
-		ret = -pthread_cond_signal(&wq->wakeup);
-		if (ret) {
-			pthread_mutex_unlock(&wq->lock);
-			return ret;
-		}
-	} else if (wq->active_threads < wq->thread_count) {
-		/* Multiple threads are idle, wake everyone */
-		ret = -pthread_cond_broadcast(&wq->wakeup);
+	/*
+	 * Account for the item before anyone can see it, so that a worker
+	 * deciding whether to go to sleep can't miss it.
+	 */
+	uatomic_inc(&wq->item_count);
+	w = workqueue_self(wq);
+	if (!(w && deque_push(w, &wi)) && !ring_push(wq, &wi)) {
+		ret = overflow_push(wq, &wi);
 		if (ret) {
-			pthread_mutex_unlock(&wq->lock);
+			uatomic_dec(&wq->item_count);
 			return ret;
 		}
 	}
 
-	pthread_mutex_unlock(&wq->lock);
-
-	return 0;
+	return workqueue_wake(wq);
 }
 
 /*
@@ -220,14 +595,13 @@ workqueue_terminate(
 
 	pthread_mutex_lock(&wq->lock);
 	wq->terminate = true;
-	pthread_mutex_unlock(&wq->lock);
-
 	ret = -pthread_cond_broadcast(&wq->wakeup);
+	pthread_mutex_unlock(&wq->lock);
 	if (ret)
 		return ret;
 
 	for (i = 0; i < wq->thread_count; i++) {
-		ret = -pthread_join(wq->threads[i], NULL);
+		ret = -pthread_join(wq->workers[i].thread, NULL);
 		if (ret)
 			return ret;
 	}
@@ -244,9 +618,16 @@ void
 workqueue_destroy(
 	struct workqueue	*wq)
 {
+	unsigned int		i;
+
 	assert(wq->terminated);
+	assert(wq->overflow_head == NULL);
 
-	free(wq->threads);
+	for (i = 0; i < wq->thread_count; i++)
+		free(wq->workers[i].items);
+	free(wq->workers);
+	free(wq->cells);
+	pthread_mutex_destroy(&wq->overflow_lock);
 	pthread_mutex_destroy(&wq->lock);
 	pthread_cond_destroy(&wq->wakeup);
 	pthread_cond_destroy(&wq->queue_full);
@@ -13,23 +13,51 @@ struct workqueue;
 typedef void workqueue_func_t(struct workqueue *wq, uint32_t index, void *arg);
 
 struct workqueue_item {
-	struct workqueue	*queue;
-	struct workqueue_item	*next;
+	struct workqueue_item	*next;		/* overflow list only */
 	workqueue_func_t	*function;
 	void			*arg;
 	uint32_t		index;
 };
 
+/* One slot of the shared queue; @seq says whether the slot is full. */
+struct workqueue_cell {
+	unsigned long		seq;
+	struct workqueue_item	item;
+};
+
+/* Per-thread work-stealing deque. */
+struct workqueue_worker {
+	struct workqueue	*wq;
+	long			top;		/* thieves take from here */
+	long			bottom;		/* owner works here */
+	struct workqueue_item	*items;		/* WORKQUEUE_DEQUE_SIZE */
+	unsigned int		victim;		/* next deque to steal from */
+	pthread_t		thread;
+};
+
 struct workqueue {
 	void			*wq_ctx;
-	pthread_t		*threads;
-	struct workqueue_item	*next_item;
-	struct workqueue_item	*last_item;
+	struct workqueue_worker	*workers;
+
+	/* shared queue for items added from outside the workers */
+	struct workqueue_cell	*cells;
+	unsigned long		cell_mask;
+	unsigned long		enqueue_pos;
+	unsigned long		dequeue_pos;
+
+	/* items that didn't fit anywhere else */
+	pthread_mutex_t		overflow_lock;
+	struct workqueue_item	*overflow_head;
+	struct workqueue_item	*overflow_tail;
+	unsigned int		overflow_count;
+
 	pthread_mutex_t		lock;
 	pthread_cond_t		wakeup;
 	unsigned int		item_count;
 	unsigned int		thread_count;
-	unsigned int		active_threads;
+	unsigned int		idle_threads;
+	unsigned int		spinning_threads;
+	unsigned int		full_waiters;
 	bool			terminate;
 	bool			terminated;
 	int			max_queued;
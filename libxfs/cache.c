@@ -17,6 +17,7 @@
 #include "xfs_trans_resv.h"
 #include "xfs_mount.h"
 #include "xfs_bit.h"
+#include "libfrog/platform.h"
 
 #define CACHE_DEBUG 1
 #undef CACHE_DEBUG
@@ -25,9 +26,103 @@
 /* #define CACHE_ABORT 1 */
 
 #define CACHE_SHAKE_COUNT	64
+#define CACHE_MAX_SHARDS	64
 
 static unsigned int cache_generic_bulkrelse(struct cache *, struct list_head *);
 
+/*
+ * Eviction
+ * ========
+ *
+ * Nodes are reclaimed in priority order, lowest first, and within each
+ * priority by a CLOCK-Pro style two-state clock.  Nodes stay on their clock
+ * for as long as they are cached, so taking and dropping references never
+ * touches a list; a lookup hit just marks the node referenced.
+ *
+ * New nodes start out cold.  When the hand finds a referenced cold node it
+ * promotes it to hot, as long as no more than half the clock is hot, and a hot
+ * node that hasn't been referenced since the hand last passed is demoted back
+ * to cold.  Only unreferenced cold nodes are reclaimed.  A node that is only
+ * ever used once, such as a block visited by a single pass over the
+ * filesystem, is therefore reclaimed the first time the hand reaches it,
+ * while the working set survives one full revolution of the hand without
+ * being used.  Unlike true CLOCK-Pro we don't keep non-resident test entries,
+ * as cache keys are opaque to us.
+ */
+
+static inline struct cache_shard *
+cache_shard(
+	struct cache		*cache,
+	unsigned int		hashidx)
+{
+	return &cache->c_shards[hashidx & (cache->c_nr_shards - 1)];
+}
+
+static inline struct cache_shard *
+cache_node_shard(
+	struct cache		*cache,
+	struct cache_node	*node)
+{
+	return cache_shard(cache, node->cn_hashidx);
+}
+
+/*
+ * Shard by CPU count so that there are roughly as many shards as threads that
+ * may be hammering on the cache, but don't make shards so small that the
+ * shaker can't find anything to reclaim in them.
+ */
+static unsigned int
+cache_nr_shards(
+	unsigned int		hashsize,
+	unsigned int		maxcount)
+{
+	unsigned int		nr;
+
+	nr = roundup_pow_of_two(max(platform_nproc(), 1));
+	nr = min_t(unsigned int, nr, CACHE_MAX_SHARDS);
+	while (nr > 1 && (nr > hashsize || maxcount / nr < 4 * CACHE_SHAKE_COUNT))
+		nr >>= 1;
+	return nr;
+}
+
+/* Clock manipulation; callers must hold the shard lock. */
+static void
+cache_clock_add(
+	struct cache_shard	*shard,
+	struct cache_node	*node)
+{
+	struct cache_clock	*clock = &shard->cs_clocks[node->cn_priority];
+
+	list_add_tail(&node->cn_mru, &clock->cc_list);
+	clock->cc_count++;
+	if (node->cn_flags & CACHE_NODE_HOT)
+		clock->cc_hot++;
+}
+
+static void
+cache_clock_del(
+	struct cache_shard	*shard,
+	struct cache_node	*node)
+{
+	struct cache_clock	*clock = &shard->cs_clocks[node->cn_priority];
+
+	list_del_init(&node->cn_mru);
+	clock->cc_count--;
+	if (node->cn_flags & CACHE_NODE_HOT)
+		clock->cc_hot--;
+}
+
+static void
+cache_clock_move(
+	struct cache_shard	*shard,
+	struct cache_node	*node,
+	int			priority)
+{
+	cache_clock_del(shard, node);
+	node->cn_priority = priority;
+	cache_clock_add(shard, node);
+}
+
 struct cache *
 cache_init(
 	int			flags,
@@ -35,7 +130,8 @@ cache_init(
 	struct cache_operations	*cache_operations)
 {
 	struct cache *		cache;
-	unsigned int		i, maxcount;
+	struct cache_shard *	shard;
+	unsigned int		i, j, maxcount;
 
 	maxcount = hashsize * HASH_CACHE_RATIO;
 
@@ -45,12 +141,15 @@ cache_init(
 		free(cache);
 		return NULL;
 	}
+	cache->c_nr_shards = cache_nr_shards(hashsize, maxcount);
+	cache->c_shards = calloc(cache->c_nr_shards, sizeof(struct cache_shard));
+	if (!cache->c_shards) {
+		free(cache->c_hash);
+		free(cache);
+		return NULL;
+	}
 
 	cache->c_flags = flags;
-	cache->c_count = 0;
-	cache->c_max = 0;
-	cache->c_hits = 0;
-	cache->c_misses = 0;
 	cache->c_maxcount = maxcount;
 	cache->c_hashsize = hashsize;
 	cache->c_hashshift = libxfs_highbit32(hashsize);
@@ -61,9 +160,9 @@ cache_init(
 	cache->compare = cache_operations->compare;
 	cache->bulkrelse = cache_operations->bulkrelse ?
 		cache_operations->bulkrelse : cache_generic_bulkrelse;
+	cache->bulkflush = cache_operations->bulkflush;
 	cache->get = cache_operations->get;
 	cache->put = cache_operations->put;
-	pthread_mutex_init(&cache->c_mutex, NULL);
 
 	for (i = 0; i < hashsize; i++) {
 		list_head_init(&cache->c_hash[i].ch_list);
@@ -71,24 +170,33 @@ cache_init(
 		pthread_mutex_init(&cache->c_hash[i].ch_mutex, NULL);
 	}
 
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_init(&cache->c_mrus[i].cm_list);
-		cache->c_mrus[i].cm_count = 0;
-		pthread_mutex_init(&cache->c_mrus[i].cm_mutex, NULL);
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		shard = &cache->c_shards[i];
+		pthread_mutex_init(&shard->cs_mutex, NULL);
+		shard->cs_maxcount = maxcount / cache->c_nr_shards;
+		for (j = 0; j <= CACHE_DIRTY_PRIORITY; j++)
+			list_head_init(&shard->cs_clocks[j].cc_list);
 	}
 	return cache;
 }
 
+/*
+ * Only the shard that ran out of nodes grows; the hash spreads keys evenly
+ * enough over the shards that the others will follow if they need to.
+ */
 static void
 cache_expand(
-	struct cache *		cache)
+	struct cache *		cache,
+	struct cache_shard *	shard)
 {
-	pthread_mutex_lock(&cache->c_mutex);
+	pthread_mutex_lock(&shard->cs_mutex);
 #ifdef CACHE_DEBUG
-	fprintf(stderr, "doubling cache size to %d\n", 2 * cache->c_maxcount);
+	fprintf(stderr, "doubling cache shard size to %d\n",
+			2 * shard->cs_maxcount);
 #endif
-	cache->c_maxcount *= 2;
-	pthread_mutex_unlock(&cache->c_mutex);
+	uatomic_add(&cache->c_maxcount, shard->cs_maxcount);
+	shard->cs_maxcount *= 2;
+	pthread_mutex_unlock(&shard->cs_mutex);
 }
 
 void
@@ -137,18 +245,19 @@ void
 cache_destroy(
 	struct cache *		cache)
 {
-	unsigned int		i;
+	unsigned int		i, j;
 
 	cache_destroy_check(cache);
 	for (i = 0; i < cache->c_hashsize; i++) {
 		list_head_destroy(&cache->c_hash[i].ch_list);
 		pthread_mutex_destroy(&cache->c_hash[i].ch_mutex);
 	}
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++) {
-		list_head_destroy(&cache->c_mrus[i].cm_list);
-		pthread_mutex_destroy(&cache->c_mrus[i].cm_mutex);
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		for (j = 0; j <= CACHE_DIRTY_PRIORITY; j++)
+			list_head_destroy(&cache->c_shards[i].cs_clocks[j].cc_list);
+		pthread_mutex_destroy(&cache->c_shards[i].cs_mutex);
 	}
-	pthread_mutex_destroy(&cache->c_mutex);
+	free(cache->c_shards);
 	free(cache->c_hash);
 	free(cache);
 }
@@ -173,31 +282,57 @@ cache_generic_bulkrelse(
 }
 
 /*
- * Park unflushable nodes on their own special MRU so that cache_shake() doesn't
- * end up repeatedly scanning them in the futile attempt to clean them before
- * reclaim.
+ * Park unflushable nodes on their own special clock so that cache_shake()
+ * doesn't end up repeatedly scanning them in the futile attempt to clean them
+ * before reclaim.  Callers must hold the shard lock.
  */
 static void
 cache_add_to_dirty_mru(
-	struct cache		*cache,
+	struct cache_shard	*shard,
 	struct cache_node	*node)
 {
-	struct cache_mru	*mru = &cache->c_mrus[CACHE_DIRTY_PRIORITY];
-
-	pthread_mutex_lock(&mru->cm_mutex);
 	node->cn_old_priority = node->cn_priority;
-	node->cn_priority = CACHE_DIRTY_PRIORITY;
-	list_add(&node->cn_mru, &mru->cm_list);
-	mru->cm_count++;
-	pthread_mutex_unlock(&mru->cm_mutex);
+	cache_clock_move(shard, node, CACHE_DIRTY_PRIORITY);
+}
+
+/*
+ * Decide what the hand does with an unused node: returns true if the node is
+ * cold and unreferenced, and hence can be reclaimed.  Otherwise the node has
+ * been given its second chance, and the caller moves the hand past it.
+ */
+static bool
+cache_clock_tick(
+	struct cache_clock	*clock,
+	struct cache_node	*node)
+{
+	if (node->cn_flags & CACHE_NODE_REFERENCED) {
+		node->cn_flags &= ~CACHE_NODE_REFERENCED;
+		if (!(node->cn_flags & CACHE_NODE_HOT) &&
+		    clock->cc_hot < clock->cc_count / 2) {
+			node->cn_flags |= CACHE_NODE_HOT;
+			clock->cc_hot++;
+		}
+		return false;
+	}
+	if (node->cn_flags & CACHE_NODE_HOT) {
+		node->cn_flags &= ~CACHE_NODE_HOT;
+		clock->cc_hot--;
+		return false;
+	}
+	return true;
 }
 
 /*
- * We've hit the limit on cache size, so we need to start reclaiming nodes we've
- * used. The MRU specified by the priority is shaken.  Returns new priority at
- * end of the call (in case we call again). We are not allowed to reclaim dirty
- * objects, so we have to flush them first. If flushing fails, we move them to
- * the "dirty, unreclaimable" list.
+ * We've hit the limit on a shard's size, so we need to start reclaiming nodes
+ * we've used. The clock specified by the priority is shaken.  Returns new
+ * priority at end of the call (in case we call again). We are not allowed to
+ * reclaim dirty objects, so we have to flush them first. If flushing fails, we
+ * move them to the "dirty, unreclaimable" clock.
+ *
+ * The hand goes round the clock at most twice, which is enough to demote and
+ * then reclaim any hot node that hasn't been used in the meantime.  Nodes that
+ * are in use are skipped, and purging ignores the hot and referenced state
+ * altogether.
  *
  * Hence we skip priorities > CACHE_MAX_PRIORITY unless "purge" is set as we
  * park unflushable (and hence unreclaimable) buffers at these priorities.
@@ -209,75 +344,77 @@ cache_add_to_dirty_mru(
 static unsigned int
 cache_shake(
 	struct cache *		cache,
+	struct cache_shard *	shard,
 	unsigned int		priority,
 	bool			purge)
 {
-	struct cache_mru	*mru;
+	struct cache_clock	*clock;
 	struct cache_hash *	hash;
 	struct list_head	temp;
-	struct list_head *	head;
-	struct list_head *	pos;
-	struct list_head *	n;
 	struct cache_node *	node;
 	unsigned int		count;
+	unsigned int		scan;
 
 	ASSERT(priority <= CACHE_DIRTY_PRIORITY);
 	if (priority > CACHE_MAX_PRIORITY && !purge)
 		priority = 0;
 
-	mru = &cache->c_mrus[priority];
+	clock = &shard->cs_clocks[priority];
 	count = 0;
 	list_head_init(&temp);
-	head = &mru->cm_list;
 
-	pthread_mutex_lock(&mru->cm_mutex);
-	for (pos = head->prev, n = pos->prev; pos != head;
-						pos = n, n = pos->prev) {
-		node = list_entry(pos, struct cache_node, cn_mru);
+	pthread_mutex_lock(&shard->cs_mutex);
+	scan = purge ? clock->cc_count : 2 * clock->cc_count;
+	while (scan-- > 0 && !list_empty(&clock->cc_list)) {
+		node = list_first_entry(&clock->cc_list, struct cache_node,
+					cn_mru);
 
 		if (pthread_mutex_trylock(&node->cn_mutex) != 0)
-			continue;
+			goto next;
+
+		if (node->cn_count > 0 ||
+		    (!purge && !cache_clock_tick(clock, node))) {
+			pthread_mutex_unlock(&node->cn_mutex);
+			goto next;
+		}
 
 		/* memory pressure is not allowed to release dirty objects */
 		if (cache->flush(node) && !purge) {
-			list_del(&node->cn_mru);
-			mru->cm_count--;
-			node->cn_priority = -1;
+			cache_add_to_dirty_mru(shard, node);
 			pthread_mutex_unlock(&node->cn_mutex);
-			cache_add_to_dirty_mru(cache, node);
 			continue;
 		}
 
 		hash = cache->c_hash + node->cn_hashidx;
 		if (pthread_mutex_trylock(&hash->ch_mutex) != 0) {
 			pthread_mutex_unlock(&node->cn_mutex);
-			continue;
+			goto next;
 		}
-		ASSERT(node->cn_count == 0);
 		ASSERT(node->cn_priority == priority);
-		node->cn_priority = -1;
 
-		list_move(&node->cn_mru, &temp);
+		cache_clock_del(shard, node);
+		node->cn_priority = -1;
+		list_add(&node->cn_mru, &temp);
 		list_del_init(&node->cn_hash);
 		hash->ch_count--;
-		mru->cm_count--;
+		shard->cs_count--;
+		if (!purge)
+			shard->cs_evictions++;
 		pthread_mutex_unlock(&hash->ch_mutex);
 		pthread_mutex_unlock(&node->cn_mutex);
 
 		count++;
 		if (!purge && count == CACHE_SHAKE_COUNT)
 			break;
+		continue;
+next:
+		list_move_tail(&node->cn_mru, &clock->cc_list);
 	}
-	pthread_mutex_unlock(&mru->cm_mutex);
+	pthread_mutex_unlock(&shard->cs_mutex);
 
-	if (count > 0) {
+	if (count > 0)
 		cache->bulkrelse(cache, &temp);
 
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= count;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
-
 	return (count == CACHE_SHAKE_COUNT) ? priority : ++priority;
 }
 
@@ -288,27 +425,28 @@ cache_shake(
 static struct cache_node *
 cache_node_allocate(
 	struct cache *		cache,
+	struct cache_shard *	shard,
 	cache_key_t		key)
 {
 	unsigned int		nodesfree;
 	struct cache_node *	node;
 
-	pthread_mutex_lock(&cache->c_mutex);
-	nodesfree = (cache->c_count < cache->c_maxcount);
+	pthread_mutex_lock(&shard->cs_mutex);
+	nodesfree = (shard->cs_count < shard->cs_maxcount);
 	if (nodesfree) {
-		cache->c_count++;
-		if (cache->c_count > cache->c_max)
-			cache->c_max = cache->c_count;
+		shard->cs_count++;
+		if (shard->cs_count > shard->cs_max)
+			shard->cs_max = shard->cs_count;
 	}
-	cache->c_misses++;
-	pthread_mutex_unlock(&cache->c_mutex);
+	shard->cs_misses++;
+	pthread_mutex_unlock(&shard->cs_mutex);
 	if (!nodesfree)
 		return NULL;
 	node = cache->alloc(key);
 	if (node == NULL) {	/* uh-oh */
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
+		pthread_mutex_lock(&shard->cs_mutex);
+		shard->cs_count--;
+		pthread_mutex_unlock(&shard->cs_mutex);
 		return NULL;
 	}
 	pthread_mutex_init(&node->cn_mutex, NULL);
@@ -316,14 +454,22 @@ cache_node_allocate(
 	node->cn_count = 1;
 	node->cn_priority = 0;
 	node->cn_old_priority = -1;
+	node->cn_flags = 0;
 	return node;
 }
 
+/* The cache has overflowed if any shard has ever been full. */
 int
 cache_overflowed(
 	struct cache *		cache)
 {
-	return cache->c_maxcount == cache->c_max;
+	unsigned int		i;
+
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		if (cache->c_shards[i].cs_max == cache->c_shards[i].cs_maxcount)
+			return 1;
+	}
+	return 0;
 }
 
 
@@ -333,7 +479,7 @@ __cache_node_purge(
 	struct cache_node *	node)
 {
 	int			count;
-	struct cache_mru *	mru;
+	struct cache_shard *	shard = cache_node_shard(cache, node);
 
 	pthread_mutex_lock(&node->cn_mutex);
 	count = node->cn_count;
@@ -348,11 +494,10 @@ __cache_node_purge(
 		return 1;
 	}
 
-	mru = &cache->c_mrus[node->cn_priority];
-	pthread_mutex_lock(&mru->cm_mutex);
-	list_del_init(&node->cn_mru);
-	mru->cm_count--;
-	pthread_mutex_unlock(&mru->cm_mutex);
+	pthread_mutex_lock(&shard->cs_mutex);
+	cache_clock_del(shard, node);
+	shard->cs_count--;
+	pthread_mutex_unlock(&shard->cs_mutex);
 
 	pthread_mutex_unlock(&node->cn_mutex);
 	pthread_mutex_destroy(&node->cn_mutex);
@@ -361,6 +506,70 @@ __cache_node_purge(
 	return 0;
 }
 
+/*
+ * Look for @key in its hash chain, and if we find it, take a reference to the
+ * node and mark it referenced for the clock.  Called with the hash chain
+ * locked.
+ */
+static struct cache_node *
+cache_node_find(
+	struct cache *		cache,
+	struct cache_hash *	hash,
+	struct cache_shard *	shard,
+	cache_key_t		key)
+{
+	struct cache_node *	node;
+	struct list_head *	head = &hash->ch_list;
+	struct list_head *	pos;
+	struct list_head *	n;
+
+	for (pos = head->next, n = pos->next; pos != head;
+					pos = n, n = pos->next) {
+		int result;
+
+		node = list_entry(pos, struct cache_node, cn_hash);
+		result = cache->compare(node, key);
+		switch (result) {
+		case CACHE_HIT:
+			break;
+		case CACHE_PURGE:
+			if ((cache->c_flags & CACHE_MISCOMPARE_PURGE) &&
+			    !__cache_node_purge(cache, node))
+				hash->ch_count--;
+			/* FALL THROUGH */
+		case CACHE_MISS:
+			continue;
+		}
+
+		/*
+		 * node found, bump node's reference count, mark it
+		 * referenced for the clock.
+		 */
+		pthread_mutex_lock(&node->cn_mutex);
+
+		if (node->cn_count == 0 && cache->get) {
+			int err = cache->get(node);
+			if (err) {
+				pthread_mutex_unlock(&node->cn_mutex);
+				continue;
+			}
+		}
+		if (node->cn_count == 0 && node->cn_old_priority != -1) {
+			ASSERT(node->cn_priority == CACHE_DIRTY_PRIORITY);
+			pthread_mutex_lock(&shard->cs_mutex);
+			cache_clock_move(shard, node, node->cn_old_priority);
+			pthread_mutex_unlock(&shard->cs_mutex);
+			node->cn_old_priority = -1;
+		}
+		node->cn_flags |= CACHE_NODE_REFERENCED;
+		node->cn_count++;
+
+		pthread_mutex_unlock(&node->cn_mutex);
+		return node;
+	}
+	return NULL;
+}
+
 /*
  * Lookup in the cache hash table.  With any luck we'll get a cache
  * hit, in which case this will all be over quickly and painlessly.
@@ -377,90 +586,31 @@ cache_node_get(
 {
 	struct cache_node *	node = NULL;
 	struct cache_hash *	hash;
-	struct cache_mru *	mru;
-	struct list_head *	head;
-	struct list_head *	pos;
-	struct list_head *	n;
+	struct cache_shard *	shard;
 	unsigned int		hashidx;
 	int			priority = 0;
-	int			purged = 0;
 
 	hashidx = cache->hash(key, cache->c_hashsize, cache->c_hashshift);
 	hash = cache->c_hash + hashidx;
-	head = &hash->ch_list;
+	shard = cache_shard(cache, hashidx);
 
 	for (;;) {
 		pthread_mutex_lock(&hash->ch_mutex);
-		for (pos = head->next, n = pos->next; pos != head;
-						pos = n, n = pos->next) {
-			int result;
-
-			node = list_entry(pos, struct cache_node, cn_hash);
-			result = cache->compare(node, key);
-			switch (result) {
-			case CACHE_HIT:
-				break;
-			case CACHE_PURGE:
-				if ((cache->c_flags & CACHE_MISCOMPARE_PURGE) &&
-				    !__cache_node_purge(cache, node)) {
-					purged++;
-					hash->ch_count--;
-				}
-				/* FALL THROUGH */
-			case CACHE_MISS:
-				goto next_object;
-			}
-
-			/*
-			 * node found, bump node's reference count, remove it
-			 * from its MRU list, and update stats.
-			 */
-			pthread_mutex_lock(&node->cn_mutex);
-
-			if (node->cn_count == 0 && cache->get) {
-				int err = cache->get(node);
-				if (err) {
-					pthread_mutex_unlock(&node->cn_mutex);
-					goto next_object;
-				}
-			}
-			if (node->cn_count == 0) {
-				ASSERT(node->cn_priority >= 0);
-				ASSERT(!list_empty(&node->cn_mru));
-				mru = &cache->c_mrus[node->cn_priority];
-				pthread_mutex_lock(&mru->cm_mutex);
-				mru->cm_count--;
-				list_del_init(&node->cn_mru);
-				pthread_mutex_unlock(&mru->cm_mutex);
-				if (node->cn_old_priority != -1) {
-					ASSERT(node->cn_priority ==
-							CACHE_DIRTY_PRIORITY);
-					node->cn_priority = node->cn_old_priority;
-					node->cn_old_priority = -1;
-				}
-			}
-			node->cn_count++;
-
-			pthread_mutex_unlock(&node->cn_mutex);
+		node = cache_node_find(cache, hash, shard, key);
+		if (node) {
 			pthread_mutex_unlock(&hash->ch_mutex);
-
-			pthread_mutex_lock(&cache->c_mutex);
-			cache->c_hits++;
-			pthread_mutex_unlock(&cache->c_mutex);
-
+			uatomic_inc(&shard->cs_hits);
 			*nodep = node;
 			return 0;
-next_object:
-			continue;	/* what the hell, gcc? */
 		}
 		pthread_mutex_unlock(&hash->ch_mutex);
 		/*
 		 * not found, allocate a new entry
 		 */
-		node = cache_node_allocate(cache, key);
+		node = cache_node_allocate(cache, shard, key);
 		if (node)
 			break;
-		priority = cache_shake(cache, priority, false);
+		priority = cache_shake(cache, shard, priority, false);
 		/*
 		 * We start at 0; if we free CACHE_SHAKE_COUNT we get
 		 * back the same priority, if not we get back priority+1.
@@ -468,35 +618,54 @@ next_object:
 		 */
 		if (priority > CACHE_MAX_PRIORITY) {
 			priority = 0;
-			cache_expand(cache);
+			cache_expand(cache, shard);
 		}
 	}
 
 	node->cn_hashidx = hashidx;
 
-	/* add new node to appropriate hash */
+	/* add new node to appropriate hash and to the tail of its clock */
 	pthread_mutex_lock(&hash->ch_mutex);
 	hash->ch_count++;
 	list_add(&node->cn_hash, &hash->ch_list);
 	pthread_mutex_unlock(&hash->ch_mutex);
 
-	if (purged) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count -= purged;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
+	pthread_mutex_lock(&shard->cs_mutex);
+	cache_clock_add(shard, node);
+	pthread_mutex_unlock(&shard->cs_mutex);
 
 	*nodep = node;
 	return 1;
 }
 
+/*
+ * Find a node that is already in the cache without allocating one if it is
+ * not there, and without counting the lookup in the hit statistics.  Returns
+ * one and a referenced node if it was found, otherwise zero.
+ */
+int
+cache_node_lookup(
+	struct cache *		cache,
+	cache_key_t		key,
+	struct cache_node **	nodep)
+{
+	struct cache_hash *	hash;
+	unsigned int		hashidx;
+
+	hashidx = cache->hash(key, cache->c_hashsize, cache->c_hashshift);
+	hash = cache->c_hash + hashidx;
+
+	pthread_mutex_lock(&hash->ch_mutex);
+	*nodep = cache_node_find(cache, hash, cache_shard(cache, hashidx), key);
+	pthread_mutex_unlock(&hash->ch_mutex);
+	return *nodep != NULL;
+}
+
 void
 cache_node_put(
 	struct cache *		cache,
 	struct cache_node *	node)
 {
-	struct cache_mru *	mru;
-
 	pthread_mutex_lock(&node->cn_mutex);
 #ifdef CACHE_DEBUG
 	if (node->cn_count < 1) {
@@ -504,8 +673,8 @@ cache_node_put(
 				__FUNCTION__, node->cn_count, node);
 		cache_abort();
 	}
-	if (!list_empty(&node->cn_mru)) {
-		fprintf(stderr, "%s: node put on node (%p) in MRU list\n",
+	if (list_empty(&node->cn_mru)) {
+		fprintf(stderr, "%s: node put on node (%p) not on a clock\n",
 				__FUNCTION__, node);
 		cache_abort();
 	}
@@ -514,14 +683,6 @@ cache_node_put(
 
 	if (node->cn_count == 0 && cache->put)
 		cache->put(node);
-	if (node->cn_count == 0) {
-		/* add unreferenced node to appropriate MRU for shaker */
-		mru = &cache->c_mrus[node->cn_priority];
-		pthread_mutex_lock(&mru->cm_mutex);
-		mru->cm_count++;
-		list_add(&node->cn_mru, &mru->cm_list);
-		pthread_mutex_unlock(&mru->cm_mutex);
-	}
 
 	pthread_mutex_unlock(&node->cn_mutex);
 }
@@ -532,6 +693,8 @@ cache_node_set_priority(
 	struct cache_node *	node,
 	int			priority)
 {
+	struct cache_shard *	shard = cache_node_shard(cache, node);
+
 	if (priority < 0)
 		priority = 0;
 	else if (priority > CACHE_MAX_PRIORITY)
@@ -539,7 +702,11 @@ cache_node_set_priority(
 
 	pthread_mutex_lock(&node->cn_mutex);
 	ASSERT(node->cn_count > 0);
-	node->cn_priority = priority;
+	if (node->cn_priority != priority) {
+		pthread_mutex_lock(&shard->cs_mutex);
+		cache_clock_move(shard, node, priority);
+		pthread_mutex_unlock(&shard->cs_mutex);
+	}
 	node->cn_old_priority = -1;
 	pthread_mutex_unlock(&node->cn_mutex);
 }
@@ -588,12 +755,6 @@ cache_node_purge(
 		break;
 	}
 	pthread_mutex_unlock(&hash->ch_mutex);
-
-	if (count == 0) {
-		pthread_mutex_lock(&cache->c_mutex);
-		cache->c_count--;
-		pthread_mutex_unlock(&cache->c_mutex);
-	}
 #ifdef CACHE_DEBUG
 	if (count >= 1) {
 		fprintf(stderr, "%s: refcount was %u, not zero (node=%p)\n",
@@ -616,22 +777,79 @@ void
 cache_purge(
 	struct cache *		cache)
 {
-	int			i;
+	struct cache_shard *	shard;
+	unsigned int		count = 0;
+	int			i, j;
 
-	for (i = 0; i <= CACHE_DIRTY_PRIORITY; i++)
-		cache_shake(cache, i, true);
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		shard = &cache->c_shards[i];
+		for (j = 0; j <= CACHE_DIRTY_PRIORITY; j++)
+			cache_shake(cache, shard, j, true);
+		count += shard->cs_count;
+	}
 
 #ifdef CACHE_DEBUG
-	if (cache->c_count != 0) {
+	if (count != 0) {
 		/* flush referenced nodes to disk */
 		cache_flush(cache);
 		fprintf(stderr, "%s: shake on cache %p left %u nodes!?\n",
-				__FUNCTION__, cache, cache->c_count);
+				__FUNCTION__, cache, count);
 		cache_abort();
 	}
 #endif
 }
 
+/*
+ * Hand every node in the cache to the bulk flush routine at once, so that it
+ * can write them out in whatever order suits it best.  The nodes are held
+ * referenced until it is done so that nobody can reclaim them.
+ */
+static void
+cache_bulk_flush(
+	struct cache *		cache)
+{
+	struct cache_hash *	hash;
+	struct cache_node *	node;
+	struct cache_node **	nodes = NULL;
+	unsigned int		nr = 0;
+	unsigned int		max = 0;
+	unsigned int		i;
+
+	for (i = 0; i < cache->c_hashsize; i++) {
+		hash = &cache->c_hash[i];
+
+		pthread_mutex_lock(&hash->ch_mutex);
+		list_for_each_entry(node, &hash->ch_list, cn_hash) {
+			pthread_mutex_lock(&node->cn_mutex);
+			if (nr == max) {
+				struct cache_node **new;
+
+				new = realloc(nodes, (max + max / 2 + 1024) *
+						     sizeof(*nodes));
+				if (!new) {
+					/* flush it the slow way instead */
+					cache->flush(node);
+					pthread_mutex_unlock(&node->cn_mutex);
+					continue;
+				}
+				nodes = new;
+				max += max / 2 + 1024;
+			}
+			node->cn_count++;
+			nodes[nr++] = node;
+			pthread_mutex_unlock(&node->cn_mutex);
+		}
+		pthread_mutex_unlock(&hash->ch_mutex);
+	}
+
+	if (nr > 0)
+		cache->bulkflush(cache, nodes, nr);
+
+	for (i = 0; i < nr; i++)
+		cache_node_put(cache, nodes[i]);
+	free(nodes);
+}
+
 /*
  * Flush all nodes in the cache to disk.
  */
@@ -648,6 +866,11 @@ cache_flush(
 	if (!cache->flush)
 		return;
 
+	if (cache->bulkflush) {
+		cache_bulk_flush(cache);
+		return;
+	}
+
 	for (i = 0; i < cache->c_hashsize; i++) {
 		hash = &cache->c_hash[i];
 
@@ -663,6 +886,25 @@ cache_flush(
 	}
 }
 
+void
+cache_get_stats(
+	struct cache		*cache,
+	struct cache_stats	*stats)
+{
+	struct cache_shard	*shard;
+	int			i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		shard = &cache->c_shards[i];
+		pthread_mutex_lock(&shard->cs_mutex);
+		stats->misses += shard->cs_misses;
+		stats->evictions += shard->cs_evictions;
+		pthread_mutex_unlock(&shard->cs_mutex);
+		stats->hits += uatomic_read(&shard->cs_hits);
+	}
+}
+
 #define	HASH_REPORT	(3 * HASH_CACHE_RATIO)
 void
 cache_report(
@@ -670,11 +912,29 @@ cache_report(
 	const char	*name,
 	struct cache	*cache)
 {
-	int		i;
+	struct cache_shard *shard;
+	int		i, j;
 	unsigned long	count, index, total;
 	unsigned long	hash_bucket_lengths[HASH_REPORT + 2];
+	unsigned long long hits = 0, misses = 0, evictions = 0;
+	unsigned int	nodes = 0, max = 0;
+	unsigned int	clock_counts[CACHE_DIRTY_PRIORITY + 1] = { 0 };
+	unsigned int	clock_hot[CACHE_DIRTY_PRIORITY + 1] = { 0 };
+
+	for (i = 0; i < cache->c_nr_shards; i++) {
+		shard = &cache->c_shards[i];
+		hits += uatomic_read(&shard->cs_hits);
+		misses += shard->cs_misses;
+		evictions += shard->cs_evictions;
+		nodes += shard->cs_count;
+		max += shard->cs_max;
+		for (j = 0; j <= CACHE_DIRTY_PRIORITY; j++) {
+			clock_counts[j] += shard->cs_clocks[j].cc_count;
+			clock_hot[j] += shard->cs_clocks[j].cc_hot;
+		}
+	}
 
-	if ((cache->c_hits + cache->c_misses) == 0)
+	if ((hits + misses) == 0 || nodes == 0)
 		return;
 
 	/* report cache summary */
@@ -683,29 +943,31 @@ cache_report(
 			"Max utilized entries = %u\n"
 			"Active entries = %u\n"
 			"Hash table size = %u\n"
+			"Shards = %u\n"
 			"Hits = %llu\n"
 			"Misses = %llu\n"
+			"Evictions = %llu\n"
 			"Hit ratio = %5.2f\n",
 			name, cache,
 			cache->c_maxcount,
-			cache->c_max,
-			cache->c_count,
+			max,
+			nodes,
 			cache->c_hashsize,
-			cache->c_hits,
-			cache->c_misses,
-			(double)cache->c_hits * 100 /
-				(cache->c_hits + cache->c_misses)
+			cache->c_nr_shards,
+			hits,
+			misses,
+			evictions,
+			(double)hits * 100 / (hits + misses)
 	);
 
 	for (i = 0; i <= CACHE_MAX_PRIORITY; i++)
-		fprintf(fp, "MRU %d entries = %6u (%3u%%)\n",
-			i, cache->c_mrus[i].cm_count,
-			cache->c_mrus[i].cm_count * 100 / cache->c_count);
+		fprintf(fp, "MRU %d entries = %6u (%3u%%), %6u hot\n",
+			i, clock_counts[i], clock_counts[i] * 100 / nodes,
+			clock_hot[i]);
 
 	i = CACHE_DIRTY_PRIORITY;
 	fprintf(fp, "Dirty MRU %d entries = %6u (%3u%%)\n",
-		i, cache->c_mrus[i].cm_count,
-		cache->c_mrus[i].cm_count * 100 / cache->c_count);
+		i, clock_counts[i], clock_counts[i] * 100 / nodes);
 
 	/* report hash bucket lengths */
 	bzero(hash_bucket_lengths, sizeof(hash_bucket_lengths));
@@ -726,10 +988,10 @@ cache_report(
 			continue;
 		fprintf(fp, "Hash buckets with  %2d entries %6ld (%3ld%%)\n",
 			i, hash_bucket_lengths[i],
-			(i * hash_bucket_lengths[i] * 100) / cache->c_count);
+			(i * hash_bucket_lengths[i] * 100) / nodes);
 	}
 	if (hash_bucket_lengths[i])	/* last report bucket is the overflow bucket */
 		fprintf(fp, "Hash buckets with >%2d entries %6ld (%3ld%%)\n",
 			i - 1, hash_bucket_lengths[i],
-			((cache->c_count - total) * 100) / cache->c_count);
+			((nodes - total) * 100) / nodes);
 }
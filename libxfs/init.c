@@ -26,6 +26,8 @@
 #include "libfrog/util.h"
 #include "libxfs/xfile.h"
 #include "libxfs/buf_mem.h"
+#include "libfrog/ioengine.h"
+#include "libxfs/mdimage.h"
 
 #include "xfs_format.h"
 #include "xfs_da_format.h"
@@ -42,6 +44,7 @@ pthread_mutex_t	atomic64_lock = PTHREAD_MUTEX_INITIALIZER;
 char *progname = "libxfs";	/* default, changed by each tool */
 
 int libxfs_bhash_size;		/* #buckets in bcache */
+int libxfs_ihash_size;		/* #buckets in icache */
 
 int	use_xfs_buf_lock;	/* global flag: use xfs_buf locks for MT */
 
@@ -112,7 +115,7 @@ libxfs_device_open(
 	if (!dev->isfile && !check_open(xi, dev))
 		return false;
 
-	if (xi->flags & LIBXFS_ISREADONLY)
+	if ((xi->flags & LIBXFS_ISREADONLY) || dev->metadump)
 		flags = O_RDONLY;
 	else
 		flags = O_RDWR;
@@ -122,7 +125,9 @@ libxfs_device_open(
 	} else {
 		if (xi->flags & LIBXFS_EXCLUSIVELY)
 			flags |= O_EXCL;
-		if ((xi->flags & LIBXFS_DIRECT) && platform_direct_blockdev())
+		/* the data in a metadump isn't aligned for direct I/O */
+		if ((xi->flags & LIBXFS_DIRECT) && !dev->metadump &&
+		    platform_direct_blockdev())
 			flags |= O_DIRECT;
 	}
 
@@ -144,6 +149,16 @@ retry:
 		exit(1);
 	}
 
+	if (dev->metadump) {
+		if (mdimage_open(dev->fd, dev->name, dev->metadump_map,
+				&dev->mdimage))
+			exit(1);
+		dev->dev = nextfakedev--;
+		dev->size = mdimage_size(dev->mdimage);
+		dev->bsize = BBSIZE;
+		return true;
+	}
+
 	if (!(xi->flags & LIBXFS_ISREADONLY) &&
 	    xi->setblksize &&
 	    (statb.st_mode & S_IFMT) == S_IFBLK) {
@@ -173,6 +188,15 @@ libxfs_device_close(
 {
 	int			ret;
 
+	if (dev->mdimage) {
+		mdimage_close(dev->mdimage);
+		dev->mdimage = NULL;
+		close(dev->fd);
+		dev->fd = -1;
+		dev->dev = 0;
+		return;
+	}
+
 	ret = platform_flush_device(dev->fd, dev->dev);
 	if (ret) {
 		ret = -errno;
@@ -275,6 +299,8 @@ libxfs_init(struct libxfs_init *a)
 
 	if (!libxfs_bhash_size)
 		libxfs_bhash_size = LIBXFS_BHASHSIZE(sbp);
+	if (!libxfs_ihash_size)
+		libxfs_ihash_size = LIBXFS_IHASHSIZE(sbp);
 	use_xfs_buf_lock = a->flags & LIBXFS_USEBUFLOCK;
 	xfs_dir_startup();
 	init_caches();
@@ -442,6 +468,34 @@ xfs_set_inode_alloc(
 	return xfs_is_inode32(mp) ? maxagi : agcount;
 }
 
+/*
+ * Pick the I/O engine for the buffer targets.  The best available engine is
+ * the default, but LIBXFS_IOENGINE can name a specific one.
+ */
+static const struct ioengine *
+libxfs_ioengine(void)
+{
+	static const struct ioengine	*engine;
+	char				*p;
+
+	if (engine)
+		return engine;
+
+	engine = ioengine_default();
+	p = getenv("LIBXFS_IOENGINE");
+	if (p && *p) {
+		const struct ioengine	*e = ioengine_find(p);
+
+		if (e)
+			engine = e;
+		else
+			fprintf(stderr,
+	_("%s: unknown I/O engine \"%s\", using \"%s\"\n"),
+				progname, p, engine->name);
+	}
+	return engine;
+}
+
 static struct xfs_buftarg *
 libxfs_buftarg_alloc(
 	struct xfs_mount	*mp,
@@ -461,6 +515,8 @@ libxfs_buftarg_alloc(
 	btp->bt_bdev = dev->dev;
 	btp->bt_bdev_fd = dev->fd;
 	btp->bt_xfile = NULL;
+	btp->bt_ioengine = libxfs_ioengine();
+	btp->bt_mdimage = dev->mdimage;
 	btp->flags = 0;
 	if (write_fails) {
 		btp->writes_left = write_fails;
@@ -870,6 +926,10 @@ libxfs_mount(
 	}
 	xfs_set_perag_data_loaded(mp);
 
+	/* Inodes looked up before this point are simply not cached. */
+	mp->m_icache = cache_init(0, libxfs_ihash_size,
+			&libxfs_icache_operations);
+
 	if (xfs_has_metadir(mp))
 		libxfs_mount_setup_metadir(mp);
 
@@ -1008,6 +1068,11 @@ libxfs_umount(
 	libxfs_rtmount_destroy(mp);
 	if (mp->m_metadirip)
 		libxfs_irele(mp->m_metadirip);
+	if (mp->m_icache) {
+		cache_purge(mp->m_icache);
+		cache_destroy(mp->m_icache);
+		mp->m_icache = NULL;
+	}
 
 	/*
 	 * Purge the buffer cache to write all dirty buffers to disk and free
@@ -1052,6 +1117,7 @@ libxfs_destroy(
 	libxfs_close_devices(li);
 
 	libxfs_bcache_free();
+	ioengine_thread_exit();
 	leaked = destroy_caches();
 	rcu_unregister_thread();
 	if (getenv("LIBXFS_LEAK_CHECK") && leaked)
@@ -1063,3 +1129,30 @@ libxfs_device_alignment(void)
 {
 	return platform_align_blockdev();
 }
+
+/*
+ * Read from a device outside of the buffer cache, for tools that go looking
+ * for superblocks.  Returns the number of bytes read, or -1 with errno set.
+ */
+int
+libxfs_device_pread(
+	struct libxfs_dev	*dev,
+	void			*buf,
+	size_t			count,
+	off_t			offset)
+{
+	int			error;
+
+	if (!dev->mdimage)
+		return pread(dev->fd, buf, count, offset);
+
+	if (offset >= BBTOB(dev->size))
+		return 0;
+	count = min_t(off_t, count, BBTOB(dev->size) - offset);
+	error = mdimage_pread(dev->mdimage, buf, count, offset);
+	if (error) {
+		errno = -error;
+		return -1;
+	}
+	return count;
+}
@@ -124,47 +124,167 @@ libxfs_iflush_int(
 }
 
 /*
- * Inode cache stubs.
+ * Incore Inode Cache
+ * ==================
+ *
+ * Incore inodes live in a bounded cache per mount, hashed on the inode number
+ * and reclaimed by the cache clock once the last reference to them has been
+ * dropped.  Repair and mkfs look up the same directories and metadata inodes
+ * over and over again, and without the cache every lookup has to map, read
+ * and decode the inode all over again.
+ *
+ * A cached inode must never disagree with its inode cluster buffer.  The
+ * buffer can change in two ways.  Transactions flush the incore inode into
+ * the buffer when they commit, and in that case the cached inode is where the
+ * new contents came from.  Repair and xfs_db also edit inode cluster buffers
+ * directly, so whenever an inode buffer is marked dirty or written out
+ * directly, every cached inode that it holds is marked stale.  Stale inodes
+ * are never returned by a lookup again, and the clock frees them once they
+ * are no longer in use.  A transaction that gets cancelled or fails to flush
+ * an inode leaves incore changes that never reached the buffer, so we mark
+ * the inode stale in that case too.
+ *
+ * New nodes are hashed before the inode has been read in, so the thread that
+ * allocated the node holds i_load_lock until the inode is ready, and anyone
+ * who finds the node in the meantime waits on the lock.
+ *
+ * The cache holds a single reference to the node for as long as i_count is
+ * nonzero, so that ihold() keeps working without knowing about the cache.
  */
 
+#define XFS_ICACHE_STALE	(1U << 0)	/* disagrees with the disk */
+#define XFS_ICACHE_ERROR	(1U << 1)	/* could not be read in */
+#define XFS_ICACHE_NONE		(1U << 2)	/* not in the cache at all */
+
 struct kmem_cache		*xfs_inode_cache;
 extern struct kmem_cache	*xfs_ili_cache;
 
-int
-libxfs_iget(
-	struct xfs_mount	*mp,
-	struct xfs_trans	*tp,
-	xfs_ino_t		ino,
-	uint			flags,
-	struct xfs_inode	**ipp)
+static inline void
+libxfs_iset_cache_flags(
+	struct xfs_inode	*ip,
+	unsigned int		flags)
 {
-	struct xfs_inode	*ip;
-	struct xfs_perag	*pag;
-	int			error = 0;
+	spin_lock(&VFS_I(ip)->i_lock);
+	ip->i_cache_flags |= flags;
+	spin_unlock(&VFS_I(ip)->i_lock);
+}
 
-	/* reject inode numbers outside existing AGs */
-	if (!xfs_verify_ino(mp, ino))
-		return -EINVAL;
+static void
+libxfs_idestroy(
+	struct xfs_inode	*ip)
+{
+	switch (VFS_I(ip)->i_mode & S_IFMT) {
+		case S_IFREG:
+		case S_IFDIR:
+		case S_IFLNK:
+			libxfs_idestroy_fork(&ip->i_df);
+			break;
+	}
+
+	libxfs_ifork_zap_attr(ip);
+
+	if (ip->i_cowfp) {
+		libxfs_idestroy_fork(ip->i_cowfp);
+		kmem_cache_free(xfs_ifork_cache, ip->i_cowfp);
+	}
+}
+
+static unsigned int
+libxfs_ihash(
+	cache_key_t		key,
+	unsigned int		hashsize,
+	unsigned int		hashshift)
+{
+	uint64_t		hashval = *(xfs_ino_t *)key;
+
+	return (hashval ^ (hashval >> hashshift)) % hashsize;
+}
+
+static int
+libxfs_icompare(
+	struct cache_node	*node,
+	cache_key_t		key)
+{
+	struct xfs_inode	*ip = container_of(node, struct xfs_inode,
+						   i_node);
+
+	if (ip->i_ino != *(xfs_ino_t *)key)
+		return CACHE_MISS;
+	if (uatomic_read(&ip->i_cache_flags) &
+	    (XFS_ICACHE_STALE | XFS_ICACHE_ERROR))
+		return CACHE_MISS;
+	return CACHE_HIT;
+}
+
+/* Allocate an inode, returning with the load lock held. */
+static struct cache_node *
+libxfs_ialloc_node(
+	cache_key_t		key)
+{
+	struct xfs_inode	*ip;
 
 	ip = kmem_cache_zalloc(xfs_inode_cache, 0);
 	if (!ip)
-		return -ENOMEM;
+		return NULL;
+
+	ip->i_ino = *(xfs_ino_t *)key;
+	spin_lock_init(&VFS_I(ip)->i_lock);
+	pthread_mutex_init(&ip->i_load_lock, NULL);
+	pthread_mutex_lock(&ip->i_load_lock);
+	return &ip->i_node;
+}
+
+/* Incore inodes only change inside transactions, so they are never dirty. */
+static int
+libxfs_iflush_node(
+	struct cache_node	*node)
+{
+	return 0;
+}
+
+static void
+libxfs_irelse(
+	struct cache_node	*node)
+{
+	struct xfs_inode	*ip = container_of(node, struct xfs_inode,
+						   i_node);
+
+	libxfs_idestroy(ip);
+	pthread_mutex_destroy(&ip->i_load_lock);
+	kmem_cache_free(xfs_inode_cache, ip);
+}
+
+struct cache_operations libxfs_icache_operations = {
+	.hash		= libxfs_ihash,
+	.alloc		= libxfs_ialloc_node,
+	.flush		= libxfs_iflush_node,
+	.relse		= libxfs_irelse,
+	.compare	= libxfs_icompare,
+};
+
+/* Fill out a newly allocated incore inode. */
+static int
+libxfs_iread(
+	struct xfs_mount	*mp,
+	struct xfs_trans	*tp,
+	struct xfs_inode	*ip,
+	uint			flags)
+{
+	struct xfs_perag	*pag;
+	int			error;
 
-	VFS_I(ip)->i_count = 1;
-	ip->i_ino = ino;
 	ip->i_mount = mp;
 	ip->i_diflags2 = mp->m_ino_geo.new_diflags2;
 	ip->i_af.if_format = XFS_DINODE_FMT_EXTENTS;
 	ip->i_next_unlinked = NULLAGINO;
 	ip->i_prev_unlinked = NULLAGINO;
-	spin_lock_init(&VFS_I(ip)->i_lock);
 
 	pag = xfs_perag_get(mp, XFS_INO_TO_AGNO(mp, ip->i_ino));
 	error = xfs_imap(pag, tp, ip->i_ino, &ip->i_imap, 0);
 	xfs_perag_put(pag);
 
 	if (error)
-		goto out_destroy;
+		return error;
 
 	/*
 	 * For version 5 superblocks, if we are initialising a new inode and we
@@ -184,25 +304,149 @@ libxfs_iget(
 
 		error = xfs_imap_to_bp(mp, tp, &ip->i_imap, &bp);
 		if (error)
-			goto out_destroy;
+			return error;
 
 		error = xfs_inode_from_disk(ip,
 				xfs_buf_offset(bp, ip->i_imap.im_boffset));
 		if (!error)
 			xfs_buf_set_ref(bp, XFS_INO_REF);
 		xfs_trans_brelse(tp, bp);
+	}
 
-		if (error)
-			goto out_destroy;
+	return error;
+}
+
+/*
+ * Mark the cached copy of an inode stale, if there is one, so that the next
+ * lookup reads it in again.
+ */
+static void
+libxfs_icache_inval_ino(
+	struct xfs_mount	*mp,
+	xfs_ino_t		ino)
+{
+	struct cache_node	*node;
+	struct xfs_inode	*ip;
+
+	if (!cache_node_lookup(mp->m_icache, &ino, &node))
+		return;
+
+	ip = container_of(node, struct xfs_inode, i_node);
+	libxfs_iset_cache_flags(ip, XFS_ICACHE_STALE);
+	cache_node_put(mp->m_icache, node);
+}
+
+/*
+ * Someone is changing an inode cluster buffer behind the back of the inode
+ * cache, so forget about every inode in it.
+ */
+void
+libxfs_icache_inval_buf(
+	struct xfs_buf		*bp)
+{
+	struct xfs_mount	*mp = bp->b_mount;
+	xfs_daddr_t		daddr = xfs_buf_daddr(bp);
+	xfs_agnumber_t		agno;
+	xfs_agino_t		agino;
+	unsigned int		i, nr;
+
+	if (!mp || !mp->m_icache || bp->b_target != mp->m_ddev_targp)
+		return;
+	if (bp->b_ops != &xfs_inode_buf_ops &&
+	    bp->b_ops != &xfs_inode_buf_ra_ops)
+		return;
+
+	agno = xfs_daddr_to_agno(mp, daddr);
+	agino = XFS_AGB_TO_AGINO(mp, xfs_daddr_to_agbno(mp, daddr));
+	nr = BBTOB(bp->b_length) >> mp->m_sb.sb_inodelog;
+	for (i = 0; i < nr; i++)
+		libxfs_icache_inval_ino(mp, XFS_AGINO_TO_INO(mp, agno,
+				agino + i));
+}
+
+/*
+ * The incore inode has changes that will never reach the disk, so drop it
+ * from the cache once the caller lets go of it.
+ */
+void
+libxfs_icache_inval_inode(
+	struct xfs_inode	*ip)
+{
+	if (ip->i_mount->m_icache)
+		libxfs_iset_cache_flags(ip, XFS_ICACHE_STALE);
+}
+
+int
+libxfs_iget(
+	struct xfs_mount	*mp,
+	struct xfs_trans	*tp,
+	xfs_ino_t		ino,
+	uint			flags,
+	struct xfs_inode	**ipp)
+{
+	struct cache_node	*node;
+	struct xfs_inode	*ip;
+	bool			extra_ref;
+	int			error;
+
+	/* reject inode numbers outside existing AGs */
+	if (!xfs_verify_ino(mp, ino))
+		return -EINVAL;
+
+	if (!mp->m_icache) {
+		node = libxfs_ialloc_node(&ino);
+		if (!node)
+			return -ENOMEM;
+		ip = container_of(node, struct xfs_inode, i_node);
+		error = libxfs_iread(mp, tp, ip, flags);
+		pthread_mutex_unlock(&ip->i_load_lock);
+		if (error) {
+			libxfs_irelse(node);
+			*ipp = NULL;
+			return error;
+		}
+		ip->i_cache_flags = XFS_ICACHE_NONE;
+		VFS_I(ip)->i_count = 1;
+		*ipp = ip;
+		return 0;
 	}
 
+	/* A new inode is built from scratch, so don't reuse a cached copy. */
+	if (flags & XFS_IGET_CREATE)
+		libxfs_icache_inval_ino(mp, ino);
+
+	for (;;) {
+		if (cache_node_get(mp->m_icache, &ino, &node)) {
+			ip = container_of(node, struct xfs_inode, i_node);
+			error = libxfs_iread(mp, tp, ip, flags);
+			if (error)
+				libxfs_iset_cache_flags(ip, XFS_ICACHE_ERROR);
+			pthread_mutex_unlock(&ip->i_load_lock);
+			if (error) {
+				cache_node_put(mp->m_icache, node);
+				*ipp = NULL;
+				return error;
+			}
+			break;
+		}
+
+		/* Wait for whoever allocated the node to read it in. */
+		ip = container_of(node, struct xfs_inode, i_node);
+		pthread_mutex_lock(&ip->i_load_lock);
+		pthread_mutex_unlock(&ip->i_load_lock);
+		if (!(uatomic_read(&ip->i_cache_flags) & XFS_ICACHE_ERROR))
+			break;
+		cache_node_put(mp->m_icache, node);
+	}
+
+	spin_lock(&VFS_I(ip)->i_lock);
+	extra_ref = VFS_I(ip)->i_count++ > 0;
+	spin_unlock(&VFS_I(ip)->i_lock);
+	if (extra_ref)
+		cache_node_put(mp->m_icache, node);
+
 	*ipp = ip;
 	return 0;
-
-out_destroy:
-	kmem_cache_free(xfs_inode_cache, ip);
-	*ipp = NULL;
-	return error;
 }
 
 /*
@@ -265,37 +509,24 @@ libxfs_metafile_iget(
 	return error;
 }
 
-static void
-libxfs_idestroy(
-	struct xfs_inode	*ip)
-{
-	switch (VFS_I(ip)->i_mode & S_IFMT) {
-		case S_IFREG:
-		case S_IFDIR:
-		case S_IFLNK:
-			libxfs_idestroy_fork(&ip->i_df);
-			break;
-	}
-
-	libxfs_ifork_zap_attr(ip);
-
-	if (ip->i_cowfp) {
-		libxfs_idestroy_fork(ip->i_cowfp);
-		kmem_cache_free(xfs_ifork_cache, ip->i_cowfp);
-	}
-}
-
 void
 libxfs_irele(
 	struct xfs_inode	*ip)
 {
-	VFS_I(ip)->i_count--;
-
-	if (VFS_I(ip)->i_count == 0) {
-		ASSERT(ip->i_itemp == NULL);
-		libxfs_idestroy(ip);
-		kmem_cache_free(xfs_inode_cache, ip);
-	}
+	struct xfs_mount	*mp = ip->i_mount;
+	bool			last;
+
+	spin_lock(&VFS_I(ip)->i_lock);
+	last = --VFS_I(ip)->i_count == 0;
+	spin_unlock(&VFS_I(ip)->i_lock);
+	if (!last)
+		return;
+
+	ASSERT(ip->i_itemp == NULL);
+	if (ip->i_cache_flags & XFS_ICACHE_NONE)
+		libxfs_irelse(&ip->i_node);
+	else
+		cache_node_put(mp->m_icache, &ip->i_node);
 }
 
 void inode_init_owner(struct mnt_idmap *idmap, struct inode *inode,
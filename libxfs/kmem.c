@@ -4,13 +4,246 @@
 #include "libxfs_priv.h"
 
 /*
- * Simple memory interface
+ * Object Caches
+ * =============
+ *
+ * Incore inodes, forks, buffers, log items, btree cursors and deferred work
+ * items are all allocated from kmem caches, often by many threads at once.
+ * Each cache carves its objects out of large slabs, and hands them out
+ * through per-thread magazines so that the common case never takes a lock.
+ *
+ * A magazine is a stack of up to KMEM_MAG_SIZE free objects.  Every thread
+ * has a loaded magazine and a previous one for each cache.  Allocations pop
+ * from the loaded magazine and frees push onto it; when it runs empty or full
+ * we swap it with the previous one, and only when that doesn't help do we go
+ * to the cache's depot of full and empty magazines, under the cache lock.
+ * When the depot is out of objects we carve more from the newest slab.  This
+ * is the design from Bonwick's "Magazines and Vmem" paper.
+ *
+ * Objects are never handed back to the slabs, so memory is only returned to
+ * the system when the cache is destroyed.  Objects are constructed with @ctor
+ * when they are carved from a slab, and must be freed in constructed state.
+ *
+ * Each thread counts its own allocations and frees; the totals are gathered
+ * up when a thread exits or the cache is destroyed.  Set LIBXFS_KMEM_STATS to
+ * print them for every cache as it is destroyed.  That also tracks the peak
+ * number of objects in use, which costs an atomic update of a shared counter
+ * on every allocation and free, so it is only done when asked for.
  */
+
+/* Objects per magazine. */
+#define KMEM_MAG_SIZE		32
+
+/* Slabs are at least this big, and hold at least KMEM_SLAB_MIN_OBJS. */
+#define KMEM_SLAB_SIZE		(64 * 1024)
+#define KMEM_SLAB_MIN_OBJS	16
+
+/* Objects are aligned at least as well as malloc would align them. */
+#define KMEM_MIN_ALIGN		(2 * sizeof(void *))
+
+struct kmem_magazine {
+	struct kmem_magazine	*next;
+	unsigned int		nr;
+	void			*objs[KMEM_MAG_SIZE];
+};
+
+struct kmem_slab {
+	struct kmem_slab	*next;
+};
+
+/* One thread's view of a cache. */
+struct kmem_thread_cache {
+	struct list_head	list;		/* cache->threads */
+	struct kmem_cache	*cache;
+	struct kmem_magazine	*loaded;
+	struct kmem_magazine	*prev;
+	unsigned long long	allocs;
+	unsigned long long	frees;
+};
+
+struct kmem_cache {
+	unsigned int		cache_unitsize;	/* Size in bytes of cache unit */
+	unsigned int		objsize;	/* unit size, aligned */
+	unsigned int		align;
+	const char		*cache_name;	/* tag name */
+	void			(*ctor)(void *);
+	bool			stats;		/* track peak usage? */
+
+	pthread_key_t		key;		/* kmem_thread_cache */
+
+	/* objects in use, and the most that ever were, if stats is set */
+	unsigned long		in_use;
+	unsigned long		peak;
+
+	/* Everything below is protected by the lock. */
+	pthread_mutex_t		lock;
+	struct kmem_magazine	*full;		/* depot, all non-empty */
+	struct kmem_magazine	*empty;		/* depot, all empty */
+	struct list_head	threads;	/* live kmem_thread_caches */
+
+	/* slabs, and the unused part of the newest one */
+	struct kmem_slab	*slabs;
+	char			*carve;
+	char			*carve_end;
+	unsigned int		slabsize;
+	unsigned int		nr_slabs;
+
+	/* counts from threads that have gone away */
+	unsigned long long	allocs;
+	unsigned long long	frees;
+};
+
+static void __attribute__((noreturn))
+kmem_cache_oom(
+	struct kmem_cache	*cache)
+{
+	fprintf(stderr, _("%s: cache alloc failed (%s, %d bytes): %s\n"),
+		progname, cache->cache_name, cache->cache_unitsize,
+		strerror(errno));
+	exit(1);
+}
+
+static struct kmem_magazine *
+kmem_magazine_alloc(
+	struct kmem_cache	*cache)
+{
+	struct kmem_magazine	*mag = cache->empty;
+
+	if (mag) {
+		cache->empty = mag->next;
+		return mag;
+	}
+
+	mag = malloc(sizeof(struct kmem_magazine));
+	if (!mag)
+		kmem_cache_oom(cache);
+	mag->nr = 0;
+	return mag;
+}
+
+/* Put a magazine into the depot; the cache must be locked. */
+static void
+kmem_magazine_put(
+	struct kmem_cache	*cache,
+	struct kmem_magazine	*mag)
+{
+	if (mag->nr) {
+		mag->next = cache->full;
+		cache->full = mag;
+	} else {
+		mag->next = cache->empty;
+		cache->empty = mag;
+	}
+}
+
+static void
+kmem_magazines_free(
+	struct kmem_magazine	*mag)
+{
+	while (mag) {
+		struct kmem_magazine	*next = mag->next;
+
+		free(mag);
+		mag = next;
+	}
+}
+
+/*
+ * Fill @mag with objects carved from the slabs, allocating a new slab if the
+ * newest one is used up.  The cache must be locked.
+ */
+static void
+kmem_slab_carve(
+	struct kmem_cache	*cache,
+	struct kmem_magazine	*mag)
+{
+	while (mag->nr < KMEM_MAG_SIZE) {
+		void		*obj;
+
+		if (cache->carve_end - cache->carve < cache->objsize) {
+			struct kmem_slab	*slab;
+			size_t			hdr;
+
+			/* stop at a slab boundary if we have something */
+			if (mag->nr)
+				return;
+
+			if (posix_memalign((void **)&slab, getpagesize(),
+					cache->slabsize)) {
+				errno = ENOMEM;
+				kmem_cache_oom(cache);
+			}
+			slab->next = cache->slabs;
+			cache->slabs = slab;
+			cache->nr_slabs++;
+
+			hdr = roundup(sizeof(struct kmem_slab), cache->align);
+			cache->carve = (char *)slab + hdr;
+			cache->carve_end = (char *)slab + cache->slabsize;
+		}
+
+		obj = cache->carve;
+		cache->carve += cache->objsize;
+		if (cache->ctor)
+			cache->ctor(obj);
+		mag->objs[mag->nr++] = obj;
+	}
+}
+
+/* Hand a thread's magazines and counts back to the cache. */
+static void
+kmem_thread_cache_release(
+	struct kmem_thread_cache	*tc)
+{
+	struct kmem_cache		*cache = tc->cache;
+
+	pthread_mutex_lock(&cache->lock);
+	kmem_magazine_put(cache, tc->loaded);
+	kmem_magazine_put(cache, tc->prev);
+	cache->allocs += tc->allocs;
+	cache->frees += tc->frees;
+	list_del(&tc->list);
+	pthread_mutex_unlock(&cache->lock);
+	free(tc);
+}
+
+static void
+kmem_thread_cache_destructor(
+	void				*p)
+{
+	kmem_thread_cache_release(p);
+}
+
+static struct kmem_thread_cache *
+kmem_thread_cache_get(
+	struct kmem_cache		*cache)
+{
+	struct kmem_thread_cache	*tc;
+
+	tc = pthread_getspecific(cache->key);
+	if (tc)
+		return tc;
+
+	tc = calloc(1, sizeof(struct kmem_thread_cache));
+	if (!tc)
+		kmem_cache_oom(cache);
+	tc->cache = cache;
+
+	pthread_mutex_lock(&cache->lock);
+	tc->loaded = kmem_magazine_alloc(cache);
+	tc->prev = kmem_magazine_alloc(cache);
+	list_add(&tc->list, &cache->threads);
+	pthread_mutex_unlock(&cache->lock);
+
+	pthread_setspecific(cache->key, tc);
+	return tc;
+}
+
 struct kmem_cache *
 kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 		unsigned int slab_flags, void (*ctor)(void *))
 {
-	struct kmem_cache	*ptr = malloc(sizeof(struct kmem_cache));
+	struct kmem_cache	*ptr = calloc(1, sizeof(struct kmem_cache));
 
 	if (ptr == NULL) {
 		fprintf(stderr, _("%s: cache init failed (%s, %d bytes): %s\n"),
@@ -20,9 +253,23 @@ kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 	}
 	ptr->cache_unitsize = size;
 	ptr->cache_name = name;
-	ptr->allocated = 0;
-	ptr->align = align;
+	ptr->align = max_t(unsigned int, align, KMEM_MIN_ALIGN);
 	ptr->ctor = ctor;
+	ptr->stats = getenv("LIBXFS_KMEM_STATS") != NULL;
+	ptr->objsize = roundup(max_t(unsigned int, size, 1), ptr->align);
+	ptr->slabsize = roundup(max_t(size_t, KMEM_SLAB_SIZE,
+				KMEM_SLAB_MIN_OBJS * ptr->objsize +
+				roundup(sizeof(struct kmem_slab), ptr->align)),
+				getpagesize());
+	pthread_mutex_init(&ptr->lock, NULL);
+	INIT_LIST_HEAD(&ptr->threads);
+
+	errno = pthread_key_create(&ptr->key, kmem_thread_cache_destructor);
+	if (errno) {
+		fprintf(stderr, _("%s: cache init failed (%s): %s\n"),
+			progname, name, strerror(errno));
+		exit(1);
+	}
 
 	return ptr;
 }
@@ -30,13 +277,56 @@ kmem_cache_create(const char *name, unsigned int size, unsigned int align,
 int
 kmem_cache_destroy(struct kmem_cache *cache)
 {
-	int	leaked = 0;
+	struct kmem_thread_cache	*tc, *n;
+	unsigned long long		allocated;
+	int				leaked = 0;
+
+	if (!cache)
+		return 0;
 
-	if (getenv("LIBXFS_LEAK_CHECK") && cache->allocated) {
+	/*
+	 * Stop the destructors from running on threads that are still
+	 * around, then gather up everything that they still hold.
+	 */
+	pthread_key_delete(cache->key);
+	list_for_each_entry_safe(tc, n, &cache->threads, list) {
+		cache->allocs += tc->allocs;
+		cache->frees += tc->frees;
+		kmem_magazine_put(cache, tc->loaded);
+		kmem_magazine_put(cache, tc->prev);
+		list_del(&tc->list);
+		free(tc);
+	}
+	allocated = cache->allocs - cache->frees;
+
+	if (cache->stats)
+		fprintf(stderr,
+ "%s: cache %-20s size %5u: %llu allocs, %llu frees, peak %lu, %llu KiB of slabs\n",
+			progname, cache->cache_name, cache->cache_unitsize,
+			cache->allocs, cache->frees, cache->peak,
+			(unsigned long long)cache->nr_slabs *
+					cache->slabsize / 1024);
+
+	if (getenv("LIBXFS_LEAK_CHECK") && allocated) {
 		leaked = 1;
-		fprintf(stderr, "cache %s freed with %d items allocated\n",
-				cache->cache_name, cache->allocated);
+		fprintf(stderr, "cache %s freed with %llu items allocated\n",
+				cache->cache_name, allocated);
+	}
+
+	kmem_magazines_free(cache->full);
+	kmem_magazines_free(cache->empty);
+
+	/* Leaked objects might still be in use, so keep their slabs. */
+	if (!allocated) {
+		while (cache->slabs) {
+			struct kmem_slab	*slab = cache->slabs;
+
+			cache->slabs = slab->next;
+			free(slab);
+		}
 	}
+
+	pthread_mutex_destroy(&cache->lock);
 	free(cache);
 	return leaked;
 }
@@ -44,16 +334,43 @@ kmem_cache_destroy(struct kmem_cache *cache)
 void *
 kmem_cache_alloc(struct kmem_cache *cache, gfp_t flags)
 {
-	void	*ptr = malloc(cache->cache_unitsize);
+	struct kmem_thread_cache	*tc = kmem_thread_cache_get(cache);
+	struct kmem_magazine		*mag;
 
-	if (ptr == NULL) {
-		fprintf(stderr, _("%s: cache alloc failed (%s, %d bytes): %s\n"),
-			progname, cache->cache_name, cache->cache_unitsize,
-			strerror(errno));
-		exit(1);
+	if (!tc->loaded->nr) {
+		if (tc->prev->nr) {
+			swap(tc->loaded, tc->prev);
+		} else {
+			/*
+			 * Both magazines are empty.  Trade the previous one
+			 * in for a full one from the depot, or fill it from
+			 * the slabs.
+			 */
+			pthread_mutex_lock(&cache->lock);
+			mag = cache->full;
+			if (mag) {
+				cache->full = mag->next;
+				kmem_magazine_put(cache, tc->prev);
+			} else {
+				mag = tc->prev;
+				kmem_slab_carve(cache, mag);
+			}
+			pthread_mutex_unlock(&cache->lock);
+			tc->prev = tc->loaded;
+			tc->loaded = mag;
+		}
 	}
-	cache->allocated++;
-	return ptr;
+
+	tc->allocs++;
+	if (cache->stats) {
+		unsigned long	in_use = uatomic_add_return(&cache->in_use, 1);
+		unsigned long	peak;
+
+		while ((peak = uatomic_read(&cache->peak)) < in_use &&
+		       uatomic_cmpxchg(&cache->peak, peak, in_use) != peak)
+			;
+	}
+	return tc->loaded->objs[--tc->loaded->nr];
 }
 
 void *
@@ -65,6 +382,37 @@ kmem_cache_zalloc(struct kmem_cache *cache, gfp_t flags)
 	return ptr;
 }
 
+void
+kmem_cache_free(struct kmem_cache *cache, void *ptr)
+{
+	struct kmem_thread_cache	*tc;
+
+	if (!ptr)
+		return;
+
+	tc = kmem_thread_cache_get(cache);
+	if (tc->loaded->nr == KMEM_MAG_SIZE) {
+		if (!tc->prev->nr) {
+			swap(tc->loaded, tc->prev);
+		} else {
+			/*
+			 * Both magazines are full.  Put the previous one in
+			 * the depot and start on an empty one.
+			 */
+			pthread_mutex_lock(&cache->lock);
+			kmem_magazine_put(cache, tc->prev);
+			tc->prev = tc->loaded;
+			tc->loaded = kmem_magazine_alloc(cache);
+			pthread_mutex_unlock(&cache->lock);
+		}
+	}
+
+	tc->frees++;
+	if (cache->stats)
+		uatomic_dec(&cache->in_use);
+	tc->loaded->objs[tc->loaded->nr++] = ptr;
+}
+
 void *
 kvmalloc(size_t size, gfp_t flags)
 {
@@ -15,6 +15,9 @@ struct xfs_buf;
 struct xfs_mount;
 struct xfs_perag;
 struct libxfs_init;
+struct ioengine;
+struct io_req;
+struct mdimage;
 
 /*
  * IO verifier callbacks need the xfs_mount pointer, so we have to behave
@@ -30,6 +33,14 @@ struct xfs_buftarg {
 	struct xfile		*bt_xfile;
 	unsigned int		flags;
 	struct cache		*bcache;	/* buffer cache */
+	const struct ioengine	*bt_ioengine;	/* moves data to the bdev */
+	struct mdimage		*bt_mdimage;	/* reads come from a metadump */
+
+	/* Completed I/O, updated atomically. */
+	uint64_t		bt_nr_reads;
+	uint64_t		bt_bytes_read;
+	uint64_t		bt_nr_writes;
+	uint64_t		bt_bytes_written;
 };
 
 /* We purged a dirty buffer and lost a write. */
@@ -176,6 +187,7 @@ int libxfs_buf_read_map(struct xfs_buftarg *btp, struct xfs_buf_map *maps,
 			int nmaps, int flags, struct xfs_buf **bpp,
 			const struct xfs_buf_ops *ops);
 void libxfs_buf_mark_dirty(struct xfs_buf *bp);
+void libxfs_buf_mark_dirty_iflush(struct xfs_buf *bp);
 int libxfs_buf_get_map(struct xfs_buftarg *btp, struct xfs_buf_map *maps,
 			int nmaps, int flags, struct xfs_buf **bpp);
 void	libxfs_buf_relse(struct xfs_buf *bp);
@@ -218,6 +230,14 @@ extern int	libxfs_bcache_overflowed(struct xfs_mount *mp);
 int		libxfs_bwrite(struct xfs_buf *bp);
 extern int	libxfs_readbufr(struct xfs_buftarg *, xfs_daddr_t, struct xfs_buf *, int, int);
 extern int	libxfs_readbufr_map(struct xfs_buftarg *, struct xfs_buf *, int);
+int		libxfs_readbufr_list(struct xfs_buftarg *btp, struct xfs_buf **bps,
+			unsigned int nr, int flags);
+int		libxfs_buftarg_readv(struct xfs_buftarg *btp, struct io_req *reqs,
+			unsigned int nr);
+int		libxfs_buftarg_writev(struct xfs_buftarg *btp,
+			struct io_req *reqs, unsigned int nr);
+void		libxfs_buftarg_account(struct xfs_buftarg *btp,
+			const struct io_req *reqs, unsigned int nr, bool write);
 
 extern int	libxfs_device_zero(struct xfs_buftarg *, xfs_daddr_t, uint);
 
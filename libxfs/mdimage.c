@@ -0,0 +1,788 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Read a filesystem straight out of a metadump.
+ *
+ * Restoring the metadump of a big filesystem takes a long time when all we
+ * want is a look at a few AGs.  Instead, work out where the data of each
+ * extent lives in the dump, either from the extent map that metadump can
+ * write next to the dump or by scanning the dump, and serve buffer reads
+ * from there.  Blocks that aren't in the dump read back as zeroes, just as
+ * they would from a restored image.  Only the data device is served, and
+ * delta dumps can't be read on their own.
+ */
+#include "libxfs_priv.h"
+#include "libxfs.h"
+#include "libfrog/ioengine.h"
+#include "libfrog/lzcodec.h"
+#include "xfs_metadump.h"
+#include "libxfs/mdimage.h"
+
+struct mdi_ext {
+	uint64_t		daddr;
+	uint64_t		len;		/* BBs */
+	uint64_t		chunk;		/* v3 only */
+	uint64_t		off;		/* of the data in the file or chunk */
+	uint64_t		seq;		/* later records win */
+};
+
+/* Decompressed v3 chunks that we keep around. */
+#define MDI_CACHE_CHUNKS	8
+
+struct mdi_chunk {
+	uint64_t		nr;		/* -1ULL if unused */
+	char			*data;
+	size_t			len;
+	size_t			size;
+};
+
+struct mdimage {
+	int			fd;
+	const char		*name;
+	unsigned int		version;
+	long long		size;		/* BBs */
+
+	/* Where the data device's blocks are, sorted and not overlapping */
+	struct mdi_ext		*exts;
+	uint64_t		nr_exts;
+	uint64_t		size_exts;
+
+	/* v3 chunk offsets, and a cache of decompressed chunks */
+	uint64_t		*chunk_offs;
+	uint64_t		nr_chunks;
+	pthread_mutex_t		lock;
+	struct mdi_chunk	cache[MDI_CACHE_CHUNKS];
+	unsigned int		clock;
+	char			*in;
+	size_t			in_size;
+};
+
+/* Read exactly @count bytes from the dump. */
+static int
+mdi_read(
+	struct mdimage		*mdi,
+	void			*buf,
+	size_t			count,
+	off_t			offset)
+{
+	ssize_t			ret;
+
+	while (count > 0) {
+		ret = pread(mdi->fd, buf, count, offset);
+		if (ret < 0)
+			return -errno;
+		if (ret == 0)
+			return -ENODATA;
+		buf += ret;
+		count -= ret;
+		offset += ret;
+	}
+	return 0;
+}
+
+static void
+mdi_add(
+	struct mdimage		*mdi,
+	uint64_t		addr,
+	uint64_t		len,
+	uint64_t		chunk,
+	uint64_t		off)
+{
+	struct mdi_ext		*ext;
+
+	/* Only the data device is served. */
+	if ((addr & XME_ADDR_DEVICE_MASK) != XME_ADDR_DATA_DEVICE || !len)
+		return;
+
+	if (mdi->nr_exts == mdi->size_exts) {
+		mdi->size_exts = max_t(uint64_t, 1024, mdi->size_exts * 2);
+		ext = realloc(mdi->exts, mdi->size_exts * sizeof(*ext));
+		if (!ext) {
+			fprintf(stderr, _("%s: out of memory\n"), progname);
+			exit(1);
+		}
+		mdi->exts = ext;
+	}
+	ext = &mdi->exts[mdi->nr_exts];
+	ext->daddr = addr & XME_ADDR_DADDR_MASK;
+	ext->len = len;
+	ext->chunk = chunk;
+	ext->off = off;
+	ext->seq = mdi->nr_exts++;
+}
+
+/* A v1 dump is a series of index blocks, each followed by its sectors. */
+static int
+mdi_scan_v1(
+	struct mdimage		*mdi)
+{
+	struct xfs_metablock	*mb;
+	__be64			*index;
+	off_t			pos = 0;
+	int			max_indices;
+	int			count;
+	int			i;
+	int			error;
+
+	mb = malloc(BBSIZE);
+	if (!mb)
+		return -ENOMEM;
+	index = (__be64 *)(mb + 1);
+	max_indices = (BBSIZE - sizeof(*mb)) / sizeof(__be64);
+
+	do {
+		error = mdi_read(mdi, mb, BBSIZE, pos);
+		if (error == -ENODATA) {
+			error = 0;
+			break;
+		}
+		if (error)
+			break;
+		if (mb->mb_magic != cpu_to_be32(XFS_MD_MAGIC_V1) ||
+		    mb->mb_blocklog != BBSHIFT) {
+			error = -EFSCORRUPTED;
+			break;
+		}
+		count = be16_to_cpu(mb->mb_count);
+		if (count > max_indices) {
+			error = -EFSCORRUPTED;
+			break;
+		}
+
+		/* Sectors that follow each other on disk make one extent. */
+		for (i = 0; i < count; i++) {
+			uint64_t	daddr = be64_to_cpu(index[i]);
+			off_t		off = pos + BBSIZE * (i + 1);
+			struct mdi_ext	*last = NULL;
+
+			if (mdi->nr_exts)
+				last = &mdi->exts[mdi->nr_exts - 1];
+			if (last && last->daddr + last->len == daddr &&
+			    last->off + BBTOB(last->len) == off)
+				last->len++;
+			else
+				mdi_add(mdi, daddr, 1, 0, off);
+		}
+		pos += BBSIZE * (count + 1);
+	} while (count == max_indices);
+
+	free(mb);
+	return error;
+}
+
+/* A v2 dump is a series of extent headers, each followed by its data. */
+static int
+mdi_scan_v2(
+	struct mdimage		*mdi)
+{
+	struct xfs_meta_extent	xme;
+	off_t			pos = sizeof(struct xfs_metadump_header);
+	uint64_t		addr;
+	uint32_t		len;
+	int			error;
+
+	for (;;) {
+		error = mdi_read(mdi, &xme, sizeof(xme), pos);
+		if (error == -ENODATA)
+			return 0;
+		if (error)
+			return error;
+		addr = be64_to_cpu(xme.xme_addr);
+		len = be32_to_cpu(xme.xme_len);
+		if (addr & XME_ADDR_TOMBSTONE)
+			return -EFSCORRUPTED;
+		pos += sizeof(xme);
+		mdi_add(mdi, addr, len, 0, pos);
+		pos += BBTOB((off_t)len);
+	}
+}
+
+/* Find the chunks of a v3 dump through the index at the end of it. */
+static int
+mdi_load_chunk_index(
+	struct mdimage		*mdi,
+	off_t			dump_size)
+{
+	struct xfs_meta_trailer	xmt;
+	struct xfs_meta_index	xmi;
+	struct xfs_meta_index_rec xmir;
+	off_t			pos;
+	uint64_t		i;
+	int			error;
+
+	if (dump_size < sizeof(struct xfs_metadump_header) + sizeof(xmt))
+		return -EFSCORRUPTED;
+	error = mdi_read(mdi, &xmt, sizeof(xmt), dump_size - sizeof(xmt));
+	if (error)
+		return error;
+	if (xmt.xmt_magic != cpu_to_be32(XFS_MD3_TRAILER_MAGIC))
+		return -EFSCORRUPTED;
+
+	pos = be64_to_cpu(xmt.xmt_index);
+	error = mdi_read(mdi, &xmi, sizeof(xmi), pos);
+	if (error)
+		return error;
+	if (xmi.xmi_magic != cpu_to_be32(XFS_MD3_INDEX_MAGIC))
+		return -EFSCORRUPTED;
+
+	mdi->nr_chunks = be32_to_cpu(xmi.xmi_count);
+	mdi->chunk_offs = calloc(mdi->nr_chunks + 1, sizeof(uint64_t));
+	if (!mdi->chunk_offs)
+		return -ENOMEM;
+	pos += sizeof(xmi);
+	for (i = 0; i < mdi->nr_chunks; i++, pos += sizeof(xmir)) {
+		error = mdi_read(mdi, &xmir, sizeof(xmir), pos);
+		if (error)
+			return error;
+		mdi->chunk_offs[i] = be64_to_cpu(xmir.xmir_offset);
+	}
+	return 0;
+}
+
+/*
+ * Decompress a v3 chunk into the cache, unless it's already there.  Caller
+ * must hold the lock, and the chunk stays valid until the lock is dropped.
+ */
+static int
+mdi_get_chunk(
+	struct mdimage		*mdi,
+	uint64_t		nr,
+	struct mdi_chunk	**chunkp)
+{
+	struct xfs_meta_chunk	xmc;
+	struct mdi_chunk	*chunk;
+	size_t			clen, ulen;
+	ssize_t			len;
+	unsigned int		i;
+	int			error;
+
+	for (i = 0; i < MDI_CACHE_CHUNKS; i++) {
+		if (mdi->cache[i].nr == nr) {
+			*chunkp = &mdi->cache[i];
+			return 0;
+		}
+	}
+	if (nr >= mdi->nr_chunks)
+		return -EFSCORRUPTED;
+
+	error = mdi_read(mdi, &xmc, sizeof(xmc), mdi->chunk_offs[nr]);
+	if (error)
+		return error;
+	clen = be32_to_cpu(xmc.xmc_len);
+	ulen = be32_to_cpu(xmc.xmc_ulen);
+	if (xmc.xmc_magic != cpu_to_be32(XFS_MD3_CHUNK_MAGIC) ||
+	    (xmc.xmc_flags & cpu_to_be32(~XFS_MD3_CHUNK_FLAGS_ALL)) ||
+	    ulen > XFS_MD3_MAX_CHUNK_SIZE ||
+	    clen > lz_compress_bound(XFS_MD3_MAX_CHUNK_SIZE))
+		return -EFSCORRUPTED;
+
+	if (mdi->in_size < clen) {
+		char		*in = realloc(mdi->in, clen);
+
+		if (!in)
+			return -ENOMEM;
+		mdi->in = in;
+		mdi->in_size = clen;
+	}
+	error = mdi_read(mdi, mdi->in, clen,
+			mdi->chunk_offs[nr] + sizeof(xmc));
+	if (error)
+		return error;
+
+	chunk = &mdi->cache[mdi->clock];
+	mdi->clock = (mdi->clock + 1) % MDI_CACHE_CHUNKS;
+	chunk->nr = -1ULL;
+	if (chunk->size < ulen) {
+		char		*data = realloc(chunk->data, ulen);
+
+		if (!data)
+			return -ENOMEM;
+		chunk->data = data;
+		chunk->size = ulen;
+	}
+
+	if (xmc.xmc_flags & cpu_to_be32(XFS_MD3_CHUNK_RAW)) {
+		if (clen != ulen)
+			return -EFSCORRUPTED;
+		memcpy(chunk->data, mdi->in, clen);
+		len = clen;
+	} else {
+		len = lz_decompress(mdi->in, clen, chunk->data, ulen);
+	}
+	if (len < 0 || (size_t)len != ulen ||
+	    crc32c(XFS_CRC_SEED, chunk->data, ulen) !=
+			be32_to_cpu(xmc.xmc_crc))
+		return -EFSBADCRC;
+
+	chunk->nr = nr;
+	chunk->len = ulen;
+	*chunkp = chunk;
+	return 0;
+}
+
+/* Without an extent map, a v3 dump has to be decompressed to be mapped. */
+static int
+mdi_scan_v3(
+	struct mdimage		*mdi)
+{
+	struct xfs_meta_extent	xme;
+	struct mdi_chunk	*chunk;
+	uint64_t		nr;
+	uint64_t		addr;
+	size_t			pos;
+	uint32_t		len;
+	int			error;
+
+	for (nr = 0; nr < mdi->nr_chunks; nr++) {
+		error = mdi_get_chunk(mdi, nr, &chunk);
+		if (error)
+			return error;
+		for (pos = 0; pos + sizeof(xme) <= chunk->len; ) {
+			memcpy(&xme, chunk->data + pos, sizeof(xme));
+			addr = be64_to_cpu(xme.xme_addr);
+			len = be32_to_cpu(xme.xme_len);
+			if (addr & XME_ADDR_TOMBSTONE)
+				return -EFSCORRUPTED;
+			pos += sizeof(xme);
+			if (pos + BBTOB((size_t)len) > chunk->len)
+				return -EFSCORRUPTED;
+			mdi_add(mdi, addr, len, nr, pos);
+			pos += BBTOB((size_t)len);
+		}
+	}
+	return 0;
+}
+
+static int
+mdi_load_map(
+	struct mdimage		*mdi,
+	const char		*path,
+	off_t			dump_size)
+{
+	struct xfs_meta_emap	xmem;
+	struct xfs_meta_emap_rec xmer;
+	uint64_t		count;
+	int			error = -EFSCORRUPTED;
+	FILE			*f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -errno;
+
+	if (fread(&xmem, sizeof(xmem), 1, f) != 1 ||
+	    xmem.xmem_magic != cpu_to_be32(XFS_MD_EMAP_MAGIC) ||
+	    xmem.xmem_version != cpu_to_be32(XFS_MD_EMAP_VERSION))
+		goto out;
+	if (be64_to_cpu(xmem.xmem_dump_size) != dump_size) {
+		error = -ESTALE;
+		goto out;
+	}
+
+	for (count = be64_to_cpu(xmem.xmem_count); count > 0; count--) {
+		uint64_t	chunk = 0;
+		uint64_t	off;
+
+		if (fread(&xmer, sizeof(xmer), 1, f) != 1)
+			goto out;
+		if (mdi->version == 3) {
+			chunk = be64_to_cpu(xmer.xmer_pos);
+			off = be32_to_cpu(xmer.xmer_chunk_off);
+			if (chunk >= mdi->nr_chunks)
+				goto out;
+		} else {
+			off = be64_to_cpu(xmer.xmer_pos);
+		}
+		mdi_add(mdi, be64_to_cpu(xmer.xmer_addr),
+				be32_to_cpu(xmer.xmer_len), chunk, off);
+	}
+	error = 0;
+out:
+	fclose(f);
+	return error;
+}
+
+static int
+mdi_ext_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct mdi_ext	*ea = a;
+	const struct mdi_ext	*eb = b;
+
+	if (ea->daddr != eb->daddr)
+		return ea->daddr < eb->daddr ? -1 : 1;
+	if (ea->seq != eb->seq)
+		return ea->seq < eb->seq ? -1 : 1;
+	return 0;
+}
+
+/* Binary max-heap of extents by sequence number, for mdi_resolve. */
+static void
+mdi_heap_push(
+	struct mdi_ext		**heap,
+	uint64_t		*nr,
+	struct mdi_ext		*ext)
+{
+	uint64_t		i = (*nr)++;
+
+	while (i > 0 && heap[(i - 1) / 2]->seq < ext->seq) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = ext;
+}
+
+static void
+mdi_heap_pop(
+	struct mdi_ext		**heap,
+	uint64_t		*nr)
+{
+	struct mdi_ext		*last = heap[--(*nr)];
+	uint64_t		i = 0;
+
+	for (;;) {
+		uint64_t	c = 2 * i + 1;
+
+		if (c >= *nr)
+			break;
+		if (c + 1 < *nr && heap[c + 1]->seq > heap[c]->seq)
+			c++;
+		if (heap[c]->seq <= last->seq)
+			break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	heap[i] = last;
+}
+
+/*
+ * A block that was dumped more than once reads back as it was last dumped,
+ * like it would from a restored image.  Sweep over the extents in disk order,
+ * and cut them up so that each block is only covered by its last copy.
+ */
+static int
+mdi_resolve(
+	struct mdimage		*mdi)
+{
+	struct mdi_ext		*in = mdi->exts;
+	struct mdi_ext		**heap;
+	uint64_t		nr_in = mdi->nr_exts;
+	uint64_t		nr_heap = 0;
+	uint64_t		i, end = 0;
+	uint64_t		pos;
+
+	qsort(in, nr_in, sizeof(*in), mdi_ext_cmp);
+
+	/* Most dumps don't have any overlaps at all. */
+	for (i = 0; i < nr_in; i++) {
+		if (in[i].daddr < end)
+			break;
+		end = in[i].daddr + in[i].len;
+	}
+	if (i == nr_in)
+		return 0;
+
+	heap = malloc(nr_in * sizeof(*heap));
+	if (!heap)
+		return -ENOMEM;
+	mdi->exts = NULL;
+	mdi->nr_exts = 0;
+	mdi->size_exts = 0;
+
+	i = 0;
+	pos = in[0].daddr;
+	while (i < nr_in || nr_heap) {
+		struct mdi_ext	*top;
+		struct mdi_ext	*last;
+		uint64_t	next;
+
+		if (!nr_heap && pos < in[i].daddr)
+			pos = in[i].daddr;
+		while (i < nr_in && in[i].daddr <= pos)
+			mdi_heap_push(heap, &nr_heap, &in[i++]);
+		while (nr_heap && heap[0]->daddr + heap[0]->len <= pos)
+			mdi_heap_pop(heap, &nr_heap);
+		if (!nr_heap)
+			continue;
+
+		top = heap[0];
+		next = top->daddr + top->len;
+		if (i < nr_in)
+			next = min(next, in[i].daddr);
+
+		/* Extend the last piece if it's the same copy. */
+		last = mdi->nr_exts ? &mdi->exts[mdi->nr_exts - 1] : NULL;
+		if (last && last->seq == top->seq &&
+		    last->daddr + last->len == pos) {
+			last->len += next - pos;
+		} else {
+			mdi_add(mdi, XME_ADDR_DATA_DEVICE | pos, next - pos,
+					top->chunk,
+					top->off + BBTOB(pos - top->daddr));
+			mdi->exts[mdi->nr_exts - 1].seq = top->seq;
+		}
+		pos = next;
+	}
+
+	free(heap);
+	free(in);
+	return 0;
+}
+
+/* Work out the size of the filesystem from the superblock in the dump. */
+static int
+mdi_find_size(
+	struct mdimage		*mdi)
+{
+	struct xfs_dsb		dsb;
+	int			error;
+
+	error = mdimage_pread(mdi, &dsb, sizeof(dsb), 0);
+	if (error)
+		return error;
+	if (dsb.sb_magicnum != cpu_to_be32(XFS_SB_MAGIC) ||
+	    dsb.sb_blocklog < XFS_MIN_BLOCKSIZE_LOG ||
+	    dsb.sb_blocklog > XFS_MAX_BLOCKSIZE_LOG)
+		return -EFSCORRUPTED;
+	mdi->size = be64_to_cpu(dsb.sb_dblocks) << (dsb.sb_blocklog - BBSHIFT);
+	return 0;
+}
+
+/*
+ * Set up random access to the metadump open on @fd.  If @map_path is given,
+ * the extent map in that file says where everything is; otherwise, the dump
+ * is scanned.  Complains and returns a negative errno on failure.
+ */
+int
+mdimage_open(
+	int			fd,
+	const char		*name,
+	const char		*map_path,
+	struct mdimage		**mdip)
+{
+	struct xfs_metadump_header xmh;
+	struct mdimage		*mdi;
+	struct stat		st;
+	unsigned int		i;
+	int			error;
+
+	mdi = calloc(1, sizeof(*mdi));
+	if (!mdi)
+		return -ENOMEM;
+	mdi->fd = fd;
+	mdi->name = name;
+	pthread_mutex_init(&mdi->lock, NULL);
+	for (i = 0; i < MDI_CACHE_CHUNKS; i++)
+		mdi->cache[i].nr = -1ULL;
+
+	if (fstat(fd, &st) < 0) {
+		error = -errno;
+		goto out;
+	}
+
+	error = mdi_read(mdi, &xmh, sizeof(xmh), 0);
+	if (error)
+		goto out_format;
+	switch (be32_to_cpu(xmh.xmh_magic)) {
+	case XFS_MD_MAGIC_V1:
+		mdi->version = 1;
+		break;
+	case XFS_MD_MAGIC_V2:
+		mdi->version = 2;
+		break;
+	case XFS_MD_MAGIC_V3:
+		mdi->version = 3;
+		break;
+	default:
+		goto out_format;
+	}
+	if (mdi->version > 1) {
+		if (xmh.xmh_incompat_flags &
+				cpu_to_be32(XFS_MD2_INCOMPAT_DELTA)) {
+			fprintf(stderr,
+	_("%s: %s is a delta dump, which has to be restored on top of its base\n"),
+				progname, name);
+			error = -EINVAL;
+			goto out;
+		}
+		if (xmh.xmh_incompat_flags &
+				cpu_to_be32(~XFS_MD2_INCOMPAT_ALL))
+			goto out_format;
+	}
+	if (mdi->version == 3) {
+		error = mdi_load_chunk_index(mdi, st.st_size);
+		if (error)
+			goto out_format;
+	}
+
+	if (map_path && mdi->version > 1) {
+		error = mdi_load_map(mdi, map_path, st.st_size);
+		if (error) {
+			fprintf(stderr,
+	_("%s: cannot use extent map %s: %s\n"),
+				progname, map_path,
+				error == -ESTALE ? _("it belongs to another dump") :
+						   strerror(-error));
+			goto out;
+		}
+	} else {
+		switch (mdi->version) {
+		case 1:
+			error = mdi_scan_v1(mdi);
+			break;
+		case 2:
+			error = mdi_scan_v2(mdi);
+			break;
+		case 3:
+			error = mdi_scan_v3(mdi);
+			break;
+		}
+		if (error)
+			goto out_format;
+	}
+
+	if (!mdi->nr_exts)
+		goto out_format;
+	error = mdi_resolve(mdi);
+	if (error)
+		goto out;
+	error = mdi_find_size(mdi);
+	if (error)
+		goto out_format;
+
+	*mdip = mdi;
+	return 0;
+
+out_format:
+	fprintf(stderr, _("%s: %s is not a usable metadump: %s\n"),
+			progname, name,
+			strerror(error ? -error : EFSCORRUPTED));
+	if (!error)
+		error = -EFSCORRUPTED;
+out:
+	mdimage_close(mdi);
+	return error;
+}
+
+void
+mdimage_close(
+	struct mdimage		*mdi)
+{
+	unsigned int		i;
+
+	if (!mdi)
+		return;
+	for (i = 0; i < MDI_CACHE_CHUNKS; i++)
+		free(mdi->cache[i].data);
+	pthread_mutex_destroy(&mdi->lock);
+	free(mdi->in);
+	free(mdi->chunk_offs);
+	free(mdi->exts);
+	free(mdi);
+}
+
+/* Size of the data device, in BBs. */
+long long
+mdimage_size(
+	const struct mdimage	*mdi)
+{
+	return mdi->size;
+}
+
+/* Copy some of an extent's data out of the dump. */
+static int
+mdi_copy(
+	struct mdimage		*mdi,
+	const struct mdi_ext	*ext,
+	void			*buf,
+	size_t			count,
+	uint64_t		ext_off)
+{
+	struct mdi_chunk	*chunk;
+	int			error;
+
+	if (mdi->version != 3)
+		return mdi_read(mdi, buf, count, ext->off + ext_off);
+
+	pthread_mutex_lock(&mdi->lock);
+	error = mdi_get_chunk(mdi, ext->chunk, &chunk);
+	if (!error && ext->off + ext_off + count > chunk->len)
+		error = -EFSCORRUPTED;
+	if (!error)
+		memcpy(buf, chunk->data + ext->off + ext_off, count);
+	pthread_mutex_unlock(&mdi->lock);
+	return error;
+}
+
+/*
+ * Read @count bytes of the filesystem at byte @offset.  Whatever the dump
+ * doesn't have reads back as zeroes.
+ */
+int
+mdimage_pread(
+	struct mdimage		*mdi,
+	void			*buf,
+	size_t			count,
+	off_t			offset)
+{
+	uint64_t		start = offset;
+	uint64_t		end = start + count;
+	uint64_t		lo = 0;
+	uint64_t		hi = mdi->nr_exts;
+	int			error;
+
+	memset(buf, 0, count);
+
+	/* Find the first extent that ends after @start. */
+	while (lo < hi) {
+		uint64_t	mid = (lo + hi) / 2;
+		struct mdi_ext	*ext = &mdi->exts[mid];
+
+		if (BBTOB(ext->daddr + ext->len) <= start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < mdi->nr_exts; lo++) {
+		struct mdi_ext	*ext = &mdi->exts[lo];
+		uint64_t	ext_start = BBTOB(ext->daddr);
+		uint64_t	ext_end = BBTOB(ext->daddr + ext->len);
+		uint64_t	s = max(start, ext_start);
+		uint64_t	e = min(end, ext_end);
+
+		if (ext_start >= end)
+			break;
+		error = mdi_copy(mdi, ext, buf + (s - start), e - s,
+				s - ext_start);
+		if (error)
+			return error;
+	}
+	return 0;
+}
+
+/* I/O engine style batch read, for the buffer cache. */
+int
+mdimage_readv(
+	struct mdimage		*mdi,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	unsigned int		i;
+	int			j;
+	int			ret = 0;
+
+	for (i = 0; i < nr; i++) {
+		off_t		offset = reqs[i].offset;
+
+		reqs[i].error = 0;
+		for (j = 0; j < reqs[i].iovcnt && !reqs[i].error; j++) {
+			reqs[i].error = mdimage_pread(mdi,
+					reqs[i].iov[j].iov_base,
+					reqs[i].iov[j].iov_len, offset);
+			offset += reqs[i].iov[j].iov_len;
+		}
+		if (reqs[i].error && !ret)
+			ret = reqs[i].error;
+	}
+	return ret;
+}
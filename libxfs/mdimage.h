@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * Read a filesystem straight out of a metadump.
+ */
+#ifndef __LIBXFS_MDIMAGE_H__
+#define __LIBXFS_MDIMAGE_H__
+
+struct mdimage;
+struct io_req;
+
+int mdimage_open(int fd, const char *name, const char *map_path,
+		struct mdimage **mdip);
+void mdimage_close(struct mdimage *mdi);
+long long mdimage_size(const struct mdimage *mdi);
+int mdimage_pread(struct mdimage *mdi, void *buf, size_t count,
+		off_t offset);
+int mdimage_readv(struct mdimage *mdi, struct io_req *reqs, unsigned int nr);
+
+#endif /* __LIBXFS_MDIMAGE_H__ */
@@ -20,6 +20,9 @@
 #include "libfrog/platform.h"
 #include "libxfs/xfile.h"
 #include "libxfs/buf_mem.h"
+#include "libxfs/mdimage.h"
+#include "libfrog/ioengine.h"
+#include "libfrog/workqueue.h"
 #include "libxfs.h"
 
 static void libxfs_brelse(struct cache_node *node);
@@ -586,21 +589,164 @@ libxfs_balloc(
 	return &bp->b_node;
 }
 
+/*
+ * Count the requests in a batch that completed successfully.  Callers that
+ * drive the I/O engine directly should call this too.
+ */
+void
+libxfs_buftarg_account(
+	struct xfs_buftarg	*btp,
+	const struct io_req	*reqs,
+	unsigned int		nr,
+	bool			write)
+{
+	uint64_t		bytes = 0;
+	uint64_t		count = 0;
+	unsigned int		i;
+
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].error)
+			continue;
+		bytes += io_req_len(&reqs[i]);
+		count++;
+	}
+	if (write) {
+		uatomic_add(&btp->bt_nr_writes, count);
+		uatomic_add(&btp->bt_bytes_written, bytes);
+	} else {
+		uatomic_add(&btp->bt_nr_reads, count);
+		uatomic_add(&btp->bt_bytes_read, bytes);
+	}
+}
+
+/*
+ * Submit a batch of I/O requests to the buffer target's I/O engine and report
+ * any that failed.
+ */
+static int
+libxfs_buftarg_io(
+	struct xfs_buftarg	*btp,
+	struct io_req		*reqs,
+	unsigned int		nr,
+	bool			write)
+{
+	const struct ioengine	*engine = btp->bt_ioengine;
+	unsigned int		i;
+	int			error;
+
+	if (!nr)
+		return 0;
+
+	if (btp->bt_mdimage) {
+		/* metadumps are read only */
+		if (write) {
+			for (i = 0; i < nr; i++)
+				reqs[i].error = -EROFS;
+			error = -EROFS;
+		} else {
+			error = mdimage_readv(btp->bt_mdimage, reqs, nr);
+		}
+	} else if (write) {
+		error = engine->writev(btp->bt_bdev_fd, reqs, nr);
+	} else {
+		error = engine->readv(btp->bt_bdev_fd, reqs, nr);
+	}
+	libxfs_buftarg_account(btp, reqs, nr, write);
+	if (!error)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		if (!reqs[i].error)
+			continue;
+		fprintf(stderr, _("%s: %s failed at offset %lld: %s\n"),
+			progname, write ? "pwrite" : "read",
+			(long long)reqs[i].offset, strerror(-reqs[i].error));
+	}
+	return error;
+}
+
+int
+libxfs_buftarg_readv(
+	struct xfs_buftarg	*btp,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	return libxfs_buftarg_io(btp, reqs, nr, false);
+}
+
+int
+libxfs_buftarg_writev(
+	struct xfs_buftarg	*btp,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	return libxfs_buftarg_io(btp, reqs, nr, true);
+}
+
+/*
+ * Most buffers have a single map, so avoid allocating request arrays for the
+ * common cases.
+ */
+#define LIBXFS_INLINE_IOREQS	4
+
+/*
+ * Describe the disk ranges backing a buffer as I/O requests.  The buffer
+ * memory is contiguous, so maps that are also adjacent on disk are merged into
+ * a single request.  Returns the number of requests filled out.
+ */
+static unsigned int
+libxfs_buf_ioreqs(
+	struct xfs_buf		*bp,
+	struct io_req		*reqs,
+	struct iovec		*iovs)
+{
+	void			*buf = bp->b_addr;
+	unsigned int		nr = 0;
+	int			i;
+
+	if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
+		iovs[0].iov_base = buf;
+		iovs[0].iov_len = BBTOB(bp->b_length);
+		reqs[0].offset = LIBXFS_BBTOOFF64(xfs_buf_daddr(bp));
+		reqs[0].iov = &iovs[0];
+		reqs[0].iovcnt = 1;
+		reqs[0].error = 0;
+		return 1;
+	}
+
+	for (i = 0; i < bp->b_nmaps; i++) {
+		off_t		offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
+		size_t		len = BBTOB(bp->b_maps[i].bm_len);
+
+		if (nr > 0 &&
+		    reqs[nr - 1].offset + iovs[nr - 1].iov_len == offset) {
+			iovs[nr - 1].iov_len += len;
+		} else {
+			iovs[nr].iov_base = buf;
+			iovs[nr].iov_len = len;
+			reqs[nr].offset = offset;
+			reqs[nr].iov = &iovs[nr];
+			reqs[nr].iovcnt = 1;
+			reqs[nr].error = 0;
+			nr++;
+		}
+		buf += len;
+	}
+	return nr;
+}
+
 static int
-__read_buf(int fd, void *buf, int len, off_t offset, int flags)
-{
-	int	sts;
-
-	sts = pread(fd, buf, len, offset);
-	if (sts < 0) {
-		int error = errno;
-		fprintf(stderr, _("%s: read failed: %s\n"),
-			progname, strerror(error));
-		return -error;
-	} else if (sts != len) {
-		fprintf(stderr, _("%s: error - read only %d of %d bytes\n"),
-			progname, sts, len);
-		return -EIO;
+libxfs_ioreqs_alloc(
+	unsigned int		nr,
+	struct io_req		**reqs,
+	struct iovec		**iovs)
+{
+	*reqs = malloc(nr * sizeof(struct io_req));
+	*iovs = malloc(nr * sizeof(struct iovec));
+	if (!*reqs || !*iovs) {
+		free(*reqs);
+		free(*iovs);
+		return -ENOMEM;
 	}
 	return 0;
 }
@@ -609,16 +755,23 @@ int
 libxfs_readbufr(struct xfs_buftarg *btp, xfs_daddr_t blkno, struct xfs_buf *bp,
 		int len, int flags)
 {
-	int	fd = btp->bt_bdev_fd;
-	int	bytes = BBTOB(len);
-	int	error;
+	struct iovec		iov = {
+		.iov_base	= bp->b_addr,
+		.iov_len	= BBTOB(len),
+	};
+	struct io_req		req = {
+		.offset		= LIBXFS_BBTOOFF64(blkno),
+		.iov		= &iov,
+		.iovcnt		= 1,
+	};
+	int			error;
 
 	ASSERT(len <= bp->b_length);
 
 	if (xfs_buftarg_is_mem(btp))
 		return 0;
 
-	error = __read_buf(fd, bp->b_addr, bytes, LIBXFS_BBTOOFF64(blkno), flags);
+	error = libxfs_buftarg_readv(btp, &req, 1);
 	if (!error &&
 	    bp->b_target == btp &&
 	    bp->b_cache_key == blkno &&
@@ -645,29 +798,73 @@ libxfs_readbuf_verify(
 int
 libxfs_readbufr_map(struct xfs_buftarg *btp, struct xfs_buf *bp, int flags)
 {
-	int	fd = btp->bt_bdev_fd;
-	int	error = 0;
-	void	*buf;
-	int	i;
+	return libxfs_readbufr_list(btp, &bp, 1, flags);
+}
+
+/*
+ * Read a list of buffers from disk in a single submission to the I/O engine.
+ * Each buffer is read in its entirety; buffers that are read successfully are
+ * marked uptodate, and the others have b_error set.  Returns the first error
+ * encountered.
+ */
+int
+libxfs_readbufr_list(
+	struct xfs_buftarg	*btp,
+	struct xfs_buf		**bps,
+	unsigned int		nr,
+	int			flags)
+{
+	struct io_req		inline_reqs[LIBXFS_INLINE_IOREQS];
+	struct iovec		inline_iovs[LIBXFS_INLINE_IOREQS];
+	struct io_req		*reqs = inline_reqs;
+	struct iovec		*iovs = inline_iovs;
+	unsigned int		nr_maps = 0;
+	unsigned int		nr_reqs = 0;
+	unsigned int		i, j;
+	int			error = 0;
 
 	if (xfs_buftarg_is_mem(btp))
 		return 0;
 
-	buf = bp->b_addr;
-	for (i = 0; i < bp->b_nmaps; i++) {
-		off_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-		int len = BBTOB(bp->b_maps[i].bm_len);
+	for (i = 0; i < nr; i++)
+		nr_maps += bps[i]->b_nmaps;
+	if (nr_maps > LIBXFS_INLINE_IOREQS) {
+		error = libxfs_ioreqs_alloc(nr_maps, &reqs, &iovs);
+		if (error)
+			return error;
+	}
 
-		error = __read_buf(fd, buf, len, offset, flags);
-		if (error) {
-			bp->b_error = error;
-			break;
+	for (i = 0; i < nr; i++)
+		nr_reqs += libxfs_buf_ioreqs(bps[i], &reqs[nr_reqs],
+				&iovs[nr_reqs]);
+
+	libxfs_buftarg_readv(btp, reqs, nr_reqs);
+
+	/* Walk the requests in the same order to find each buffer's status. */
+	for (i = 0, j = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
+		void		*end = bp->b_addr + BBTOB(bp->b_length);
+		int		bp_error = 0;
+
+		for (; j < nr_reqs && reqs[j].iov[0].iov_base >= bp->b_addr &&
+			reqs[j].iov[0].iov_base < end; j++) {
+			if (!bp_error)
+				bp_error = reqs[j].error;
+		}
+
+		if (bp_error) {
+			bp->b_error = bp_error;
+			if (!error)
+				error = bp_error;
+		} else {
+			bp->b_flags |= LIBXFS_B_UPTODATE;
 		}
-		buf += len;
 	}
 
-	if (!error)
-		bp->b_flags |= LIBXFS_B_UPTODATE;
+	if (reqs != inline_reqs) {
+		free(reqs);
+		free(iovs);
+	}
 	return error;
 }
 
@@ -812,31 +1009,14 @@ err:
 	return error;
 }
 
+/*
+ * Get a buffer ready to be written.  Returns a negative errno if the buffer
+ * must not be written.
+ */
 static int
-__write_buf(int fd, void *buf, int len, off_t offset, int flags)
-{
-	int	sts;
-
-	sts = pwrite(fd, buf, len, offset);
-	if (sts < 0) {
-		int error = errno;
-		fprintf(stderr, _("%s: pwrite failed: %s\n"),
-			progname, strerror(error));
-		return -error;
-	} else if (sts != len) {
-		fprintf(stderr, _("%s: error - pwrite only %d of %d bytes\n"),
-			progname, sts, len);
-		return -EIO;
-	}
-	return 0;
-}
-
-int
-libxfs_bwrite(
+libxfs_bwrite_start(
 	struct xfs_buf	*bp)
 {
-	int		fd = bp->b_target->bt_bdev_fd;
-
 	/*
 	 * we never write buffers that are marked stale. This indicates they
 	 * contain data that has been invalidated, and even if the buffer is
@@ -848,6 +1028,14 @@ libxfs_bwrite(
 		return bp->b_error;
 	}
 
+	/*
+	 * Buffers that were marked dirty have already let go of their cached
+	 * inodes, but callers such as xfs_db change buffers and write them
+	 * straight out.
+	 */
+	if (!(bp->b_flags & LIBXFS_B_DIRTY))
+		libxfs_icache_inval_buf(bp);
+
 	/* Trigger the writeback hook if there is one. */
 	if (bp->b_mount->m_buf_writeback_fn)
 		bp->b_mount->m_buf_writeback_fn(bp);
@@ -858,44 +1046,68 @@ libxfs_bwrite(
 	 * the error before fixing and writing it back.
 	 */
 	bp->b_error = 0;
-	if (bp->b_ops) {
-		bp->b_ops->verify_write(bp);
-		if (bp->b_error) {
-			fprintf(stderr,
+	return 0;
+}
+
+/* Run the write verifier.  This is safe to call from many threads at once. */
+static int
+libxfs_bwrite_verify(
+	struct xfs_buf	*bp)
+{
+	if (!bp->b_ops)
+		return 0;
+
+	bp->b_ops->verify_write(bp);
+	if (bp->b_error)
+		fprintf(stderr,
 	_("%s: write verifier failed on %s bno 0x%llx/0x%x\n"),
-				__func__, bp->b_ops->name,
-				(unsigned long long)xfs_buf_daddr(bp),
-				bp->b_length);
-			return bp->b_error;
-		}
-	}
+			"libxfs_bwrite", bp->b_ops->name,
+			(unsigned long long)xfs_buf_daddr(bp),
+			bp->b_length);
+	return bp->b_error;
+}
 
-	if (xfs_buftarg_is_mem(bp->b_target)) {
-		bp->b_error = 0;
-	} else if (!(bp->b_flags & LIBXFS_B_DISCONTIG)) {
-		bp->b_error = __write_buf(fd, bp->b_addr, BBTOB(bp->b_length),
-				    LIBXFS_BBTOOFF64(xfs_buf_daddr(bp)),
-				    bp->b_flags);
-	} else {
-		int	i;
-		void	*buf = bp->b_addr;
+/* Write a buffer's contents to disk, without any of the checks. */
+static int
+libxfs_bwrite_io(
+	struct xfs_buf	*bp)
+{
+	struct io_req	inline_reqs[LIBXFS_INLINE_IOREQS];
+	struct iovec	inline_iovs[LIBXFS_INLINE_IOREQS];
+	struct io_req	*reqs = inline_reqs;
+	struct iovec	*iovs = inline_iovs;
+	unsigned int	nr;
+	int		error;
 
-		for (i = 0; i < bp->b_nmaps; i++) {
-			off_t	offset = LIBXFS_BBTOOFF64(bp->b_maps[i].bm_bn);
-			int len = BBTOB(bp->b_maps[i].bm_len);
+	if (xfs_buftarg_is_mem(bp->b_target))
+		return 0;
 
-			bp->b_error = __write_buf(fd, buf, len, offset,
-						  bp->b_flags);
-			if (bp->b_error)
-				break;
-			buf += len;
-		}
+	if (bp->b_nmaps > LIBXFS_INLINE_IOREQS) {
+		error = libxfs_ioreqs_alloc(bp->b_nmaps, &reqs, &iovs);
+		if (error)
+			return error;
 	}
 
+	nr = libxfs_buf_ioreqs(bp, reqs, iovs);
+	error = libxfs_buftarg_writev(bp->b_target, reqs, nr);
+
+	if (reqs != inline_reqs) {
+		free(reqs);
+		free(iovs);
+	}
+	return error;
+}
+
+/* Update the buffer state once a write has finished. */
+static void
+libxfs_bwrite_done(
+	struct xfs_buf	*bp)
+{
 	if (bp->b_error) {
 		fprintf(stderr,
 	_("%s: write failed on %s bno 0x%llx/0x%x, err=%d\n"),
-			__func__, bp->b_ops ? bp->b_ops->name : "(unknown)",
+			"libxfs_bwrite",
+			bp->b_ops ? bp->b_ops->name : "(unknown)",
 			(unsigned long long)xfs_buf_daddr(bp),
 			bp->b_length, -bp->b_error);
 	} else {
@@ -903,15 +1115,461 @@ libxfs_bwrite(
 		bp->b_flags &= ~(LIBXFS_B_DIRTY | LIBXFS_B_UNCHECKED);
 		xfs_buftarg_trip_write(bp->b_target);
 	}
+}
+
+int
+libxfs_bwrite(
+	struct xfs_buf	*bp)
+{
+	if (libxfs_bwrite_start(bp))
+		return bp->b_error;
+	if (libxfs_bwrite_verify(bp))
+		return bp->b_error;
+
+	bp->b_error = libxfs_bwrite_io(bp);
+	libxfs_bwrite_done(bp);
 	return bp->b_error;
 }
 
 /*
- * Mark a buffer dirty.  The dirty data will be written out when the cache
- * is flushed (or at release time if the buffer is uncached).
+ * Batched Buffer Writeback
+ * ========================
+ *
+ * Writing a long list of buffers one libxfs_bwrite call at a time runs every
+ * write verifier on one CPU and issues one small synchronous write after
+ * another, so mkfs on filesystems with many AGs and the final flush of
+ * xfs_repair never got anywhere near the bandwidth of the device.
+ *
+ * Instead, we sort the buffers by disk address and cut the list into chunks.
+ * Each chunk runs its write verifiers, merges buffers that are adjacent on
+ * disk into vectored writes, and hands its writes to the I/O engine in as few
+ * submissions as it can.  Long lists are spread over a pool of writer threads
+ * that lives as long as the program, so the verifiers run in parallel and
+ * many writes are in flight even with the synchronous engine.  If a merged
+ * write fails, its buffers are written again one at a time so that the error
+ * is reported against the right buffer.
+ *
+ * Buffers that overlap on disk are kept in the order that the caller gave
+ * them to us, so the last one still wins.  They always end up in the same
+ * chunk, and they never share a submission.
+ */
+
+/* Fewest buffers handled by each work item. */
+#define LIBXFS_WBATCH_CHUNK		64
+
+/* Limits on the size of a merged write. */
+#define LIBXFS_WBATCH_MAX_IOVS		64
+#define LIBXFS_WBATCH_MAX_BYTES		(1U << 20)
+
+#define LIBXFS_WBATCH_MAX_THREADS	16
+
+struct libxfs_wbatch_ent {
+	struct xfs_buf		*bp;
+	xfs_daddr_t		start;
+	xfs_daddr_t		end;
+	unsigned int		seq;		/* position in the caller's list */
+};
+
+static int
+libxfs_wbatch_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct libxfs_wbatch_ent *ea = a;
+	const struct libxfs_wbatch_ent *eb = b;
+
+	if (ea->bp->b_target != eb->bp->b_target)
+		return ea->bp->b_target < eb->bp->b_target ? -1 : 1;
+	if (ea->start != eb->start)
+		return ea->start < eb->start ? -1 : 1;
+	if (ea->seq != eb->seq)
+		return ea->seq < eb->seq ? -1 : 1;
+	return 0;
+}
+
+static int
+libxfs_wbatch_cmp_seq(
+	const void		*a,
+	const void		*b)
+{
+	const struct libxfs_wbatch_ent *ea = a;
+	const struct libxfs_wbatch_ent *eb = b;
+
+	if (ea->seq != eb->seq)
+		return ea->seq < eb->seq ? -1 : 1;
+	return 0;
+}
+
+/*
+ * Sort @bps by disk address, leaving runs of buffers that overlap on disk in
+ * their original order, and cut it into chunks of at least
+ * LIBXFS_WBATCH_CHUNK buffers that don't overlap each other.  The first
+ * buffer of each chunk goes in @chunks, followed by @nr.  Returns the number
+ * of chunks.
+ */
+static unsigned int
+libxfs_wbatch_sort(
+	struct xfs_buf		**bps,
+	unsigned int		nr,
+	unsigned int		*chunks)
+{
+	struct libxfs_wbatch_ent *ents;
+	unsigned int		nr_chunks = 0;
+	unsigned int		start;
+	unsigned int		i;
+	int			j;
+
+	ents = malloc(nr * sizeof(struct libxfs_wbatch_ent));
+	if (!ents) {
+		chunks[0] = 0;
+		chunks[1] = nr;
+		return 1;
+	}
+
+	/* Discontiguous buffers are sorted on the span of all their maps. */
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
+
+		ents[i].bp = bp;
+		ents[i].seq = i;
+		ents[i].start = bp->b_maps[0].bm_bn;
+		ents[i].end = bp->b_maps[0].bm_bn + bp->b_maps[0].bm_len;
+		for (j = 1; j < bp->b_nmaps; j++) {
+			ents[i].start = min(ents[i].start,
+					bp->b_maps[j].bm_bn);
+			ents[i].end = max(ents[i].end,
+					bp->b_maps[j].bm_bn +
+					bp->b_maps[j].bm_len);
+		}
+	}
+	qsort(ents, nr, sizeof(struct libxfs_wbatch_ent), libxfs_wbatch_cmp);
+
+	chunks[0] = 0;
+	for (start = 0; start < nr; start = i) {
+		struct xfs_buftarg	*btp = ents[start].bp->b_target;
+		xfs_daddr_t		end = ents[start].end;
+
+		for (i = start + 1; i < nr; i++) {
+			if (ents[i].bp->b_target != btp ||
+			    ents[i].start >= end)
+				break;
+			end = max(end, ents[i].end);
+		}
+		if (i - start > 1)
+			qsort(&ents[start], i - start,
+					sizeof(struct libxfs_wbatch_ent),
+					libxfs_wbatch_cmp_seq);
+		if (i - chunks[nr_chunks] >= LIBXFS_WBATCH_CHUNK)
+			chunks[++nr_chunks] = i;
+	}
+	if (chunks[nr_chunks] < nr)
+		chunks[++nr_chunks] = nr;
+
+	for (i = 0; i < nr; i++)
+		bps[i] = ents[i].bp;
+	free(ents);
+	return nr_chunks;
+}
+
+/* Can @bp be added to the end of @req, which ends with @prev? */
+static inline bool
+libxfs_wbatch_can_merge(
+	struct xfs_buf		*prev,
+	struct xfs_buf		*bp,
+	struct io_req		*req)
+{
+	size_t			len = io_req_len(req);
+
+	if (prev->b_target != bp->b_target)
+		return false;
+	if ((prev->b_flags | bp->b_flags) & LIBXFS_B_DISCONTIG)
+		return false;
+	if (req->iovcnt >= LIBXFS_WBATCH_MAX_IOVS ||
+	    len + BBTOB(bp->b_length) > LIBXFS_WBATCH_MAX_BYTES)
+		return false;
+	return req->offset + len == LIBXFS_BBTOOFF64(xfs_buf_daddr(bp));
+}
+
+/*
+ * Verify and write a sorted run of buffers that have been through
+ * libxfs_bwrite_start.  This sets b_error on each buffer but leaves the rest
+ * of the completion to the caller.
+ */
+static void
+libxfs_wbatch_write(
+	struct xfs_buf		**bps,
+	unsigned int		nr)
+{
+	struct io_req		*reqs;
+	struct iovec		*iovs;
+	unsigned int		*req_buf;	/* first buffer of each req */
+	struct xfs_buf		*prev = NULL;
+	unsigned int		nr_maps = 0;
+	unsigned int		nr_reqs = 0;
+	unsigned int		nr_iovs = 0;
+	unsigned int		i, j, start;
+
+	for (i = 0; i < nr; i++) {
+		if (!libxfs_bwrite_verify(bps[i]))
+			nr_maps += bps[i]->b_nmaps;
+	}
+	if (!nr_maps)
+		return;
+
+	req_buf = malloc(nr_maps * sizeof(unsigned int));
+	if (!req_buf || libxfs_ioreqs_alloc(nr_maps, &reqs, &iovs)) {
+		free(req_buf);
+		for (i = 0; i < nr; i++) {
+			if (!bps[i]->b_error)
+				bps[i]->b_error = libxfs_bwrite_io(bps[i]);
+		}
+		return;
+	}
+
+	/*
+	 * Describe the writes.  The iovecs are handed out in order, so a
+	 * request grows into the next free iovec when it absorbs a buffer.
+	 */
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = bps[i];
+		unsigned int	n;
+
+		if (bp->b_error || xfs_buftarg_is_mem(bp->b_target))
+			continue;
+
+		if (prev && libxfs_wbatch_can_merge(prev, bp,
+						&reqs[nr_reqs - 1])) {
+			iovs[nr_iovs].iov_base = bp->b_addr;
+			iovs[nr_iovs].iov_len = BBTOB(bp->b_length);
+			reqs[nr_reqs - 1].iovcnt++;
+			nr_iovs++;
+		} else {
+			n = libxfs_buf_ioreqs(bp, &reqs[nr_reqs],
+					&iovs[nr_iovs]);
+			for (j = 0; j < n; j++)
+				req_buf[nr_reqs + j] = i;
+			nr_reqs += n;
+			nr_iovs += n;
+		}
+		prev = bp;
+	}
+
+	/*
+	 * Submit the writes for each buffer target in turn.  The engine may
+	 * run the writes of one submission in any order, so start a new one
+	 * whenever a write might land on top of an earlier one, and finish
+	 * off any failed writes before anything else can overwrite them.
+	 */
+	for (start = 0; start < nr_reqs; start = i) {
+		struct xfs_buftarg	*btp = bps[req_buf[start]]->b_target;
+		off_t			end;
+
+		end = reqs[start].offset + io_req_len(&reqs[start]);
+		for (i = start + 1; i < nr_reqs; i++) {
+			if (bps[req_buf[i]]->b_target != btp ||
+			    reqs[i].offset < end)
+				break;
+			end = reqs[i].offset + io_req_len(&reqs[i]);
+		}
+		libxfs_buftarg_writev(btp, &reqs[start], i - start);
+
+		/*
+		 * Pass errors on to the buffers.  A request covers the
+		 * buffers from its first one up to the first buffer of the
+		 * next request, but discontiguous buffers can have several
+		 * requests of their own.
+		 */
+		for (j = start; j < i; j++) {
+			unsigned int	first = req_buf[j];
+			unsigned int	last;
+			unsigned int	k;
+
+			if (!reqs[j].error)
+				continue;
+
+			last = j + 1 < nr_reqs ? req_buf[j + 1] : nr;
+			if (last <= first + 1) {
+				bps[first]->b_error = reqs[j].error;
+				continue;
+			}
+
+			for (k = first; k < last; k++) {
+				if (!bps[k]->b_error &&
+				    !xfs_buftarg_is_mem(bps[k]->b_target))
+					bps[k]->b_error =
+						libxfs_bwrite_io(bps[k]);
+			}
+		}
+	}
+
+	free(req_buf);
+	free(reqs);
+	free(iovs);
+}
+
+/*
+ * Writer threads, started the first time a batch is big enough to need them
+ * and stopped by libxfs_bcache_free.  Any number of batches can share them.
+ */
+static pthread_mutex_t		libxfs_wbatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct workqueue		libxfs_wbatch_wq;
+static bool			libxfs_wbatch_started;
+static bool			libxfs_wbatch_running;
+
+static struct workqueue *
+libxfs_wbatch_pool(void)
+{
+	struct workqueue	*wq = NULL;
+	unsigned int		nr_threads;
+
+	pthread_mutex_lock(&libxfs_wbatch_lock);
+	if (!libxfs_wbatch_started) {
+		nr_threads = min_t(unsigned int, platform_nproc(),
+				LIBXFS_WBATCH_MAX_THREADS);
+		if (nr_threads > 1 &&
+		    !workqueue_create(&libxfs_wbatch_wq, NULL, nr_threads))
+			libxfs_wbatch_running = true;
+		libxfs_wbatch_started = true;
+	}
+	if (libxfs_wbatch_running)
+		wq = &libxfs_wbatch_wq;
+	pthread_mutex_unlock(&libxfs_wbatch_lock);
+
+	return wq;
+}
+
+static void
+libxfs_wbatch_pool_stop(void)
+{
+	pthread_mutex_lock(&libxfs_wbatch_lock);
+	if (libxfs_wbatch_running) {
+		workqueue_terminate(&libxfs_wbatch_wq);
+		workqueue_destroy(&libxfs_wbatch_wq);
+	}
+	libxfs_wbatch_running = false;
+	libxfs_wbatch_started = false;
+	pthread_mutex_unlock(&libxfs_wbatch_lock);
+}
+
+struct libxfs_wbatch {
+	struct xfs_buf		**bps;
+	unsigned int		*chunks;	/* first buffer of each chunk */
+	pthread_mutex_t		lock;
+	pthread_cond_t		done;
+	unsigned int		pending;	/* chunks not yet written */
+};
+
+static void
+libxfs_wbatch_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct libxfs_wbatch	*wb = arg;
+	unsigned int		start = wb->chunks[index];
+
+	libxfs_wbatch_write(wb->bps + start, wb->chunks[index + 1] - start);
+
+	pthread_mutex_lock(&wb->lock);
+	if (--wb->pending == 0)
+		pthread_cond_signal(&wb->done);
+	pthread_mutex_unlock(&wb->lock);
+}
+
+/*
+ * Write out an array of buffers, and return the first error.  The array is
+ * sorted in place; the caller keeps its references to the buffers.
+ */
+static int
+libxfs_bwrite_batch(
+	struct xfs_buf		**bps,
+	unsigned int		nr)
+{
+	struct libxfs_wbatch	wb = {
+		.bps		= bps,
+		.lock		= PTHREAD_MUTEX_INITIALIZER,
+		.done		= PTHREAD_COND_INITIALIZER,
+	};
+	unsigned int		one_chunk[2];
+	struct workqueue	*wq = NULL;
+	unsigned int		nr_chunks;
+	unsigned int		nr_todo = 0;
+	unsigned int		i;
+	int			error = 0;
+
+	/*
+	 * Write failure injection crashes the program after a set number of
+	 * writes, so issue them in order and one at a time to keep the crash
+	 * point exact.
+	 */
+	for (i = 0; i < nr; i++) {
+		if (bps[i]->b_target->flags & XFS_BUFTARG_INJECT_WRITE_FAIL)
+			break;
+	}
+	if (i < nr) {
+		for (i = 0; i < nr; i++) {
+			libxfs_bwrite(bps[i]);
+			if (bps[i]->b_error && !error)
+				error = bps[i]->b_error;
+		}
+		return error;
+	}
+
+	/* Weed out the buffers that we must not write at all. */
+	for (i = 0; i < nr; i++) {
+		if (!libxfs_bwrite_start(bps[i]))
+			bps[nr_todo++] = bps[i];
+		else if (!error)
+			error = bps[i]->b_error;
+	}
+	if (!nr_todo)
+		return error;
+
+	/* If we can't sort, write everything in the order we were given. */
+	wb.chunks = malloc((DIV_ROUND_UP(nr_todo, LIBXFS_WBATCH_CHUNK) + 1) *
+			sizeof(unsigned int));
+	if (wb.chunks) {
+		nr_chunks = libxfs_wbatch_sort(bps, nr_todo, wb.chunks);
+	} else {
+		one_chunk[0] = 0;
+		one_chunk[1] = nr_todo;
+		wb.chunks = one_chunk;
+		nr_chunks = 1;
+	}
+
+	wb.pending = nr_chunks;
+	if (nr_chunks > 1)
+		wq = libxfs_wbatch_pool();
+	for (i = 0; i < nr_chunks; i++) {
+		if (!wq || workqueue_add(wq, libxfs_wbatch_worker, i, &wb))
+			libxfs_wbatch_worker(wq, i, &wb);
+	}
+
+	pthread_mutex_lock(&wb.lock);
+	while (wb.pending > 0)
+		pthread_cond_wait(&wb.done, &wb.lock);
+	pthread_mutex_unlock(&wb.lock);
+	pthread_cond_destroy(&wb.done);
+	pthread_mutex_destroy(&wb.lock);
+	if (wb.chunks != one_chunk)
+		free(wb.chunks);
+
+	for (i = 0; i < nr_todo; i++) {
+		if (!bps[i]->b_error)
+			libxfs_bwrite_done(bps[i]);
+		else if (!error)
+			error = bps[i]->b_error;
+	}
+	return error;
+}
+
+/*
+ * Mark an inode cluster buffer dirty after flushing an incore inode into it.
+ * The new contents came from the inode cache, so unlike
+ * libxfs_buf_mark_dirty this leaves the cached inodes alone.
  */
 void
-libxfs_buf_mark_dirty(
+libxfs_buf_mark_dirty_iflush(
 	struct xfs_buf	*bp)
 {
 	/*
@@ -923,6 +1581,18 @@ libxfs_buf_mark_dirty(
 	bp->b_flags |= LIBXFS_B_DIRTY | LIBXFS_B_UPTODATE;
 }
 
+/*
+ * Mark a buffer dirty.  The dirty data will be written out when the cache
+ * is flushed (or at release time if the buffer is uncached).
+ */
+void
+libxfs_buf_mark_dirty(
+	struct xfs_buf	*bp)
+{
+	libxfs_icache_inval_buf(bp);
+	libxfs_buf_mark_dirty_iflush(bp);
+}
+
 /* Prepare a buffer to be sent to the MRU list. */
 static inline void
 libxfs_buf_prepare_mru(
@@ -994,6 +1664,8 @@ libxfs_bcache_free(void)
 	struct list_head	*cm_list;
 	struct xfs_buf		*bp, *next;
 
+	libxfs_wbatch_pool_stop();
+
 	cm_list = &xfs_buf_freelist.cm_list;
 	list_for_each_entry_safe(bp, next, cm_list, b_node.cn_mru) {
 		free(bp->b_addr);
@@ -1022,11 +1694,46 @@ libxfs_bflush(
 	return bp->b_error;
 }
 
+/* Write back all the dirty buffers in the cache in one batch. */
+static void
+libxfs_bbulkflush(
+	struct cache		*cache,
+	struct cache_node	**nodes,
+	unsigned int		nr)
+{
+	struct xfs_buf		**bps;
+	unsigned int		nr_dirty = 0;
+	unsigned int		i;
+
+	bps = malloc(nr * sizeof(struct xfs_buf *));
+	if (!bps) {
+		for (i = 0; i < nr; i++)
+			libxfs_bflush(nodes[i]);
+		return;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct xfs_buf	*bp = container_of(nodes[i], struct xfs_buf,
+						   b_node);
+
+		if (!bp->b_error && bp->b_flags & LIBXFS_B_DIRTY)
+			bps[nr_dirty++] = bp;
+	}
+
+	libxfs_bwrite_batch(bps, nr_dirty);
+	free(bps);
+}
+
+/*
+ * Purging writes out dirty buffers one at a time as it comes across them, so
+ * flush them all in one go first.
+ */
 void
 libxfs_bcache_purge(struct xfs_mount *mp)
 {
 	if (!mp)
 		return;
+	libxfs_bcache_flush(mp);
 	cache_purge(mp->m_ddev_targp->bcache);
 	cache_purge(mp->m_logdev_targp->bcache);
 	cache_purge(mp->m_rtdev_targp->bcache);
@@ -1056,7 +1763,8 @@ struct cache_operations libxfs_bcache_operations = {
 	.flush		= libxfs_bflush,
 	.relse		= libxfs_brelse,
 	.compare	= libxfs_bcompare,
-	.bulkrelse	= libxfs_bulkrelse
+	.bulkrelse	= libxfs_bulkrelse,
+	.bulkflush	= libxfs_bbulkflush,
 };
 
 /*
@@ -1126,17 +1834,37 @@ int
 xfs_buf_delwri_submit(
 	struct list_head	*buffer_list)
 {
+	struct xfs_buf		**bps;
 	struct xfs_buf		*bp, *n;
+	unsigned int		nr = 0;
 	int			error = 0, error2;
 
+	list_for_each_entry(bp, buffer_list, b_list)
+		nr++;
+
+	bps = malloc(nr * sizeof(struct xfs_buf *));
+	if (!bps) {
+		list_for_each_entry_safe(bp, n, buffer_list, b_list) {
+			list_del_init(&bp->b_list);
+			error2 = libxfs_bwrite(bp);
+			if (!error)
+				error = error2;
+			libxfs_buf_relse(bp);
+		}
+		return error;
+	}
+
+	nr = 0;
 	list_for_each_entry_safe(bp, n, buffer_list, b_list) {
 		list_del_init(&bp->b_list);
-		error2 = libxfs_bwrite(bp);
-		if (!error)
-			error = error2;
-		libxfs_buf_relse(bp);
+		bps[nr++] = bp;
 	}
 
+	error = libxfs_bwrite_batch(bps, nr);
+
+	while (nr > 0)
+		libxfs_buf_relse(bps[--nr]);
+	free(bps);
 	return error;
 }
 
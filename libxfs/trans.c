@@ -930,10 +930,11 @@ inode_item_done(
 	if (error) {
 		fprintf(stderr, _("%s: warning - iflush_int failed (%d)\n"),
 			progname, error);
+		libxfs_icache_inval_inode(iip->ili_inode);
 		goto free;
 	}
 
-	libxfs_buf_mark_dirty(bp);
+	libxfs_buf_mark_dirty_iflush(bp);
 free:
 	libxfs_buf_relse(bp);
 free_item:
@@ -1005,6 +1006,9 @@ static void
 inode_item_unlock(
 	struct xfs_inode_log_item	*iip)
 {
+	/* Logged changes that never get flushed must not stay cached. */
+	if (iip->ili_fields & XFS_ILOG_ALL)
+		libxfs_icache_inval_inode(iip->ili_inode);
 	xfs_inode_item_put(iip);
 }
 
@@ -257,6 +257,30 @@ AC_DEFUN([AC_HAVE_GETRANDOM_NONBLOCK],
     AC_SUBST(have_getrandom_nonblock)
   ])
 
+#
+# Check if we have the io_uring system calls and ring definitions (Linux)
+#
+AC_DEFUN([AC_HAVE_IO_URING],
+  [ AC_MSG_CHECKING([for io_uring])
+    AC_LINK_IFELSE(
+    [	AC_LANG_PROGRAM([[
+#define _GNU_SOURCE
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+	]], [[
+struct io_uring_params p = { .features = IORING_FEAT_SINGLE_MMAP };
+int op = IORING_OP_READV;
+int cancel = IORING_OP_ASYNC_CANCEL;
+syscall(__NR_io_uring_setup, 1, &p);
+syscall(__NR_io_uring_enter, 0, 0, 0, IORING_ENTER_GETEVENTS, 0, 0);
+	]])
+    ], have_io_uring=yes
+       AC_MSG_RESULT(yes),
+       AC_MSG_RESULT(no))
+    AC_SUBST(have_io_uring)
+  ])
+
 AC_DEFUN([AC_PACKAGE_CHECK_LTO],
   [ AC_MSG_CHECKING([if C compiler supports LTO])
     OLD_CFLAGS="$CFLAGS"
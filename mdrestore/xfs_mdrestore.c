@@ -8,6 +8,10 @@
 #include "xfs_metadump.h"
 #include <libfrog/platform.h>
 #include "libfrog/div64.h"
+#include "libfrog/workqueue.h"
+#include "libfrog/lzcodec.h"
+#include "libfrog/ioengine.h"
+#include <getopt.h>
 
 union mdrestore_headers {
 	__be32				magic;
@@ -36,9 +40,11 @@ static struct mdrestore {
 	struct mdrestore_ops	*mdrops;
 	bool			show_progress;
 	bool			show_info;
+	bool			show_stats;
 	bool			progress_since_warning;
 	bool			external_log;
 	bool			realtime_data;
+	bool			delta;
 } mdrestore;
 
 static void
@@ -190,18 +196,333 @@ verify_device_size(
 	}
 }
 
+/*
+ * A delta is restored on top of its base, so the target devices have already
+ * been sized and anything written at their ends is live.  The filesystem may
+ * have grown since the base was dumped, though, so grow a file target to fit.
+ */
 static void
-verify_main_device_size(
+grow_device_file(
 	const struct mdrestore_dev	*dev,
-	struct xfs_sb			*sb)
+	xfs_rfsblock_t			nr_blocks,
+	uint32_t			blocksize)
 {
-	xfs_rfsblock_t			nr_blocks = sb->sb_dblocks;
+	struct stat			statbuf;
 
+	if (!dev->is_file)
+		return;
+	if (fstat(dev->fd, &statbuf) < 0)
+		fatal("cannot stat filesystem image: %s\n", strerror(errno));
+	if (statbuf.st_size < (off_t)nr_blocks * blocksize &&
+	    ftruncate(dev->fd, nr_blocks * blocksize))
+		fatal("cannot set filesystem image size: %s\n",
+			strerror(errno));
+}
+
+static xfs_rfsblock_t
+main_device_blocks(
+	struct xfs_sb			*sb)
+{
 	/* internal RT device */
 	if (sb->sb_rtstart)
-		nr_blocks = sb->sb_rtstart + sb->sb_rblocks;
+		return sb->sb_rtstart + sb->sb_rblocks;
+	return sb->sb_dblocks;
+}
+
+static void
+verify_main_device_size(
+	const struct mdrestore_dev	*dev,
+	struct xfs_sb			*sb)
+{
+	verify_device_size(dev, main_device_blocks(sb), sb->sb_blocksize);
+}
+
+/*
+ * Restore Pipeline
+ * ================
+ *
+ * Restored blocks are gathered into large batches.  Blocks that are adjacent
+ * on the target device are coalesced into a single write, and a writer thread
+ * pushes each batch through the I/O engine while the main thread reads the
+ * next part of the dump.  Batches are written strictly in order and a batch
+ * never holds two writes to the same block, so if a block appears more than
+ * once in a dump, the last copy wins just as it always has.
+ */
+#define MDR_BATCH_SIZE		(4U << 20)
+#define MDR_BATCH_WRITES	256
+#define MDR_NR_BATCHES		4
+
+/* stdio buffer for reading the dump */
+#define MDR_READ_BUF_SIZE	(8U << 20)
+
+struct mdr_batch {
+	char			*buf;
+	size_t			used;
+	int			fd;
+	const char		*device;
+	unsigned int		nr;
+	struct io_req		reqs[MDR_BATCH_WRITES];
+	struct iovec		iov[MDR_BATCH_WRITES];
+};
+
+static struct mdr_writer {
+	const struct ioengine	*engine;
+	pthread_t		thread;
+	pthread_mutex_t		lock;
+	pthread_cond_t		wake;
+	struct mdr_batch	batches[MDR_NR_BATCHES];
+	uint64_t		head;	/* batch being filled */
+	uint64_t		tail;	/* next batch to write */
+	bool			shutdown;
+
+	/* statistics */
+	uint64_t		read_bytes;
+	uint64_t		read_ns;
+	uint64_t		write_bytes;
+	uint64_t		write_ns;
+	uint64_t		nr_writes;
+} mdr_writer;
+
+static inline uint64_t
+mdr_now(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* mdr_fread() from the dump, accounting for the read side of the pipeline. */
+static size_t
+mdr_fread(
+	void			*ptr,
+	size_t			size,
+	size_t			nmemb,
+	FILE			*md_fp)
+{
+	uint64_t		start = mdr_now();
+	size_t			ret;
+
+	ret = fread(ptr, size, nmemb, md_fp);
+	mdr_writer.read_ns += mdr_now() - start;
+	mdr_writer.read_bytes += ret * size;
+	return ret;
+}
+
+static void *
+mdr_writer_thread(
+	void			*arg)
+{
+	pthread_mutex_lock(&mdr_writer.lock);
+	for (;;) {
+		struct mdr_batch	*batch;
+		uint64_t		start;
+		unsigned int		i;
+		int			error;
+
+		while (mdr_writer.tail == mdr_writer.head &&
+		       !mdr_writer.shutdown)
+			pthread_cond_wait(&mdr_writer.wake, &mdr_writer.lock);
+		if (mdr_writer.tail == mdr_writer.head)
+			break;
+		batch = &mdr_writer.batches[mdr_writer.tail % MDR_NR_BATCHES];
+		pthread_mutex_unlock(&mdr_writer.lock);
+
+		start = mdr_now();
+		error = mdr_writer.engine->writev(batch->fd, batch->reqs,
+				batch->nr);
+		for (i = 0; error && i < batch->nr; i++) {
+			if (batch->reqs[i].error)
+				fatal("error writing to %s device at offset %llu: %s\n",
+					batch->device,
+					(unsigned long long)batch->reqs[i].offset,
+					strerror(-batch->reqs[i].error));
+		}
+
+		pthread_mutex_lock(&mdr_writer.lock);
+		mdr_writer.write_ns += mdr_now() - start;
+		mdr_writer.write_bytes += batch->used;
+		mdr_writer.nr_writes += batch->nr;
+		batch->used = 0;
+		batch->nr = 0;
+		mdr_writer.tail++;
+		pthread_cond_broadcast(&mdr_writer.wake);
+	}
+	pthread_mutex_unlock(&mdr_writer.lock);
+
+	ioengine_thread_exit();
+	return NULL;
+}
+
+static void
+mdr_writer_start(void)
+{
+	unsigned int		i;
+	int			error;
+
+	mdr_writer.engine = ioengine_default();
+	mdr_writer.shutdown = false;
+	for (i = 0; i < MDR_NR_BATCHES; i++) {
+		mdr_writer.batches[i].buf = malloc(MDR_BATCH_SIZE);
+		if (!mdr_writer.batches[i].buf)
+			fatal("Unable to allocate write buffer memory\n");
+	}
+	pthread_mutex_init(&mdr_writer.lock, NULL);
+	pthread_cond_init(&mdr_writer.wake, NULL);
+
+	error = pthread_create(&mdr_writer.thread, NULL, mdr_writer_thread,
+			NULL);
+	if (error)
+		fatal("Unable to start writer thread: %s\n", strerror(error));
+}
+
+/* Hand the batch being filled to the writer and wait for a free one. */
+static void
+mdr_writer_submit(void)
+{
+	struct mdr_batch	*batch;
+
+	batch = &mdr_writer.batches[mdr_writer.head % MDR_NR_BATCHES];
+	if (!batch->nr)
+		return;
+
+	pthread_mutex_lock(&mdr_writer.lock);
+	mdr_writer.head++;
+	pthread_cond_broadcast(&mdr_writer.wake);
+	while (mdr_writer.head - mdr_writer.tail >= MDR_NR_BATCHES)
+		pthread_cond_wait(&mdr_writer.wake, &mdr_writer.lock);
+	pthread_mutex_unlock(&mdr_writer.lock);
+}
+
+/* Write out everything queued so far and stop the writer thread. */
+static void
+mdr_writer_finish(void)
+{
+	unsigned int		i;
+
+	mdr_writer_submit();
+
+	pthread_mutex_lock(&mdr_writer.lock);
+	mdr_writer.shutdown = true;
+	pthread_cond_broadcast(&mdr_writer.wake);
+	pthread_mutex_unlock(&mdr_writer.lock);
+	pthread_join(mdr_writer.thread, NULL);
+
+	for (i = 0; i < MDR_NR_BATCHES; i++)
+		free(mdr_writer.batches[i].buf);
+	pthread_cond_destroy(&mdr_writer.wake);
+	pthread_mutex_destroy(&mdr_writer.lock);
+}
+
+/*
+ * Find room in the current batch for @len bytes to be written to @offset on
+ * @fd.  The caller fills in the data and then calls mdr_writer_commit().
+ */
+static void *
+mdr_writer_space(
+	int			fd,
+	const char		*device,
+	uint64_t		offset,
+	size_t			len)
+{
+	struct mdr_batch	*batch;
+	unsigned int		i;
+
+	ASSERT(len <= MDR_BATCH_SIZE);
+
+	batch = &mdr_writer.batches[mdr_writer.head % MDR_NR_BATCHES];
+	if (batch->nr && (batch->fd != fd ||
+			  batch->used + len > MDR_BATCH_SIZE ||
+			  batch->nr == MDR_BATCH_WRITES))
+		goto submit;
+
+	/* The engine may reorder writes within a batch, so no overlaps. */
+	for (i = 0; i < batch->nr; i++) {
+		struct io_req	*req = &batch->reqs[i];
+
+		if (offset < req->offset + req->iov->iov_len &&
+		    req->offset < offset + len)
+			goto submit;
+	}
+	goto out;
+
+submit:
+	mdr_writer_submit();
+	batch = &mdr_writer.batches[mdr_writer.head % MDR_NR_BATCHES];
+out:
+	batch->fd = fd;
+	batch->device = device;
+	return batch->buf + batch->used;
+}
+
+static void
+mdr_writer_commit(
+	uint64_t		offset,
+	size_t			len)
+{
+	struct mdr_batch	*batch;
+	struct io_req		*req;
+
+	batch = &mdr_writer.batches[mdr_writer.head % MDR_NR_BATCHES];
+
+	/* Extend the last write if this one follows it on disk. */
+	if (batch->nr) {
+		req = &batch->reqs[batch->nr - 1];
+		if (req->offset + req->iov->iov_len == offset) {
+			req->iov->iov_len += len;
+			batch->used += len;
+			return;
+		}
+	}
+
+	req = &batch->reqs[batch->nr];
+	req->offset = offset;
+	req->iov = &batch->iov[batch->nr];
+	req->iovcnt = 1;
+	req->iov->iov_base = batch->buf + batch->used;
+	req->iov->iov_len = len;
+	batch->nr++;
+	batch->used += len;
+}
+
+/* Queue a copy of @len bytes at @buf to be written to @offset on @fd. */
+static void
+mdr_write(
+	int			fd,
+	const char		*device,
+	const char		*buf,
+	size_t			len,
+	uint64_t		offset)
+{
+	while (len > 0) {
+		size_t		count = min_t(size_t, len, MDR_BATCH_SIZE);
+
+		memcpy(mdr_writer_space(fd, device, offset, count), buf,
+				count);
+		mdr_writer_commit(offset, count);
+		buf += count;
+		offset += count;
+		len -= count;
+	}
+}
 
-	verify_device_size(dev, nr_blocks, sb->sb_blocksize);
+static void
+report_stats(
+	uint64_t		elapsed_ns)
+{
+	double			rsecs = mdr_writer.read_ns / 1e9;
+	double			wsecs = mdr_writer.write_ns / 1e9;
+	double			mb = 1024.0 * 1024.0;
+
+	printf("read:  %.1f MiB in %.3fs, %.1f MiB/s\n",
+		mdr_writer.read_bytes / mb, rsecs,
+		rsecs > 0 ? mdr_writer.read_bytes / mb / rsecs : 0.0);
+	printf("write: %.1f MiB in %llu writes, %.3fs, %.1f MiB/s (%s)\n",
+		mdr_writer.write_bytes / mb,
+		(unsigned long long)mdr_writer.nr_writes, wsecs,
+		wsecs > 0 ? mdr_writer.write_bytes / mb / wsecs : 0.0,
+		mdr_writer.engine->name);
+	printf("total: %.3fs\n", elapsed_ns / 1e9);
 }
 
 static void
@@ -209,7 +530,7 @@ read_header_v1(
 	union mdrestore_headers	*h,
 	FILE			*md_fp)
 {
-	if (fread((uint8_t *)&(h->v1.mb_count),
+	if (mdr_fread((uint8_t *)&(h->v1.mb_count),
 			sizeof(h->v1) - sizeof(h->magic), 1, md_fp) != 1)
 		fatal("error reading from metadump file\n");
 }
@@ -263,14 +584,14 @@ restore_v1(
 	block_index = (__be64 *)((char *)metablock + sizeof(xfs_metablock_t));
 	block_buffer = (char *)metablock + block_size;
 
-	if (fread(block_index, block_size - sizeof(struct xfs_metablock), 1,
+	if (mdr_fread(block_index, block_size - sizeof(struct xfs_metablock), 1,
 			md_fp) != 1)
 		fatal("error reading from metadump file\n");
 
 	if (block_index[0] != 0)
 		fatal("first block is not the primary superblock\n");
 
-	if (fread(block_buffer, mb_count << h->v1.mb_blocklog, 1, md_fp) != 1)
+	if (mdr_fread(block_buffer, mb_count << h->v1.mb_blocklog, 1, md_fp) != 1)
 		fatal("error reading from metadump file\n");
 
 	libxfs_sb_from_disk(&sb, (struct xfs_dsb *)block_buffer);
@@ -297,19 +618,15 @@ restore_v1(
 	for (;;) {
 		maybe_print_progress(&mb_read, bytes_read);
 
-		for (cur_index = 0; cur_index < mb_count; cur_index++) {
-			if (pwrite(ddev->fd, &block_buffer[cur_index <<
+		for (cur_index = 0; cur_index < mb_count; cur_index++)
+			mdr_write(ddev->fd, "data", &block_buffer[cur_index <<
 					h->v1.mb_blocklog], block_size,
 					be64_to_cpu(block_index[cur_index]) <<
-						BBSHIFT) < 0)
-				fatal("error writing block %llu: %s\n",
-					be64_to_cpu(block_index[cur_index]) << BBSHIFT,
-					strerror(errno));
-		}
+						BBSHIFT);
 		if (mb_count < max_indices)
 			break;
 
-		if (fread(metablock, block_size, 1, md_fp) != 1)
+		if (mdr_fread(metablock, block_size, 1, md_fp) != 1)
 			fatal("error reading from metadump file\n");
 
 		mb_count = be16_to_cpu(metablock->mb_count);
@@ -318,13 +635,14 @@ restore_v1(
 		if (mb_count > max_indices)
 			fatal("bad block count: %u\n", mb_count);
 
-		if (fread(block_buffer, mb_count << h->v1.mb_blocklog,
+		if (mdr_fread(block_buffer, mb_count << h->v1.mb_blocklog,
 				1, md_fp) != 1)
 			fatal("error reading from metadump file\n");
 
 		bytes_read += block_size + (mb_count << h->v1.mb_blocklog);
 	}
 
+	mdr_writer_finish();
 	final_print_progress(&mb_read, bytes_read);
 
 	fixup_superblock(ddev->fd, block_buffer, &sb);
@@ -345,14 +663,19 @@ read_header_v2(
 {
 	unsigned int			compat;
 
-	if (fread((uint8_t *)&(h->v2) + sizeof(h->v2.xmh_magic),
+	/* v3 uses the v2 header, only with a different magic number */
+
+	if (mdr_fread((uint8_t *)&(h->v2) + sizeof(h->v2.xmh_magic),
 			sizeof(h->v2) - sizeof(h->v2.xmh_magic), 1, md_fp) != 1)
 		fatal("error reading from metadump file\n");
 
 	if (h->v2.xmh_incompat_flags & cpu_to_be32(~XFS_MD2_INCOMPAT_ALL))
 		fatal("Metadump header has unknown incompat flags set\n");
 
-	if (h->v2.xmh_reserved != 0)
+	mdrestore.delta = h->v2.xmh_incompat_flags &
+			  cpu_to_be32(XFS_MD2_INCOMPAT_DELTA);
+	if (!mdrestore.delta &&
+	    (h->v2.xmh_chain_id != 0 || h->v2.xmh_chain_seq != 0))
 		fatal("Metadump header's reserved field has a non-zero value\n");
 
 	compat = be32_to_cpu(h->v2.xmh_compat_flags);
@@ -383,99 +706,185 @@ show_info_v2(
 		compat_flags & XFS_MD2_COMPAT_EXTERNALLOG ? "":"not ",
 		incompat_flags & XFS_MD2_INCOMPAT_RTDEVICE ? "":"not ",
 		compat_flags & XFS_MD2_COMPAT_FULLBLOCKS ? "full":"zeroed");
+	if (incompat_flags & XFS_MD2_INCOMPAT_DELTA)
+		printf("%s: delta %u of chain 0x%08x\n", md_file,
+			be32_to_cpu(h->v2.xmh_chain_seq),
+			be32_to_cpu(h->v2.xmh_chain_id));
 }
 
-#define MDR_IO_BUF_SIZE (8 * 1024 * 1024)
+/* Pick the target device for a v2 extent address. */
+static int
+xme_addr_to_fd(
+	uint64_t			addr,
+	const struct mdrestore_dev	*ddev,
+	const struct mdrestore_dev	*logdev,
+	const struct mdrestore_dev	*rtdev,
+	char				**device)
+{
+	switch (addr & XME_ADDR_DEVICE_MASK) {
+	case XME_ADDR_DATA_DEVICE:
+		*device = "data";
+		return ddev->fd;
+	case XME_ADDR_LOG_DEVICE:
+		*device = "log";
+		return logdev->fd;
+	case XME_ADDR_RT_DEVICE:
+		*device = "rt";
+		return rtdev->fd;
+	default:
+		fatal("Invalid device found in metadump\n");
+		return -1;
+	}
+}
 
+/* Read an extent from the dump straight into the write batches. */
 static void
 restore_meta_extent(
 	FILE		*md_fp,
 	int		dev_fd,
 	char		*device,
-	void		*buf,
 	uint64_t	offset,
 	int		len)
 {
 	int		io_size;
-
-	io_size = min(len, MDR_IO_BUF_SIZE);
+	void		*buf;
 
 	do {
-		if (fread(buf, io_size, 1, md_fp) != 1)
+		io_size = min_t(int, len, MDR_BATCH_SIZE);
+		buf = mdr_writer_space(dev_fd, device, offset, io_size);
+		if (mdr_fread(buf, io_size, 1, md_fp) != 1)
 			fatal("error reading from metadump file\n");
-		if (pwrite(dev_fd, buf, io_size, offset) < 0)
-			fatal("error writing to %s device at offset %llu: %s\n",
-				device, offset, strerror(errno));
+		mdr_writer_commit(offset, io_size);
 		len -= io_size;
 		offset += io_size;
-
-		io_size = min(len, io_size);
 	} while (len);
 }
 
+/* Zero an extent that a delta dump says is no longer metadata. */
 static void
-restore_v2(
-	union mdrestore_headers		*h,
-	FILE				*md_fp,
-	const struct mdrestore_dev	*ddev,
-	const struct mdrestore_dev	*logdev,
-	const struct mdrestore_dev	*rtdev)
+restore_tombstone(
+	int		dev_fd,
+	char		*device,
+	uint64_t	offset,
+	int64_t		len)
 {
-	struct xfs_sb		sb;
-	struct xfs_meta_extent	xme;
-	char			*block_buffer;
-	int64_t			mb_read = 0;
-	int64_t			bytes_read;
-	uint64_t		offset;
-	int			len;
+	if (!mdrestore.delta)
+		fatal("Tombstone found in a metadump that isn't a delta\n");
 
-	block_buffer = malloc(MDR_IO_BUF_SIZE);
-	if (block_buffer == NULL)
-		fatal("Unable to allocate input buffer memory\n");
+	while (len > 0) {
+		size_t	count = min_t(int64_t, len, MDR_BATCH_SIZE);
 
-	if (fread(&xme, sizeof(xme), 1, md_fp) != 1)
-		fatal("error reading from metadump file\n");
+		memset(mdr_writer_space(dev_fd, device, offset, count), 0,
+				count);
+		mdr_writer_commit(offset, count);
+		len -= count;
+		offset += count;
+	}
+}
 
-	/*
-	 * The first block must be the primary super, which is at the start of
-	 * the data device, which is device 0.
-	 */
-	if (xme.xme_addr != 0)
+/*
+ * The first extent must be the primary super, which is at the start of the
+ * data device, which is device 0.  Returns the length of the superblock.
+ */
+static int
+check_superblock_extent(
+	const struct xfs_meta_extent	*xme)
+{
+	int				len;
+
+	if (xme->xme_addr != 0)
 		fatal("Invalid superblock disk address 0x%llx\n",
-				be64_to_cpu(xme.xme_addr));
+				be64_to_cpu(xme->xme_addr));
 
-	len = BBTOB(be32_to_cpu(xme.xme_len));
+	len = BBTOB(be32_to_cpu(xme->xme_len));
 
 	/* The primary superblock is always a single filesystem sector. */
 	if (len < BBTOB(1) || len > XFS_MAX_SECTORSIZE)
 		fatal("Invalid superblock disk length 0x%x\n",
-				be32_to_cpu(xme.xme_len));
-
-	if (fread(block_buffer, len, 1, md_fp) != 1)
-		fatal("error reading from metadump file\n");
+				be32_to_cpu(xme->xme_len));
+	return len;
+}
 
-	libxfs_sb_from_disk(&sb, (struct xfs_dsb *)block_buffer);
+/*
+ * Size the target devices from the primary superblock in @block_buffer and
+ * write it out, marked in progress until the restore completes.  Deltas
+ * leave the devices as the base restore sized them.
+ */
+static void
+restore_superblock(
+	char				*block_buffer,
+	int				len,
+	struct xfs_sb			*sb,
+	const struct mdrestore_dev	*ddev,
+	const struct mdrestore_dev	*logdev,
+	const struct mdrestore_dev	*rtdev)
+{
+	libxfs_sb_from_disk(sb, (struct xfs_dsb *)block_buffer);
 
-	if (sb.sb_magicnum != XFS_SB_MAGIC)
+	if (sb->sb_magicnum != XFS_SB_MAGIC)
 		fatal("bad magic number for primary superblock\n");
 
 	((struct xfs_dsb *)block_buffer)->sb_inprogress = 1;
 
-	verify_main_device_size(ddev, &sb);
+	if (mdrestore.delta) {
+		grow_device_file(ddev, main_device_blocks(sb),
+				sb->sb_blocksize);
+		if (sb->sb_logstart == 0)
+			grow_device_file(logdev, sb->sb_logblocks,
+					sb->sb_blocksize);
+		if (sb->sb_rblocks > 0 && !sb->sb_rtstart)
+			grow_device_file(rtdev, sb->sb_rblocks,
+					sb->sb_blocksize);
+	} else {
+		verify_main_device_size(ddev, sb);
 
-	if (sb.sb_logstart == 0) {
-		ASSERT(mdrestore.external_log == true);
-		verify_device_size(logdev, sb.sb_logblocks, sb.sb_blocksize);
-	}
+		if (sb->sb_logstart == 0) {
+			ASSERT(mdrestore.external_log == true);
+			verify_device_size(logdev, sb->sb_logblocks,
+					sb->sb_blocksize);
+		}
 
-	if (sb.sb_rblocks > 0 && !sb.sb_rtstart) {
-		ASSERT(mdrestore.realtime_data == true);
-		verify_device_size(rtdev, sb.sb_rblocks, sb.sb_blocksize);
+		if (sb->sb_rblocks > 0 && !sb->sb_rtstart) {
+			ASSERT(mdrestore.realtime_data == true);
+			verify_device_size(rtdev, sb->sb_rblocks,
+					sb->sb_blocksize);
+		}
 	}
 
 	if (pwrite(ddev->fd, block_buffer, len, 0) < 0)
 		fatal("error writing primary superblock: %s\n",
 			strerror(errno));
+}
+
+static void
+restore_v2(
+	union mdrestore_headers		*h,
+	FILE				*md_fp,
+	const struct mdrestore_dev	*ddev,
+	const struct mdrestore_dev	*logdev,
+	const struct mdrestore_dev	*rtdev)
+{
+	struct xfs_sb		sb;
+	struct xfs_meta_extent	xme;
+	char			*block_buffer;
+	int64_t			mb_read = 0;
+	int64_t			bytes_read;
+	uint64_t		offset;
+	int			len;
+
+	block_buffer = malloc(XFS_MAX_SECTORSIZE);
+	if (block_buffer == NULL)
+		fatal("Unable to allocate input buffer memory\n");
+
+	if (mdr_fread(&xme, sizeof(xme), 1, md_fp) != 1)
+		fatal("error reading from metadump file\n");
+
+	len = check_superblock_extent(&xme);
+
+	if (mdr_fread(block_buffer, len, 1, md_fp) != 1)
+		fatal("error reading from metadump file\n");
+
+	restore_superblock(block_buffer, len, &sb, ddev, logdev, rtdev);
 
 	bytes_read = len;
 
@@ -485,39 +894,30 @@ restore_v2(
 
 		maybe_print_progress(&mb_read, bytes_read);
 
-		if (fread(&xme, sizeof(xme), 1, md_fp) != 1) {
+		if (mdr_fread(&xme, sizeof(xme), 1, md_fp) != 1) {
 			if (feof(md_fp))
 				break;
 			fatal("error reading from metadump file\n");
 		}
 
 		offset = BBTOB(be64_to_cpu(xme.xme_addr) & XME_ADDR_DADDR_MASK);
-		switch (be64_to_cpu(xme.xme_addr) & XME_ADDR_DEVICE_MASK) {
-		case XME_ADDR_DATA_DEVICE:
-			device = "data";
-			fd = ddev->fd;
-			break;
-		case XME_ADDR_LOG_DEVICE:
-			device = "log";
-			fd = logdev->fd;
-			break;
-		case XME_ADDR_RT_DEVICE:
-			device = "rt";
-			fd = rtdev->fd;
-			break;
-		default:
-			fatal("Invalid device found in metadump\n");
-			break;
+		fd = xme_addr_to_fd(be64_to_cpu(xme.xme_addr), ddev, logdev,
+				rtdev, &device);
+
+		if (xme.xme_addr & cpu_to_be64(XME_ADDR_TOMBSTONE)) {
+			restore_tombstone(fd, device, offset,
+					BBTOB((int64_t)be32_to_cpu(xme.xme_len)));
+			continue;
 		}
 
 		len = BBTOB(be32_to_cpu(xme.xme_len));
 
-		restore_meta_extent(md_fp, fd, device, block_buffer, offset,
-				len);
+		restore_meta_extent(md_fp, fd, device, offset, len);
 
 		bytes_read += len;
 	} while (1);
 
+	mdr_writer_finish();
 	final_print_progress(&mb_read, bytes_read);
 
 	fixup_superblock(ddev->fd, block_buffer, &sb);
@@ -531,14 +931,391 @@ static struct mdrestore_ops mdrestore_ops_v2 = {
 	.restore	= restore_v2,
 };
 
+/*
+ * A v3 chunk.  The main thread reads @in from the dump, a worker decompresses
+ * it into @data, and the main thread writes the records in @data out to the
+ * target devices in dump order.  Writing in order matters because a block can
+ * appear more than once in a dump, and the last copy must win.
+ */
+struct mdr_chunk {
+	struct xfs_meta_chunk	xmc;
+	char			*in;
+	size_t			in_size;
+	char			*data;
+	size_t			data_size;
+	size_t			len;
+	bool			done;
+	bool			corrupt;
+};
+
+static struct mdr_chunks {
+	struct workqueue	wq;
+	pthread_mutex_t		lock;
+	pthread_cond_t		done;
+	struct mdr_chunk	*chunks;
+	unsigned int		nr_chunks;
+} mdr_chunks;
+
+static void
+decompress_chunk_v3(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct mdr_chunk	*chunk = arg;
+	size_t			ulen = be32_to_cpu(chunk->xmc.xmc_ulen);
+	size_t			clen = be32_to_cpu(chunk->xmc.xmc_len);
+	ssize_t			len;
+
+	if (chunk->xmc.xmc_flags & cpu_to_be32(XFS_MD3_CHUNK_RAW)) {
+		memcpy(chunk->data, chunk->in, clen);
+		len = clen;
+	} else {
+		len = lz_decompress(chunk->in, clen, chunk->data, ulen);
+	}
+
+	pthread_mutex_lock(&mdr_chunks.lock);
+	chunk->len = len;
+	chunk->corrupt = len < 0 || (size_t)len != ulen ||
+			 crc32c(XFS_CRC_SEED, chunk->data, ulen) !=
+				be32_to_cpu(chunk->xmc.xmc_crc);
+	chunk->done = true;
+	pthread_cond_broadcast(&mdr_chunks.done);
+	pthread_mutex_unlock(&mdr_chunks.lock);
+}
+
+/* Grow a chunk buffer to at least @size bytes. */
+static void
+grow_chunk_buffer(
+	char			**buf,
+	size_t			*buf_size,
+	size_t			size)
+{
+	if (*buf_size >= size)
+		return;
+	free(*buf);
+	*buf = malloc(size);
+	if (!*buf)
+		fatal("Unable to allocate chunk buffer memory\n");
+	*buf_size = size;
+}
+
+/*
+ * Read the next chunk from the dump into @chunk.  Returns false when we reach
+ * the index, which follows the last chunk.
+ */
+static bool
+read_chunk_v3(
+	FILE			*md_fp,
+	struct mdr_chunk	*chunk,
+	int64_t			*bytes_read)
+{
+	struct xfs_meta_chunk	*xmc = &chunk->xmc;
+	size_t			clen, ulen;
+
+	if (mdr_fread(&xmc->xmc_magic, sizeof(xmc->xmc_magic), 1, md_fp) != 1)
+		fatal("error reading from metadump file\n");
+	if (xmc->xmc_magic == cpu_to_be32(XFS_MD3_INDEX_MAGIC))
+		return false;
+	if (xmc->xmc_magic != cpu_to_be32(XFS_MD3_CHUNK_MAGIC))
+		fatal("bad chunk magic 0x%x at offset %lld\n",
+				be32_to_cpu(xmc->xmc_magic),
+				(long long)*bytes_read);
+
+	if (mdr_fread((char *)xmc + sizeof(xmc->xmc_magic),
+			sizeof(*xmc) - sizeof(xmc->xmc_magic), 1, md_fp) != 1)
+		fatal("error reading from metadump file\n");
+
+	clen = be32_to_cpu(xmc->xmc_len);
+	ulen = be32_to_cpu(xmc->xmc_ulen);
+	if (xmc->xmc_flags & cpu_to_be32(~XFS_MD3_CHUNK_FLAGS_ALL))
+		fatal("chunk at offset %lld has unknown flags 0x%x\n",
+				(long long)*bytes_read,
+				be32_to_cpu(xmc->xmc_flags));
+	if (ulen > XFS_MD3_MAX_CHUNK_SIZE ||
+	    clen > lz_compress_bound(ulen) ||
+	    ((xmc->xmc_flags & cpu_to_be32(XFS_MD3_CHUNK_RAW)) && clen != ulen))
+		fatal("chunk at offset %lld has bad length %zu/%zu\n",
+				(long long)*bytes_read, clen, ulen);
+
+	grow_chunk_buffer(&chunk->in, &chunk->in_size, clen);
+	grow_chunk_buffer(&chunk->data, &chunk->data_size, ulen);
+	if (clen && mdr_fread(chunk->in, clen, 1, md_fp) != 1)
+		fatal("error reading from metadump file\n");
+
+	*bytes_read += sizeof(*xmc) + clen;
+	return true;
+}
+
+/*
+ * Write out the records in a decompressed chunk.  The very first record of the
+ * dump must be the primary superblock, which sizes the target devices.
+ */
+static void
+restore_chunk_v3(
+	struct mdr_chunk		*chunk,
+	bool				first,
+	char				*sb_buffer,
+	struct xfs_sb			*sb,
+	const struct mdrestore_dev	*ddev,
+	const struct mdrestore_dev	*logdev,
+	const struct mdrestore_dev	*rtdev)
+{
+	char				*p = chunk->data;
+	char				*end = chunk->data + chunk->len;
+
+	if (first && p == end)
+		fatal("metadump contains no superblock\n");
+
+	while (p < end) {
+		struct xfs_meta_extent	xme;
+		uint64_t		offset;
+		char			*device;
+		size_t			len;
+		int			fd;
+
+		if (end - p < sizeof(xme))
+			fatal("truncated extent record in chunk\n");
+		memcpy(&xme, p, sizeof(xme));
+		p += sizeof(xme);
+
+		if (!first &&
+		    (xme.xme_addr & cpu_to_be64(XME_ADDR_TOMBSTONE))) {
+			offset = BBTOB(be64_to_cpu(xme.xme_addr) &
+					XME_ADDR_DADDR_MASK);
+			fd = xme_addr_to_fd(be64_to_cpu(xme.xme_addr), ddev,
+					logdev, rtdev, &device);
+			restore_tombstone(fd, device, offset,
+					BBTOB((int64_t)be32_to_cpu(xme.xme_len)));
+			continue;
+		}
+
+		len = BBTOB(be32_to_cpu(xme.xme_len));
+		if (len > end - p)
+			fatal("extent record overruns chunk\n");
+
+		if (first) {
+			len = check_superblock_extent(&xme);
+			memcpy(sb_buffer, p, len);
+			restore_superblock(sb_buffer, len, sb, ddev, logdev,
+					rtdev);
+			p += len;
+			first = false;
+			continue;
+		}
+
+		offset = BBTOB(be64_to_cpu(xme.xme_addr) & XME_ADDR_DADDR_MASK);
+		fd = xme_addr_to_fd(be64_to_cpu(xme.xme_addr), ddev, logdev,
+				rtdev, &device);
+		mdr_write(fd, device, p, len, offset);
+		p += len;
+	}
+}
+
+static void
+restore_v3(
+	union mdrestore_headers		*h,
+	FILE				*md_fp,
+	const struct mdrestore_dev	*ddev,
+	const struct mdrestore_dev	*logdev,
+	const struct mdrestore_dev	*rtdev)
+{
+	struct xfs_sb			sb;
+	char				*sb_buffer;
+	unsigned int			nr_threads = platform_nproc();
+	uint64_t			head = 0;
+	uint64_t			tail = 0;
+	int64_t				mb_read = 0;
+	int64_t				bytes_read;
+	bool				more = true;
+	int				error;
+
+	sb_buffer = calloc(1, XFS_MAX_SECTORSIZE);
+	if (!sb_buffer)
+		fatal("Unable to allocate input buffer memory\n");
+
+	/*
+	 * Read up to two chunks per thread ahead of the one being restored,
+	 * so the decompression threads still have work queued while the
+	 * extents of a chunk are written to the target.
+	 */
+	mdr_chunks.nr_chunks = nr_threads * 2;
+	mdr_chunks.chunks = calloc(mdr_chunks.nr_chunks,
+			sizeof(struct mdr_chunk));
+	if (!mdr_chunks.chunks)
+		fatal("Unable to allocate chunk memory\n");
+	pthread_mutex_init(&mdr_chunks.lock, NULL);
+	pthread_cond_init(&mdr_chunks.done, NULL);
+	error = workqueue_create(&mdr_chunks.wq, NULL, nr_threads);
+	if (error)
+		fatal("Unable to start decompression threads: %s\n",
+				strerror(-error));
+
+	bytes_read = sizeof(struct xfs_metadump_header);
+
+	while (more || tail < head) {
+		struct mdr_chunk	*chunk;
+
+		maybe_print_progress(&mb_read, bytes_read);
+
+		/* Read ahead and decompress until the ring is full. */
+		while (more && head - tail < mdr_chunks.nr_chunks) {
+			chunk = &mdr_chunks.chunks[head %
+						   mdr_chunks.nr_chunks];
+			more = read_chunk_v3(md_fp, chunk, &bytes_read);
+			if (!more)
+				break;
+			chunk->done = false;
+			error = workqueue_add(&mdr_chunks.wq,
+					decompress_chunk_v3, 0, chunk);
+			if (error)
+				fatal("Unable to queue decompression: %s\n",
+						strerror(-error));
+			head++;
+		}
+		if (tail == head)
+			break;
+
+		/* Write out the oldest chunk. */
+		chunk = &mdr_chunks.chunks[tail % mdr_chunks.nr_chunks];
+		pthread_mutex_lock(&mdr_chunks.lock);
+		while (!chunk->done)
+			pthread_cond_wait(&mdr_chunks.done, &mdr_chunks.lock);
+		pthread_mutex_unlock(&mdr_chunks.lock);
+
+		if (chunk->corrupt)
+			fatal("chunk %llu of metadump is corrupt\n",
+					(unsigned long long)tail);
+		restore_chunk_v3(chunk, tail == 0, sb_buffer, &sb, ddev,
+				logdev, rtdev);
+		tail++;
+	}
+
+	if (head == 0)
+		fatal("metadump contains no superblock\n");
+
+	workqueue_terminate(&mdr_chunks.wq);
+	workqueue_destroy(&mdr_chunks.wq);
+
+	mdr_writer_finish();
+	final_print_progress(&mb_read, bytes_read);
+
+	fixup_superblock(ddev->fd, sb_buffer, &sb);
+
+	for (head = 0; head < mdr_chunks.nr_chunks; head++) {
+		free(mdr_chunks.chunks[head].in);
+		free(mdr_chunks.chunks[head].data);
+	}
+	free(mdr_chunks.chunks);
+	pthread_cond_destroy(&mdr_chunks.done);
+	pthread_mutex_destroy(&mdr_chunks.lock);
+	free(sb_buffer);
+}
+
+static struct mdrestore_ops mdrestore_ops_v3 = {
+	.read_header	= read_header_v2,
+	.show_info	= show_info_v2,
+	.restore	= restore_v3,
+};
+
 static void
 usage(void)
 {
-	fprintf(stderr, "Usage: %s [-V] [-g] [-i] [-l logdev] [-r rtdev] source target\n",
+	fprintf(stderr, "Usage: %s [-V] [-g] [-i] [-l logdev] [-r rtdev] [-d delta]... [--stats] source target\n",
 		progname);
 	exit(1);
 }
 
+/*
+ * Open a dump, test if this really is a dump and read its header.  The rest
+ * of the dump will be passed to mdrestore_ops->restore() which will continue
+ * to read the file from this point.  This avoids rewinding the stream, which
+ * causes restore to fail when source was being read from stdin.
+ */
+static FILE *
+open_dump(
+	const char		*path,
+	union mdrestore_headers	*headers)
+{
+	FILE			*src_f;
+
+	if (strcmp(path, "-") == 0) {
+		src_f = stdin;
+		if (isatty(fileno(stdin)))
+			fatal("cannot read from a terminal\n");
+	} else {
+		src_f = fopen(path, "rb");
+		if (src_f == NULL)
+			fatal("cannot open source dump file %s\n", path);
+		posix_fadvise(fileno(src_f), 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+	/* read the dump in large chunks */
+	setvbuf(src_f, NULL, _IOFBF, MDR_READ_BUF_SIZE);
+
+	if (mdr_fread(&headers->magic, sizeof(headers->magic), 1, src_f) != 1)
+		fatal("Unable to read metadump magic from metadump file\n");
+
+	switch (be32_to_cpu(headers->magic)) {
+	case XFS_MD_MAGIC_V1:
+		if (mdrestore.external_log)
+			usage();
+		mdrestore.mdrops = &mdrestore_ops_v1;
+		break;
+
+	case XFS_MD_MAGIC_V2:
+		mdrestore.mdrops = &mdrestore_ops_v2;
+		break;
+
+	case XFS_MD_MAGIC_V3:
+		mdrestore.mdrops = &mdrestore_ops_v3;
+		break;
+
+	default:
+		fatal("specified file is not a metadata dump\n");
+		break;
+	}
+
+	mdrestore.delta = false;
+	mdrestore.mdrops->read_header(headers, src_f);
+
+	if (mdrestore.show_info)
+		mdrestore.mdrops->show_info(headers, path);
+
+	return src_f;
+}
+
+static void
+close_dump(
+	FILE			*src_f)
+{
+	if (src_f != stdin)
+		fclose(src_f);
+}
+
+/*
+ * Deltas must be applied in the order they were made, on top of the full
+ * dump that started their chain.  The full dump doesn't record the chain, so
+ * all we can check is that the deltas belong together and that none are
+ * missing.
+ */
+static void
+check_delta(
+	union mdrestore_headers	*h,
+	const char		*path,
+	uint32_t		seq,
+	uint32_t		*chain_id)
+{
+	if (!mdrestore.delta)
+		fatal("%s is not a delta metadump\n", path);
+	if (be32_to_cpu(h->v2.xmh_chain_seq) != seq)
+		fatal("%s is delta %u of its chain, expected delta %u\n",
+				path, be32_to_cpu(h->v2.xmh_chain_seq), seq);
+	if (seq > 1 && be32_to_cpu(h->v2.xmh_chain_id) != *chain_id)
+		fatal("%s belongs to a different delta chain\n", path);
+	*chain_id = be32_to_cpu(h->v2.xmh_chain_id);
+}
+
 int
 main(
 	int			argc,
@@ -551,7 +1328,22 @@ main(
 	FILE			*src_f;
 	char			*logdev_path = NULL;
 	char			*rtdev_path = NULL;
+	char			**deltas = NULL;
+	unsigned int		nr_deltas = 0;
+	unsigned int		i;
+	uint32_t		chain_id = 0;
+	uint64_t		start;
+	int			show_stats = 0;
 	int			c;
+	struct option		long_options[] = {
+	{
+		.name		= "stats",
+		.has_arg	= no_argument,
+		.flag		= &show_stats,
+		.val		= 1,
+	},
+	{NULL, 0, NULL, 0 },
+	};
 
 	mdrestore.show_progress = false;
 	mdrestore.show_info = false;
@@ -561,8 +1353,18 @@ main(
 
 	progname = basename(argv[0]);
 
-	while ((c = getopt(argc, argv, "gil:r:V")) != EOF) {
+	while ((c = getopt_long(argc, argv, "d:gil:r:V", long_options,
+					NULL)) != EOF) {
 		switch (c) {
+			case 0:
+				break;
+			case 'd':
+				deltas = realloc(deltas,
+						(nr_deltas + 1) * sizeof(char *));
+				if (!deltas)
+					fatal("Unable to allocate memory\n");
+				deltas[nr_deltas++] = optarg;
+				break;
 			case 'g':
 				mdrestore.show_progress = true;
 				break;
@@ -588,52 +1390,25 @@ main(
 	if (argc - optind < 1 || argc - optind > 2)
 		usage();
 
+	mdrestore.show_stats = show_stats;
+
 	/* show_info without a target is ok */
 	if (!mdrestore.show_info && argc - optind != 2)
 		usage();
 
-	/*
-	 * open source and test if this really is a dump. The first metadump
-	 * block will be passed to mdrestore_ops->restore() which will continue
-	 * to read the file from this point. This avoids rewind the stream,
-	 * which causes restore to fail when source was being read from stdin.
- 	 */
-	if (strcmp(argv[optind], "-") == 0) {
-		src_f = stdin;
-		if (isatty(fileno(stdin)))
-			fatal("cannot read from a terminal\n");
-	} else {
-		src_f = fopen(argv[optind], "rb");
-		if (src_f == NULL)
-			fatal("cannot open source dump file\n");
-	}
-
-	if (fread(&headers.magic, sizeof(headers.magic), 1, src_f) != 1)
-		fatal("Unable to read metadump magic from metadump file\n");
-
-	switch (be32_to_cpu(headers.magic)) {
-	case XFS_MD_MAGIC_V1:
-		if (logdev_path != NULL)
-			usage();
-		mdrestore.mdrops = &mdrestore_ops_v1;
-		break;
-
-	case XFS_MD_MAGIC_V2:
-		mdrestore.mdrops = &mdrestore_ops_v2;
-		break;
-
-	default:
-		fatal("specified file is not a metadata dump\n");
-		break;
-	}
-
-	mdrestore.mdrops->read_header(&headers, src_f);
-
-	if (mdrestore.show_info) {
-		mdrestore.mdrops->show_info(&headers, argv[optind]);
-
-		if (argc - optind == 1)
-			exit(0);
+	start = mdr_now();
+	src_f = open_dump(argv[optind], &headers);
+	if (mdrestore.delta)
+		fatal("%s is a delta metadump, restore its base first\n",
+				argv[optind]);
+
+	if (argc - optind == 1) {
+		for (i = 0; i < nr_deltas; i++) {
+			close_dump(src_f);
+			src_f = open_dump(deltas[i], &headers);
+			check_delta(&headers, deltas[i], i + 1, &chain_id);
+		}
+		exit(0);
 	}
 
 	optind++;
@@ -649,14 +1424,28 @@ main(
 	if (mdrestore.realtime_data)
 		open_device(&rtdev, rtdev_path);
 
+	mdr_writer_start();
 	mdrestore.mdrops->restore(&headers, src_f, &ddev, &logdev, &rtdev);
+	close_dump(src_f);
+
+	/* apply the deltas on top, in order */
+	for (i = 0; i < nr_deltas; i++) {
+		src_f = open_dump(deltas[i], &headers);
+		check_delta(&headers, deltas[i], i + 1, &chain_id);
+
+		mdr_writer_start();
+		mdrestore.mdrops->restore(&headers, src_f, &ddev, &logdev,
+				&rtdev);
+		close_dump(src_f);
+	}
+
+	if (mdrestore.show_stats)
+		report_stats(mdr_now() - start);
 
 	close_device(&ddev);
 	close_device(&logdev);
 	close_device(&rtdev);
-
-	if (src_f != stdin)
-		fclose(src_f);
+	free(deltas);
 
 	return 0;
 }
@@ -11,6 +11,7 @@
 #include <sys/xattr.h>
 #include <linux/xattr.h>
 #include "libfrog/convert.h"
+#include "libfrog/workqueue.h"
 #include "proto.h"
 
 /*
@@ -25,8 +26,10 @@ static void rtinit(xfs_mount_t *mp);
 static off_t filesize(int fd);
 static void populate_from_dir(struct xfs_mount *mp, struct fsxattr *fsxp,
 		char *source_dir);
+struct proto_dir;
 static void walk_dir(struct xfs_mount *mp, struct xfs_inode *pip,
-		struct fsxattr *fsxp, char *path_buf, int path_len);
+		struct fsxattr *fsxp, char *path_buf, int path_len,
+		struct proto_dir *pd);
 static int preserve_atime;
 static int slashes_are_spaces;
 
@@ -298,15 +301,168 @@ writesymlink(
 	}
 }
 
+/*
+ * Parallel Population
+ * ===================
+ *
+ * Populating a filesystem from a large source tree is dominated by reading the
+ * source: walking directories, stat'ing every entry and copying file data.
+ * None of that changes the new filesystem, so we farm it out to worker
+ * threads, and keep all the metadata updates on the main thread.  Inodes and
+ * directory entries are created in a fixed order (directory entries sorted by
+ * name), so the image comes out the same no matter how many threads we use.
+ *
+ * The main thread allocates space for each file's data and maps it, and then
+ * hands the file off to a copier thread, which reads the source straight into
+ * large uncached buffers and writes them to the blocks that were allocated.
+ */
+
+/* Copy file data in pieces of at most this many bytes. */
+#define PROTO_COPY_MAX		(4U << 20)
+
+/* Let each copier thread have this many files queued up. */
+#define PROTO_COPY_QUEUE	8
+
+struct proto_workers {
+	struct workqueue	scan_wq;
+	struct workqueue	copy_wq;
+	bool			threaded;
+};
+
+static struct proto_workers	workers;
+
+/* A directory entry in the source tree, and its scan if it's a directory. */
+struct proto_dirent {
+	char			*d_name;
+	struct stat		st;
+	struct proto_dir	*subdir;
+};
+
+/* The sorted contents of a source directory. */
+struct proto_dir {
+	pthread_mutex_t		lock;
+	pthread_cond_t		wait;
+	bool			queued;
+	bool			scanned;
+	char			*path;
+	struct proto_dirent	*ents;
+	unsigned int		nr_ents;
+};
+
+/* One contiguous piece of a file and where it goes on disk. */
+struct copy_piece {
+	off_t			pos;
+	xfs_daddr_t		daddr;
+	unsigned int		len;
+};
+
+struct copy_job {
+	struct xfs_mount	*mp;
+	char			*fname;
+	int			fd;
+	unsigned int		nr_pieces;
+	unsigned int		max_pieces;
+	struct copy_piece	*pieces;
+};
+
+static void
+copy_job_add(
+	struct copy_job		*job,
+	off_t			pos,
+	xfs_daddr_t		daddr,
+	unsigned int		len)
+{
+	struct copy_piece	*cp;
+
+	if (job->nr_pieces == job->max_pieces) {
+		unsigned int	nr = max(job->max_pieces * 2, 8U);
+
+		cp = reallocarray(job->pieces, nr, sizeof(*cp));
+		if (!cp)
+			fail(_("error allocating file copy list"), errno);
+		job->pieces = cp;
+		job->max_pieces = nr;
+	}
+
+	cp = &job->pieces[job->nr_pieces++];
+	cp->pos = pos;
+	cp->daddr = daddr;
+	cp->len = len;
+}
+
+/*
+ * Read one piece of the source file into a buffer and write it out.  The
+ * pieces always cover whole filesystem blocks; anything past the end of the
+ * source file is zeroed.
+ */
+static void
+copy_piece(
+	struct copy_job		*job,
+	struct copy_piece	*cp)
+{
+	struct xfs_buf		*bp;
+	size_t			done = 0;
+	int			error;
+
+	error = -libxfs_buf_get_uncached(job->mp->m_ddev_targp,
+			BTOBB(cp->len), &bp);
+	if (error)
+		fail(_("error allocating file data buffer"), error);
+	xfs_buf_set_daddr(bp, cp->daddr);
+
+	while (done < cp->len) {
+		ssize_t		read_len;
+
+		read_len = pread(job->fd, bp->b_addr + done, cp->len - done,
+				cp->pos + done);
+		if (read_len < 0) {
+			fprintf(stderr, _("%s: read failed on %s: %s\n"),
+					progname, job->fname, strerror(errno));
+			exit(1);
+		}
+		if (read_len == 0)
+			break;
+		done += read_len;
+	}
+	if (done < cp->len)
+		memset(bp->b_addr + done, 0, cp->len - done);
+
+	error = -libxfs_bwrite(bp);
+	if (error)
+		fail(_("error writing file"), error);
+	libxfs_buf_relse(bp);
+}
+
+static void
+copy_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct copy_job		*job = arg;
+	unsigned int		i;
+
+	for (i = 0; i < job->nr_pieces; i++)
+		copy_piece(job, &job->pieces[i]);
+
+	close(job->fd);
+	free(job->fname);
+	free(job->pieces);
+	free(job);
+}
+
+/* Allocate space for part of a file and add the mappings to the copy job. */
 static void
 writefile_range(
 	struct xfs_inode	*ip,
-	const char		*fname,
-	int			fd,
+	struct copy_job		*job,
 	off_t			pos,
 	uint64_t		len)
 {
-	static char		buf[131072];
+	struct xfs_mount	*mp = ip->i_mount;
+	xfs_fileoff_t		off_fsb = XFS_B_TO_FSBT(mp, pos);
+	xfs_fileoff_t		end_fsb = XFS_B_TO_FSB(mp, pos + len);
+	xfs_extlen_t		max_fsb = XFS_B_TO_FSBT(mp, PROTO_COPY_MAX);
 	int			error;
 
 	if (XFS_IS_REALTIME_INODE(ip)) {
@@ -316,26 +472,34 @@ writefile_range(
 		exit(1);
 	}
 
-	while (len > 0) {
-		ssize_t		read_len;
-
-		read_len = pread(fd, buf, min(len, sizeof(buf)), pos);
-		if (read_len < 0) {
-			fprintf(stderr, _("%s: read failed on %s: %s\n"),
-					progname, fname, strerror(errno));
-			exit(1);
-		}
+	error = -libxfs_alloc_file_space(ip, pos, len, 0);
+	if (error)
+		fail(_("error allocating space for a file"), error);
 
-		error = -libxfs_alloc_file_space(ip, pos, read_len, 0);
-		if (error)
-			fail(_("error allocating space for a file"), error);
+	while (off_fsb < end_fsb) {
+		struct xfs_bmbt_irec	map;
+		int			nmap = 1;
+		xfs_filblks_t		i;
 
-		error = -libxfs_file_write(ip, buf, pos, read_len);
+		error = -libxfs_bmapi_read(ip, off_fsb, end_fsb - off_fsb,
+				&map, &nmap, 0);
 		if (error)
-			fail(_("error writing file"), error);
-
-		pos += read_len;
-		len -= read_len;
+			fail(_("error mapping file data"), error);
+		if (nmap != 1 || map.br_startblock == HOLESTARTBLOCK ||
+		    map.br_state == XFS_EXT_UNWRITTEN)
+			fail(_("error mapping file data"), EFSCORRUPTED);
+
+		for (i = 0; i < map.br_blockcount; i += max_fsb) {
+			xfs_filblks_t	count;
+
+			count = min_t(xfs_filblks_t, max_fsb,
+					map.br_blockcount - i);
+			copy_job_add(job, XFS_FSB_TO_B(mp, off_fsb + i),
+					XFS_FSB_TO_DADDR(mp,
+						map.br_startblock + i),
+					XFS_FSB_TO_B(mp, count));
+		}
+		off_fsb += map.br_blockcount;
 	}
 }
 
@@ -348,6 +512,7 @@ writefile(
 	struct xfs_trans	*tp;
 	struct xfs_mount	*mp = ip->i_mount;
 	struct stat		statbuf;
+	struct copy_job		*job;
 	off_t			data_pos;
 	int			error;
 
@@ -359,6 +524,11 @@ writefile(
 	if (!S_ISREG(statbuf.st_mode))
 		return;
 
+	job = calloc(1, sizeof(struct copy_job));
+	if (!job)
+		fail(_("error allocating file copy job"), errno);
+	job->mp = mp;
+
 	data_pos = lseek(fd, 0, SEEK_DATA);
 	while (data_pos >= 0) {
 		off_t		hole_pos;
@@ -385,12 +555,28 @@ writefile(
 		hole_pos = min(roundup_64(hole_pos, mp->m_sb.sb_blocksize),
 			       statbuf.st_size);
 
-		writefile_range(ip, fname, fd, data_pos, hole_pos - data_pos);
+		writefile_range(ip, job, data_pos, hole_pos - data_pos);
 		data_pos = lseek(fd, hole_pos, SEEK_DATA);
 	}
 	if (data_pos < 0 && errno != ENXIO)
 		fail(_("error finding file data to import"), errno);
 
+	/*
+	 * The copier owns its own file descriptor so that the caller can
+	 * carry on with this one.
+	 */
+	if (job->nr_pieces == 0) {
+		free(job);
+	} else {
+		job->fd = dup(fd);
+		job->fname = strdup(fname);
+		if (job->fd < 0 || !job->fname)
+			fail(_("error setting up file copy"), errno);
+		if (!workers.threaded ||
+		    workqueue_add(&workers.copy_wq, copy_worker, 0, job))
+			copy_worker(NULL, 0, job);
+	}
+
 	/* extend EOF only after writing all the file data */
 	error = -libxfs_trans_alloc_inode(ip, &M_RES(mp)->tr_ichange, 0, 0,
 			false, &tp);
@@ -996,11 +1182,21 @@ parse_proto(
 	struct fsxattr		*fsx,
 	struct proto_source	*protosource,
 	int			proto_slashes_are_spaces,
-	int			proto_preserve_atime)
+	int			proto_preserve_atime,
+	unsigned int		nr_threads)
 {
 	preserve_atime = proto_preserve_atime;
 	slashes_are_spaces = proto_slashes_are_spaces;
 
+	if (nr_threads > 1 &&
+	    !workqueue_create(&workers.scan_wq, NULL, nr_threads)) {
+		if (!workqueue_create_bound(&workers.copy_wq, NULL,
+				nr_threads, nr_threads * PROTO_COPY_QUEUE))
+			workers.threaded = true;
+		else
+			workqueue_destroy(&workers.scan_wq);
+	}
+
 	/*
 	 * In case of a file input, we will use the prototype file logic else
 	 * we will fallback to populate from dir.
@@ -1015,6 +1211,15 @@ parse_proto(
 	case PROTO_SRC_NONE:
 		fail(_("invalid or unreadable source path"), ENOENT);
 	}
+
+	/* Wait for the last of the file data to be written. */
+	if (workers.threaded) {
+		workqueue_terminate(&workers.copy_wq);
+		workqueue_destroy(&workers.copy_wq);
+		workqueue_terminate(&workers.scan_wq);
+		workqueue_destroy(&workers.scan_wq);
+		workers.threaded = false;
+	}
 }
 
 /* Create a sb-rooted metadata file. */
@@ -1478,7 +1683,8 @@ create_directory_inode(
 	int			fd,
 	char			*entryname,
 	char			*path_buf,
-	int			path_len)
+	int			path_len,
+	struct proto_dir	*pd)
 {
 
 	int			error;
@@ -1522,7 +1728,7 @@ create_directory_inode(
 	writefsxattrs(ip, fsxp);
 	close(fd);
 
-	walk_dir(mp, ip, fsxp, path_buf, path_len);
+	walk_dir(mp, ip, fsxp, path_buf, path_len, pd);
 
 	libxfs_irele(ip);
 }
@@ -1635,42 +1841,19 @@ handle_direntry(
 	struct fsxattr		*fsxp,
 	char			*path_buf,
 	int			path_len,
-	struct dirent		*entry)
+	int			dir_fd,
+	struct proto_dirent	*entry)
 {
 	char			*fname = "";
 	int			flags;
 	int			majdev;
 	int			mindev;
 	int			mode;
-	int			pathfd,fd = -1;
+	int			fd = -1;
 	int			rdev = 0;
-	struct stat		file_stat;
+	struct stat		file_stat = entry->st;
 	struct xfs_name		xname;
 
-	pathfd = open(path_buf, O_NOFOLLOW | O_PATH);
-	if (pathfd < 0){
-		fprintf(stderr, _("%s: cannot open %s: %s\n"), progname,
-			path_buf, strerror(errno));
-		exit(1);
-	}
-
-	/*
-	 * Symlinks and sockets will need to be opened with O_PATH to work, so
-	 * we handle this special case.
-	 */
-	fd = openat(pathfd, entry->d_name, O_NOFOLLOW | O_PATH);
-	if(fd < 0) {
-		fprintf(stderr, _("%s: cannot open %s: %s\n"), progname,
-			path_buf, strerror(errno));
-		exit(1);
-	}
-
-	if (fstat(fd, &file_stat) < 0) {
-		fprintf(stderr, _("%s: cannot stat '%s': %s (errno=%d)\n"),
-			progname, path_buf, strerror(errno), errno);
-		exit(1);
-	}
-
 	/* Ensure we're within the limits of PATH_MAX. */
 	size_t avail = PATH_MAX - path_len;
 	size_t wrote = snprintf(path_buf + path_len, avail, "/%s", entry->d_name);
@@ -1678,28 +1861,29 @@ handle_direntry(
 		fail(path_buf, ENAMETOOLONG);
 
 	/*
-	 * Regular files instead need to be reopened with broader flags so we
-	 * check if that's the case and reopen those.
+	 * Symlinks and sockets will need to be opened with O_PATH to work, and
+	 * everything else needs to be opened with broader flags.
 	 */
-	if (!S_ISSOCK(file_stat.st_mode) &&
-	    !S_ISLNK(file_stat.st_mode)  &&
-	    !S_ISFIFO(file_stat.st_mode)) {
-		close(fd);
+	if (S_ISSOCK(file_stat.st_mode) ||
+	    S_ISLNK(file_stat.st_mode)  ||
+	    S_ISFIFO(file_stat.st_mode)) {
+		fd = openat(dir_fd, entry->d_name, O_NOFOLLOW | O_PATH);
+	} else {
 		/*
 		 * Try to open the source file noatime to avoid a flood of
 		 * writes to the source fs, but we can fall back to plain
 		 * readonly mode if we don't have enough permission.
 		 */
-		fd = openat(pathfd, entry->d_name,
+		fd = openat(dir_fd, entry->d_name,
 			    O_NOFOLLOW | O_RDONLY | O_NOATIME);
 		if (fd < 0)
-			fd = openat(pathfd, entry->d_name,
+			fd = openat(dir_fd, entry->d_name,
 				    O_NOFOLLOW | O_RDONLY);
-		if(fd < 0) {
-			fprintf(stderr, _("%s: cannot open %s: %s\n"), progname,
-				path_buf, strerror(errno));
-			exit(1);
-		}
+	}
+	if (fd < 0) {
+		fprintf(stderr, _("%s: cannot open %s: %s\n"), progname,
+			path_buf, strerror(errno));
+		exit(1);
 	}
 
 	struct cred creds = {
@@ -1718,7 +1902,8 @@ handle_direntry(
 		xname.type = XFS_DIR3_FT_DIR;
 		create_directory_inode(mp, pip, fsxp, mode, creds, xname, flags,
 				       file_stat, fd, entry->d_name, path_buf,
-				       path_len + strlen(entry->d_name) + 1);
+				       path_len + strlen(entry->d_name) + 1,
+				       entry->subdir);
 		goto out;
 	case S_IFREG:
 		xname.type = XFS_DIR3_FT_REG_FILE;
@@ -1780,14 +1965,144 @@ handle_direntry(
 	create_nondir_inode(mp, pip, fsxp, mode, creds, xname, flags, file_stat,
 			    rdev, fd, fname);
 out:
-	close(pathfd);
 	/* Reset path_buf to original */
 	path_buf[path_len] = '\0';
 }
 
+/* Sort directory entries by name so that the image is reproducible. */
+static int
+proto_dirent_cmp(
+	const void		*a,
+	const void		*b)
+{
+	const struct proto_dirent *da = a;
+	const struct proto_dirent *db = b;
+
+	return strcmp(da->d_name, db->d_name);
+}
+
+/* Read all the entries in a directory and stat them. */
+static void
+scan_dir(
+	struct proto_dir	*pd)
+{
+	struct proto_dirent	*ents = NULL;
+	unsigned int		nr = 0;
+	unsigned int		max = 0;
+	struct dirent		*entry;
+	DIR			*dir;
+
+	if ((dir = opendir(pd->path)) == NULL) {
+		fprintf(stderr, _("%s: cannot open input dir: %s [%d - %s]\n"),
+				progname, pd->path, errno, strerror(errno));
+		exit(1);
+	}
+	while ((entry = readdir(dir)) != NULL) {
+		struct proto_dirent	*ent;
+
+		if (strcmp(entry->d_name, ".") == 0 ||
+		    strcmp(entry->d_name, "..") == 0)
+			continue;
+
+		if (nr == max) {
+			max = max ? max * 2 : 64;
+			ents = reallocarray(ents, max, sizeof(*ents));
+			if (!ents)
+				fail(_("error allocating directory entries"),
+						errno);
+		}
+
+		ent = &ents[nr];
+		memset(ent, 0, sizeof(*ent));
+		ent->d_name = strdup(entry->d_name);
+		if (!ent->d_name)
+			fail(_("error allocating directory entries"), errno);
+		if (fstatat(dirfd(dir), entry->d_name, &ent->st,
+					AT_SYMLINK_NOFOLLOW) < 0) {
+			fprintf(stderr,
+				_("%s: cannot stat '%s/%s': %s (errno=%d)\n"),
+				progname, pd->path, entry->d_name,
+				strerror(errno), errno);
+			exit(1);
+		}
+		nr++;
+	}
+	closedir(dir);
+
+	qsort(ents, nr, sizeof(*ents), proto_dirent_cmp);
+
+	pthread_mutex_lock(&pd->lock);
+	pd->ents = ents;
+	pd->nr_ents = nr;
+	pd->scanned = true;
+	pthread_cond_broadcast(&pd->wait);
+	pthread_mutex_unlock(&pd->lock);
+}
+
+static void
+scan_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	scan_dir(arg);
+}
+
+/* Start scanning a directory in the background. */
+static struct proto_dir *
+proto_dir_start(
+	const char		*path)
+{
+	struct proto_dir	*pd;
+
+	pd = calloc(1, sizeof(struct proto_dir));
+	if (!pd)
+		fail(_("error allocating directory scan"), errno);
+	pd->path = strdup(path);
+	if (!pd->path)
+		fail(_("error allocating directory scan"), errno);
+	pthread_mutex_init(&pd->lock, NULL);
+	pthread_cond_init(&pd->wait, NULL);
+
+	if (workers.threaded &&
+	    !workqueue_add(&workers.scan_wq, scan_worker, 0, pd))
+		pd->queued = true;
+	return pd;
+}
+
+/* Wait for a directory scan to finish, or do it now if nobody else will. */
+static void
+proto_dir_wait(
+	struct proto_dir	*pd)
+{
+	pthread_mutex_lock(&pd->lock);
+	while (pd->queued && !pd->scanned)
+		pthread_cond_wait(&pd->wait, &pd->lock);
+	pthread_mutex_unlock(&pd->lock);
+
+	if (!pd->scanned)
+		scan_dir(pd);
+}
+
+static void
+proto_dir_free(
+	struct proto_dir	*pd)
+{
+	unsigned int		i;
+
+	for (i = 0; i < pd->nr_ents; i++)
+		free(pd->ents[i].d_name);
+	free(pd->ents);
+	free(pd->path);
+	pthread_cond_destroy(&pd->wait);
+	pthread_mutex_destroy(&pd->lock);
+	free(pd);
+}
+
 /*
  * Walk_dir will recursively list files and directories and populate the
- * mountpoint *mp with them using handle_direntry().
+ * mountpoint *mp with them using handle_direntry().  The subdirectories are
+ * scanned in the background while we work through this one.
  */
 static void
 walk_dir(
@@ -1795,28 +2110,43 @@ walk_dir(
 	struct xfs_inode	*pip,
 	struct fsxattr		*fsxp,
 	char			*path_buf,
-	int			path_len)
+	int			path_len,
+	struct proto_dir	*pd)
 {
-	DIR			*dir;
-	struct dirent		*entry;
+	unsigned int		i;
+	int			dir_fd;
 
-	/*
-	 * Open input directory and iterate over all entries in it.
-	 * when another directory is found, we will recursively call walk_dir.
-	 */
-	if ((dir = opendir(path_buf)) == NULL) {
-		fprintf(stderr, _("%s: cannot open input dir: %s [%d - %s]\n"),
-				progname, path_buf, errno, strerror(errno));
+	proto_dir_wait(pd);
+
+	dir_fd = open(path_buf, O_NOFOLLOW | O_PATH);
+	if (dir_fd < 0) {
+		fprintf(stderr, _("%s: cannot open %s: %s\n"), progname,
+			path_buf, strerror(errno));
 		exit(1);
 	}
-	while ((entry = readdir(dir)) != NULL) {
-		if (strcmp(entry->d_name, ".") == 0 ||
-		    strcmp(entry->d_name, "..") == 0)
+
+	for (i = 0; i < pd->nr_ents; i++) {
+		struct proto_dirent	*ent = &pd->ents[i];
+
+		if (!S_ISDIR(ent->st.st_mode))
 			continue;
+		if (snprintf(path_buf + path_len, PATH_MAX - path_len, "/%s",
+				ent->d_name) >= PATH_MAX - path_len)
+			fail(path_buf, ENAMETOOLONG);
+		ent->subdir = proto_dir_start(path_buf);
+	}
+	path_buf[path_len] = '\0';
+
+	for (i = 0; i < pd->nr_ents; i++) {
+		struct proto_dirent	*ent = &pd->ents[i];
 
-		handle_direntry(mp, pip, fsxp, path_buf, path_len, entry);
+		handle_direntry(mp, pip, fsxp, path_buf, path_len, dir_fd, ent);
+		if (ent->subdir) {
+			proto_dir_free(ent->subdir);
+			ent->subdir = NULL;
+		}
 	}
-	closedir(dir);
+	close(dir_fd);
 }
 
 static void
@@ -1832,6 +2162,7 @@ populate_from_dir(
 	struct stat		file_stat;
 	struct xfs_inode	*ip;
 	struct xfs_trans	*tp;
+	struct proto_dir	*pd;
 
 	/*
 	 * Initialize path_buf cur_path, strip trailing slashes they're
@@ -1911,7 +2242,9 @@ populate_from_dir(
 	 * Now that we have a root inode, let's walk the input dir and populate
 	 * the partition.
 	 */
-	walk_dir(mp, ip, fsxp, path_buf, strlen(cur_path));
+	pd = proto_dir_start(path_buf);
+	walk_dir(mp, ip, fsxp, path_buf, strlen(cur_path), pd);
+	proto_dir_free(pd);
 
 	/*
 	 * Cleanup hardlinks tracker.
@@ -20,7 +20,8 @@ struct proto_source setup_proto(char *fname);
 void parse_proto(struct xfs_mount *mp, struct fsxattr *fsx,
 		 struct proto_source *protosource,
 		 int proto_slashes_are_spaces,
-		 int proto_preserve_atime);
+		 int proto_preserve_atime,
+		 unsigned int nr_threads);
 void res_failed(int err);
 
 #endif /* MKFS_PROTO_H_ */
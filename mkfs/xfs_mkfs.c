@@ -15,6 +15,7 @@
 #include "libfrog/dahashselftest.h"
 #include "libfrog/fsproperties.h"
 #include "libfrog/zones.h"
+#include "libfrog/workqueue.h"
 #include "proto.h"
 #include <ini.h>
 
@@ -81,6 +82,7 @@ enum {
 	D_COWEXTSIZE,
 	D_DAXINHERIT,
 	D_CONCURRENCY,
+	D_DISCARD,
 	D_MAX_OPTS,
 };
 
@@ -342,6 +344,7 @@ static struct opt_params dopts = {
 		[D_COWEXTSIZE] = "cowextsize",
 		[D_DAXINHERIT] = "daxinherit",
 		[D_CONCURRENCY] = "concurrency",
+		[D_DISCARD] = "discard",
 		[D_MAX_OPTS] = NULL,
 	},
 	.subopt_params = {
@@ -474,6 +477,10 @@ static struct opt_params dopts = {
 		  .maxval = INT_MAX,
 		  .defaultval = 1,
 		},
+		{ .index = D_DISCARD,
+		  .conflicts = { { NULL, LAST_CONFLICT } },
+		  .defaultval = SUBOPT_NEEDS_VAL,
+		},
 	},
 };
 
@@ -1102,6 +1109,7 @@ struct cli_params {
 	int	log_concurrency;
 	int	rtvol_concurrency;
 	int	imaxpct;
+	bool	discard_free;
 
 	/* parameters where 0 is not a valid value */
 	int64_t	agcount;
@@ -1214,7 +1222,7 @@ usage( void )
 			    pquota|pqnoenforce]\n\
 /* data subvol */	[-d agcount=n,agsize=n,file,name=xxx,size=num,\n\
 			    (sunit=value,swidth=value|su=num,sw=num|noalign),\n\
-			    sectsize=num,concurrency=num]\n\
+			    sectsize=num,concurrency=num,discard=all|free]\n\
 /* force overwrite */	[-f]\n\
 /* inode size */	[-i perblock=n|size=num,maxpct=n,attr=0|1|2,\n\
 			    projid32bit=0|1,sparse=0|1,nrext64=0|1,\n\
@@ -1328,6 +1336,30 @@ nr_cpus(void)
 	return min(INT_MAX, cpus);
 }
 
+/* Don't start more than this many worker threads for any one job. */
+#define MKFS_MAX_THREADS	64
+
+/*
+ * Work out how many threads to use to process @nr independent items, with
+ * @dflt threads unless the user says otherwise.  Setting MKFS_XFS_THREADS=1 in
+ * the environment forces the serial code paths, which is useful to check that
+ * the parallel ones write the same filesystem.
+ */
+static unsigned int
+mkfs_nr_threads(
+	unsigned int	nr,
+	unsigned int	dflt)
+{
+	unsigned int	nr_threads = dflt;
+	char		*p = getenv("MKFS_XFS_THREADS");
+
+	if (p && *p)
+		nr_threads = strtoul(p, NULL, 0);
+	nr_threads = min(nr_threads, MKFS_MAX_THREADS);
+	nr_threads = min(nr_threads, nr);
+	return max(nr_threads, 1U);
+}
+
 static void
 check_device_type(
 	struct cli_params	*cli,
@@ -1570,41 +1602,203 @@ done:
 	free(buf);
 }
 
+/*
+ * Discards are issued in pieces of at most this size, so that mkfs can still
+ * be interrupted promptly, and spread over a pool of threads so that storage
+ * with many queues (and thin provisioned LUNs in particular) can work on many
+ * of them at once.  Discard is I/O bound, so the default pool size does not
+ * depend on the number of CPUs.
+ */
+#define DISCARD_STEP		(2ULL << 30)
+#define DISCARD_THREADS		16
+
+enum {
+	DISCARD_DATA = 0,
+	DISCARD_RT,
+	DISCARD_LOG,
+	DISCARD_MAX_DEVS,
+};
+
+struct discard_range {
+	uint64_t		offset;		/* bytes */
+	uint64_t		len;		/* bytes */
+	unsigned int		dev;
+};
+
+struct discard_ctl {
+	struct workqueue	wq;
+	bool			running;
+
+	struct discard_range	*ranges;
+	unsigned int		nr_ranges;
+	unsigned int		max_ranges;
+	int			fds[DISCARD_MAX_DEVS];
+
+	/* everything below is protected by lock */
+	pthread_mutex_t		lock;
+	bool			failed[DISCARD_MAX_DEVS];
+	uint64_t		total;
+	uint64_t		done;
+	int			pct;
+	bool			started;
+	bool			show_pct;
+	int			quiet;
+};
+
+static void
+discard_init(
+	struct discard_ctl	*dc,
+	int			quiet)
+{
+	memset(dc, 0, sizeof(*dc));
+	pthread_mutex_init(&dc->lock, NULL);
+	dc->quiet = quiet;
+	dc->show_pct = isatty(STDOUT_FILENO);
+	dc->pct = -1;
+}
+
+/* Queue up a byte range of a device to be discarded. */
 static void
-discard_blocks(int fd, uint64_t nsectors, int quiet)
+discard_add(
+	struct discard_ctl	*dc,
+	unsigned int		dev,
+	int			fd,
+	uint64_t		offset,
+	uint64_t		len)
 {
-	uint64_t	offset = 0;
-	/* Discard the device 2G at a time */
-	const uint64_t	step = 2ULL << 30;
-	const uint64_t	count = BBTOB(nsectors);
+	dc->fds[dev] = fd;
+	while (len > 0) {
+		struct discard_range	*dr;
+		uint64_t		step = min(DISCARD_STEP, len);
+
+		if (dc->nr_ranges == dc->max_ranges) {
+			unsigned int	nr = max(dc->max_ranges * 2, 64U);
+
+			dr = realloc(dc->ranges, nr * sizeof(*dr));
+			if (!dr) {
+				fprintf(stderr,
+	_("%s: failed to allocate discard ranges\n"), progname);
+				exit(1);
+			}
+			dc->ranges = dr;
+			dc->max_ranges = nr;
+		}
+
+		dr = &dc->ranges[dc->nr_ranges++];
+		dr->offset = offset;
+		dr->len = step;
+		dr->dev = dev;
+		dc->total += step;
+
+		offset += step;
+		len -= step;
+	}
+}
+
+/* Tell the user how far we've got; caller must hold the lock. */
+static void
+discard_progress(
+	struct discard_ctl	*dc)
+{
+	int			pct;
+
+	if (dc->quiet)
+		return;
+
+	if (!dc->started) {
+		printf("Discarding blocks...");
+		fflush(stdout);
+		dc->started = true;
+	}
+	if (!dc->show_pct)
+		return;
+
+	pct = dc->done * 100 / dc->total;
+	if (pct != dc->pct) {
+		printf("\rDiscarding blocks... %d%%", pct);
+		fflush(stdout);
+		dc->pct = pct;
+	}
+}
+
+static void
+discard_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct discard_ctl	*dc = arg;
+	struct discard_range	*dr = &dc->ranges[index];
+	bool			failed;
+	int			error;
+
+	pthread_mutex_lock(&dc->lock);
+	failed = dc->failed[dr->dev];
+	pthread_mutex_unlock(&dc->lock);
+	if (failed)
+		return;
 
 	/*
-	 * The block discarding happens in smaller batches so it can be
-	 * interrupted prematurely
+	 * We intentionally ignore errors from the discard ioctl. It is
+	 * not necessary for the mkfs functionality but just an
+	 * optimization. However we should stop on error.
 	 */
-	while (offset < count) {
-		uint64_t	tmp_step = min(step, count - offset);
+	error = platform_discard_blocks(dc->fds[dr->dev], dr->offset, dr->len);
 
-		/*
-		 * We intentionally ignore errors from the discard ioctl. It is
-		 * not necessary for the mkfs functionality but just an
-		 * optimization. However we should stop on error.
-		 */
-		if (platform_discard_blocks(fd, offset, tmp_step) == 0) {
-			if (offset == 0 && !quiet) {
-				printf("Discarding blocks...");
-				fflush(stdout);
-			}
-		} else {
-			if (offset > 0 && !quiet)
-				printf("\n");
-			return;
+	pthread_mutex_lock(&dc->lock);
+	if (error) {
+		dc->failed[dr->dev] = true;
+	} else {
+		dc->done += dr->len;
+		discard_progress(dc);
+	}
+	pthread_mutex_unlock(&dc->lock);
+}
+
+/* Start discarding everything that has been queued. */
+static void
+discard_start(
+	struct discard_ctl	*dc)
+{
+	unsigned int		nr_threads;
+	unsigned int		i;
+
+	if (!dc->nr_ranges)
+		return;
+
+	nr_threads = mkfs_nr_threads(dc->nr_ranges, DISCARD_THREADS);
+	if (nr_threads > 1 && !workqueue_create(&dc->wq, NULL, nr_threads)) {
+		dc->running = true;
+		for (i = 0; i < dc->nr_ranges; i++) {
+			if (workqueue_add(&dc->wq, discard_worker, i, dc))
+				discard_worker(NULL, i, dc);
 		}
+		return;
+	}
 
-		offset += tmp_step;
+	for (i = 0; i < dc->nr_ranges; i++)
+		discard_worker(NULL, i, dc);
+}
+
+/* Wait for all the discards to finish. */
+static void
+discard_wait(
+	struct discard_ctl	*dc)
+{
+	if (dc->running) {
+		workqueue_terminate(&dc->wq);
+		workqueue_destroy(&dc->wq);
+		dc->running = false;
 	}
-	if (offset > 0 && !quiet)
+
+	if (dc->started) {
+		if (dc->show_pct)
+			printf("\rDiscarding blocks...");
 		printf("Done.\n");
+	}
+
+	free(dc->ranges);
+	pthread_mutex_destroy(&dc->lock);
 }
 
 static __attribute__((noreturn)) void
@@ -1890,6 +2084,15 @@ data_opts_parser(
 	case D_CONCURRENCY:
 		set_data_concurrency(opts, subopt, cli, value);
 		break;
+	case D_DISCARD:
+		value = getstr(value, opts, subopt);
+		if (!strcmp(value, "all"))
+			cli->discard_free = false;
+		else if (!strcmp(value, "free"))
+			cli->discard_free = true;
+		else
+			illegal(value, "d discard");
+		break;
 	default:
 		return -EINVAL;
 	}
@@ -3765,6 +3968,10 @@ open_devices(
 	xi->log.size &= (uint64_t)-1 << (max(cfg->lsectorlog, 10) - BBSHIFT);
 }
 
+/*
+ * Discard the whole of every device, the data, rt and log devices all at the
+ * same time, before we write anything to them.
+ */
 static void
 discard_devices(
 	struct mkfs_params	*cfg,
@@ -3772,17 +3979,100 @@ discard_devices(
 	struct zone_topology	*zt,
 	int			quiet)
 {
+	struct discard_ctl	dc;
+
+	discard_init(&dc, quiet);
 	if (!xi->data.isfile) {
 		uint64_t	nsectors = xi->data.size;
 
 		if (cfg->rtstart && zt->data.nr_zones)
 			nsectors -= cfg->rtstart;
-		discard_blocks(xi->data.fd, nsectors, quiet);
+		discard_add(&dc, DISCARD_DATA, xi->data.fd, 0,
+				BBTOB(nsectors));
 	}
 	if (xi->rt.dev && !xi->rt.isfile && !zt->rt.nr_zones)
-		discard_blocks(xi->rt.fd, xi->rt.size, quiet);
+		discard_add(&dc, DISCARD_RT, xi->rt.fd, 0, BBTOB(xi->rt.size));
 	if (xi->log.dev && xi->log.dev != xi->data.dev && !xi->log.isfile)
-		discard_blocks(xi->log.fd, xi->log.size, quiet);
+		discard_add(&dc, DISCARD_LOG, xi->log.fd, 0,
+				BBTOB(xi->log.size));
+	discard_start(&dc);
+	discard_wait(&dc);
+}
+
+/* Queue a discard of [start, end) of the data device, minus the internal log. */
+static void
+discard_add_data_free(
+	struct discard_ctl	*dc,
+	struct mkfs_params	*cfg,
+	struct xfs_mount	*mp,
+	int			fd,
+	uint64_t		start,
+	uint64_t		end)
+{
+	uint64_t		log_start, log_end;
+
+	if (start >= end)
+		return;
+
+	if (cfg->loginternal) {
+		log_start = BBTOB(XFS_FSB_TO_DADDR(mp, cfg->logstart));
+		log_end = log_start + XFS_FSB_TO_B(mp, cfg->logblocks);
+		if (log_start < end && log_end > start) {
+			discard_add_data_free(dc, cfg, mp, fd, start, log_start);
+			discard_add_data_free(dc, cfg, mp, fd, log_end, end);
+			return;
+		}
+	}
+
+	discard_add(dc, DISCARD_DATA, fd, start, end - start);
+}
+
+/*
+ * Start discarding only the space that the new filesystem will leave free:
+ * everything in each AG past the preallocated headers and btree roots, except
+ * for the internal log, and the rt device apart from its first and last
+ * blocks.  Nothing that mkfs writes lives there until the first allocation,
+ * so this can run in the background while the AG headers are written.
+ * The regions at either end of the data device that we zeroed to wipe out
+ * old signatures are left alone.  We don't touch an external log device
+ * because all of it is about to be written.
+ */
+static void
+discard_free_space_start(
+	struct discard_ctl	*dc,
+	struct mkfs_params	*cfg,
+	struct libxfs_init	*xi,
+	struct xfs_mount	*mp,
+	struct zone_topology	*zt,
+	int			quiet)
+{
+	uint64_t		dev_end = BBTOB(xi->data.size) - WHACK_SIZE;
+	xfs_agnumber_t		agno;
+
+	discard_init(dc, quiet);
+	if (!xi->data.isfile) {
+		for (agno = 0; agno < cfg->agcount; agno++) {
+			xfs_rfsblock_t	agblocks = cfg->agsize;
+			uint64_t	start, end;
+
+			if (agno == cfg->agcount - 1)
+				agblocks = cfg->dblocks -
+					(xfs_rfsblock_t)agno * cfg->agsize;
+
+			start = BBTOB(XFS_AGB_TO_DADDR(mp, agno,
+					mp->m_ag_prealloc_blocks));
+			end = BBTOB(XFS_AGB_TO_DADDR(mp, agno, 0)) +
+					XFS_FSB_TO_B(mp, agblocks);
+			discard_add_data_free(dc, cfg, mp, xi->data.fd,
+					max_t(uint64_t, start, WHACK_SIZE),
+					min(end, dev_end));
+		}
+	}
+	if (xi->rt.dev && !xi->rt.isfile && !zt->rt.nr_zones &&
+	    cfg->rtblocks > 2)
+		discard_add(dc, DISCARD_RT, xi->rt.fd, cfg->blocksize,
+				XFS_FSB_TO_B(mp, cfg->rtblocks - 2));
+	discard_start(dc);
 }
 
 static void
@@ -5634,6 +5924,167 @@ initialise_ag_freespace(
 	}
 }
 
+/*
+ * The AG headers are written out in batches of this many AGs per thread so
+ * that we never have to hold the headers for every AG in memory at once.
+ */
+#define AGHDR_BATCH_PER_THREAD	16
+
+struct aghdr_slot {
+	struct list_head	buffer_list;
+	int			worst_freelist;
+};
+
+struct aghdr_batch {
+	struct mkfs_params	*cfg;
+	struct xfs_mount	*mp;
+	xfs_agnumber_t		start;
+	struct aghdr_slot	*slots;
+	int			worst_freelist;
+};
+
+static void
+initialise_ag_headers_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct aghdr_batch	*ab = arg;
+	struct aghdr_slot	*slot = &ab->slots[index];
+
+	initialise_ag_headers(ab->cfg, ab->mp, ab->start + index,
+			&slot->worst_freelist, &slot->buffer_list);
+}
+
+/*
+ * Each AG's headers depend only on the geometry, so build them for a batch of
+ * AGs in parallel, each onto its own buffer list.  The lists are then joined
+ * in AG order and submitted together, which sorts and merges the writes.
+ */
+static int
+initialise_all_ag_headers(
+	struct mkfs_params	*cfg,
+	struct xfs_mount	*mp)
+{
+	struct aghdr_batch	ab = {
+		.cfg		= cfg,
+		.mp		= mp,
+	};
+	struct list_head	buffer_list;
+	struct workqueue	wq;
+	unsigned int		nr_threads = mkfs_nr_threads(cfg->agcount, nr_cpus());
+	unsigned int		batch = nr_threads * AGHDR_BATCH_PER_THREAD;
+	unsigned int		nr;
+	unsigned int		i;
+	int			error;
+
+	ab.slots = calloc(batch, sizeof(struct aghdr_slot));
+	if (!ab.slots) {
+		fprintf(stderr, _("%s: failed to allocate AG header lists\n"),
+				progname);
+		exit(1);
+	}
+
+	INIT_LIST_HEAD(&buffer_list);
+	for (ab.start = 0; ab.start < cfg->agcount; ab.start += nr) {
+		nr = min_t(xfs_agnumber_t, batch, cfg->agcount - ab.start);
+		for (i = 0; i < nr; i++) {
+			INIT_LIST_HEAD(&ab.slots[i].buffer_list);
+			ab.slots[i].worst_freelist = 0;
+		}
+
+		if (nr_threads > 1) {
+			error = -workqueue_create(&wq, NULL, nr_threads);
+			if (error) {
+				fprintf(stderr,
+	_("%s: could not start AG header threads, err=%d\n"),
+						progname, error);
+				exit(1);
+			}
+			for (i = 0; i < nr; i++) {
+				if (workqueue_add(&wq,
+						initialise_ag_headers_worker,
+						i, &ab))
+					initialise_ag_headers_worker(NULL, i,
+							&ab);
+			}
+			workqueue_terminate(&wq);
+			workqueue_destroy(&wq);
+		} else {
+			for (i = 0; i < nr; i++)
+				initialise_ag_headers_worker(NULL, i, &ab);
+		}
+
+		for (i = 0; i < nr; i++) {
+			list_splice_tail_init(&ab.slots[i].buffer_list,
+					&buffer_list);
+			ab.worst_freelist = max(ab.worst_freelist,
+					ab.slots[i].worst_freelist);
+		}
+
+		error = -libxfs_buf_delwri_submit(&buffer_list);
+		if (error) {
+			fprintf(stderr,
+	_("%s: writing AG headers failed, err=%d\n"),
+					progname, error);
+			exit(1);
+		}
+	}
+
+	free(ab.slots);
+	return ab.worst_freelist;
+}
+
+struct agfree_init {
+	struct xfs_mount	*mp;
+	int			worst_freelist;
+};
+
+static void
+initialise_ag_freespace_worker(
+	struct workqueue	*wq,
+	uint32_t		index,
+	void			*arg)
+{
+	struct agfree_init	*ai = arg;
+
+	initialise_ag_freespace(ai->mp, index, ai->worst_freelist);
+}
+
+/*
+ * Filling the AGFL of one AG only touches that AG's headers and btrees, so
+ * the AGs can be done in parallel as well.
+ */
+static void
+initialise_all_ag_freespace(
+	struct mkfs_params	*cfg,
+	struct xfs_mount	*mp,
+	int			worst_freelist)
+{
+	struct agfree_init	ai = {
+		.mp		= mp,
+		.worst_freelist	= worst_freelist,
+	};
+	struct workqueue	wq;
+	unsigned int		nr_threads = mkfs_nr_threads(cfg->agcount, nr_cpus());
+	xfs_agnumber_t		agno;
+
+	if (nr_threads > 1 && !workqueue_create(&wq, NULL, nr_threads)) {
+		for (agno = 0; agno < cfg->agcount; agno++) {
+			if (workqueue_add(&wq, initialise_ag_freespace_worker,
+					agno, &ai))
+				initialise_ag_freespace_worker(NULL, agno,
+						&ai);
+		}
+		workqueue_terminate(&wq);
+		workqueue_destroy(&wq);
+		return;
+	}
+
+	for (agno = 0; agno < cfg->agcount; agno++)
+		initialise_ag_freespace_worker(NULL, agno, &ai);
+}
+
 /*
  * rewrite several secondary superblocks with the root inode number filled out.
  * This can help repair recovery from a trashed primary superblock without
@@ -5929,7 +6380,6 @@ main(
 	int			argc,
 	char			**argv)
 {
-	xfs_agnumber_t		agno;
 	struct xfs_buf		*buf;
 	int			c;
 	int			dry_run = 0;
@@ -5937,7 +6387,8 @@ main(
 	int			force_overwrite = 0;
 	int			quiet = 0;
 	struct proto_source	protosource;
-	int			worst_freelist = 0;
+	struct discard_ctl	dc;
+	int			worst_freelist;
 
 	struct libxfs_init	xi = {
 		.flags = LIBXFS_EXCLUSIVELY | LIBXFS_DIRECT,
@@ -6003,7 +6454,6 @@ main(
 		},
 	};
 	struct zone_topology zt = {};
-	struct list_head	buffer_list;
 	int			error;
 
 	platform_uuid_generate(&cli.uuid);
@@ -6214,7 +6664,7 @@ main(
 	/*
 	 * All values have been validated, discard the old device layout.
 	 */
-	if (discard && !dry_run)
+	if (discard && !cli.discard_free && !dry_run)
 		discard_devices(&cfg, cli.xi, &zt, quiet);
 	if (cli.sb_feat.zoned && !dry_run)
 		reset_devices(&cfg, cli.xi, &zt, quiet);
@@ -6240,29 +6690,13 @@ main(
 	/*
 	 * Initialise all the static on disk metadata.
 	 */
-	INIT_LIST_HEAD(&buffer_list);
-	for (agno = 0; agno < cfg.agcount; agno++) {
-		initialise_ag_headers(&cfg, mp, agno, &worst_freelist,
-				&buffer_list);
+	if (discard && cli.discard_free)
+		discard_free_space_start(&dc, &cfg, &xi, mp, &zt, quiet);
 
-		if (agno % 16)
-			continue;
+	worst_freelist = initialise_all_ag_headers(&cfg, mp);
 
-		error = -libxfs_buf_delwri_submit(&buffer_list);
-		if (error) {
-			fprintf(stderr,
-	_("%s: writing AG headers failed, err=%d\n"),
-					progname, error);
-			exit(1);
-		}
-	}
-
-	error = -libxfs_buf_delwri_submit(&buffer_list);
-	if (error) {
-		fprintf(stderr, _("%s: writing AG headers failed, err=%d\n"),
-				progname, error);
-		exit(1);
-	}
+	if (discard && cli.discard_free)
+		discard_wait(&dc);
 
 	if (xfs_has_rtsb(mp) && cfg.rtblocks > 0)
 		write_rtsb(mp);
@@ -6270,8 +6704,7 @@ main(
 	/*
 	 * Initialise the freespace freelists (i.e. AGFLs) in each AG.
 	 */
-	for (agno = 0; agno < cfg.agcount; agno++)
-		initialise_ag_freespace(mp, agno, worst_freelist);
+	initialise_all_ag_freespace(&cfg, mp, worst_freelist);
 
 	/*
 	 * Allocate the root inode and anything else in the proto file.
@@ -6280,7 +6713,8 @@ main(
 	parse_proto(mp, &cli.fsx,
 			&protosource,
 			cli.proto_slashes_are_spaces,
-			cli.proto_atime);
+			cli.proto_atime,
+			mkfs_nr_threads(MKFS_MAX_THREADS, nr_cpus()));
 
 	/*
 	 * Protect ourselves against possible stupidity
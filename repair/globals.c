@@ -38,6 +38,8 @@ int	verbose;
 int	no_modify;
 int	dangerously;		/* live dangerously ... fix ro mount */
 int	isa_file;
+bool	isa_metadump;		/* check a metadump, not a device */
+char	*metadump_map;		/* extent map of that metadump */
 int	zap_log;
 int	dumpcore;		/* abort, not exit on fatal errs */
 int	force_geo;		/* can set geo on low confidence info */
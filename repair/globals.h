@@ -79,6 +79,8 @@ extern int	verbose;
 extern int	no_modify;
 extern int	dangerously;		/* live dangerously ... fix ro mount */
 extern int	isa_file;
+extern bool	isa_metadump;		/* check a metadump, not a device */
+extern char	*metadump_map;		/* extent map of that metadump */
 extern int	zap_log;
 extern int	dumpcore;		/* abort, not exit on fatal errs */
 extern int	force_geo;		/* can set geo on low confidence info */
@@ -58,6 +58,8 @@ xfs_init(struct libxfs_init *args)
 
 	args->data.name = fs_name;
 	args->data.isfile = isa_file;
+	args->data.metadump = isa_metadump;
+	args->data.metadump_map = metadump_map;
 
 	if (log_spec)  {	/* External log specified */
 		args->log.name = log_name;
@@ -167,7 +167,8 @@ phase3(
 		create_work_queue(&wq, mp, scan_threads);
 
 		for (i = 0; i < mp->m_sb.sb_agcount; i++)
-			queue_work(&wq, do_uncertain_aginodes, i, &counts[i]);
+			queue_ag_work(&wq, do_uncertain_aginodes, i,
+					&counts[i]);
 
 		destroy_work_queue(&wq);
 
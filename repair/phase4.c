@@ -244,7 +244,7 @@ process_rmap_data(
 
 	create_work_queue(&wq, mp, platform_nproc());
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		queue_work(&wq, check_rmap_btrees, i, NULL);
+		queue_ag_work(&wq, check_rmap_btrees, i, NULL);
 	if (xfs_has_rtrmapbt(mp)) {
 		for (i = 0; i < mp->m_sb.sb_rgcount; i++)
 			queue_work(&wq, check_rtrmap_btrees, i, NULL);
@@ -256,7 +256,7 @@ process_rmap_data(
 
 	create_work_queue(&wq, mp, platform_nproc());
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		queue_work(&wq, compute_ag_refcounts, i, NULL);
+		queue_ag_work(&wq, compute_ag_refcounts, i, NULL);
 	if (xfs_has_rtreflink(mp)) {
 		for (i = 0; i < mp->m_sb.sb_rgcount; i++)
 			queue_work(&wq, compute_rt_refcounts, i, NULL);
@@ -265,8 +265,8 @@ process_rmap_data(
 
 	create_work_queue(&wq, mp, platform_nproc());
 	for (i = 0; i < mp->m_sb.sb_agcount; i++) {
-		queue_work(&wq, process_inode_reflink_flags, i, NULL);
-		queue_work(&wq, check_refcount_btrees, i, NULL);
+		queue_ag_work(&wq, process_inode_reflink_flags, i, NULL);
+		queue_ag_work(&wq, check_refcount_btrees, i, NULL);
 	}
 	if (xfs_has_rtreflink(mp)) {
 		for (i = 0; i < mp->m_sb.sb_rgcount; i++)
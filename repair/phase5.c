@@ -434,12 +434,22 @@ keep_fsinos(xfs_mount_t *mp)
 	}
 }
 
+/*
+ * Rebuild one AG.  Everything an AG rebuild touches is private to that AG --
+ * the new btree blocks come out of the AG's own incore free space trees, and
+ * the counters go into per-AG slots -- except for the lost blocks bitmap,
+ * which does its own locking.  Hence we can rebuild AGs concurrently and
+ * still end up with exactly the same filesystem as rebuilding them in order.
+ */
 static void
 phase5_func(
-	struct xfs_mount	*mp,
-	struct xfs_perag	*pag,
-	struct bitmap		*lost_blocks)
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
 {
+	struct xfs_mount	*mp = wq->wq_ctx;
+	struct bitmap		*lost_blocks = arg;
+	struct xfs_perag	*pag = libxfs_perag_get(mp, agno);
 	struct repair_ctx	sc = { .mp = mp, };
 	struct bt_rebuild	btr_bno;
 	struct bt_rebuild	btr_cnt;
@@ -447,7 +457,6 @@ phase5_func(
 	struct bt_rebuild	btr_fino;
 	struct bt_rebuild	btr_rmap;
 	struct bt_rebuild	btr_refc;
-	xfs_agnumber_t		agno = pag_agno(pag);
 	int			extra_blocks = 0;
 	uint			num_freeblocks;
 	xfs_agblock_t		num_extents;
@@ -593,6 +602,7 @@ _("unable to rebuild AG %u.  Not enough free space in on-disk AG.\n"),
 	 */
 	release_agbno_extent_tree(agno);
 	release_agbcnt_extent_tree(agno);
+	libxfs_perag_put(pag);
 	PROG_RPT_INC(prog_rpt_done[agno], 1);
 }
 
@@ -745,10 +755,12 @@ are_packed_btrees_needed(
 }
 
 void
-phase5(xfs_mount_t *mp)
+phase5(
+	struct xfs_mount	*mp,
+	int			scan_threads)
 {
+	struct workqueue	wq;
 	struct bitmap		*lost_blocks = NULL;
-	struct xfs_perag	*pag = NULL;
 	xfs_agnumber_t		agno;
 	int			error;
 
@@ -797,8 +809,10 @@ phase5(xfs_mount_t *mp)
 
 	need_packed_btrees = are_packed_btrees_needed(mp);
 
-	while ((pag = xfs_perag_next(mp, pag)))
-		phase5_func(mp, pag, lost_blocks);
+	create_work_queue(&wq, mp, scan_threads);
+	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
+		queue_ag_work(&wq, phase5_func, agno, lost_blocks);
+	destroy_work_queue(&wq);
 
 	print_final_rpt();
 
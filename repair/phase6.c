@@ -770,6 +770,10 @@ mk_metadir(
 	int			error;
 
 	libxfs_rtginode_irele(&mp->m_rtdirip);
+	if (mp->m_metadirip) {
+		libxfs_irele(mp->m_metadirip);
+		mp->m_metadirip = NULL;
+	}
 
 	error = init_fs_root_dir(mp, mp->m_sb.sb_metadirino, 0,
 			&mp->m_metadirip);
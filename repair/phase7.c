@@ -144,7 +144,7 @@ phase7(
 	create_work_queue(&wq, mp, scan_threads);
 
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		queue_work(&wq, do_link_updates, agno, NULL);
+		queue_ag_work(&wq, do_link_updates, agno, NULL);
 
 	destroy_work_queue(&wq);
 
@@ -1330,7 +1330,7 @@ check_parent_ptrs(
 	create_work_queue(&wq, mp, ag_stride);
 
 	for (agno = 0; agno < mp->m_sb.sb_agcount; agno++)
-		queue_work(&wq, check_ag_parent_ptrs, agno, NULL);
+		queue_ag_work(&wq, check_ag_parent_ptrs, agno, NULL);
 
 	destroy_work_queue(&wq);
 }
@@ -16,6 +16,8 @@
 #include "threads.h"
 #include "prefetch.h"
 #include "progress.h"
+#include "stats.h"
+#include "libfrog/ioengine.h"
 
 int do_prefetch = 1;
 
@@ -33,6 +35,21 @@ static int		pf_max_bbs;
 static int		pf_max_fsbs;
 static int		pf_batch_bytes;
 static int		pf_batch_fsbs;
+static int		pf_discard_bytes;
+
+/* I/O accounting for the summary report. */
+static atomic64_t	pf_bytes_read;
+static atomic64_t	pf_bytes_direct;
+static atomic64_t	pf_bytes_discarded;
+static atomic64_t	pf_nr_reads;
+
+/*
+ * Buffers we were asked to prefetch, how many of those were already in the
+ * cache, and how many we read in ahead of the processing threads.
+ */
+static atomic64_t	pf_nr_requested;
+static atomic64_t	pf_nr_cached;
+static atomic64_t	pf_nr_prefetched;
 
 static void		pf_read_inode_dirs(prefetch_args_t *, struct xfs_buf *);
 
@@ -70,6 +87,14 @@ static void		pf_read_inode_dirs(prefetch_args_t *, struct xfs_buf *);
 
 #define MAX_BUFS	128
 
+/*
+ * Each batch read is a scatter list with one segment per buffer and the gaps
+ * between them pointed at a single discard page.  A batch never spans more
+ * than pf_max_bytes (128 pages), so the gaps need at most 128 full pages plus
+ * one partial page per gap.
+ */
+#define MAX_IOVS	(MAX_BUFS * 3)
+
 #define IO_THRESHOLD	(MAX_BUFS * 2)
 
 typedef enum pf_which {
@@ -115,6 +140,8 @@ pf_queue_io(
 	xfs_fsblock_t		fsbno = XFS_DADDR_TO_FSB(mp, map[0].bm_bn);
 	int			error;
 
+	atomic64_inc(&pf_nr_requested);
+
 	/*
 	 * Never block on a buffer lock here, given that the actual repair
 	 * code might lock buffers in a different order from us.  Given that
@@ -127,6 +154,7 @@ pf_queue_io(
 		return;
 
 	if (bp->b_flags & LIBXFS_B_UPTODATE) {
+		atomic64_inc(&pf_nr_cached);
 		if (B_IS_INODE(flag))
 			pf_read_inode_dirs(args, bp);
 		libxfs_buf_set_priority(bp, libxfs_buf_priority(bp) +
@@ -464,6 +492,104 @@ pf_read_inode_dirs(
 		libxfs_buf_set_priority(bp, B_DIR_INODE);
 }
 
+/*
+ * A scattered read failed, perhaps because it ran off the end of the device.
+ * Read each buffer on its own so that the ones that are there still count.
+ */
+static void
+pf_read_each(
+	struct xfs_buf		**bplist,
+	unsigned int		num,
+	struct iovec		*iovs)
+{
+	struct io_req		reqs[MAX_BUFS];
+	unsigned int		i;
+
+	for (i = 0; i < num; i++) {
+		iovs[i].iov_base = bplist[i]->b_addr;
+		iovs[i].iov_len = BBTOB(bplist[i]->b_length);
+		reqs[i].offset = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i]));
+		reqs[i].iov = &iovs[i];
+		reqs[i].iovcnt = 1;
+		reqs[i].error = 0;
+	}
+
+	mp->m_ddev_targp->bt_ioengine->readv(mp_fd, reqs, num);
+	libxfs_buftarg_account(mp->m_ddev_targp, reqs, num, false);
+
+	for (i = 0; i < num; i++) {
+		if (reqs[i].error)
+			continue;
+		bplist[i]->b_flags |= (LIBXFS_B_UPTODATE | LIBXFS_B_UNCHECKED);
+		atomic64_inc(&pf_nr_reads);
+		atomic64_add(iovs[i].iov_len, &pf_bytes_read);
+		atomic64_add(iovs[i].iov_len, &pf_bytes_direct);
+	}
+}
+
+/*
+ * Read as many of the @num buffers at the start of @bplist as we can with a
+ * single read, scattered straight into the buffers, with the gaps between
+ * them sent to the @discard page.  Overlapping buffers can't be scattered
+ * into, so the read stops short of the first buffer that overlaps the one
+ * before it.  Buffers that were read in full are marked up to date.
+ * Returns the number of buffers dealt with.
+ */
+static unsigned int
+pf_scatter_read(
+	struct xfs_buf		**bplist,
+	unsigned int		num,
+	struct iovec		*iovs,
+	void			*discard)
+{
+	struct io_req		req;
+	off_t			first_off;
+	off_t			next_off;
+	off_t			direct = 0;
+	unsigned int		nr_iovs = 0;
+	unsigned int		i, j;
+
+	first_off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[0]));
+	next_off = first_off;
+	for (i = 0; i < num; i++) {
+		off_t	off = LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i]));
+
+		if (off < next_off)
+			break;
+		while (next_off < off) {
+			iovs[nr_iovs].iov_base = discard;
+			iovs[nr_iovs].iov_len = min_t(off_t, off - next_off,
+					pf_discard_bytes);
+			next_off += iovs[nr_iovs].iov_len;
+			nr_iovs++;
+		}
+		iovs[nr_iovs].iov_base = bplist[i]->b_addr;
+		iovs[nr_iovs].iov_len = BBTOB(bplist[i]->b_length);
+		next_off += iovs[nr_iovs].iov_len;
+		direct += iovs[nr_iovs].iov_len;
+		nr_iovs++;
+	}
+
+	req.offset = first_off;
+	req.iov = iovs;
+	req.iovcnt = nr_iovs;
+	req.error = 0;
+	if (mp->m_ddev_targp->bt_ioengine->readv(mp_fd, &req, 1)) {
+		pf_read_each(bplist, i, iovs);
+		return i;
+	}
+	libxfs_buftarg_account(mp->m_ddev_targp, &req, 1, false);
+
+	for (j = 0; j < i; j++)
+		bplist[j]->b_flags |= (LIBXFS_B_UPTODATE | LIBXFS_B_UNCHECKED);
+
+	atomic64_inc(&pf_nr_reads);
+	atomic64_add(next_off - first_off, &pf_bytes_read);
+	atomic64_add(direct, &pf_bytes_direct);
+	atomic64_add(next_off - first_off - direct, &pf_bytes_discarded);
+	return i;
+}
+
 /*
  * pf_batch_read must be called with the lock locked.
  */
@@ -471,17 +597,17 @@ static void
 pf_batch_read(
 	prefetch_args_t		*args,
 	pf_which_t		which,
-	void			*buf)
+	void			*discard)
 {
 	struct xfs_buf		*bplist[MAX_BUFS];
+	struct iovec		iovs[MAX_IOVS];
 	unsigned int		num;
 	off_t			first_off, last_off, next_off;
-	int			len, size;
 	int			i;
+	unsigned int		nr_read;
 	int			inode_bufs;
 	unsigned long		fsbno = 0;
 	unsigned long		max_fsbno;
-	char			*pbuf;
 
 	for (;;) {
 		num = 0;
@@ -572,11 +698,6 @@ pf_batch_read(
 #endif
 		pthread_mutex_unlock(&args->lock);
 
-		/*
-		 * now read the data and put into the xfs_but_t's
-		 */
-		len = pread(mp_fd, buf, (int)(last_off - first_off), first_off);
-
 		/*
 		 * Check the last buffer on the list to see if we need to
 		 * process a discontiguous buffer. The gather above loop
@@ -584,37 +705,42 @@ pf_batch_read(
 		 * discontiguous buffer.
 		 */
 		if ((bplist[num - 1]->b_flags & LIBXFS_B_DISCONTIG)) {
-			libxfs_readbufr_map(mp->m_ddev_targp, bplist[num - 1], 0);
+			if (!libxfs_readbufr_map(mp->m_ddev_targp,
+						bplist[num - 1], 0))
+				atomic64_inc(&pf_nr_prefetched);
 			bplist[num - 1]->b_flags |= LIBXFS_B_UNCHECKED;
 			libxfs_buf_relse(bplist[num - 1]);
 			num--;
 		}
 
-		if (len > 0) {
-			/*
-			 * go through the struct xfs_buf list copying from the
-			 * read buffer into the struct xfs_buf's and release them.
-			 */
-			for (i = 0; i < num; i++) {
+		/*
+		 * Now read the data straight into the struct xfs_buf's.  A
+		 * buffer that overlaps the one before it starts another read.
+		 */
+		for (i = 0; i < num; i += nr_read)
+			nr_read = pf_scatter_read(bplist + i, num - i, iovs,
+					discard);
 
-				pbuf = ((char *)buf) + (LIBXFS_BBTOOFF64(xfs_buf_daddr(bplist[i])) - first_off);
-				size = BBTOB(bplist[i]->b_length);
-				if (len < size)
-					break;
-				memcpy(bplist[i]->b_addr, pbuf, size);
-				bplist[i]->b_flags |= (LIBXFS_B_UPTODATE |
-						       LIBXFS_B_UNCHECKED);
-				len -= size;
-				if (B_IS_INODE(libxfs_buf_priority(bplist[i])))
-					pf_read_inode_dirs(args, bplist[i]);
-				else if (which == PF_META_ONLY)
-					libxfs_buf_set_priority(bplist[i],
-								B_DIR_META_H);
-				else if (which == PF_PRIMARY && num == 1)
-					libxfs_buf_set_priority(bplist[i],
-								B_DIR_META_S);
-			}
+		/*
+		 * go through the struct xfs_buf list, and pick up the buffers
+		 * we read before releasing them.
+		 */
+		nr_read = 0;
+		for (i = 0; i < num; i++) {
+			if (!(bplist[i]->b_flags & LIBXFS_B_UPTODATE))
+				continue;
+			nr_read++;
+			if (B_IS_INODE(libxfs_buf_priority(bplist[i])))
+				pf_read_inode_dirs(args, bplist[i]);
+			else if (which == PF_META_ONLY)
+				libxfs_buf_set_priority(bplist[i],
+							B_DIR_META_H);
+			else if (which == PF_PRIMARY && num == 1)
+				libxfs_buf_set_priority(bplist[i],
+							B_DIR_META_S);
 		}
+		atomic64_add(nr_read, &pf_nr_prefetched);
+
 		for (i = 0; i < num; i++) {
 			pftrace("putbuf %c %p (%llu) in AG %d",
 				B_IS_INODE(libxfs_buf_priority(bplist[i])) ?
@@ -638,12 +764,12 @@ pf_batch_read(
 				pftrace("reading metadata bufs from primary queue for AG %d",
 					args->agno);
 
-				pf_batch_read(args, PF_META_ONLY, buf);
+				pf_batch_read(args, PF_META_ONLY, discard);
 
 				pftrace("reading bufs from secondary queue for AG %d",
 					args->agno);
 
-				pf_batch_read(args, PF_SECONDARY, buf);
+				pf_batch_read(args, PF_SECONDARY, discard);
 			}
 		}
 	}
@@ -655,7 +781,7 @@ pf_io_worker(
 {
 	prefetch_args_t		*args = param;
 	void			*buf = memalign(libxfs_device_alignment(),
-						pf_max_bytes);
+						pf_discard_bytes);
 
 	if (buf == NULL)
 		return NULL;
@@ -884,6 +1010,38 @@ init_prefetch(
 	pf_max_fsbs = pf_max_bytes >> mp->m_sb.sb_blocklog;
 	pf_batch_bytes = DEF_BATCH_BYTES;
 	pf_batch_fsbs = DEF_BATCH_BYTES >> (mp->m_sb.sb_blocklog + 1);
+	pf_discard_bytes = sysconf(_SC_PAGE_SIZE);
+}
+
+/*
+ * Report how much the prefetcher read, and how much of that landed directly
+ * in the buffer cache as opposed to the holes that had to be read through.
+ */
+void
+prefetch_report(void)
+{
+	uint64_t		nr_reads = atomic64_read(&pf_nr_reads);
+
+	if (!nr_reads)
+		return;
+
+	do_log(
+_("Prefetch: %" PRIu64 " reads, %" PRIu64 " bytes read, %" PRIu64 " bytes into buffers, %" PRIu64 " bytes discarded\n"),
+		nr_reads, (uint64_t)atomic64_read(&pf_bytes_read),
+		(uint64_t)atomic64_read(&pf_bytes_direct),
+		(uint64_t)atomic64_read(&pf_bytes_discarded));
+}
+
+void
+prefetch_get_stats(
+	struct prefetch_stats	*ps)
+{
+	ps->requested = atomic64_read(&pf_nr_requested);
+	ps->cached = atomic64_read(&pf_nr_cached);
+	ps->prefetched = atomic64_read(&pf_nr_prefetched);
+	ps->nr_reads = atomic64_read(&pf_nr_reads);
+	ps->bytes_read = atomic64_read(&pf_bytes_read);
+	ps->bytes_discarded = atomic64_read(&pf_bytes_discarded);
 }
 
 prefetch_args_t *
@@ -977,6 +1135,7 @@ prefetch_ag_range(
 	struct xfs_mount	*mp = work->wq_ctx;
 	int			i;
 	struct prefetch_args	*pf_args[2];
+	uint64_t		start;
 
 	pf_args[start_ag & 1] = start_inode_prefetch(mp, start_ag, dirs_only,
 			NULL);
@@ -985,7 +1144,9 @@ prefetch_ag_range(
 		if (i + 1 < end_ag)
 			pf_args[(~i) & 1] = start_inode_prefetch(mp, i + 1,
 						dirs_only, pf_args[i & 1]);
+		start = stats_now();
 		func(work, i, pf_args[i & 1]);
+		stats_ag_done(i, start);
 	}
 }
 
@@ -1036,7 +1197,7 @@ do_inode_prefetch(
 		queue.wq_ctx = mp;
 		create_work_queue(&queue, mp, platform_nproc());
 		for (i = 0; i < mp->m_sb.sb_agcount; i++)
-			queue_work(&queue, func, i, NULL);
+			queue_ag_work(&queue, func, i, NULL);
 		destroy_work_queue(&queue);
 		return;
 	}
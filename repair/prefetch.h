@@ -61,6 +61,22 @@ void
 cleanup_inode_prefetch(
 	prefetch_args_t		*args);
 
+void
+prefetch_report(void);
+
+struct prefetch_stats {
+	uint64_t		requested;	/* buffers asked for */
+	uint64_t		cached;		/* ...already in the cache */
+	uint64_t		prefetched;	/* ...read ahead by us */
+	uint64_t		nr_reads;	/* batched reads issued */
+	uint64_t		bytes_read;
+	uint64_t		bytes_discarded;
+};
+
+void
+prefetch_get_stats(
+	struct prefetch_stats	*ps);
+
 
 #ifdef XR_PF_TRACE
 void	pftrace_init(void);
@@ -4,6 +4,7 @@
 #include "globals.h"
 #include "progress.h"
 #include "err_protos.h"
+#include "prefetch.h"
 #include <signal.h>
 
 #define ONEMINUTE  60
@@ -396,6 +397,8 @@ timestamp(
 
 	if (verbose > 1 && mp && mp->m_ddev_targp && mp->m_ddev_targp->bcache)
 		cache_report(stderr, "libxfs_bcache", mp->m_ddev_targp->bcache);
+	if (verbose > 1 && mp && mp->m_icache)
+		cache_report(stderr, "libxfs_icache", mp->m_icache);
 
 	now = time(NULL);
 
@@ -542,4 +545,5 @@ summary_report(void)
 		}
 	}
 	do_log(_("\nTotal run time: %s\n"), duration(phase_times[0].duration, msgbuf));
+	prefetch_report();
 }
@@ -128,10 +128,8 @@ __find_secondary_sb(
 		/*
 		 * read disk 1 MByte at a time.
 		 */
-		if (lseek(x.data.fd, off, SEEK_SET) != off)
-			done = 1;
-
-		if (!done && (bsize = read(x.data.fd, sb, BSIZE)) <= 0)
+		bsize = libxfs_device_pread(&x.data, sb, BSIZE, off);
+		if (bsize <= 0)
 			done = 1;
 
 		do_warn(".");
@@ -582,15 +580,7 @@ get_sb(xfs_sb_t *sbp, xfs_off_t off, int size, xfs_agnumber_t agno)
 
 	/* try and read it first */
 
-	if (lseek(x.data.fd, off, SEEK_SET) != off)  {
-		do_warn(
-	_("error reading superblock %u -- seek to offset %" PRId64 " failed\n"),
-			agno, off);
-		free(buf);
-		return(XR_EOF);
-	}
-
-	if ((rval = read(x.data.fd, buf, size)) != size)  {
+	if ((rval = libxfs_device_pread(&x.data, buf, size, off)) != size)  {
 		error = errno;
 		do_warn(
 	_("superblock read failed, offset %" PRId64 ", size %d, ag %u, rval %d\n"),
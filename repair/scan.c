@@ -3478,7 +3478,7 @@ scan_ags(
 	create_work_queue(&wq, mp, scan_threads);
 
 	for (i = 0; i < mp->m_sb.sb_agcount; i++)
-		queue_work(&wq, scan_ag, i, &agcnts[i]);
+		queue_ag_work(&wq, scan_ag, i, &agcnts[i]);
 
 	destroy_work_queue(&wq);
 
@@ -0,0 +1,309 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * Per-phase performance telemetry.
+ *
+ * With -o stats=<file>, we write one JSON object per line to the file at the
+ * end of every phase, describing how long the phase took, how much I/O it
+ * did, how well prefetch and the buffer cache worked, and how evenly the
+ * per-AG work was spread.  Lines are flushed as they are written so that
+ * the file can be followed while repair runs.
+ */
+
+#include "libxfs.h"
+#include <pthread.h>
+#include <sys/resource.h>
+#include "globals.h"
+#include "err_protos.h"
+#include "prefetch.h"
+#include "stats.h"
+
+struct stats_snap {
+	uint64_t		wall_ns;
+	uint64_t		user_ns;
+	uint64_t		sys_ns;
+	uint64_t		nr_reads;
+	uint64_t		bytes_read;
+	uint64_t		nr_writes;
+	uint64_t		bytes_written;
+	struct prefetch_stats	pf;
+	struct cache_stats	bcache;
+};
+
+static FILE			*stats_fp;
+static struct stats_snap	stats_prev;
+
+/* Time spent on each AG during the current phase, in ns. */
+static pthread_mutex_t		stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t			*stats_ag_ns;
+static xfs_agnumber_t		stats_nr_ags;
+
+static inline uint64_t
+tv_to_ns(
+	const struct timeval	*tv)
+{
+	return tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL;
+}
+
+static inline double
+ns_to_s(
+	uint64_t		ns)
+{
+	return ns / 1e9;
+}
+
+uint64_t
+stats_now(void)
+{
+	struct timespec		ts;
+
+	if (!stats_fp)
+		return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+bool
+stats_enabled(void)
+{
+	return stats_fp != NULL;
+}
+
+/* Add up the I/O done through a buffer target, unless we've seen it. */
+static void
+stats_add_buftarg(
+	struct stats_snap	*s,
+	struct xfs_buftarg	*btp,
+	struct xfs_buftarg	*seen1,
+	struct xfs_buftarg	*seen2)
+{
+	if (!btp || btp == seen1 || btp == seen2)
+		return;
+	s->nr_reads += uatomic_read(&btp->bt_nr_reads);
+	s->bytes_read += uatomic_read(&btp->bt_bytes_read);
+	s->nr_writes += uatomic_read(&btp->bt_nr_writes);
+	s->bytes_written += uatomic_read(&btp->bt_bytes_written);
+}
+
+static void
+stats_snapshot(
+	struct xfs_mount	*mp,
+	struct stats_snap	*s)
+{
+	struct rusage		ru;
+
+	memset(s, 0, sizeof(*s));
+	s->wall_ns = stats_now();
+	if (!getrusage(RUSAGE_SELF, &ru)) {
+		s->user_ns = tv_to_ns(&ru.ru_utime);
+		s->sys_ns = tv_to_ns(&ru.ru_stime);
+	}
+
+	if (mp) {
+		stats_add_buftarg(s, mp->m_ddev_targp, NULL, NULL);
+		stats_add_buftarg(s, mp->m_logdev_targp, mp->m_ddev_targp,
+				NULL);
+		stats_add_buftarg(s, mp->m_rtdev_targp, mp->m_ddev_targp,
+				mp->m_logdev_targp);
+		if (mp->m_ddev_targp && mp->m_ddev_targp->bcache)
+			cache_get_stats(mp->m_ddev_targp->bcache, &s->bcache);
+	}
+	prefetch_get_stats(&s->pf);
+}
+
+void
+stats_open(
+	const char		*path)
+{
+	stats_fp = fopen(path, "w");
+	if (!stats_fp)
+		do_abort(_("cannot open stats file %s: %s\n"), path,
+				strerror(errno));
+}
+
+void
+stats_close(void)
+{
+	if (!stats_fp)
+		return;
+	if (fclose(stats_fp))
+		do_warn(_("error writing stats file: %s\n"), strerror(errno));
+	stats_fp = NULL;
+	free(stats_ag_ns);
+	stats_ag_ns = NULL;
+	stats_nr_ags = 0;
+}
+
+/*
+ * Charge the time since @start to an AG.  Work items for the same AG add up,
+ * since some phases make several passes over each AG.
+ */
+void
+stats_ag_done(
+	xfs_agnumber_t		agno,
+	uint64_t		start)
+{
+	uint64_t		elapsed;
+
+	if (!stats_fp)
+		return;
+	elapsed = stats_now() - start;
+
+	pthread_mutex_lock(&stats_lock);
+	if (!stats_ag_ns && glob_agcount) {
+		stats_ag_ns = calloc(glob_agcount, sizeof(uint64_t));
+		if (stats_ag_ns)
+			stats_nr_ags = glob_agcount;
+	}
+	if (agno < stats_nr_ags)
+		stats_ag_ns[agno] += elapsed;
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/* Print a ratio, or null if there's nothing to divide by. */
+static void
+stats_ratio(
+	const char		*name,
+	uint64_t		num,
+	uint64_t		den)
+{
+	if (den)
+		fprintf(stats_fp, "\"%s\":%.4f", name, (double)num / den);
+	else
+		fprintf(stats_fp, "\"%s\":null", name);
+}
+
+static void
+stats_ag_report(void)
+{
+	uint64_t		min_ns = UINT64_MAX;
+	uint64_t		max_ns = 0;
+	uint64_t		sum_ns = 0;
+	xfs_agnumber_t		slowest = 0;
+	xfs_agnumber_t		count = 0;
+	xfs_agnumber_t		agno;
+
+	pthread_mutex_lock(&stats_lock);
+	for (agno = 0; agno < stats_nr_ags; agno++) {
+		uint64_t	ns = stats_ag_ns[agno];
+
+		if (!ns)
+			continue;
+		count++;
+		sum_ns += ns;
+		min_ns = min(min_ns, ns);
+		if (ns > max_ns) {
+			max_ns = ns;
+			slowest = agno;
+		}
+		stats_ag_ns[agno] = 0;
+	}
+	pthread_mutex_unlock(&stats_lock);
+
+	if (!count) {
+		fprintf(stats_fp, "\"ag_time\":null");
+		return;
+	}
+
+	fprintf(stats_fp,
+"\"ag_time\":{\"count\":%u,\"min_s\":%.6f,\"max_s\":%.6f,\"mean_s\":%.6f,",
+			count, ns_to_s(min_ns), ns_to_s(max_ns),
+			ns_to_s(sum_ns / count));
+	stats_ratio("skew", max_ns * count, sum_ns);
+	fprintf(stats_fp, ",\"slowest_ag\":%u}", slowest);
+}
+
+/*
+ * Write out what happened since the end of the previous phase.  The end of
+ * phase zero is when we start counting.
+ */
+void
+stats_phase_end(
+	struct xfs_mount	*mp,
+	int			phase)
+{
+	struct stats_snap	now;
+	struct stats_snap	*p = &stats_prev;
+	struct prefetch_stats	pfd;
+	struct prefetch_stats	*pf = &pfd;
+	struct cache_stats	bcd;
+	struct cache_stats	*bc = &bcd;
+	struct rusage		ru;
+	uint64_t		nr_reads, nr_writes;
+	uint64_t		bytes_read, bytes_written;
+
+	if (!stats_fp)
+		return;
+
+	stats_snapshot(mp, &now);
+	if (phase == 0)
+		goto out;
+
+	pfd = now.pf;
+	bcd = now.bcache;
+	nr_reads = now.nr_reads - p->nr_reads;
+	bytes_read = now.bytes_read - p->bytes_read;
+	nr_writes = now.nr_writes - p->nr_writes;
+	bytes_written = now.bytes_written - p->bytes_written;
+
+	pf->requested -= p->pf.requested;
+	pf->cached -= p->pf.cached;
+	pf->prefetched -= p->pf.prefetched;
+	pf->nr_reads -= p->pf.nr_reads;
+	pf->bytes_read -= p->pf.bytes_read;
+	pf->bytes_discarded -= p->pf.bytes_discarded;
+
+	/* The cache can be torn down and recreated between phases. */
+	if (bc->hits >= p->bcache.hits && bc->misses >= p->bcache.misses &&
+	    bc->evictions >= p->bcache.evictions) {
+		bc->hits -= p->bcache.hits;
+		bc->misses -= p->bcache.misses;
+		bc->evictions -= p->bcache.evictions;
+	}
+
+	fprintf(stats_fp,
+"{\"phase\":%d,\"wall_s\":%.6f,\"user_s\":%.6f,\"sys_s\":%.6f,",
+			phase, ns_to_s(now.wall_ns - p->wall_ns),
+			ns_to_s(now.user_ns - p->user_ns),
+			ns_to_s(now.sys_ns - p->sys_ns));
+
+	fprintf(stats_fp,
+"\"io\":{\"reads\":%llu,\"bytes_read\":%llu,\"avg_read_bytes\":%llu,"
+"\"writes\":%llu,\"bytes_written\":%llu,\"avg_write_bytes\":%llu},",
+			(unsigned long long)nr_reads,
+			(unsigned long long)bytes_read,
+			(unsigned long long)(nr_reads ? bytes_read / nr_reads : 0),
+			(unsigned long long)nr_writes,
+			(unsigned long long)bytes_written,
+			(unsigned long long)(nr_writes ?
+					bytes_written / nr_writes : 0));
+
+	fprintf(stats_fp,
+"\"prefetch\":{\"requested\":%llu,\"cached\":%llu,\"prefetched\":%llu,",
+			(unsigned long long)pf->requested,
+			(unsigned long long)pf->cached,
+			(unsigned long long)pf->prefetched);
+	stats_ratio("hit_rate", pf->cached + pf->prefetched, pf->requested);
+	fprintf(stats_fp,
+",\"reads\":%llu,\"bytes_read\":%llu,\"bytes_discarded\":%llu},",
+			(unsigned long long)pf->nr_reads,
+			(unsigned long long)pf->bytes_read,
+			(unsigned long long)pf->bytes_discarded);
+
+	fprintf(stats_fp,
+"\"bcache\":{\"hits\":%llu,\"misses\":%llu,\"evictions\":%llu,",
+			(unsigned long long)bc->hits,
+			(unsigned long long)bc->misses,
+			(unsigned long long)bc->evictions);
+	stats_ratio("hit_rate", bc->hits, bc->hits + bc->misses);
+	fprintf(stats_fp, "},");
+
+	if (getrusage(RUSAGE_SELF, &ru))
+		ru.ru_maxrss = 0;
+	fprintf(stats_fp, "\"peak_rss_kb\":%ld,", ru.ru_maxrss);
+
+	stats_ag_report();
+	fprintf(stats_fp, "}\n");
+	fflush(stats_fp);
+out:
+	stats_prev = now;
+}
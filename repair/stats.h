@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: GPL-2.0
+
+#ifndef _XFS_REPAIR_STATS_H_
+#define _XFS_REPAIR_STATS_H_
+
+void	stats_open(const char *path);
+void	stats_close(void);
+bool	stats_enabled(void);
+
+uint64_t stats_now(void);
+void	stats_ag_done(xfs_agnumber_t agno, uint64_t start);
+void	stats_phase_end(struct xfs_mount *mp, int phase);
+
+#endif	/* _XFS_REPAIR_STATS_H_ */
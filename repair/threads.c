@@ -7,6 +7,7 @@
 #include "err_protos.h"
 #include "protos.h"
 #include "globals.h"
+#include "stats.h"
 
 void
 thread_init(void)
@@ -52,6 +53,52 @@ queue_work(
 				err, strerror(err));
 }
 
+struct ag_work {
+	workqueue_func_t	*func;
+	void			*arg;
+};
+
+static void
+ag_work_timed(
+	struct workqueue	*wq,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct ag_work		*aw = arg;
+	uint64_t		start = stats_now();
+
+	aw->func(wq, agno, aw->arg);
+	stats_ag_done(agno, start);
+	free(aw);
+}
+
+/*
+ * Queue work on a single AG, and charge the time it takes to that AG if
+ * we're collecting statistics.
+ */
+void
+queue_ag_work(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agno,
+	void			*arg)
+{
+	struct ag_work		*aw;
+
+	if (!stats_enabled()) {
+		queue_work(wq, func, agno, arg);
+		return;
+	}
+
+	aw = malloc(sizeof(struct ag_work));
+	if (!aw)
+		do_error(_("cannot allocate worker item, error = [%d] %s\n"),
+				ENOMEM, strerror(ENOMEM));
+	aw->func = func;
+	aw->arg = arg;
+	queue_work(wq, ag_work_timed, agno, aw);
+}
+
 void
 destroy_work_queue(
 	struct workqueue	*wq)
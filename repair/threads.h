@@ -20,6 +20,13 @@ queue_work(
 	xfs_agnumber_t 		agno,
 	void			*arg);
 
+void
+queue_ag_work(
+	struct workqueue	*wq,
+	workqueue_func_t	func,
+	xfs_agnumber_t		agno,
+	void			*arg);
+
 void
 destroy_work_queue(
 	struct workqueue	*wq);
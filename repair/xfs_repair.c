@@ -28,6 +28,7 @@
 #include "quotacheck.h"
 #include "rcbag_btree.h"
 #include "rt.h"
+#include "stats.h"
 
 /*
  * option tables for getsubopt calls
@@ -46,6 +47,8 @@ enum o_opt_nums {
 	BLOAD_LEAF_SLACK,
 	BLOAD_NODE_SLACK,
 	NOQUOTA,
+	STATS_FILE,
+	METADUMP,
 	O_MAX_OPTS,
 };
 
@@ -59,6 +62,8 @@ static char *o_opts[] = {
 	[BLOAD_LEAF_SLACK]	= "debug_bload_leaf_slack",
 	[BLOAD_NODE_SLACK]	= "debug_bload_node_slack",
 	[NOQUOTA]		= "noquota",
+	[STATS_FILE]		= "stats",
+	[METADUMP]		= "metadump",
 	[O_MAX_OPTS]		= NULL,
 };
 
@@ -209,6 +214,8 @@ process_args(int argc, char **argv)
 	no_modify = 0;
 	dangerously = 0;
 	isa_file = 0;
+	isa_metadump = false;
+	metadump_map = NULL;
 	zap_log = 0;
 	dumpcore = 0;
 	full_ino_ex_data = 0;
@@ -246,8 +253,14 @@ process_args(int argc, char **argv)
 					assume_xfs = 1;
 					break;
 				case IHASH_SIZE:
-					do_warn(
-		_("-o ihash option has been removed and will be ignored\n"));
+					if (!val)
+						do_abort(
+		_("-o ihash requires a parameter\n"));
+					errno = 0;
+					libxfs_ihash_size = (int)strtol(val, NULL, 0);
+					if (errno)
+						do_abort(
+		_("-o ihash invalid parameter: %s\n"), strerror(errno));
 					break;
 				case BHASH_SIZE:
 					if (max_mem_specified)
@@ -313,6 +326,21 @@ process_args(int argc, char **argv)
 				case NOQUOTA:
 					quotacheck_skip();
 					break;
+				case STATS_FILE:
+					if (!val)
+						do_abort(
+		_("-o stats requires a parameter\n"));
+					if (stats_enabled())
+						respec('o', o_opts, STATS_FILE);
+					stats_open(val);
+					break;
+				case METADUMP:
+					if (isa_metadump)
+						respec('o', o_opts, METADUMP);
+					isa_metadump = true;
+					isa_file = 1;
+					metadump_map = val;
+					break;
 				default:
 					unknown('o', val);
 					break;
@@ -441,6 +469,16 @@ process_args(int argc, char **argv)
 	if (report_corrected && no_modify)
 		usage();
 
+	if (isa_metadump && !no_modify)
+		do_abort(_("-o metadump can only be used with -n\n"));
+
+	/*
+	 * The prefetcher reads straight from the device, so it can't see the
+	 * blocks in a metadump.
+	 */
+	if (isa_metadump)
+		do_prefetch = 0;
+
 	p = getenv("XFS_REPAIR_FAIL_AFTER_PHASE");
 	if (p) {
 		errno = 0;
@@ -837,6 +875,10 @@ check_fs_vs_host_sectsize(
 	long	old_flags;
 	struct xfs_fsop_geom	geom = { 0 };
 
+	/* metadumps aren't read with direct I/O */
+	if (isa_metadump)
+		return;
+
 	ret = -xfrog_geometry(x.data.fd, &geom);
 	if (ret) {
 		do_log(_("Cannot get host filesystem geometry.\n"
@@ -1062,6 +1104,7 @@ phase_end(
 	int			phase)
 {
 	timestamp(mp, PHASE_END, phase, NULL);
+	stats_phase_end(mp, phase);
 
 	/* Fail if someone injected an post-phase error. */
 	if (fail_after_phase && phase == fail_after_phase)
@@ -1379,7 +1422,7 @@ main(int argc, char **argv)
 	if (no_modify) {
 		printf(_("No modify flag set, skipping phase 5\n"));
 	} else {
-		phase5(mp);
+		phase5(mp, phase2_threads);
 	}
 	phase_end(mp, 5);
 	rcbagbt_destroy_cur_cache();
@@ -1553,6 +1596,7 @@ _("Note - stripe unit (%d) and width (%d) were copied from a backup superblock.\
 				error);
 
 	libxfs_destroy(&x);
+	stats_close();
 
 	if (verbose)
 		summary_report();
@@ -14,6 +14,7 @@
 #include "xfs_scrub.h"
 #include "common.h"
 #include "progress.h"
+#include "throttle.h"
 
 extern char		*progname;
 
@@ -295,21 +296,17 @@ scrub_nproc_workqueue(
 
 /*
  * Sleep for 100us * however many -b we got past the initial one.
- * This is an (albeit clumsy) way to throttle scrub activity.
+ * This is an (albeit clumsy) way to throttle scrub activity.  If the user
+ * gave us an I/O latency target, the throttle may pause for longer.
  */
 void
 background_sleep(void)
 {
-	unsigned long long	time_ns;
-	struct timespec		tv;
+	unsigned long long	time_ns = 0;
 
-	if (bg_mode < 2)
-		return;
-
-	time_ns =  100 * NSEC_PER_USEC * (bg_mode - 1);
-	tv.tv_sec = time_ns / NSEC_PER_SEC;
-	tv.tv_nsec = time_ns % NSEC_PER_SEC;
-	nanosleep(&tv, NULL);
+	if (bg_mode > 1)
+		time_ns = 100 * NSEC_PER_USEC * (bg_mode - 1);
+	throttle_wait(time_ns);
 }
 
 /*
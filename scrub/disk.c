@@ -15,6 +15,7 @@
 #include "platform_defs.h"
 #include "libfrog/util.h"
 #include "libfrog/paths.h"
+#include "libfrog/ioengine.h"
 #include "xfs_scrub.h"
 #include "common.h"
 #include "disk.h"
@@ -78,6 +79,50 @@ disk_heads(
 	return __disk_heads(disk);
 }
 
+/*
+ * Figure out how many verify reads each thread should keep in flight.  Solid
+ * state devices only reach full speed with lots of IO queued, so give them a
+ * deep queue.  Spinning disks can stream a few sequential reads from one
+ * thread without seeking, but more than that just adds latency.
+ */
+static unsigned int
+__disk_queue_depth(
+	struct disk		*disk)
+{
+	unsigned short		rot;
+	int			error;
+
+	/* SCSI VERIFY is a synchronous ioctl. */
+	if (disk->d_flags & DISK_FLAG_SCSI_VERIFY)
+		return 1;
+
+	/* Simulated disk errors only work with one read at a time. */
+	if (debug && (getenv("XFS_SCRUB_DISK_ERROR_INTERVAL") ||
+		      getenv("XFS_SCRUB_DISK_VERIFY_SKIP")))
+		return 1;
+
+	/* Not a block device?  Leave it to the filesystem underneath. */
+	if (!S_ISBLK(disk->d_sb.st_mode))
+		return 8;
+
+	rot = 1;
+	error = ioctl(disk->d_fd, BLKROTATIONAL, &rot);
+	if (error == 0 && rot == 0)
+		return 16;
+
+	return 4;
+}
+
+/* Figure out how many verify reads each thread should keep in flight. */
+unsigned int
+disk_queue_depth(
+	struct disk		*disk)
+{
+	if (force_io_depth)
+		return force_io_depth;
+	return __disk_queue_depth(disk);
+}
+
 /*
  * Execute a SCSI VERIFY(16) to verify disk contents.
  * For devices that support this command, this can sharply reduce the
@@ -352,3 +397,17 @@ disk_read_verify(
 
 	return pread(disk->d_fd, buf, length, start);
 }
+
+/*
+ * Read-verify a batch of extents of a disk device at once.  Each request's
+ * error is set to zero if the whole extent was read, or a negative errno.
+ * Returns the error of the first request that failed.
+ */
+int
+disk_read_verify_batch(
+	struct disk		*disk,
+	struct io_req		*reqs,
+	unsigned int		nr)
+{
+	return ioengine_default()->readv(disk->d_fd, reqs, nr);
+}
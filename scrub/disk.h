@@ -18,10 +18,15 @@ struct disk {
 	uint64_t	d_start;	/* bytes */
 };
 
+struct io_req;
+
 unsigned int disk_heads(struct disk *disk);
+unsigned int disk_queue_depth(struct disk *disk);
 struct disk *disk_open(const char *pathname);
 int disk_close(struct disk *disk);
 ssize_t disk_read_verify(struct disk *disk, void *buf, uint64_t startblock,
 		uint64_t blockcount);
+int disk_read_verify_batch(struct disk *disk, struct io_req *reqs,
+		unsigned int nr);
 
 #endif /* XFS_SCRUB_DISK_H_ */
@@ -133,6 +133,7 @@ scan_ag_metadata(
 	if (sctl->aborted)
 		return;
 
+	background_sleep();
 	scrub_item_init_ag(&sri, agno);
 	snprintf(descr, DESCR_BUFSZ, _("AG %u"), agno);
 
@@ -257,6 +258,7 @@ scan_rtgroup_metadata(
 	if (sctl->aborted)
 		return;
 
+	background_sleep();
 	scrub_item_init_rtgroup(&sri, rgno);
 	if (ctx->mnt.fsgeom.rgcount == 0)
 		snprintf(descr, DESCR_BUFSZ, _("realtime"));
@@ -10,12 +10,14 @@
 #include "libfrog/ptvar.h"
 #include "libfrog/workqueue.h"
 #include "libfrog/paths.h"
+#include "libfrog/ioengine.h"
 #include "xfs_scrub.h"
 #include "common.h"
 #include "counter.h"
 #include "disk.h"
 #include "read_verify.h"
 #include "progress.h"
+#include "throttle.h"
 
 /*
  * Read Verify Pool
@@ -25,6 +27,12 @@
  * pool worker.  Adjacent (or nearly adjacent) requests can be combined
  * to reduce overhead when free space fragmentation is high.  The thread
  * pool takes care of issuing multiple IOs to the device, if possible.
+ *
+ * Each thread also keeps several reads in flight, so that a few threads can
+ * keep a fast device busy without seeking a slow one back and forth.  A
+ * request is split into RVP_QUEUE_IO_SIZE reads that are submitted together
+ * through the I/O engine.  If any of them fails, we fall back to issuing one
+ * read at a time so that we can narrow the failure down to single blocks.
  */
 
 /*
@@ -43,9 +51,25 @@
 static inline unsigned int
 rvp_io_max_size(void)
 {
+	if (throttle_adaptive())
+		return throttle_io_size(RVP_BACKGROUND_IO_MAX_SIZE,
+				RVP_IO_MAX_SIZE);
 	return bg_mode > 0 ? RVP_BACKGROUND_IO_MAX_SIZE : RVP_IO_MAX_SIZE;
 }
 
+/* How big can the IO size get? */
+static inline unsigned int
+rvp_io_buf_size(void)
+{
+	return throttle_adaptive() ? RVP_IO_MAX_SIZE : rvp_io_max_size();
+}
+
+/* Size of each read when we have several in flight. */
+#define RVP_QUEUE_IO_SIZE	(1048576)
+
+/* Most reads that can be in flight at once from one thread. */
+#define RVP_MAX_QUEUE_DEPTH	(RVP_IO_MAX_SIZE / RVP_QUEUE_IO_SIZE)
+
 /* Tolerate 64k holes in adjacent read verify requests. */
 #define RVP_IO_BATCH_LOCALITY	(65536)
 
@@ -65,6 +89,7 @@ struct read_verify_pool {
 	struct disk		*disk;		/* which disk? */
 	read_verify_ioerr_fn_t	ioerr_fn;	/* io error callback */
 	size_t			miniosz;	/* minimum io size, bytes */
+	unsigned int		queue_depth;	/* reads in flight per thread */
 
 	/*
 	 * Store a runtime error code here so that we can stop the pool and
@@ -101,7 +126,9 @@ read_verify_pool_alloc(
 	 */
 	if (miniosz % disk->d_lbasize)
 		return EINVAL;
-	if (rvp_io_max_size() % miniosz)
+	if (rvp_io_buf_size() % miniosz)
+		return EINVAL;
+	if (throttle_adaptive() && RVP_BACKGROUND_IO_MAX_SIZE % miniosz)
 		return EINVAL;
 
 	rvp = calloc(1, sizeof(struct read_verify_pool));
@@ -109,13 +136,23 @@ read_verify_pool_alloc(
 		return errno;
 
 	ret = posix_memalign((void **)&rvp->readbuf, page_size,
-			rvp_io_max_size());
+			rvp_io_buf_size());
 	if (ret)
 		goto out_free;
 	ret = ptcounter_alloc(verifier_threads, &rvp->verified_bytes);
 	if (ret)
 		goto out_buf;
 	rvp->miniosz = miniosz;
+
+	/*
+	 * Background scrubs keep one read in flight, unless the adaptive
+	 * throttle is on.  Then rvp_queue_depth lets it decide how many of
+	 * these reads to use as it grows and shrinks the IO size.
+	 */
+	rvp->queue_depth = 1;
+	if (bg_mode == 0 || throttle_adaptive())
+		rvp->queue_depth = max(1U, min(disk_queue_depth(disk),
+					       RVP_MAX_QUEUE_DEPTH));
 	rvp->ctx = ctx;
 	rvp->disk = disk;
 	rvp->ioerr_fn = ioerr_fn;
@@ -171,6 +208,63 @@ read_verify_pool_destroy(
 	free(rvp);
 }
 
+/* How many reads may a thread have in flight right now? */
+static inline unsigned int
+rvp_queue_depth(
+	const struct read_verify_pool	*rvp)
+{
+	if (throttle_adaptive())
+		return min_t(unsigned int, rvp->queue_depth,
+				rvp_io_max_size() / RVP_QUEUE_IO_SIZE);
+	return rvp->queue_depth;
+}
+
+/*
+ * Verify the start of @rv with a batch of reads that are all in flight at
+ * once.  All the reads land in the same buffer as every other thread's, since
+ * we never look at the data.  Returns false if any read failed, in which case
+ * @rv has been advanced up to the first read that did.
+ */
+static bool
+read_verify_batch(
+	struct read_verify_pool		*rvp,
+	struct read_verify		*rv,
+	unsigned long long		*verified)
+{
+	struct io_req			reqs[RVP_MAX_QUEUE_DEPTH];
+	struct iovec			iov[RVP_MAX_QUEUE_DEPTH];
+	uint64_t			start = rv->io_start;
+	uint64_t			end = rv->io_start + rv->io_length;
+	unsigned int			depth = rvp_queue_depth(rvp);
+	unsigned int			nr;
+	unsigned int			i;
+
+	for (nr = 0; nr < depth && start < end; nr++) {
+		iov[nr].iov_base = rvp->readbuf + nr * RVP_QUEUE_IO_SIZE;
+		iov[nr].iov_len = min(end - start, RVP_QUEUE_IO_SIZE);
+		reqs[nr].offset = start;
+		reqs[nr].iov = &iov[nr];
+		reqs[nr].iovcnt = 1;
+		start += iov[nr].iov_len;
+	}
+
+	dbg_printf("diskverify %d %"PRIu64" %"PRIu64" x%u\n",
+			rvp->disk->d_fd, rv->io_start, start - rv->io_start,
+			nr);
+	disk_read_verify_batch(rvp->disk, reqs, nr);
+
+	for (i = 0; i < nr; i++) {
+		if (reqs[i].error)
+			return false;
+
+		progress_add(iov[i].iov_len);
+		*verified += iov[i].iov_len;
+		rv->io_start += iov[i].iov_len;
+		rv->io_length -= iov[i].iov_len;
+	}
+	return true;
+}
+
 /*
  * Issue a read-verify IO in big batches.
  */
@@ -186,6 +280,7 @@ read_verify(
 	ssize_t				io_max_size;
 	ssize_t				sz;
 	ssize_t				len;
+	bool				batch;
 	int				read_error;
 	int				ret;
 
@@ -194,8 +289,20 @@ read_verify(
 		return;
 
 	io_max_size = rvp_io_max_size();
+	batch = rvp->queue_depth > 1;
 
 	while (rv->io_length > 0) {
+		/*
+		 * Keep several reads in flight until one fails, then let the
+		 * single read code below work out what went wrong and where.
+		 */
+		if (batch && rvp_queue_depth(rvp) > 1) {
+			if (!read_verify_batch(rvp, rv, &verified))
+				batch = false;
+			background_sleep();
+			continue;
+		}
+
 		read_error = 0;
 		len = min(rv->io_length, io_max_size);
 		dbg_printf("diskverify %d %"PRIu64" %zu\n", rvp->disk->d_fd,
@@ -278,6 +385,10 @@ read_verify(
 		rv->io_start += sz;
 		rv->io_length -= sz;
 		background_sleep();
+
+		/* The throttle may have changed its mind about the IO size. */
+		if (io_max_size > rvp->miniosz)
+			io_max_size = rvp_io_max_size();
 	}
 
 	free(rv);
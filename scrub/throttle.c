@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#include "xfs.h"
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/statvfs.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include "libfrog/paths.h"
+#include "xfs_scrub.h"
+#include "common.h"
+#include "throttle.h"
+
+/*
+ * Adaptive Throttling
+ *
+ * Background scrubs used to be throttled with a fixed pause after every
+ * unit of work, which is too much on an idle machine and not enough on a
+ * busy one.  If the user gives us an I/O latency or I/O pressure target,
+ * we instead sample the data device's average completion latency (from
+ * sysfs) and the system's I/O pressure stall information every so often,
+ * and steer two knobs with an additive-increase/multiplicative-decrease
+ * controller:
+ *
+ * The duty cycle is the fraction of each thread's time that it is allowed
+ * to spend doing scrub work; after finishing a unit of work, a thread
+ * pauses long enough to stay under that fraction.  Running N threads at a
+ * duty cycle of d is about the same load as running N * d threads flat out,
+ * so this is how we adjust scrub concurrency without tearing down thread
+ * pools.
+ *
+ * The media verification I/O size is scaled between the background and
+ * the foreground maximums.
+ *
+ * Both knobs are halved whenever the measured latency or pressure exceeds
+ * the target, and walked back up slowly while there's headroom.  The
+ * device statistics include scrub's own I/O, which is what we want: the
+ * latency that foreground I/O sees is whatever the queue looks like,
+ * regardless of who filled it.
+ */
+
+/* How often do we sample the I/O statistics? */
+#define THROTTLE_SAMPLE_NS	(100ULL * 1000 * 1000)
+
+/* Never pause for more than a second at a time. */
+#define THROTTLE_MAX_PAUSE_NS	(1000ULL * 1000 * 1000)
+
+/* Duty cycle limits and the additive increase step. */
+#define THROTTLE_MIN_DUTY	(1.0 / 64)
+#define THROTTLE_DUTY_STEP	(1.0 / 16)
+
+/* Shrink the media verify I/O size by up to this power of two. */
+#define THROTTLE_MAX_IO_SHIFT	(8)
+
+/* Speed up only if we're below this fraction of the target. */
+#define THROTTLE_HEADROOM	(0.8)
+
+#define PSI_IO_PATH		"/proc/pressure/io"
+
+struct throttle {
+	pthread_mutex_t		lock;
+
+	/* Targets; zero means we don't care. */
+	unsigned int		latency_us;
+	double			pressure;
+
+	char			stat_path[64];
+	bool			adaptive;
+
+	/* Controller state. */
+	double			duty;
+	unsigned int		io_shift;
+
+	/* Previous sample. */
+	unsigned long long	sample_ns;
+	unsigned long long	nr_ios;
+	unsigned long long	io_ticks;	/* ms */
+	unsigned long long	stall_us;
+
+	/* Time spent working and pausing during this phase. */
+	unsigned int		phase_gen;
+	unsigned long long	work_ns;
+	unsigned long long	pause_ns;
+};
+
+static struct throttle tt = {
+	.lock			= PTHREAD_MUTEX_INITIALIZER,
+	.duty			= 1.0,
+};
+
+/* When did this thread last come out of throttle_wait, and in which phase? */
+static __thread unsigned long long	last_ns;
+static __thread unsigned int		last_gen;
+
+static unsigned long long
+now_ns(void)
+{
+	struct timespec		ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read the completed I/O count and the time they spent, in ms. */
+static int
+read_disk_stat(
+	unsigned long long	*nr_ios,
+	unsigned long long	*ticks)
+{
+	unsigned long long	rd_ios, rd_merges, rd_sectors, rd_ticks;
+	unsigned long long	wr_ios, wr_merges, wr_sectors, wr_ticks;
+	FILE			*fp;
+	int			nr;
+
+	fp = fopen(tt.stat_path, "r");
+	if (!fp)
+		return errno;
+	nr = fscanf(fp, "%llu %llu %llu %llu %llu %llu %llu %llu",
+			&rd_ios, &rd_merges, &rd_sectors, &rd_ticks,
+			&wr_ios, &wr_merges, &wr_sectors, &wr_ticks);
+	fclose(fp);
+	if (nr != 8)
+		return EINVAL;
+
+	*nr_ios = rd_ios + wr_ios;
+	*ticks = rd_ticks + wr_ticks;
+	return 0;
+}
+
+/* Read the total time that some task was stalled on I/O, in us. */
+static int
+read_psi(
+	unsigned long long	*stall_us)
+{
+	char			line[256];
+	char			*p;
+	FILE			*fp;
+	int			ret = EINVAL;
+
+	fp = fopen(PSI_IO_PATH, "r");
+	if (!fp)
+		return errno;
+	while (fgets(line, sizeof(line), fp)) {
+		if (strncmp(line, "some ", 5))
+			continue;
+		p = strstr(line, "total=");
+		if (p && sscanf(p, "total=%llu", stall_us) == 1)
+			ret = 0;
+		break;
+	}
+	fclose(fp);
+	return ret;
+}
+
+/*
+ * Look at what the storage has been up to since the last sample and adjust
+ * the knobs.  Caller must hold the lock.
+ */
+static void
+throttle_adjust(
+	unsigned long long	now)
+{
+	unsigned long long	nr_ios, ticks, stall_us;
+	double			ratio = 0;
+
+	if (tt.latency_us && !read_disk_stat(&nr_ios, &ticks)) {
+		if (nr_ios > tt.nr_ios) {
+			double	lat_us = (ticks - tt.io_ticks) * 1000.0 /
+					 (nr_ios - tt.nr_ios);
+
+			ratio = max(ratio, lat_us / tt.latency_us);
+		}
+		tt.nr_ios = nr_ios;
+		tt.io_ticks = ticks;
+	}
+
+	if (tt.pressure > 0 && !read_psi(&stall_us)) {
+		double	pct = (stall_us - tt.stall_us) * 100000.0 /
+			      (now - tt.sample_ns);
+
+		ratio = max(ratio, pct / tt.pressure);
+		tt.stall_us = stall_us;
+	}
+	tt.sample_ns = now;
+
+	if (ratio > 1.0) {
+		tt.duty = max(tt.duty / 2, THROTTLE_MIN_DUTY);
+		tt.io_shift = min(tt.io_shift + 1, THROTTLE_MAX_IO_SHIFT);
+	} else if (ratio < THROTTLE_HEADROOM) {
+		if (tt.duty < 1.0)
+			tt.duty = min(tt.duty + THROTTLE_DUTY_STEP, 1.0);
+		else if (tt.io_shift > 0)
+			tt.io_shift--;
+	}
+	dbg_printf("throttle ratio %.2f duty %.3f io_shift %u\n", ratio,
+			tt.duty, tt.io_shift);
+}
+
+/*
+ * Set up the adaptive throttle if the user gave us a target.  Complain if
+ * we can't find the statistics we need.
+ */
+void
+throttle_init(
+	struct scrub_ctx	*ctx)
+{
+	tt.latency_us = ctx->throttle_latency_us;
+	tt.pressure = ctx->throttle_pressure;
+	if (!tt.latency_us && tt.pressure <= 0)
+		return;
+
+	if (tt.latency_us) {
+		snprintf(tt.stat_path, sizeof(tt.stat_path),
+				"/sys/dev/block/%u:%u/stat",
+				major(ctx->mnt_sb.st_dev),
+				minor(ctx->mnt_sb.st_dev));
+		if (read_disk_stat(&tt.nr_ios, &tt.io_ticks)) {
+			str_error(ctx, ctx->mntpoint,
+_("Cannot read I/O statistics from %s; ignoring io_latency target."),
+					tt.stat_path);
+			tt.latency_us = 0;
+		}
+	}
+	if (tt.pressure > 0 && read_psi(&tt.stall_us)) {
+		str_error(ctx, ctx->mntpoint,
+_("Cannot read %s; ignoring io_pressure target."),
+				PSI_IO_PATH);
+		tt.pressure = 0;
+	}
+	if (!tt.latency_us && tt.pressure <= 0)
+		return;
+
+	/* Start out as gently as -b would, and speed up if we can. */
+	tt.adaptive = true;
+	tt.io_shift = THROTTLE_MAX_IO_SHIFT;
+	tt.sample_ns = now_ns();
+}
+
+/* Are we steering the throttle by I/O latency? */
+bool
+throttle_adaptive(void)
+{
+	return tt.adaptive;
+}
+
+/* Reset the duty cycle accounting for a new phase. */
+void
+throttle_start_phase(void)
+{
+	pthread_mutex_lock(&tt.lock);
+	tt.phase_gen++;
+	tt.work_ns = 0;
+	tt.pause_ns = 0;
+	pthread_mutex_unlock(&tt.lock);
+}
+
+/*
+ * Report the fraction of time that threads spent working instead of
+ * pausing during this phase.  Returns false if we weren't throttling.
+ */
+bool
+throttle_end_phase(
+	double			*duty)
+{
+	bool			ret = false;
+
+	pthread_mutex_lock(&tt.lock);
+	if ((tt.adaptive || tt.pause_ns > 0) && tt.work_ns + tt.pause_ns > 0) {
+		*duty = (double)tt.work_ns / (tt.work_ns + tt.pause_ns);
+		ret = true;
+	}
+	pthread_mutex_unlock(&tt.lock);
+	return ret;
+}
+
+/*
+ * Called between units of work.  Pause for @fixed_ns plus however long it
+ * takes to bring this thread down to the current duty cycle.
+ */
+void
+throttle_wait(
+	unsigned long long	fixed_ns)
+{
+	unsigned long long	now;
+	unsigned long long	pause_ns = fixed_ns;
+	unsigned long long	work_ns = 0;
+	struct timespec		tv;
+
+	if (!tt.adaptive && !fixed_ns)
+		return;
+
+	now = now_ns();
+	pthread_mutex_lock(&tt.lock);
+	if (last_gen == tt.phase_gen)
+		work_ns = now - last_ns;
+	tt.work_ns += work_ns;
+	if (tt.adaptive) {
+		if (now - tt.sample_ns >= THROTTLE_SAMPLE_NS)
+			throttle_adjust(now);
+		if (tt.duty < 1.0)
+			pause_ns += min_t(unsigned long long,
+					work_ns * (1.0 / tt.duty - 1.0),
+					THROTTLE_MAX_PAUSE_NS);
+	}
+	last_gen = tt.phase_gen;
+	pthread_mutex_unlock(&tt.lock);
+
+	if (pause_ns) {
+		tv.tv_sec = pause_ns / NSEC_PER_SEC;
+		tv.tv_nsec = pause_ns % NSEC_PER_SEC;
+		nanosleep(&tv, NULL);
+		last_ns = now_ns();
+
+		pthread_mutex_lock(&tt.lock);
+		tt.pause_ns += last_ns - now;
+		pthread_mutex_unlock(&tt.lock);
+	} else {
+		last_ns = now;
+	}
+}
+
+/* How big should media verification reads be right now? */
+size_t
+throttle_io_size(
+	size_t			min_size,
+	size_t			max_size)
+{
+	return max(min_size, max_size >> tt.io_shift);
+}
@@ -0,0 +1,14 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+#ifndef XFS_SCRUB_THROTTLE_H_
+#define XFS_SCRUB_THROTTLE_H_
+
+struct scrub_ctx;
+
+void throttle_init(struct scrub_ctx *ctx);
+bool throttle_adaptive(void);
+void throttle_start_phase(void);
+bool throttle_end_phase(double *duty);
+void throttle_wait(unsigned long long fixed_ns);
+size_t throttle_io_size(size_t min_size, size_t max_size);
+
+#endif /* XFS_SCRUB_THROTTLE_H_ */
@@ -18,6 +18,7 @@
 #include "descr.h"
 #include "unicrash.h"
 #include "progress.h"
+#include "throttle.h"
 #include "libfrog/histogram.h"
 
 /*
@@ -113,6 +114,8 @@
  * XFS_SCRUB_NO_SCSI_VERIFY	-- disable SCSI VERIFY (if present)
  * XFS_SCRUB_PHASE		-- run only this scrub phase
  * XFS_SCRUB_THREADS		-- start exactly this number of threads
+ * XFS_SCRUB_IO_DEPTH		-- keep this many media verify reads in flight
+ *				   per thread
  * XFS_SCRUB_DISK_ERROR_INTERVAL-- simulate a disk error every this many bytes
  * XFS_SCRUB_DISK_VERIFY_SKIP	-- pretend disk verify read calls succeeded
  * XFS_SCRUB_FORCE_SINGLE	-- fall back to ioctl-per-item scrubbing
@@ -137,6 +140,9 @@ unsigned int			bg_mode;
 /* Number of threads we're allowed to use. */
 unsigned int			force_nr_threads;
 
+/* Number of media verify reads that each thread may have in flight. */
+unsigned int			force_io_depth;
+
 /* Verbosity; higher values print more information. */
 bool				verbose;
 
@@ -390,6 +396,23 @@ _("%sI/O rate: %.1f%s/s in, %.1f%s/s out, %.1f%s/s tot\n"),
 	return 0;
 }
 
+/* Report how hard we throttled ourselves during this phase. */
+static void
+report_throttle(
+	unsigned int		phase)
+{
+	double			duty;
+
+	if (!throttle_end_phase(&duty))
+		return;
+	if (!throttle_adaptive() && !verbose && !display_rusage)
+		return;
+
+	fprintf(stdout, _("Phase %u: Duty cycle: %.1f%%\n"), phase,
+			duty * 100.0);
+	fflush(stdout);
+}
+
 /* Run all the phases of the scrubber. */
 static bool
 run_scrub_phases(
@@ -513,6 +536,7 @@ run_scrub_phases(
 		}
 		if (ret)
 			break;
+		throttle_start_phase();
 		ret = sp->fn(ctx);
 		if (ret) {
 			str_info(ctx, ctx->mntpoint,
@@ -522,6 +546,7 @@ _("Scrub aborted after phase %d."),
 		}
 		progress_end_phase();
 		descr_end_phase();
+		report_throttle(phase);
 		ret = phase_end(&pi, phase);
 		if (ret)
 			break;
@@ -635,6 +660,8 @@ enum o_opt_nums {
 	IWARN = 0,
 	FSTRIM_PCT,
 	AUTOFSCK,
+	IO_LATENCY,
+	IO_PRESSURE,
 	O_MAX_OPTS,
 };
 
@@ -642,6 +669,8 @@ static char *o_opts[] = {
 	[IWARN]			= "iwarn",
 	[FSTRIM_PCT]		= "fstrim_pct",
 	[AUTOFSCK]		= "autofsck",
+	[IO_LATENCY]		= "io_latency",
+	[IO_PRESSURE]		= "io_pressure",
 	[O_MAX_OPTS]		= NULL,
 };
 
@@ -702,6 +731,38 @@ parse_o_opts(
 			}
 			ctx->mode = SCRUB_MODE_NONE;
 			break;
+		case IO_LATENCY:
+			if (!val) {
+				fprintf(stderr,
+ _("-o io_latency requires a parameter\n"));
+				usage();
+			}
+			errno = 0;
+			ctx->throttle_latency_us = cvt_u32(val, 10);
+			if (errno || ctx->throttle_latency_us == 0) {
+				fprintf(stderr,
+ _("-o io_latency must be a positive number of microseconds\n"));
+				usage();
+			}
+			break;
+		case IO_PRESSURE:
+			if (!val) {
+				fprintf(stderr,
+ _("-o io_pressure requires a parameter\n"));
+				usage();
+			}
+
+			errno = 0;
+			dval = strtod(val, &endp);
+
+			if (*endp || errno || dval <= 0 || dval > 100) {
+				fprintf(stderr,
+ _("-o io_pressure must be larger than 0 and at most 100\n"));
+				usage();
+			}
+
+			ctx->throttle_pressure = dval;
+			break;
 		default:
 			usage();
 			break;
@@ -852,6 +913,18 @@ main(
 		force_nr_threads = x;
 	}
 
+	/* Override media verify queue depth if debugger */
+	if (debug_tweak_on("XFS_SCRUB_IO_DEPTH")) {
+		unsigned int	x;
+
+		x = cvt_u32(getenv("XFS_SCRUB_IO_DEPTH"), 10);
+		if (errno) {
+			perror("io_depth");
+			usage();
+		}
+		force_io_depth = x;
+	}
+
 	if (optind != argc - 1)
 		usage();
 
@@ -917,6 +990,18 @@ main(
 	if (debug_tweak_on("XFS_SCRUB_FORCE_REPAIR"))
 		ctx.mode = SCRUB_MODE_REPAIR;
 
+	throttle_init(&ctx);
+
+	/*
+	 * Once the throttle is steering by a latency or pressure target, it
+	 * decides how much concurrency we can get away with, so -b no longer
+	 * means a single thread.  If it couldn't find the statistics it
+	 * needs, -b stays as it was.
+	 */
+	if (throttle_adaptive() && bg_mode > 0 &&
+	    !debug_tweak_on("XFS_SCRUB_THREADS"))
+		force_nr_threads = 0;
+
 	/* Scrub a filesystem. */
 	error = run_scrub_phases(&ctx, progress_fp);
 	if (error && ctx.runtime_errors == 0)
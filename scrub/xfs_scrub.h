@@ -14,6 +14,7 @@ extern char *progname;
 #define _PATH_PROC_MOUNTS	"/proc/mounts"
 
 extern unsigned int		force_nr_threads;
+extern unsigned int		force_io_depth;
 extern unsigned int		bg_mode;
 extern unsigned int		debug;
 extern bool			verbose;
@@ -108,6 +109,13 @@ struct scrub_ctx {
 	 * this much space per volume.
 	 */
 	double			fstrim_block_pct;
+
+	/*
+	 * Adaptive throttling targets: average data device I/O latency, in
+	 * microseconds, and percentage of time stalled on I/O.  Zero if unset.
+	 */
+	unsigned int		throttle_latency_us;
+	double			throttle_pressure;
 };
 
 /*